@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "arena.h"
+
+struct Slab arena_slab = SLAB_INIT("Arena blocks", sizeof(struct ArenaBlock) + ARENA_BLOCK,
+                                   4096, 4);
+
+static atomic_ullong allocations;
+static atomic_ullong allocated_bytes;
+static atomic_ullong oversized;
+
+static struct ArenaBlock *new_block(size_t len){
+  struct ArenaBlock *block;
+  size_t size = ARENA_BLOCK;
+
+  if(len > ARENA_BLOCK){
+    size = len;
+    block = malloc(sizeof(struct ArenaBlock) + size);
+    atomic_fetch_add_explicit(&oversized, 1, memory_order_relaxed);
+  }
+
+  else {
+    block = slab_get(&arena_slab);
+  }
+
+  if(block == NULL){
+    perror("ERROR allocating arena");
+    exit(1);
+  }
+
+  block->next = NULL;
+  block->size = size;
+  return block;
+}
+
+static void free_blocks(struct ArenaBlock *block){
+  struct ArenaBlock *next;
+
+  for(; block != NULL; block = next){
+    next = block->next;
+    if(block->size > ARENA_BLOCK){
+      free(block);
+    }
+
+    else {
+      slab_put(&arena_slab, block);
+    }
+  }
+}
+
+/*
+ * len bytes, aligned for any type, valid until the arena is rewound past
+ * them. Exits if memory runs out, like the other allocations of a request.
+ */
+void *arena_alloc(struct Arena *arena, size_t len){
+  struct ArenaBlock *block = arena->current, *next;
+
+  len = (len + 15) & ~(size_t)15;
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&allocated_bytes, len, memory_order_relaxed);
+
+  if(block == NULL || block->used + len > block->size){
+    // the blocks after current are free; the next one is reused if it is big enough
+    next = block != NULL ? block->next : arena->first;
+    if(next != NULL && next->size < len){
+      if(block != NULL){
+        block->next = NULL;
+      }
+
+      else {
+        arena->first = NULL;
+      }
+
+      free_blocks(next);
+      next = NULL;
+    }
+
+    if(next == NULL){
+      next = new_block(len);
+      if(block != NULL){
+        block->next = next;
+      }
+
+      else {
+        arena->first = next;
+      }
+    }
+
+    next->used = 0;
+    arena->current = block = next;
+  }
+
+  block->used += len;
+  return block->data + block->used - len;
+}
+
+struct ArenaMark arena_mark(struct Arena *arena){
+  struct ArenaMark mark = {arena->current, 0};
+
+  if(arena->current != NULL){
+    mark.used = arena->current->used;
+  }
+
+  return mark;
+}
+
+/* Gives back everything allocated since mark was taken. */
+void arena_release(struct Arena *arena, struct ArenaMark mark){
+  arena->current = mark.block;
+  if(mark.block != NULL){
+    mark.block->used = mark.used;
+    return;
+  }
+
+  free_blocks(arena->first);
+  arena->first = NULL;
+}
+
+void arena_reset(struct Arena *arena){
+  struct ArenaMark empty = {NULL, 0};
+
+  arena_release(arena, empty);
+}
+
+void arena_report(){
+  slab_report(&arena_slab);
+  printf("Arenas: %llu allocations (%.1f MB), %llu oversized blocks allocated\n",
+         atomic_load_explicit(&allocations, memory_order_relaxed),
+         atomic_load_explicit(&allocated_bytes, memory_order_relaxed) / 1e6,
+         atomic_load_explicit(&oversized, memory_order_relaxed));
+}
@@ -0,0 +1,43 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include "slab.h"
+
+#define ARENA_BLOCK (256 * 1024)
+
+/*
+ * Scratch memory for what one request builds and is done with before the
+ * next one: listings, pages, bitmaps. Allocations bump a pointer through a
+ * chain of blocks and are given back all at once by rewinding to a mark
+ * taken beforehand. Blocks come from arena_slab, shared by every arena, and
+ * go back there once an arena is rewound to empty, so an idle session holds
+ * none. Only a request that needs more than ARENA_BLOCK at once has its
+ * block allocated for it. One thread owns an arena.
+ */
+struct ArenaBlock{
+  struct ArenaBlock *next;
+  size_t size;
+  size_t used;
+  char data[];
+};
+
+struct Arena{
+  struct ArenaBlock *first;
+  struct ArenaBlock *current;
+};
+
+struct ArenaMark{
+  struct ArenaBlock *block;
+  size_t used;
+};
+
+void *arena_alloc(struct Arena *arena, size_t len);
+struct ArenaMark arena_mark(struct Arena *arena);
+void arena_release(struct Arena *arena, struct ArenaMark mark);
+void arena_reset(struct Arena *arena);
+void arena_report();
+
+extern struct Slab arena_slab;
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ * Compares the two UPLOAD ingest paths in transfer.c: splice(2) through a
+ * pipe versus the buffered read/pwrite fallback. For every file size a
+ * sender thread pushes the file over a loopback TCP connection with
+ * sendfile(2) while the main thread receives it with receiver_pump().
+ *
+ * Usage: bench/ingest [-d dir] [-r repeats] [size_kb ...]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../transfer.h"
+
+struct SendJob{
+  int sockfd;
+  int filefd;
+  off_t size;
+};
+
+void error_occurred(const char *msg){
+  perror(msg);
+  exit(1);
+}
+
+double now(clockid_t clock){
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *send_job(void *arg){
+  struct SendJob *job = arg;
+  off_t offset = 0;
+  ssize_t bytes_sent;
+
+  while(offset < job->size){
+    bytes_sent = sendfile(job->sockfd, job->filefd, &offset, job->size - offset);
+    if(bytes_sent <= 0){
+      perror("sendfile");
+      break;
+    }
+  }
+
+  close(job->sockfd);
+  return 0;
+}
+
+void connect_pair(int *client, int *server){
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int listenfd;
+
+  listenfd = socket(AF_INET, SOCK_STREAM, 0);
+  bzero(&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenfd, 1) < 0){
+    error_occurred("ERROR on binding");
+  }
+
+  getsockname(listenfd, (struct sockaddr *)&addr, &len);
+  *client = socket(AF_INET, SOCK_STREAM, 0);
+  if(connect(*client, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+    error_occurred("ERROR connecting");
+  }
+
+  *server = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK);
+  if(*server < 0){
+    error_occurred("ERROR on accept");
+  }
+
+  close(listenfd);
+}
+
+void make_source(const char *path, off_t size){
+  char buffer[65536];
+  off_t written = 0;
+  unsigned int seed = 173;
+  size_t i;
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0){
+    error_occurred("ERROR creating source file");
+  }
+
+  while(written < size){
+    size_t len = size - written < (off_t)sizeof(buffer) ? size - written : sizeof(buffer);
+    for(i = 0; i < len; i++){
+      buffer[i] = rand_r(&seed) & 0xff;
+    }
+
+    if(write(fd, buffer, len) != (ssize_t)len){
+      error_occurred("ERROR writing source file");
+    }
+
+    written += len;
+  }
+
+  close(fd);
+}
+
+bool same_contents(const char *a, const char *b){
+  char buffer_a[65536], buffer_b[65536];
+  ssize_t len_a, len_b;
+  bool same = true;
+  int fd_a = open(a, O_RDONLY), fd_b = open(b, O_RDONLY);
+
+  while(same){
+    len_a = read(fd_a, buffer_a, sizeof(buffer_a));
+    len_b = read(fd_b, buffer_b, sizeof(buffer_b));
+    if(len_a != len_b || (len_a > 0 && memcmp(buffer_a, buffer_b, len_a) != 0)){
+      same = false;
+    }
+
+    if(len_a <= 0){
+      break;
+    }
+  }
+
+  close(fd_a);
+  close(fd_b);
+  return same;
+}
+
+/* Receives one file and returns {wall seconds, receiver cpu seconds}. */
+void run_once(const char *source, const char *target, off_t size, bool use_splice,
+              double *wall, double *cpu){
+  struct FileReceiver receiver;
+  struct SendJob job;
+  struct pollfd pfd;
+  pthread_t thread;
+  enum TransferStatus status;
+  double wall_start, cpu_start;
+  int sockfd, filefd;
+
+  filefd = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  job.filefd = open(source, O_RDONLY);
+  job.size = size;
+  connect_pair(&job.sockfd, &sockfd);
+
+  receiver_init(&receiver);
+  receiver.use_splice = use_splice;
+  receiver_start(&receiver, filefd, 0, size);
+
+  wall_start = now(CLOCK_MONOTONIC);
+  cpu_start = now(CLOCK_THREAD_CPUTIME_ID);
+  pthread_create(&thread, NULL, send_job, &job);
+
+  pfd.fd = sockfd;
+  pfd.events = POLLIN;
+  while((status = receiver_pump(&receiver, sockfd, 0, NULL)) == TRANSFER_AGAIN){
+    poll(&pfd, 1, -1);
+  }
+
+  *cpu = now(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+  *wall = now(CLOCK_MONOTONIC) - wall_start;
+
+  if(status != TRANSFER_DONE){
+    error_occurred("ERROR receiving file");
+  }
+
+  pthread_join(thread, NULL);
+  receiver_free(&receiver);
+  close(job.filefd);
+  close(filefd);
+  close(sockfd);
+}
+
+int main(int argc, char *argv[]){
+  long default_sizes[] = {64, 1024, 16384, 131072};
+  const char *dir = "/tmp";
+  char source[4096], target[4096];
+  int repeats = 5;
+  int option, i, r, mode;
+  long *sizes = default_sizes;
+  int size_count = 4;
+
+  while((option = getopt(argc, argv, "d:r:")) != -1){
+    switch(option){
+      case 'd':
+        dir = optarg;
+        break;
+      case 'r':
+        repeats = atoi(optarg);
+        break;
+      default:
+        printf("Usage: %s [-d dir] [-r repeats] [size_kb ...]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if(optind < argc){
+    size_count = argc - optind;
+    sizes = malloc(sizeof(long) * size_count);
+    for(i = 0; i < size_count; i++){
+      sizes[i] = atol(argv[optind + i]);
+    }
+  }
+
+  snprintf(source, sizeof(source), "%s/bitdrive_ingest_src", dir);
+  snprintf(target, sizeof(target), "%s/bitdrive_ingest_dst", dir);
+
+  printf("%13s  %-8s  %10s  %10s  %12s\n", "size", "path", "MB/s", "cpu ms", "cpu ms/GB");
+  for(i = 0; i < size_count; i++){
+    off_t size = (off_t)sizes[i] * 1024;
+    make_source(source, size);
+
+    for(mode = 0; mode < 2; mode++){
+      double best_wall = 0, total_cpu = 0, wall, cpu;
+
+      for(r = 0; r < repeats; r++){
+        run_once(source, target, size, mode == 0, &wall, &cpu);
+        if(r == 0 || wall < best_wall){
+          best_wall = wall;
+        }
+
+        total_cpu += cpu;
+      }
+
+      if(!same_contents(source, target)){
+        printf("ERROR: received file differs from source\n");
+        return 1;
+      }
+
+      printf("%10ld KB  %-8s  %10.1f  %10.2f  %12.1f\n", sizes[i],
+             mode == 0 ? "splice" : "buffered", size / best_wall / 1e6,
+             total_cpu / repeats * 1e3, total_cpu / repeats * 1e3 / (size / 1e9));
+    }
+  }
+
+  unlink(source);
+  unlink(target);
+  return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * Measures what a store's layout costs as it grows: for every object
+ * count, fills an empty store with that many files, then looks each one
+ * up in random order and deletes them all, once flat and once sharded.
+ * Times are per operation, so a layout that scales keeps them flat.
+ *
+ * Usage: bench/layout [-d dir] [count ...]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../layout.h"
+
+void error_occurred(const char *msg){
+  perror(msg);
+  exit(1);
+}
+
+double now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void object_name(char *name, long i){
+  sprintf(name, "artifact-%08ld.bin", i);
+}
+
+/* Empties a store again, shard directories included. */
+void clear_store(const char *root){
+  char command[PATH_MAX + 32];
+
+  snprintf(command, sizeof(command), "rm -rf '%s'", root);
+  if(system(command) != 0 || mkdir(root, 0755) < 0){
+    error_occurred("ERROR resetting store");
+  }
+}
+
+void run(const char *root, enum Layout layout, long count){
+  char name[64];
+  char path[PATH_MAX];
+  struct stat file_stats;
+  double start, create, lookup, delete;
+  long i, *order;
+  int fd;
+
+  clear_store(root);
+  order = malloc(count * sizeof(long));
+  for(i = 0; i < count; i++){
+    order[i] = i;
+  }
+
+  // lookups in random order, so no directory block stays conveniently hot
+  srandom(count);
+  for(i = count - 1; i > 0; i--){
+    long j = random() % (i + 1), tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+
+  start = now();
+  for(i = 0; i < count; i++){
+    object_name(name, i);
+    layout_path(path, root, layout, name);
+    if(!layout_prepare(root, layout, name) ||
+       (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0){
+      error_occurred("ERROR creating object");
+    }
+
+    close(fd);
+  }
+
+  create = now() - start;
+  start = now();
+  for(i = 0; i < count; i++){
+    object_name(name, order[i]);
+    layout_path(path, root, layout, name);
+    if(stat(path, &file_stats) < 0){
+      error_occurred("ERROR looking up object");
+    }
+  }
+
+  lookup = now() - start;
+  start = now();
+  for(i = 0; i < count; i++){
+    object_name(name, order[i]);
+    layout_path(path, root, layout, name);
+    if(unlink(path) < 0){
+      error_occurred("ERROR deleting object");
+    }
+  }
+
+  delete = now() - start;
+  printf("%-8s %10ld %12.2f %12.2f %12.2f\n", layout == LAYOUT_FLAT ? "flat" : "sharded",
+         count, create / count * 1e6, lookup / count * 1e6, delete / count * 1e6);
+  free(order);
+}
+
+int main(int argc, char *argv[]){
+  long default_counts[] = {10000, 50000, 100000};
+  char root[PATH_MAX];
+  const char *dir = "/tmp";
+  int option, i;
+
+  while((option = getopt(argc, argv, "d:")) != -1){
+    switch(option){
+      case 'd':
+        dir = optarg;
+        break;
+      default:
+        printf("Usage: %s [-d dir] [count ...]\n", argv[0]);
+        exit(1);
+    }
+  }
+
+  snprintf(root, sizeof(root), "%s/bitdrive-layout-%d", dir, getpid());
+  printf("%-8s %10s %12s %12s %12s\n", "layout", "objects", "create us", "lookup us",
+         "delete us");
+
+  for(i = optind; i < argc || (optind == argc && i < 3); i++){
+    long count = optind < argc ? atol(argv[i]) : default_counts[i];
+    run(root, LAYOUT_FLAT, count);
+    run(root, LAYOUT_SHARDED, count);
+  }
+
+  clear_store(root);
+  rmdir(root);
+  return 0;
+}
@@ -0,0 +1,614 @@
+/*
+ * Load generator for a running server. Every simulated session is a
+ * thread with its own framed connection that runs a random mix of LIST,
+ * UPLOAD, DOWNLOAD and DELETE in lockstep, one request at a time, on
+ * files of its own, so the latency of a command is the time from sending
+ * the request to its last reply byte. Uploads pick their size from a
+ * weighted table; downloads and deletes pick one of the session's files
+ * that is stored, falling back to an upload when there is none. Each
+ * session uploads all its files before the clock starts and deletes them
+ * at the end.
+ *
+ * -m weighs the commands as list,upload,download,delete; -s lists
+ * size_kb:weight pairs. Reported per command: operations, ops/s, MB/s of
+ * file data and the 50th, 99th and 99.9th percentile latency.
+ *
+ * Usage: bench/load [-h host] [-p port] [-c sessions] [-t seconds] [-f files]
+ *                   [-m list,upload,download,delete] [-s size_kb:weight,...]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "../protocol.h"
+
+#define MAX_SIZES 16
+#define DRAIN_SIZE (256 * 1024)
+
+enum Command{
+  CMD_LIST,
+  CMD_UPLOAD,
+  CMD_DOWNLOAD,
+  CMD_DELETE,
+  CMD_COUNT
+};
+
+const char *command_names[CMD_COUNT] = {"LIST", "UPLOAD", "DOWNLOAD", "DELETE"};
+
+// latencies of one command, in nanoseconds
+struct Samples{
+  uint64_t *ns;
+  size_t count;
+  size_t capacity;
+  unsigned long long bytes;
+  unsigned long long errors;
+};
+
+struct LoadSession{
+  int id;
+  pthread_t thread;
+  int sockfd;
+  unsigned int seed;
+  uint32_t request_id;
+  off_t *stored;      // size of each of its files on the server, -1 if none
+  char *drain;
+  struct Samples samples[CMD_COUNT];
+  bool failed;
+};
+
+const char *host = "127.0.0.1";
+const char *port = "8080";
+int session_count = 16;
+int duration = 10;
+int file_count = 8;
+int weights[CMD_COUNT] = {10, 30, 50, 10};
+long size_kb[MAX_SIZES] = {4, 64, 1024, 16384};
+int size_weights[MAX_SIZES] = {60, 25, 10, 5};
+int size_count = 4;
+char *data;
+pthread_barrier_t start_line;
+double deadline;
+
+void error_occurred(const char *msg){
+  perror(msg);
+  exit(1);
+}
+
+double now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Picks an index of weights (count entries) in proportion to its weight. */
+int pick(unsigned int *seed, const int *weights, int count){
+  int i, total = 0, roll;
+
+  for(i = 0; i < count; i++){
+    total += weights[i];
+  }
+
+  roll = rand_r(seed) % total;
+  for(i = 0; roll >= weights[i]; i++){
+    roll -= weights[i];
+  }
+
+  return i;
+}
+
+void record(struct Samples *samples, uint64_t ns, unsigned long long bytes, bool ok){
+  if(!ok){
+    samples->errors++;
+    return;
+  }
+
+  if(samples->count == samples->capacity){
+    samples->capacity = samples->capacity ? samples->capacity * 2 : 1024;
+    samples->ns = realloc(samples->ns, samples->capacity * sizeof(uint64_t));
+    if(samples->ns == NULL){
+      error_occurred("ERROR allocating samples");
+    }
+  }
+
+  samples->ns[samples->count++] = ns;
+  samples->bytes += bytes;
+}
+
+int connect_server(){
+  struct addrinfo hints, *addresses, *address;
+  int sockfd = -1, one = 1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if(getaddrinfo(host, port, &hints, &addresses) != 0){
+    return -1;
+  }
+
+  for(address = addresses; address != NULL; address = address->ai_next){
+    sockfd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if(sockfd >= 0 && connect(sockfd, address->ai_addr, address->ai_addrlen) == 0){
+      break;
+    }
+
+    if(sockfd >= 0){
+      close(sockfd);
+      sockfd = -1;
+    }
+  }
+
+  freeaddrinfo(addresses);
+  if(sockfd >= 0){
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+
+  return sockfd;
+}
+
+/* Reads and throws away len bytes. */
+bool drain(struct LoadSession *session, uint64_t len){
+  size_t take;
+
+  while(len > 0){
+    take = len < DRAIN_SIZE ? len : DRAIN_SIZE;
+    if(read_full(session->sockfd, session->drain, take) < 0){
+      return false;
+    }
+
+    len -= take;
+  }
+
+  return true;
+}
+
+/* Reads one reply to request_id; false on ERROR or a broken connection. */
+bool expect(struct LoadSession *session, uint8_t opcode, struct FrameHeader *header){
+  if(frame_recv(session->sockfd, header) < 0 || header->request_id != session->request_id){
+    session->failed = true;
+    return false;
+  }
+
+  if(header->opcode != opcode){
+    if(!drain(session, header->length)){
+      session->failed = true;
+    }
+
+    return false;
+  }
+
+  return true;
+}
+
+/* HELLO without any optional features: every command runs in lockstep. */
+bool negotiate(struct LoadSession *session){
+  unsigned char hello[4];
+  struct FrameHeader header;
+
+  put_u32(hello, 0);
+  session->request_id++;
+  return frame_send(session->sockfd, OP_HELLO, 0, session->request_id, hello, 4) == 0 &&
+         expect(session, OP_HELLO, &header) && drain(session, header.length);
+}
+
+void file_name(struct LoadSession *session, int file, char *name){
+  snprintf(name, NAME_MAX + 1, "load-%d-%d.bin", session->id, file);
+}
+
+bool run_list(struct LoadSession *session, unsigned long long *bytes){
+  struct FrameHeader header;
+
+  session->request_id++;
+  if(frame_send(session->sockfd, OP_LIST, 0, session->request_id, NULL, 0) < 0){
+    session->failed = true;
+    return false;
+  }
+
+  if(!expect(session, OP_OK, &header)){
+    return false;
+  }
+
+  *bytes = header.length;
+  return drain(session, header.length);
+}
+
+bool run_upload(struct LoadSession *session, int file, off_t size){
+  unsigned char request[8 + NAME_MAX + 1];
+  struct FrameHeader header;
+  char name[NAME_MAX + 1];
+  size_t len;
+
+  file_name(session, file, name);
+  len = strlen(name);
+  put_u64(request, size);
+  memcpy(request + 8, name, len);
+  session->request_id++;
+  if(frame_send(session->sockfd, OP_UPLOAD, 0, session->request_id, request, 8 + len) < 0){
+    session->failed = true;
+    return false;
+  }
+
+  if(!expect(session, OP_READY, &header) || !drain(session, header.length)){
+    return false;
+  }
+
+  if(frame_send(session->sockfd, OP_DATA, FLAG_FIN, session->request_id, data, size) < 0){
+    session->failed = true;
+    return false;
+  }
+
+  if(!expect(session, OP_OK, &header) || !drain(session, header.length)){
+    return false;
+  }
+
+  session->stored[file] = size;
+  return true;
+}
+
+bool run_download(struct LoadSession *session, int file){
+  struct FrameHeader header;
+  char name[NAME_MAX + 1];
+  off_t received = 0;
+
+  file_name(session, file, name);
+  session->request_id++;
+  if(frame_send(session->sockfd, OP_DOWNLOAD, 0, session->request_id, name, strlen(name)) < 0){
+    session->failed = true;
+    return false;
+  }
+
+  if(!expect(session, OP_OK, &header) || !drain(session, header.length)){
+    return false;
+  }
+
+  do{
+    if(!expect(session, OP_DATA, &header) || !drain(session, header.length)){
+      session->failed = true;
+      return false;
+    }
+
+    received += header.length;
+  } while(!(header.flags & FLAG_FIN));
+
+  return received == session->stored[file];
+}
+
+bool run_delete(struct LoadSession *session, int file){
+  struct FrameHeader header;
+  char name[NAME_MAX + 1];
+
+  file_name(session, file, name);
+  session->request_id++;
+  if(frame_send(session->sockfd, OP_DELETE, 0, session->request_id, name, strlen(name)) < 0){
+    session->failed = true;
+    return false;
+  }
+
+  if(!expect(session, OP_OK, &header) || !drain(session, header.length)){
+    return false;
+  }
+
+  session->stored[file] = -1;
+  return true;
+}
+
+/* One of the session's files that is stored, or -1. */
+int stored_file(struct LoadSession *session){
+  int start = rand_r(&session->seed) % file_count, i;
+
+  for(i = 0; i < file_count; i++){
+    if(session->stored[(start + i) % file_count] >= 0){
+      return (start + i) % file_count;
+    }
+  }
+
+  return -1;
+}
+
+off_t pick_size(struct LoadSession *session){
+  return size_kb[pick(&session->seed, size_weights, size_count)] * 1024;
+}
+
+void run_command(struct LoadSession *session){
+  enum Command command = pick(&session->seed, weights, CMD_COUNT);
+  unsigned long long bytes = 0;
+  int file = rand_r(&session->seed) % file_count;
+  uint64_t start;
+  off_t size;
+  bool ok;
+
+  if(command == CMD_DOWNLOAD || command == CMD_DELETE){
+    file = stored_file(session);
+    if(file < 0){
+      command = CMD_UPLOAD;
+      file = rand_r(&session->seed) % file_count;
+    }
+  }
+
+  start = now_ns();
+  switch(command){
+    case CMD_LIST:
+      ok = run_list(session, &bytes);
+      bytes = 0;
+      break;
+    case CMD_UPLOAD:
+      size = pick_size(session);
+      ok = run_upload(session, file, size);
+      bytes = size;
+      break;
+    case CMD_DOWNLOAD:
+      bytes = session->stored[file];
+      ok = run_download(session, file);
+      break;
+    default:
+      ok = run_delete(session, file);
+      break;
+  }
+
+  record(&session->samples[command], now_ns() - start, bytes, ok);
+}
+
+void *run_session(void *arg){
+  struct LoadSession *session = arg;
+  int i;
+
+  session->sockfd = connect_server();
+  if(session->sockfd < 0 || !negotiate(session)){
+    printf("Session %d: could not connect to %s:%s\n", session->id, host, port);
+    session->failed = true;
+  }
+
+  for(i = 0; i < file_count && !session->failed; i++){
+    run_upload(session, i, pick_size(session));
+  }
+
+  pthread_barrier_wait(&start_line);
+  while(!session->failed && now() < deadline){
+    run_command(session);
+  }
+
+  for(i = 0; i < file_count && !session->failed; i++){
+    if(session->stored[i] >= 0){
+      run_delete(session, i);
+    }
+  }
+
+  if(session->sockfd >= 0){
+    close(session->sockfd);
+  }
+
+  return 0;
+}
+
+int compare_ns(const void *a, const void *b){
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+double percentile(const struct Samples *samples, double fraction){
+  size_t index = (size_t)(fraction * samples->count);
+
+  if(samples->count == 0){
+    return 0;
+  }
+
+  if(index >= samples->count){
+    index = samples->count - 1;
+  }
+
+  return samples->ns[index] / 1e6;
+}
+
+/* Merges what every session measured for command into one sorted set. */
+void merge(struct LoadSession *sessions, enum Command command, struct Samples *total){
+  int i;
+
+  memset(total, 0, sizeof(*total));
+  for(i = 0; i < session_count; i++){
+    struct Samples *samples = &sessions[i].samples[command];
+    size_t j;
+
+    for(j = 0; j < samples->count; j++){
+      record(total, samples->ns[j], 0, true);
+    }
+
+    total->bytes += samples->bytes;
+    total->errors += samples->errors;
+  }
+
+  qsort(total->ns, total->count, sizeof(uint64_t), compare_ns);
+}
+
+void report(struct LoadSession *sessions, double elapsed){
+  unsigned long long ops = 0, bytes = 0;
+  struct Samples total;
+  int i, failed = 0;
+
+  printf("%-9s  %9s  %9s  %9s  %9s  %9s  %9s  %7s\n", "command", "ops", "ops/s", "MB/s",
+         "p50 ms", "p99 ms", "p99.9 ms", "errors");
+  for(i = 0; i < CMD_COUNT; i++){
+    merge(sessions, i, &total);
+    printf("%-9s  %9zu  %9.1f  %9.1f  %9.3f  %9.3f  %9.3f  %7llu\n", command_names[i],
+           total.count, total.count / elapsed, total.bytes / 1e6 / elapsed,
+           percentile(&total, 0.50), percentile(&total, 0.99), percentile(&total, 0.999),
+           total.errors);
+    ops += total.count;
+    bytes += total.bytes;
+    free(total.ns);
+  }
+
+  for(i = 0; i < session_count; i++){
+    failed += sessions[i].failed;
+  }
+
+  printf("%-9s  %9llu  %9.1f  %9.1f\n", "total", ops, ops / elapsed, bytes / 1e6 / elapsed);
+  if(failed > 0){
+    printf("%d sessions lost their connection.\n", failed);
+  }
+}
+
+bool parse_mix(char *spec){
+  char *field, *rest = spec;
+  int i, total = 0;
+
+  for(i = 0; i < CMD_COUNT; i++){
+    field = strsep(&rest, ",");
+    if(field == NULL || atoi(field) < 0){
+      return false;
+    }
+
+    weights[i] = atoi(field);
+    total += weights[i];
+  }
+
+  return rest == NULL && total > 0;
+}
+
+bool parse_sizes(char *spec){
+  char *field, *rest = spec, *weight;
+
+  size_count = 0;
+  while((field = strsep(&rest, ",")) != NULL){
+    if(size_count == MAX_SIZES){
+      return false;
+    }
+
+    weight = strchr(field, ':');
+    size_kb[size_count] = atol(field);
+    size_weights[size_count] = weight != NULL ? atoi(weight + 1) : 1;
+    if(size_kb[size_count] < 0 || size_weights[size_count] <= 0){
+      return false;
+    }
+
+    size_count++;
+  }
+
+  return size_count > 0;
+}
+
+void usage(const char *name){
+  printf("Usage: %s [-h host] [-p port] [-c sessions] [-t seconds] [-f files] "
+         "[-m list,upload,download,delete] [-s size_kb:weight,...]\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[]){
+  struct LoadSession *sessions;
+  unsigned int seed = 1;
+  long largest = 0;
+  double start;
+  int option, i;
+  long j;
+
+  while((option = getopt(argc, argv, "h:p:c:t:f:m:s:")) != -1){
+    switch(option){
+      case 'h':
+        host = optarg;
+        break;
+      case 'p':
+        port = optarg;
+        break;
+      case 'c':
+        session_count = atoi(optarg);
+        break;
+      case 't':
+        duration = atoi(optarg);
+        break;
+      case 'f':
+        file_count = atoi(optarg);
+        break;
+      case 'm':
+        if(!parse_mix(optarg)){
+          usage(argv[0]);
+        }
+        break;
+      case 's':
+        if(!parse_sizes(optarg)){
+          usage(argv[0]);
+        }
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if(session_count <= 0 || duration <= 0 || file_count <= 0){
+    usage(argv[0]);
+  }
+
+  // one buffer of incompressible bytes every upload sends from
+  for(i = 0; i < size_count; i++){
+    if(size_kb[i] > largest){
+      largest = size_kb[i];
+    }
+  }
+
+  data = malloc(largest * 1024 + 1);
+  sessions = calloc(session_count, sizeof(struct LoadSession));
+  if(data == NULL || sessions == NULL){
+    error_occurred("ERROR allocating buffers");
+  }
+
+  for(j = 0; j < largest * 1024; j++){
+    data[j] = rand_r(&seed);
+  }
+
+  printf("%d sessions for %d s against %s:%s, %d files each\n", session_count, duration,
+         host, port, file_count);
+  printf("mix: LIST %d, UPLOAD %d, DOWNLOAD %d, DELETE %d\n",
+         weights[CMD_LIST], weights[CMD_UPLOAD], weights[CMD_DOWNLOAD], weights[CMD_DELETE]);
+  printf("sizes:");
+  for(i = 0; i < size_count; i++){
+    printf(" %ld KB x%d", size_kb[i], size_weights[i]);
+  }
+
+  printf("\n");
+
+  pthread_barrier_init(&start_line, NULL, session_count + 1);
+  for(i = 0; i < session_count; i++){
+    sessions[i].id = i;
+    sessions[i].sockfd = -1;
+    sessions[i].seed = i + 1;
+    sessions[i].stored = malloc(file_count * sizeof(off_t));
+    sessions[i].drain = malloc(DRAIN_SIZE);
+    if(sessions[i].stored == NULL || sessions[i].drain == NULL){
+      error_occurred("ERROR allocating sessions");
+    }
+
+    for(j = 0; j < file_count; j++){
+      sessions[i].stored[j] = -1;
+    }
+
+    if(pthread_create(&sessions[i].thread, NULL, run_session, &sessions[i]) != 0){
+      error_occurred("ERROR starting session");
+    }
+  }
+
+  // every session has its files uploaded; the clock starts now
+  deadline = now() + duration;
+  start = now();
+  pthread_barrier_wait(&start_line);
+  for(i = 0; i < session_count; i++){
+    pthread_join(sessions[i].thread, NULL);
+  }
+
+  report(sessions, now() - start);
+  return 0;
+}
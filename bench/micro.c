@@ -0,0 +1,650 @@
+/*
+ * Microbenchmarks of the hot primitives, checked against a stored
+ * baseline so a change to one of them can be judged in seconds:
+ *
+ *   send/...   sender_pump() from a file, with sendfile(2) and with the
+ *            buffered fallback, over loopback TCP and a socketpair, at a
+ *            few per-call budgets (the client's and server's upload and
+ *            download loops are both built on it)
+ *   recv/...   receiver_pump() into a file, with splice(2) and buffered
+ *   index/...  the file index behind LIST: adding files, the legacy LIST
+ *            text and the framed paged query, at 10^3 to 10^6 files
+ *   frame/...  encoding and decoding frame headers, and one small request
+ *            frame through a socketpair
+ *
+ * Index entries get their size from a stand-in for the packed store's
+ * stat, so no files are created for them. Every case runs repeats times
+ * and keeps its best run. Results are compared with the baseline file;
+ * one worse than it by more than the tolerance (in percent) is flagged
+ * and makes the exit status 1. -w writes the results of the cases run
+ * into the baseline instead. Only cases whose name starts with prefix run.
+ *
+ * Usage: bench/micro [-d dir] [-r repeats] [-b baseline] [-x tolerance] [-n max_files]
+ *                    [-w] [prefix]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "../server.h"
+
+#define MAX_CASES 256
+#define CASE_NAME 64
+#define TRANSFER_SIZE (32 * 1024 * 1024)
+#define FRAME_ROUNDS 2000000
+#define PAGE_ROUNDS 1000
+
+struct Case{
+  char name[CASE_NAME];
+  double value;
+  char unit[8];
+};
+
+struct Peer{
+  int sockfd;
+  off_t size;
+  char *buffer;
+};
+
+struct Config config;
+
+struct Case baseline[MAX_CASES];
+int baseline_count;
+int repeats = 3;
+double tolerance = 30;
+const char *prefix = "";
+bool write_baseline;
+int regressions;
+
+void error_occurred(const char *msg){
+  perror(msg);
+  exit(1);
+}
+
+double now(clockid_t clock){
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// what index.c needs from the rest of the server
+void build_path(char *path, const char *filename){
+  layout_path(path, STORAGE_DIR, config.layout, filename);
+}
+
+void cache_drop(const char *filename){
+}
+
+void cache_clear(){
+}
+
+bool dedup_stat(int dirfd, const char *name, struct stat *file_stats){
+  return false;
+}
+
+/* Makes up a size and mtime for name instead of looking at a disk. */
+bool pack_stat(int dirfd, const char *name, struct stat *file_stats){
+  size_t hash = 5381;
+
+  for(; *name != '\0'; name++){
+    hash = hash * 33 + (unsigned char)*name;
+  }
+
+  memset(file_stats, 0, sizeof(*file_stats));
+  file_stats->st_mode = S_IFREG | 0644;
+  file_stats->st_size = hash % (64 * 1024 * 1024);
+  file_stats->st_mtime = 1700000000 + hash % 100000000;
+  return true;
+}
+
+bool selected(const char *name){
+  return strncmp(name, prefix, strlen(prefix)) == 0;
+}
+
+/* Whether any case of a group (a name prefix like "index/") is selected. */
+bool group_selected(const char *group){
+  size_t len = strlen(prefix) < strlen(group) ? strlen(prefix) : strlen(group);
+
+  return strncmp(group, prefix, len) == 0;
+}
+
+struct Case *find_case(const char *name){
+  int i;
+
+  for(i = 0; i < baseline_count; i++){
+    if(strcmp(baseline[i].name, name) == 0){
+      return &baseline[i];
+    }
+  }
+
+  return NULL;
+}
+
+void load_baseline(const char *path){
+  char line[256];
+  struct Case *entry;
+  FILE *file = fopen(path, "r");
+
+  if(file == NULL){
+    return;
+  }
+
+  while(fgets(line, sizeof(line), file) != NULL && baseline_count < MAX_CASES){
+    entry = &baseline[baseline_count];
+    if(line[0] != '#' &&
+       sscanf(line, "%63s %lf %7s", entry->name, &entry->value, entry->unit) == 3){
+      baseline_count++;
+    }
+  }
+
+  fclose(file);
+}
+
+void save_baseline(const char *path){
+  FILE *file = fopen(path, "w");
+  int i;
+
+  if(file == NULL){
+    error_occurred("ERROR writing baseline");
+  }
+
+  fprintf(file, "# bench/micro baseline: case, best result, unit (MB/s: higher is better)\n");
+  for(i = 0; i < baseline_count; i++){
+    fprintf(file, "%s %.1f %s\n", baseline[i].name, baseline[i].value, baseline[i].unit);
+  }
+
+  fclose(file);
+}
+
+/*
+ * Prints one result next to its baseline. MB/s is better higher, anything
+ * else (nanoseconds per operation) lower.
+ */
+void report(const char *name, double value, const char *unit){
+  struct Case *entry = find_case(name);
+  bool higher = strcmp(unit, "MB/s") == 0;
+  double change;
+
+  if(write_baseline){
+    if(entry == NULL && baseline_count < MAX_CASES){
+      entry = &baseline[baseline_count++];
+      snprintf(entry->name, CASE_NAME, "%s", name);
+    }
+
+    if(entry != NULL){
+      entry->value = value;
+      snprintf(entry->unit, sizeof(entry->unit), "%s", unit);
+    }
+
+    printf("%-32s  %12.1f %-4s\n", name, value, unit);
+    return;
+  }
+
+  if(entry == NULL || entry->value <= 0){
+    printf("%-32s  %12.1f %-4s  %12s\n", name, value, unit, "new");
+    return;
+  }
+
+  change = (value - entry->value) / entry->value * 100;
+  printf("%-32s  %12.1f %-4s  %12.1f  %+7.1f%%", name, value, unit, entry->value, change);
+  if(higher ? change < -tolerance : change > tolerance){
+    printf("  REGRESSION");
+    regressions++;
+  }
+
+  printf("\n");
+}
+
+/* A connected pair: TCP over loopback when tcp is set, else a socketpair. */
+void connect_pair(bool tcp, int *a, int *b){
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int listenfd, fds[2], one = 1;
+
+  if(!tcp){
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0){
+      error_occurred("ERROR creating socketpair");
+    }
+
+    *a = fds[0];
+    *b = fds[1];
+    return;
+  }
+
+  listenfd = socket(AF_INET, SOCK_STREAM, 0);
+  bzero(&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenfd, 1) < 0){
+    error_occurred("ERROR on binding");
+  }
+
+  getsockname(listenfd, (struct sockaddr *)&addr, &len);
+  *a = socket(AF_INET, SOCK_STREAM, 0);
+  if(connect(*a, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+    error_occurred("ERROR connecting");
+  }
+
+  *b = accept(listenfd, NULL, NULL);
+  if(*b < 0){
+    error_occurred("ERROR on accept");
+  }
+
+  setsockopt(*a, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  setsockopt(*b, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  close(listenfd);
+}
+
+void *drain_peer(void *arg){
+  struct Peer *peer = arg;
+  off_t received = 0;
+  ssize_t len;
+
+  while(received < peer->size){
+    len = read(peer->sockfd, peer->buffer, TRANSFER_BUFFER_SIZE);
+    if(len <= 0){
+      break;
+    }
+
+    received += len;
+  }
+
+  return 0;
+}
+
+void *feed_peer(void *arg){
+  struct Peer *peer = arg;
+
+  write_full(peer->sockfd, peer->buffer, peer->size);
+  return 0;
+}
+
+/* Seconds to send the whole of filefd through sender_pump. */
+double run_send(bool tcp, bool use_sendfile, size_t budget, int filefd, char *scratch){
+  struct FileSender sender;
+  struct Peer peer;
+  pthread_t thread;
+  enum TransferStatus status;
+  double start, elapsed;
+  int sockfd;
+
+  connect_pair(tcp, &sockfd, &peer.sockfd);
+  peer.size = TRANSFER_SIZE;
+  peer.buffer = scratch;
+  pthread_create(&thread, NULL, drain_peer, &peer);
+
+  start = now(CLOCK_MONOTONIC);
+  sender_init(&sender, filefd, 0, TRANSFER_SIZE);
+  sender.use_sendfile = use_sendfile;
+  while((status = sender_pump(&sender, sockfd, budget, NULL)) == TRANSFER_AGAIN){
+  }
+
+  sender_free(&sender);
+  pthread_join(thread, NULL);
+  elapsed = now(CLOCK_MONOTONIC) - start;
+
+  if(status != TRANSFER_DONE){
+    error_occurred("ERROR sending file");
+  }
+
+  close(sockfd);
+  close(peer.sockfd);
+  return elapsed;
+}
+
+/* Seconds to receive a whole file through receiver_pump into filefd. */
+double run_recv(bool tcp, bool use_splice, size_t budget, int filefd, char *data){
+  struct FileReceiver receiver;
+  struct Peer peer;
+  pthread_t thread;
+  enum TransferStatus status;
+  double start, elapsed;
+  int sockfd;
+
+  connect_pair(tcp, &sockfd, &peer.sockfd);
+  peer.size = TRANSFER_SIZE;
+  peer.buffer = data;
+  ftruncate(filefd, 0);
+
+  start = now(CLOCK_MONOTONIC);
+  pthread_create(&thread, NULL, feed_peer, &peer);
+  receiver_init(&receiver);
+  receiver.use_splice = use_splice;
+  receiver_start(&receiver, filefd, 0, TRANSFER_SIZE);
+  while((status = receiver_pump(&receiver, sockfd, budget, NULL)) == TRANSFER_AGAIN){
+  }
+
+  receiver_free(&receiver);
+  pthread_join(thread, NULL);
+  elapsed = now(CLOCK_MONOTONIC) - start;
+
+  if(status != TRANSFER_DONE){
+    error_occurred("ERROR receiving file");
+  }
+
+  close(sockfd);
+  close(peer.sockfd);
+  return elapsed;
+}
+
+void bench_transfers(){
+  size_t budgets[] = {64 * 1024, 256 * 1024, 1024 * 1024};
+  const char *budget_names[] = {"64k", "256k", "1m"};
+  char name[CASE_NAME];
+  char *data, *scratch;
+  unsigned int seed = 173;
+  double best, elapsed;
+  int source, target, send, tcp, mode, b, r;
+  size_t i;
+
+  data = malloc(TRANSFER_SIZE);
+  scratch = malloc(TRANSFER_BUFFER_SIZE);
+  if(data == NULL || scratch == NULL){
+    error_occurred("ERROR allocating buffers");
+  }
+
+  for(i = 0; i < TRANSFER_SIZE; i++){
+    data[i] = rand_r(&seed) & 0xff;
+  }
+
+  source = open("source.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+  target = open("target.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(source < 0 || target < 0 || write_full(source, data, TRANSFER_SIZE) < 0){
+    error_occurred("ERROR creating transfer files");
+  }
+
+  for(send = 1; send >= 0; send--){
+    for(tcp = 1; tcp >= 0; tcp--){
+      for(mode = 1; mode >= 0; mode--){
+        for(b = 0; b < 3; b++){
+          snprintf(name, CASE_NAME, "%s/%s/%s/%s", send ? "send" : "recv",
+                   tcp ? "tcp" : "unix",
+                   send ? (mode ? "sendfile" : "buffered") : (mode ? "splice" : "buffered"),
+                   budget_names[b]);
+          if(!selected(name)){
+            continue;
+          }
+
+          best = 0;
+          for(r = 0; r < repeats; r++){
+            elapsed = send ? run_send(tcp, mode, budgets[b], source, scratch) :
+                             run_recv(tcp, mode, budgets[b], target, data);
+            if(best == 0 || elapsed < best){
+              best = elapsed;
+            }
+          }
+
+          report(name, TRANSFER_SIZE / 1e6 / best, "MB/s");
+        }
+      }
+    }
+  }
+
+  close(source);
+  close(target);
+  unlink("source.bin");
+  unlink("target.bin");
+  free(data);
+  free(scratch);
+}
+
+/*
+ * Grows the index to 10^3, 10^4, ... files up to max_files and at every
+ * size times adding files, the LIST text, the first paged query after a
+ * change (index/sort, from when that re-sorted the whole view) and a page
+ * from the middle of the view.
+ */
+void bench_index(long max_files){
+  struct ListEntry *entries;
+  struct ListQuery query;
+  struct Arena arena = {0};
+  char name[CASE_NAME], filename[NAME_MAX + 1];
+  long count = 0, target, i;
+  double start, elapsed, best;
+  int file_counter, r;
+
+  if(!group_selected("index/")){
+    return;
+  }
+
+  config.packed = true;
+  config.layout = LAYOUT_SHARDED;
+  index_init();
+
+  entries = malloc(LIST_PAGE * sizeof(struct ListEntry));
+  if(entries == NULL){
+    error_occurred("ERROR allocating page");
+  }
+
+  for(target = 1000; target <= max_files; target *= 10){
+    // the files added since the last size, taken out again between runs
+    snprintf(name, CASE_NAME, "index/update/%ld", target);
+    best = 0;
+    for(r = 0; r < (selected(name) ? repeats : 1); r++){
+      for(i = r > 0 ? count : target; i < target; i++){
+        snprintf(filename, sizeof(filename), "file-%08ld.bin", i);
+        index_remove(filename);
+      }
+
+      start = now(CLOCK_MONOTONIC);
+      for(i = count; i < target; i++){
+        snprintf(filename, sizeof(filename), "file-%08ld.bin", i);
+        index_update(filename);
+      }
+
+      elapsed = (now(CLOCK_MONOTONIC) - start) / (target - count);
+      if(best == 0 || elapsed < best){
+        best = elapsed;
+      }
+    }
+
+    count = target;
+    if(selected(name)){
+      report(name, best * 1e9, "ns");
+    }
+
+    snprintf(name, CASE_NAME, "index/list/%ld", target);
+    if(selected(name)){
+      best = 0;
+      for(r = 0; r < repeats; r++){
+        start = now(CLOCK_MONOTONIC);
+        index_list(&arena, &file_counter);
+        elapsed = now(CLOCK_MONOTONIC) - start;
+        arena_reset(&arena);
+        if(best == 0 || elapsed < best){
+          best = elapsed;
+        }
+      }
+
+      report(name, best * 1e9, "ns");
+    }
+
+    snprintf(name, CASE_NAME, "index/sort/%ld", target);
+    if(selected(name)){
+      best = 0;
+      for(r = 0; r < repeats; r++){
+        index_update("file-00000000.bin");
+        memset(&query, 0, sizeof(query));
+        start = now(CLOCK_MONOTONIC);
+        index_page(&query, entries, LIST_PAGE);
+        elapsed = now(CLOCK_MONOTONIC) - start;
+        if(best == 0 || elapsed < best){
+          best = elapsed;
+        }
+      }
+
+      report(name, best * 1e9, "ns");
+    }
+
+    snprintf(name, CASE_NAME, "index/page/%ld", target);
+    if(selected(name)){
+      best = 0;
+      for(r = 0; r < repeats; r++){
+        start = now(CLOCK_MONOTONIC);
+        for(i = 0; i < PAGE_ROUNDS; i++){
+          memset(&query, 0, sizeof(query));
+          snprintf(query.after_name, sizeof(query.after_name), "file-%08ld.bin",
+                   i * 7919 % target);
+          index_page(&query, entries, LIST_PAGE);
+        }
+
+        elapsed = (now(CLOCK_MONOTONIC) - start) / PAGE_ROUNDS;
+        if(best == 0 || elapsed < best){
+          best = elapsed;
+        }
+      }
+
+      report(name, best * 1e9, "ns");
+    }
+  }
+
+  free(entries);
+}
+
+void bench_framing(){
+  unsigned char buffer[FRAME_HEADER_SIZE], payload[64];
+  const char *request = "some-directory-name/and-a-file-name.bin";
+  struct FrameHeader header;
+  volatile uint64_t sink = 0;
+  double start, elapsed, best = 0;
+  int fds[2], i, r;
+
+  if(selected("frame/header")){
+    for(r = 0; r < repeats; r++){
+      start = now(CLOCK_MONOTONIC);
+      for(i = 0; i < FRAME_ROUNDS; i++){
+        frame_encode(buffer, OP_DATA, FLAG_FIN, i, (uint64_t)i * 4096);
+        frame_decode(buffer, &header);
+        sink += header.length;
+      }
+
+      elapsed = (now(CLOCK_MONOTONIC) - start) / FRAME_ROUNDS;
+      if(best == 0 || elapsed < best){
+        best = elapsed;
+      }
+    }
+
+    report("frame/header", best * 1e9, "ns");
+  }
+
+  if(selected("frame/socketpair")){
+    connect_pair(false, &fds[0], &fds[1]);
+    best = 0;
+    for(r = 0; r < repeats; r++){
+      start = now(CLOCK_MONOTONIC);
+      for(i = 0; i < FRAME_ROUNDS / 20; i++){
+        if(frame_send(fds[0], OP_DOWNLOAD, 0, i, request, strlen(request)) < 0 ||
+           frame_recv(fds[1], &header) < 0 ||
+           read_full(fds[1], payload, header.length) < 0){
+          error_occurred("ERROR passing frames");
+        }
+      }
+
+      elapsed = (now(CLOCK_MONOTONIC) - start) / (FRAME_ROUNDS / 20);
+      if(best == 0 || elapsed < best){
+        best = elapsed;
+      }
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+    report("frame/socketpair", best * 1e9, "ns");
+  }
+}
+
+int main(int argc, char *argv[]){
+  const char *dir = "/tmp";
+  const char *baseline_path = "bench/micro.baseline";
+  char workdir[4096], cwd[4096];
+  long max_files = 1000000;
+  int option;
+
+  while((option = getopt(argc, argv, "d:r:b:x:n:w")) != -1){
+    switch(option){
+      case 'd':
+        dir = optarg;
+        break;
+      case 'r':
+        repeats = atoi(optarg);
+        break;
+      case 'b':
+        baseline_path = optarg;
+        break;
+      case 'x':
+        tolerance = atof(optarg);
+        break;
+      case 'n':
+        max_files = atol(optarg);
+        break;
+      case 'w':
+        write_baseline = true;
+        break;
+      default:
+        printf("Usage: %s [-d dir] [-r repeats] [-b baseline] [-x tolerance] [-n max_files] "
+               "[-w] [prefix]\n", argv[0]);
+        exit(1);
+    }
+  }
+
+  if(optind < argc){
+    prefix = argv[optind];
+  }
+
+  if(repeats < 1){
+    repeats = 1;
+  }
+
+  // the baseline is read and written from where we were started
+  if(getcwd(cwd, sizeof(cwd)) == NULL){
+    error_occurred("ERROR getting working directory");
+  }
+
+  load_baseline(baseline_path);
+
+  // an empty directory of our own, so the index starts out empty
+  snprintf(workdir, sizeof(workdir), "%s/bitdrive-micro-XXXXXX", dir);
+  if(mkdtemp(workdir) == NULL || chdir(workdir) < 0){
+    error_occurred("ERROR creating work directory");
+  }
+
+  if(write_baseline){
+    printf("%-32s  %17s\n", "case", "result");
+  }
+
+  else {
+    printf("%-32s  %17s  %12s  %8s  (tolerance %.0f%%)\n", "case", "result", "baseline",
+           "change", tolerance);
+  }
+
+  bench_transfers();
+  bench_index(max_files);
+  bench_framing();
+
+  if(chdir(cwd) < 0 || rmdir(workdir) < 0){
+    perror("WARNING: could not remove work directory");
+  }
+
+  if(write_baseline){
+    save_baseline(baseline_path);
+    printf("Baseline written to %s\n", baseline_path);
+    return 0;
+  }
+
+  if(regressions > 0){
+    printf("%d cases regressed\n", regressions);
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,417 @@
+/*
+ * Compares the two event loop backends of reactor.c on the download path
+ * the server uses: a reactor accepts connections on loopback and sends a
+ * file to each, with sendfile(2) on epoll and through reactor_send on
+ * io_uring, while one thread per connection reads and discards it. The
+ * system calls the event loop thread makes through libc are counted by
+ * wrapping them at link time (see compile.sh), which covers epoll_wait,
+ * epoll_ctl, accept4, sendfile, read/write and io_uring_enter. With -u
+ * every round starts with the file evicted from the page cache.
+ *
+ * Usage: bench/uring [-d dir] [-c connections] [-r repeats] [-u] [size_kb ...]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../reactor.h"
+
+#define PUMP_BUDGET (4 * 1024 * 1024)
+#define RECEIVE_BUFFER (1024 * 1024)
+
+struct Download{
+  struct Watcher watcher;
+  struct FileSender sender;
+};
+
+struct Run{
+  struct Reactor reactor;
+  struct Watcher listener;
+  const char *source;
+  off_t size;
+  int connections;
+  int done;
+  bool failed;
+};
+
+static __thread bool counting;
+static unsigned long long syscalls;
+
+int __real_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+int __real_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int __real_accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+ssize_t __real_sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+ssize_t __real_pread(int fd, void *buf, size_t count, off_t offset);
+int __real_close(int fd);
+long __real_syscall(long number, ...);
+
+static void count_call(){
+  if(counting){
+    syscalls++;
+  }
+}
+
+int __wrap_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout){
+  count_call();
+  return __real_epoll_wait(epfd, events, maxevents, timeout);
+}
+
+int __wrap_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event){
+  count_call();
+  return __real_epoll_ctl(epfd, op, fd, event);
+}
+
+int __wrap_accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags){
+  count_call();
+  return __real_accept4(sockfd, addr, addrlen, flags);
+}
+
+ssize_t __wrap_sendfile(int out_fd, int in_fd, off_t *offset, size_t count){
+  count_call();
+  return __real_sendfile(out_fd, in_fd, offset, count);
+}
+
+ssize_t __wrap_read(int fd, void *buf, size_t count){
+  count_call();
+  return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count){
+  count_call();
+  return __real_write(fd, buf, count);
+}
+
+ssize_t __wrap_pread(int fd, void *buf, size_t count, off_t offset){
+  count_call();
+  return __real_pread(fd, buf, count, offset);
+}
+
+int __wrap_close(int fd){
+  count_call();
+  return __real_close(fd);
+}
+
+long __wrap_syscall(long number, ...){
+  long args[6];
+  va_list ap;
+  int i;
+
+  va_start(ap, number);
+  for(i = 0; i < 6; i++){
+    args[i] = va_arg(ap, long);
+  }
+
+  va_end(ap);
+  count_call();
+  return __real_syscall(number, args[0], args[1], args[2], args[3], args[4], args[5]);
+}
+
+void error_occurred(const char *msg){
+  perror(msg);
+  exit(1);
+}
+
+double now(clockid_t clock){
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void make_source(const char *path, off_t size){
+  char buffer[65536];
+  off_t written = 0;
+  unsigned int seed = 173;
+  size_t i;
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0){
+    error_occurred("ERROR creating source file");
+  }
+
+  while(written < size){
+    size_t len = size - written < (off_t)sizeof(buffer) ? size - written : sizeof(buffer);
+    for(i = 0; i < len; i++){
+      buffer[i] = rand_r(&seed) & 0xff;
+    }
+
+    if(write(fd, buffer, len) != (ssize_t)len){
+      error_occurred("ERROR writing source file");
+    }
+
+    written += len;
+  }
+
+  close(fd);
+}
+
+/* A client: connects and reads until the server closes, checking the byte count. */
+void *receive_job(void *arg){
+  struct sockaddr_in *addr = arg;
+  char *buffer = malloc(RECEIVE_BUFFER);
+  ssize_t bytes_read;
+  off_t total = 0;
+  int sockfd;
+
+  sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  if(buffer == NULL || sockfd < 0 ||
+     connect(sockfd, (struct sockaddr *)addr, sizeof(*addr)) < 0){
+    error_occurred("ERROR connecting");
+  }
+
+  while((bytes_read = read(sockfd, buffer, RECEIVE_BUFFER)) > 0){
+    total += bytes_read;
+  }
+
+  close(sockfd);
+  free(buffer);
+  return (void *)(intptr_t)total;
+}
+
+void free_download(struct Watcher *watcher){
+  free(watcher);
+}
+
+void finish_download(struct Run *run, struct Download *download, bool failed){
+  reactor_abandon(&run->reactor, &download->sender);
+  reactor_remove(&run->reactor, &download->watcher);
+  close(download->watcher.fd);
+  close(download->sender.filefd);
+  sender_free(&download->sender);
+  reactor_release(&run->reactor, &download->watcher, free_download);
+
+  run->failed |= failed;
+  if(++run->done == run->connections){
+    reactor_stop(&run->reactor);
+  }
+}
+
+/* Mirrors flush_session: pump, then wait for the socket or for the ring to call back. */
+void pump(struct Reactor *reactor, struct Watcher *watcher, uint32_t events){
+  struct Download *download = (struct Download *)watcher;
+  struct Run *run = (struct Run *)((char *)reactor - offsetof(struct Run, reactor));
+  enum TransferStatus status;
+
+  status = reactor_send(reactor, watcher, &download->sender, PUMP_BUDGET, NULL);
+  if(status == TRANSFER_AGAIN){
+    reactor_update(reactor, watcher, EPOLLOUT | EPOLLRDHUP);
+  }
+
+  else if(status == TRANSFER_PENDING){
+    reactor_update(reactor, watcher, EPOLLRDHUP);
+  }
+
+  else {
+    finish_download(run, download, status == TRANSFER_ERROR);
+  }
+}
+
+void accept_download(struct Reactor *reactor, struct Watcher *watcher, int clientfd){
+  struct Run *run = (struct Run *)((char *)reactor - offsetof(struct Run, reactor));
+  struct Download *download = calloc(1, sizeof(struct Download));
+  int filefd = open(run->source, O_RDONLY | O_CLOEXEC);
+
+  if(download == NULL || filefd < 0){
+    error_occurred("ERROR starting download");
+  }
+
+  download->watcher.fd = clientfd;
+  download->watcher.callback = pump;
+  sender_init(&download->sender, filefd, 0, run->size);
+  if(reactor_add(reactor, &download->watcher, EPOLLOUT | EPOLLRDHUP) < 0){
+    error_occurred("ERROR watching download");
+  }
+}
+
+/* One round of downloads; returns {wall seconds, loop cpu seconds, syscalls}. */
+bool run_once(enum Backend backend, const char *source, off_t size, int connections,
+              double *wall, double *cpu, unsigned long long *calls, bool *registered){
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  pthread_t *threads = calloc(connections, sizeof(pthread_t));
+  struct Run *run = calloc(1, sizeof(struct Run));
+  double wall_start, cpu_start;
+  void *received;
+  bool ok;
+  int i;
+
+  if(threads == NULL || run == NULL || reactor_init(&run->reactor, backend) < 0){
+    error_occurred("ERROR creating event loop");
+  }
+
+  if(run->reactor.backend != backend){
+    printf("io_uring is not available here; only epoll was measured.\n");
+    reactor_close(&run->reactor);
+    free(threads);
+    free(run);
+    return false;
+  }
+
+  run->source = source;
+  run->size = size;
+  run->connections = connections;
+  run->listener.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(bind(run->listener.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+     listen(run->listener.fd, connections) < 0 ||
+     getsockname(run->listener.fd, (struct sockaddr *)&addr, &len) < 0 ||
+     reactor_listen(&run->reactor, &run->listener, accept_download) < 0){
+    error_occurred("ERROR on binding");
+  }
+
+  *registered = run->reactor.registered;
+  syscalls = 0;
+  wall_start = now(CLOCK_MONOTONIC);
+  cpu_start = now(CLOCK_THREAD_CPUTIME_ID);
+  for(i = 0; i < connections; i++){
+    pthread_create(&threads[i], NULL, receive_job, &addr);
+  }
+
+  counting = true;
+  reactor_run(&run->reactor);
+  counting = false;
+  *cpu = now(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+  *calls = syscalls;
+
+  // polls still in flight hold the sockets open until the ring goes
+  reactor_close(&run->reactor);
+  ok = !run->failed;
+  for(i = 0; i < connections; i++){
+    pthread_join(threads[i], &received);
+    ok = ok && (off_t)(intptr_t)received == size;
+  }
+
+  *wall = now(CLOCK_MONOTONIC) - wall_start;
+  if(!ok){
+    error_occurred("ERROR: a download came out short");
+  }
+
+  close(run->listener.fd);
+  free(threads);
+  free(run);
+  return true;
+}
+
+/* Drops the source from the page cache, so the round reads it from disk. */
+void evict_source(const char *path){
+  int fd = open(path, O_RDONLY);
+
+  if(fd < 0 || fdatasync(fd) < 0 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0){
+    error_occurred("ERROR evicting source file");
+  }
+
+  close(fd);
+}
+
+int main(int argc, char *argv[]){
+  long default_sizes[] = {16, 1024, 65536};
+  const char *dir = "/tmp";
+  char source[4096];
+  int repeats = 3, connections = 32;
+  int option, i, r, mode;
+  long *sizes = default_sizes;
+  int size_count = 3;
+  bool registered = false, cold = false, available = true;
+
+  while((option = getopt(argc, argv, "d:c:r:u")) != -1){
+    switch(option){
+      case 'd':
+        dir = optarg;
+        break;
+      case 'c':
+        connections = atoi(optarg);
+        break;
+      case 'r':
+        repeats = atoi(optarg);
+        break;
+      case 'u':
+        cold = true;
+        break;
+      default:
+        printf("Usage: %s [-d dir] [-c connections] [-r repeats] [-u] [size_kb ...]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if(optind < argc){
+    size_count = argc - optind;
+    sizes = malloc(sizeof(long) * size_count);
+    for(i = 0; i < size_count; i++){
+      sizes[i] = atol(argv[optind + i]);
+    }
+  }
+
+  if(connections <= 0 || repeats <= 0){
+    printf("Usage: %s [-d dir] [-c connections] [-r repeats] [-u] [size_kb ...]\n", argv[0]);
+    return 1;
+  }
+
+  snprintf(source, sizeof(source), "%s/bitdrive_uring_src", dir);
+
+  printf("%d connections, %s page cache\n", connections, cold ? "cold" : "warm");
+  printf("%13s  %-9s  %10s  %10s  %12s  %10s\n", "size", "backend", "MB/s", "syscalls",
+         "syscalls/MB", "cpu ms/GB");
+  for(i = 0; i < size_count && available; i++){
+    off_t size = (off_t)sizes[i] * 1024;
+    double mb = (double)connections * size / 1e6;
+    make_source(source, size);
+
+    for(mode = 0; mode < 2 && available; mode++){
+      enum Backend backend = mode == 0 ? BACKEND_EPOLL : BACKEND_URING;
+      double best_wall = 0, total_cpu = 0, wall, cpu;
+      unsigned long long total_calls = 0, calls;
+
+      for(r = 0; r < repeats; r++){
+        if(cold){
+          evict_source(source);
+        }
+
+        available = run_once(backend, source, size, connections, &wall, &cpu, &calls,
+                             &registered);
+        if(!available){
+          break;
+        }
+
+        if(r == 0 || wall < best_wall){
+          best_wall = wall;
+        }
+
+        total_cpu += cpu;
+        total_calls += calls;
+      }
+
+      if(!available){
+        break;
+      }
+
+      printf("%10ld KB  %-9s  %10.1f  %10llu  %12.1f  %10.1f\n", sizes[i],
+             mode == 0 ? "epoll" : (registered ? "io_uring" : "io_uring*"),
+             mb / best_wall, total_calls / repeats, total_calls / repeats / mb,
+             total_cpu / repeats * 1e3 / (mb / 1e3));
+    }
+  }
+
+  if(available && !registered){
+    printf("* buffers could not be registered (RLIMIT_MEMLOCK); plain READ/WRITE was used\n");
+  }
+
+  unlink(source);
+  return 0;
+}
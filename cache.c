@@ -0,0 +1,297 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "server.h"
+
+#define CACHE_BUCKETS 4096
+
+/*
+ * The hot-file cache: the content of recently downloaded files, shared by
+ * every worker, so a file that keeps being downloaded is sent from memory
+ * without being opened, read or even looked up on disk. It holds at most
+ * config.cache_size bytes, no file bigger than a CACHE_FILE_SHARE of that,
+ * and the least recently used files make room first. Whatever changes a
+ * file also updates the index, which drops it from here.
+ *
+ * A download holds a reference to the entry it sends from, so an entry
+ * evicted or dropped meanwhile is only freed after the last one is done.
+ * Every drop bumps the generation of the file's bucket, and a file read in
+ * while its bucket's generation moved is not kept, since it may be the old
+ * content; fills of files in other buckets are not disturbed.
+ */
+static struct CacheEntry *buckets[CACHE_BUCKETS];
+static uint64_t generations[CACHE_BUCKETS];
+static struct CacheEntry *newest, *oldest;
+static size_t used;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_ullong hits, misses, evictions, drops;
+
+static size_t hash_name(const char *name){
+  size_t hash = 14695981039346656037ULL;
+
+  while(*name != '\0'){
+    hash = (hash ^ (unsigned char)*name++) * 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+static size_t bucket_of(const char *name){
+  return hash_name(name) % CACHE_BUCKETS;
+}
+
+static struct CacheEntry **find_entry(const char *name){
+  struct CacheEntry **link = &buckets[bucket_of(name)];
+
+  while(*link != NULL && strcmp((*link)->name, name) != 0){
+    link = &(*link)->next;
+  }
+
+  return link;
+}
+
+static void free_entry(struct CacheEntry *entry){
+  free(entry->name);
+  free(entry->data);
+  free(entry);
+}
+
+static void unlink_lru(struct CacheEntry *entry){
+  if(entry->newer != NULL){
+    entry->newer->older = entry->older;
+  }
+
+  else {
+    newest = entry->older;
+  }
+
+  if(entry->older != NULL){
+    entry->older->newer = entry->newer;
+  }
+
+  else {
+    oldest = entry->newer;
+  }
+}
+
+static void push_newest(struct CacheEntry *entry){
+  entry->older = newest;
+  entry->newer = NULL;
+  if(newest != NULL){
+    newest->newer = entry;
+  }
+
+  newest = entry;
+  if(oldest == NULL){
+    oldest = entry;
+  }
+}
+
+/* Takes an entry out of the cache; called with the lock held. */
+static void remove_entry(struct CacheEntry **link){
+  struct CacheEntry *entry = *link;
+
+  *link = entry->next;
+  unlink_lru(entry);
+  used -= entry->size;
+  entry->cached = false;
+  if(entry->refs == 0){
+    free_entry(entry);
+  }
+}
+
+/* Reads the whole of a stored file into memory, if it is small enough. */
+static char *read_stored(const char *filename, off_t *size){
+  struct stat file_stats;
+  ssize_t bytes_read;
+  off_t offset = 0;
+  char *data = NULL;
+  int filefd = open_stored(filename);
+
+  if(filefd >= 0 && fstat(filefd, &file_stats) == 0 && S_ISREG(file_stats.st_mode) &&
+     (size_t)file_stats.st_size <= config.cache_size / CACHE_FILE_SHARE){
+    data = malloc(file_stats.st_size > 0 ? file_stats.st_size : 1);
+  }
+
+  while(data != NULL && offset < file_stats.st_size){
+    bytes_read = pread(filefd, data + offset, file_stats.st_size - offset, offset);
+    if(bytes_read < 0 && errno == EINTR){
+      continue;
+    }
+
+    if(bytes_read <= 0){
+      free(data);
+      data = NULL;
+      break;
+    }
+
+    offset += bytes_read;
+  }
+
+  if(filefd >= 0){
+    close(filefd);
+  }
+
+  *size = offset;
+  return data;
+}
+
+/*
+ * Reads a file the cache missed into it, making room by evicting the least
+ * recently used files. Returns the entry with a reference for the caller,
+ * or NULL if the file is too big or changed while it was read.
+ */
+static struct CacheEntry *fill(const char *filename){
+  struct CacheEntry *entry, **link;
+  size_t bucket = bucket_of(filename);
+  uint64_t started;
+  off_t size;
+  char *data;
+
+  if(!index_size(filename, &size) || (size_t)size > config.cache_size / CACHE_FILE_SHARE){
+    return NULL;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  started = generations[bucket];
+  pthread_mutex_unlock(&cache_lock);
+
+  data = read_stored(filename, &size);
+  entry = calloc(1, sizeof(struct CacheEntry));
+  if(data == NULL || entry == NULL || (entry->name = strdup(filename)) == NULL){
+    free(data);
+    free(entry);
+    return NULL;
+  }
+
+  entry->data = data;
+  entry->size = size;
+  entry->refs = 1;
+
+  pthread_mutex_lock(&cache_lock);
+  link = find_entry(filename);
+  if(started != generations[bucket] || *link != NULL){
+    pthread_mutex_unlock(&cache_lock);
+    free_entry(entry);
+    return NULL;
+  }
+
+  while(used + size > config.cache_size && oldest != NULL){
+    remove_entry(find_entry(oldest->name));
+    atomic_fetch_add_explicit(&evictions, 1, memory_order_relaxed);
+  }
+
+  // the link may have been inside an entry that was just evicted
+  link = find_entry(filename);
+  *link = entry;
+  entry->cached = true;
+  push_newest(entry);
+  used += size;
+  pthread_mutex_unlock(&cache_lock);
+  return entry;
+}
+
+/*
+ * The cached content of a stored file, read in on a miss, with a reference
+ * the caller gives back with cache_release. NULL means the cache is off or
+ * the file is not cached, and the caller reads it from the store.
+ */
+struct CacheEntry *cache_open(const char *filename){
+  struct CacheEntry *entry;
+
+  if(config.cache_size == 0){
+    return NULL;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  entry = *find_entry(filename);
+  if(entry != NULL){
+    unlink_lru(entry);
+    push_newest(entry);
+    entry->refs++;
+  }
+
+  pthread_mutex_unlock(&cache_lock);
+  if(entry != NULL){
+    atomic_fetch_add_explicit(&hits, 1, memory_order_relaxed);
+    return entry;
+  }
+
+  atomic_fetch_add_explicit(&misses, 1, memory_order_relaxed);
+  return fill(filename);
+}
+
+void cache_release(struct CacheEntry *entry){
+  bool unused;
+
+  pthread_mutex_lock(&cache_lock);
+  unused = --entry->refs == 0 && !entry->cached;
+  pthread_mutex_unlock(&cache_lock);
+  if(unused){
+    free_entry(entry);
+  }
+}
+
+/* Forgets a file that changed or is gone. */
+void cache_drop(const char *filename){
+  struct CacheEntry **link;
+
+  if(config.cache_size == 0){
+    return;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  generations[bucket_of(filename)]++;
+  link = find_entry(filename);
+  if(*link != NULL){
+    remove_entry(link);
+    atomic_fetch_add_explicit(&drops, 1, memory_order_relaxed);
+  }
+
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/* Forgets every file, for when it is not known which ones changed. */
+void cache_clear(){
+  size_t bucket;
+
+  if(config.cache_size == 0){
+    return;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  for(bucket = 0; bucket < CACHE_BUCKETS; bucket++){
+    generations[bucket]++;
+  }
+
+  while(oldest != NULL){
+    remove_entry(find_entry(oldest->name));
+    atomic_fetch_add_explicit(&drops, 1, memory_order_relaxed);
+  }
+
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void report_cache(){
+  size_t in_use;
+
+  if(config.cache_size == 0){
+    return;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  in_use = used;
+  pthread_mutex_unlock(&cache_lock);
+
+  printf("Cache: %.1f of %.1f MB, %llu hits, %llu misses, %llu evictions, %llu dropped\n",
+         in_use / 1048576.0, config.cache_size / 1048576.0,
+         atomic_load_explicit(&hits, memory_order_relaxed),
+         atomic_load_explicit(&misses, memory_order_relaxed),
+         atomic_load_explicit(&evictions, memory_order_relaxed),
+         atomic_load_explicit(&drops, memory_order_relaxed));
+}
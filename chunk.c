@@ -0,0 +1,240 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "chunk.h"
+#include "protocol.h"
+
+#define CHUNK_BUFFER (4 * CHUNK_MAX)
+
+// the top bits of the gear hash depend on the most bytes
+#define MASK_SMALL 0xFFFFC00000000000ULL
+#define MASK_LARGE 0xFFFC000000000000ULL
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/* splitmix64 from a fixed seed: both ends must cut in the same places. */
+static void fill_gear(){
+  uint64_t seed = 0x42697444726976ULL, z;
+  int i;
+
+  for(i = 0; i < 256; i++){
+    z = (seed += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    gear[i] = z ^ (z >> 31);
+  }
+}
+
+/*
+ * Returns the length of the chunk starting at data. The caller passes at
+ * least CHUNK_MAX bytes unless the file ends sooner.
+ */
+size_t chunk_cut(const unsigned char *data, size_t len){
+  size_t i, end = len < CHUNK_MAX ? len : CHUNK_MAX;
+  uint64_t hash = 0;
+
+  pthread_once(&gear_once, fill_gear);
+  if(end <= CHUNK_MIN){
+    return end;
+  }
+
+  for(i = CHUNK_MIN; i < end; i++){
+    hash = (hash << 1) + gear[data[i]];
+    if(!(hash & (i < CHUNK_AVG ? MASK_SMALL : MASK_LARGE))){
+      return i + 1;
+    }
+  }
+
+  return end;
+}
+
+static bool add_chunk(struct ChunkList *list, int *capacity, const unsigned char *data,
+                      off_t offset, size_t len){
+  struct Chunk *chunks;
+
+  if(list->count == *capacity){
+    *capacity = *capacity ? *capacity * 2 : 64;
+    chunks = realloc(list->chunks, *capacity * sizeof(struct Chunk));
+    if(chunks == NULL){
+      return false;
+    }
+
+    list->chunks = chunks;
+  }
+
+  sha256(data, len, list->chunks[list->count].hash);
+  list->chunks[list->count].offset = offset;
+  list->chunks[list->count].length = len;
+  list->count++;
+  list->size += len;
+  return true;
+}
+
+/* Cuts the whole of an open file into chunks and hashes each of them. */
+bool chunk_file(int filefd, struct ChunkList *list){
+  unsigned char *buffer = malloc(CHUNK_BUFFER);
+  size_t start = 0, end = 0, cut;
+  off_t offset = 0;
+  bool eof = false;
+  int capacity = 0;
+  ssize_t len;
+
+  list->chunks = NULL;
+  list->count = 0;
+  list->size = 0;
+  if(buffer == NULL){
+    return false;
+  }
+
+  while(true){
+    // keep at least CHUNK_MAX bytes ahead, moving the tail down to refill
+    if(!eof && end - start < CHUNK_MAX){
+      memmove(buffer, buffer + start, end - start);
+      end -= start;
+      start = 0;
+      while(!eof && end < CHUNK_BUFFER){
+        len = pread(filefd, buffer + end, CHUNK_BUFFER - end, offset + end);
+        if(len < 0 && errno == EINTR){
+          continue;
+        }
+
+        if(len < 0){
+          free(buffer);
+          chunk_list_free(list);
+          return false;
+        }
+
+        eof = len == 0;
+        end += len;
+      }
+    }
+
+    if(start == end){
+      break;
+    }
+
+    cut = chunk_cut(buffer + start, end - start);
+    if(!add_chunk(list, &capacity, buffer + start, offset, cut)){
+      free(buffer);
+      chunk_list_free(list);
+      return false;
+    }
+
+    start += cut;
+    offset += cut;
+  }
+
+  free(buffer);
+  return true;
+}
+
+void chunk_list_free(struct ChunkList *list){
+  free(list->chunks);
+  list->chunks = NULL;
+  list->count = 0;
+}
+
+void chunk_hex(const unsigned char *hash, char *hex){
+  int i;
+
+  for(i = 0; i < SHA256_SIZE; i++){
+    sprintf(hex + i * 2, "%02x", hash[i]);
+  }
+}
+
+bool chunk_unhex(const char *hex, unsigned char *hash){
+  unsigned int byte;
+  int i;
+
+  if(strlen(hex) != SHA256_SIZE * 2){
+    return false;
+  }
+
+  for(i = 0; i < SHA256_SIZE; i++){
+    if(sscanf(hex + i * 2, "%2x", &byte) != 1){
+      return false;
+    }
+
+    hash[i] = byte;
+  }
+
+  return true;
+}
+
+unsigned char *manifest_encode(const struct ChunkList *list, size_t *len){
+  unsigned char *data;
+  unsigned char *entry;
+  int i;
+
+  *len = MANIFEST_HEADER + (size_t)list->count * MANIFEST_ENTRY;
+  data = malloc(*len);
+  if(data == NULL){
+    return NULL;
+  }
+
+  memcpy(data, MANIFEST_MAGIC, 4);
+  put_u32(data + 4, list->count);
+  put_u64(data + 8, list->size);
+  for(i = 0; i < list->count; i++){
+    entry = data + MANIFEST_HEADER + (size_t)i * MANIFEST_ENTRY;
+    memcpy(entry, list->chunks[i].hash, SHA256_SIZE);
+    put_u32(entry + SHA256_SIZE, list->chunks[i].length);
+  }
+
+  return data;
+}
+
+/*
+ * Reads a manifest back into a chunk list with the offsets filled in.
+ * Fails on anything that does not add up, so a list that comes back is
+ * safe to serve byte ranges from.
+ */
+bool manifest_decode(const unsigned char *data, size_t len, struct ChunkList *list){
+  const unsigned char *entry;
+  uint32_t count;
+  int i;
+
+  list->chunks = NULL;
+  list->count = 0;
+  list->size = 0;
+  if(len < MANIFEST_HEADER || memcmp(data, MANIFEST_MAGIC, 4) != 0){
+    return false;
+  }
+
+  count = get_u32(data + 4);
+  if((len - MANIFEST_HEADER) % MANIFEST_ENTRY != 0 ||
+     (len - MANIFEST_HEADER) / MANIFEST_ENTRY != count){
+    return false;
+  }
+
+  list->chunks = malloc((count > 0 ? count : 1) * sizeof(struct Chunk));
+  if(list->chunks == NULL){
+    return false;
+  }
+
+  for(i = 0; i < (int)count; i++){
+    entry = data + MANIFEST_HEADER + (size_t)i * MANIFEST_ENTRY;
+    memcpy(list->chunks[i].hash, entry, SHA256_SIZE);
+    list->chunks[i].length = get_u32(entry + SHA256_SIZE);
+    list->chunks[i].offset = list->size;
+    if(list->chunks[i].length == 0 || list->chunks[i].length > CHUNK_MAX){
+      chunk_list_free(list);
+      return false;
+    }
+
+    list->size += list->chunks[i].length;
+  }
+
+  list->count = count;
+  if((uint64_t)list->size != get_u64(data + 8)){
+    chunk_list_free(list);
+    return false;
+  }
+
+  return true;
+}
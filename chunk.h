@@ -0,0 +1,51 @@
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "sha256.h"
+
+/*
+ * Content-defined chunking. A cut is made wherever a gear hash over the
+ * last 64 bytes hits a mask, so an insertion early in a file only changes
+ * the chunks around it and the rest line up with the old version again.
+ * Cuts are normalised towards CHUNK_AVG: a stricter mask applies before
+ * it and a looser one after, and no chunk is shorter than CHUNK_MIN
+ * (except the last) or longer than CHUNK_MAX.
+ */
+#define CHUNK_MIN (16 * 1024)
+#define CHUNK_AVG (64 * 1024)
+#define CHUNK_MAX (256 * 1024)
+
+/*
+ * A manifest describes a file as its chunks, in order: a MANIFEST_HEADER
+ * of the magic, u32 chunk count and u64 file size, then for every chunk
+ * its SHA-256 and u32 length. Integers are big endian like the protocol.
+ */
+#define MANIFEST_MAGIC "BDM1"
+#define MANIFEST_HEADER 16
+#define MANIFEST_ENTRY (SHA256_SIZE + 4)
+
+struct Chunk{
+  unsigned char hash[SHA256_SIZE];
+  off_t offset;
+  uint32_t length;
+};
+
+struct ChunkList{
+  struct Chunk *chunks;
+  int count;
+  off_t size;
+};
+
+size_t chunk_cut(const unsigned char *data, size_t len);
+bool chunk_file(int filefd, struct ChunkList *list);
+void chunk_list_free(struct ChunkList *list);
+void chunk_hex(const unsigned char *hash, char *hex);
+bool chunk_unhex(const char *hex, unsigned char *hash);
+
+unsigned char *manifest_encode(const struct ChunkList *list, size_t *len);
+bool manifest_decode(const unsigned char *data, size_t len, struct ChunkList *list);
+
+#endif
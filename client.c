@@ -3,10 +3,147 @@
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <time.h>
+#include "protocol.h"
+#include "transfer.h"
+#include "chunk.h"
+#include "delta.h"
+#include "lz.h"
+
+#define PROGRESS_STEP (1024 * 1024)
+#define MAX_REPLY (64 * 1024 * 1024)
+#define MAX_STRIPES 16
+#define STRIPE_CHUNK (8 * 1024 * 1024)
+
+struct Progress{
+  long long done;
+  long long total;
+  int curr_value;
+};
+
+/*
+ * One framed request. Interactive commands run a single Operation in
+ * lockstep; batch mode queues them all and, when the server supports
+ * FEATURE_PIPELINE, sends them from a writer thread while the main thread
+ * reads the replies in order. With FEATURE_STREAMS the replies may come in
+ * any order and transfers run side by side (see run_streams).
+ */
+struct Operation{
+  uint8_t opcode;
+  char *filename;
+  uint32_t request_id;
+  int filefd;
+  off_t size;
+  bool failed;
+  struct Progress *progress;
+  off_t offset;
+  off_t resumed;
+
+  /* -u: the delta goes out in place of the file, full_size is the file's */
+  bool delta;
+  off_t full_size;
+
+  /* FEATURE_COMPRESS */
+  bool compress;      // still compressing the upload
+  int misses;         // blocks in a row that did not compress
+  off_t wire_bytes;
+  long long cpu_ns;
+
+  /* FEATURE_LISTING: offset counts the entries listed */
+  char cursor[NAME_MAX + 24];
+
+  /* FEATURE_STREAMS */
+  int64_t window;
+  uint32_t grant;
+  bool sent;
+  bool ready;
+  bool fin_sent;
+  bool done;
+};
+
+struct Batch{
+  int sockfd;
+  struct Operation *operations;
+  int count;
+
+  /* FEATURE_STREAMS: shared by the writer thread and the reader */
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  int finished;
+};
+
+/*
+ * A striped transfer (-s): the file is cut into stripe_chunk ranges and
+ * each of the stripe_count connections takes the next range until none
+ * are left, so one large file moves over several TCP streams at once.
+ */
+struct Stripes{
+  struct Operation *operation;
+  uint64_t token;
+  off_t chunks;
+  off_t next;
+  off_t received;
+  bool failed;
+  pthread_mutex_t lock;
+};
+
+struct StripeWorker{
+  struct Stripes *stripes;
+  int sockfd;
+  uint32_t next_request_id;
+  pthread_t thread;
+};
+
+/*
+ * Buffers for FEATURE_COMPRESS. Upload bodies are only ever sent by one
+ * thread at a time and download bodies read by one, so each side has one.
+ */
+struct Packer{
+  struct LzState state;
+  unsigned char block[COMPRESS_BLOCK];
+  unsigned char packed[FRAME_MAX_CONTROL];
+};
+
+/*
+ * A deduplicated upload (-d): the chunks of the file, which of them the
+ * server still needs, and the request_ids the chunk uploads are sent with.
+ */
+struct ChunkUpload{
+  struct Operation *operation;
+  int sockfd;
+  struct ChunkList list;
+  bool *needed;
+  int missing;
+  uint32_t first_id;
+};
+
+bool framed = false;
+bool force_legacy = false;
+bool resume = false;
+uint32_t features = 0;
+uint32_t next_request_id = 1;
+struct sockaddr_in server_addr;
+int stripe_count = 1;
+off_t stripe_chunk = STRIPE_CHUNK;
+int stripe_fds[MAX_STRIPES];
+uint8_t list_order = LIST_BY_NAME;
+char *list_pattern = "";
+uint32_t list_limit = 0;
+char *list_cursor = NULL;
+bool dedup = false;
+bool delta = false;
+int compress_level = 0;
+struct Packer *packer;
+struct Packer *unpacker;
 
 void display_welcome();
 void display_commands();
@@ -22,10 +159,57 @@ char *send_filename(char *filename, char *response);
 void upload(int sockfd, char *response);
 bool send_file(int sockfd, char *filename);
 bool recv_file(int clientfd, char *filename);
+bool send_body(int sockfd, int filefd, off_t offset, off_t length, struct Progress *progress);
+bool recv_body(int sockfd, int filefd, off_t offset, off_t length, struct Progress *progress);
+off_t send_data(int sockfd, struct Operation *operation, off_t offset, off_t len, bool fin);
+bool recv_data(int sockfd, struct Operation *operation, struct FrameHeader *header);
+long long elapsed_ns(const struct timespec *start);
+void report_compression(struct Operation *operation, off_t raw_bytes);
+void update_progress(struct Progress *progress, long long bytes);
 bool send_command(char *command, int sockfd);
+bool negotiate(int sockfd);
+char *recv_payload(int sockfd, struct FrameHeader *header);
+char *recv_reply(int sockfd, struct FrameHeader *header);
+void framed_command(int sockfd, uint8_t opcode);
+bool prepare_operation(struct Operation *operation, uint8_t opcode, char *filename);
+void request_operation(int sockfd, struct Operation *operation);
+void send_operation(int sockfd, struct Operation *operation);
+bool handle_reply(struct Operation *operation, struct FrameHeader *header, char *reply);
+void finish_download(struct Operation *operation);
+void resume_upload(struct Operation *operation, off_t offset);
+bool finish_operation(int sockfd, struct Operation *operation);
+void *send_operations(void *arg);
+int open_streams(struct Batch *batch);
+struct Operation *next_upload(struct Batch *batch, int *turn);
+void *send_streams(void *arg);
+struct Operation *find_operation(struct Batch *batch, uint32_t request_id);
+void complete_operation(struct Batch *batch, struct Operation *operation, bool succeeded);
+void read_streams(struct Batch *batch);
+int run_streams(int sockfd, struct Operation *operations, int count);
+void run_batch(int sockfd, int count, char *commands[]);
+void framed_stats(int sockfd);
+bool framed_quit(int sockfd);
+bool paged_list(struct Operation *operation);
+bool parse_order(const char *order);
+void list_entries(struct Operation *operation, const unsigned char *page, size_t len);
+void finish_list(struct Operation *operation, bool more);
+int connect_server();
+bool open_stripes();
+void close_stripes();
+bool take_range(struct Stripes *stripes, off_t *offset, off_t *length);
+bool upload_range(struct StripeWorker *worker, off_t offset, off_t length);
+bool download_range(struct StripeWorker *worker, off_t offset, off_t length);
+void *run_stripe(void *arg);
+bool run_stripes(struct Operation *operation);
+bool dedup_upload(int sockfd, struct Operation *operation);
+bool find_missing(struct ChunkUpload *upload);
+void *send_chunks(void *arg);
+int compare_chunks(const void *a, const void *b);
+bool send_manifest(struct ChunkUpload *upload);
+void prepare_delta(int sockfd, struct Operation *operation);
 
 void run_bitdrive(int sockfd);
-void start_client(char *server, int port);
+void start_client(char *server, int port, int command_count, char *commands[]);
 void error_occurred(const char *msg);
 
 static inline void load_bar(int x, int n, int r, int w){
@@ -52,20 +236,80 @@ static inline void load_bar(int x, int n, int r, int w){
 }
 
 int main(int argc, char* argv[]){
-  if(argc < 3) {
-    printf("Usage: %s <ip of server> <port>", argv[0]);
+  int option;
+
+  while((option = getopt(argc, argv, "lrdus:c:f:o:n:a:z:")) != -1){
+    switch(option){
+      case 'l':
+        force_legacy = true;
+        break;
+      case 'r':
+        resume = true;
+        break;
+      case 'd':
+        dedup = true;
+        break;
+      case 'u':
+        delta = true;
+        break;
+      case 'z':
+        compress_level = atoi(optarg);
+        if(compress_level < LZ_LEVEL_MIN || compress_level > LZ_LEVEL_MAX){
+          printf("The compression level must be between %d and %d.\n", LZ_LEVEL_MIN, LZ_LEVEL_MAX);
+          exit(0);
+        }
+        break;
+      case 's':
+        stripe_count = atoi(optarg);
+        if(stripe_count < 1 || stripe_count > MAX_STRIPES){
+          printf("The stripe count must be between 1 and %d.\n", MAX_STRIPES);
+          exit(0);
+        }
+        break;
+      case 'c':
+        stripe_chunk = (off_t)atoll(optarg) * 1024;
+        if(stripe_chunk <= 0){
+          printf("The chunk size must be at least 1 KB.\n");
+          exit(0);
+        }
+        break;
+      case 'f':
+        list_pattern = optarg;
+        break;
+      case 'o':
+        if(!parse_order(optarg)){
+          printf("Order by name, size or mtime; a leading - reverses it.\n");
+          exit(0);
+        }
+        break;
+      case 'n':
+        list_limit = atoi(optarg);
+        break;
+      case 'a':
+        list_cursor = optarg;
+        break;
+      default:
+        printf("Usage: %s <ip of server> <port> [-l] [-r] [-d] [-u] [-s stripes] [-c chunk_kb] "
+               "[-f pattern] [-o order] [-n limit] [-a cursor] [-z level] [command ...]\n", argv[0]);
+        exit(0);
+    }
+  }
+
+  if(argc - optind < 2) {
+    printf("Usage: %s <ip of server> <port> [-l] [-r] [-d] [-u] [-s stripes] [-c chunk_kb] "
+           "[-f pattern] [-o order] [-n limit] [-a cursor] [-z level] [command ...]\n", argv[0]);
+    printf("Commands: list | upload <file> | download <file> | delete <file>\n");
     exit(0);
   }
 
   display_welcome();
-  start_client(argv[1], atoi(argv[2]));
+  start_client(argv[optind], atoi(argv[optind + 1]), argc - optind - 2, argv + optind + 2);
   return 0;
 }
 
-void start_client(char *server, int port){
-  struct sockaddr_in server_addr;
+void start_client(char *server, int port, int command_count, char *commands[]){
   struct hostent *host_addr;
-  int sockfd, status;
+  int sockfd;
 
   set_sockaddr(&server_addr, htons(port));
 
@@ -75,26 +319,85 @@ void start_client(char *server, int port){
     exit(0);
   }
 
-  sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  if(sockfd < 0){
-    error_occurred("ERROR opening socket");
-  }
-
   bcopy((char *)host_addr->h_addr,
         (char *)&server_addr.sin_addr.s_addr,
         host_addr->h_length);
 
-  status = connect(sockfd, (struct sockaddr *) &server_addr, sizeof(server_addr));
-  if(status < 0){
-    error_occurred("ERROR connecting");
+  sockfd = connect_server();
+  printf("Connected to: %s\n", server);
+
+  if(!force_legacy){
+    framed = negotiate(sockfd);
   }
 
-  printf("Connected to: %s\n", server);
+  if(resume && !(features & FEATURE_RESUME)){
+    printf("The server cannot resume transfers; sending whole files.\n");
+    resume = false;
+  }
+
+  if(dedup && !(features & FEATURE_DEDUP)){
+    printf("The server does not keep chunks; sending whole files.\n");
+    dedup = false;
+  }
+
+  if(delta && !(features & FEATURE_DELTA)){
+    printf("The server cannot take deltas; sending whole files.\n");
+    delta = false;
+  }
+
+  if(compress_level > 0 && !(features & FEATURE_COMPRESS)){
+    printf("The server cannot compress transfers; sending them as they are.\n");
+  }
+
+  if(features & FEATURE_COMPRESS){
+    packer = malloc(sizeof(struct Packer));
+    unpacker = malloc(sizeof(struct Packer));
+    if(packer == NULL || unpacker == NULL){
+      error_occurred("ERROR allocating compression buffers");
+    }
+  }
+
+  if((list_pattern[0] != '\0' || list_order != LIST_BY_NAME || list_limit > 0 ||
+      list_cursor != NULL) && !(features & FEATURE_LISTING)){
+    printf("The server cannot filter or page listings; listing everything.\n");
+  }
 
-  run_bitdrive(sockfd);
+  if(stripe_count > 1 && !open_stripes()){
+    printf("The server cannot stripe transfers; using one connection.\n");
+    stripe_count = 1;
+  }
+
+  if(command_count > 0){
+    run_batch(sockfd, command_count, commands);
+  }
+
+  else {
+    run_bitdrive(sockfd);
+  }
+
+  close_stripes();
   close(sockfd);
 }
 
+int connect_server(){
+  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  if(sockfd < 0){
+    error_occurred("ERROR opening socket");
+  }
+
+  if(connect(sockfd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0){
+    error_occurred("ERROR connecting");
+  }
+
+  // a chunked upload writes small frames and waits for their replies
+  if(dedup){
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+
+  return sockfd;
+}
+
 void set_sockaddr(struct sockaddr_in *socket_addr, int port) {
   bzero((char *) socket_addr, sizeof(*socket_addr));
   socket_addr->sin_family = AF_INET;
@@ -104,7 +407,12 @@ void set_sockaddr(struct sockaddr_in *socket_addr, int port) {
 char *get_input(){
   printf("> ");
   char *input = malloc(sizeof(char) * 256);
-  scanf("%s", input);
+
+  // treat end of input as QUIT so scripted sessions terminate
+  if(scanf("%255s", input) != 1){
+    strcpy(input, "Q");
+  }
+
   return input;
 }
 
@@ -138,6 +446,7 @@ void display_commands(){
   printf("[U] UPLOAD: Upload a file to the server.\n");
   printf("[D] DOWNLOAD: Download a file from the server.\n");
   printf("[X] DELETE: Delete a file from the server.\n");
+  printf("[S] STATS: Show the server's metrics.\n");
   printf("[V] VIEW: View list of commands.\n");
   printf("[Q] QUIT: Exit BitDrive.\n\n");
 }
@@ -187,7 +496,11 @@ char *process_command(char *command, int sockfd){
     buffer = "QUIT";
   }
 
-  if(strcmp(command, "L") == 0 || strcmp(command, "U") == 0 || strcmp(command, "D") == 0 || strcmp(command, "X") == 0 || strcmp(command, "Q") == 0){
+  else if(strcmp("S", command) == 0){
+    buffer = "STATS";
+  }
+
+  if(strcmp(command, "L") == 0 || strcmp(command, "U") == 0 || strcmp(command, "D") == 0 || strcmp(command, "X") == 0 || strcmp(command, "Q") == 0 || strcmp(command, "S") == 0){
     send_request(sockfd, buffer);
     return recv_response(sockfd, response);
   }
@@ -198,6 +511,45 @@ char *process_command(char *command, int sockfd){
 
 bool send_command(char *command, int sockfd){
   char *response;
+
+  if(framed){
+    if(strcmp("L", command) == 0){
+      framed_command(sockfd, OP_LIST);
+    }
+
+    else if(strcmp("U", command) == 0){
+      framed_command(sockfd, OP_UPLOAD);
+    }
+
+    else if(strcmp("D", command) == 0){
+      framed_command(sockfd, OP_DOWNLOAD);
+    }
+
+    else if(strcmp("X", command) == 0){
+      framed_command(sockfd, OP_DELETE);
+    }
+
+    else if(strcmp("S", command) == 0){
+      framed_stats(sockfd);
+    }
+
+    else if(strcmp("V", command) == 0){
+      display_commands();
+    }
+
+    else if(strcmp("Q", command) == 0){
+      free(command);
+      return framed_quit(sockfd);
+    }
+
+    else{
+      printf("Invalid input.\n");
+    }
+
+    free(command);
+    return true;
+  }
+
   response = process_command(command, sockfd);
 
     if(strcmp("L", command) == 0){
@@ -216,6 +568,10 @@ bool send_command(char *command, int sockfd){
       delete(sockfd, response);
     }
 
+    else if(strcmp("S", command) == 0){
+      printf("%s", response);
+    }
+
     else if(strcmp("V", command) == 0){
       display_commands();
     }
@@ -239,134 +595,1808 @@ bool send_command(char *command, int sockfd){
   return true;
 }
 
-bool send_file(int sockfd, char *filename){
-  FILE *file;
-  file = fopen(filename, "rb");
-
-  int bytes_read = 0;
-  int bytes_written = 0;
-  int curr_percentage = 0;
-  int curr_value = 0;
-  int size = 0;
-  char *buffer = malloc(sizeof(char) * 256);
-  bzero(buffer, 256);
+void update_progress(struct Progress *progress, long long bytes){
+  int curr_percentage = 100;
 
-  if(file == NULL){
-    error_occurred("Error opening file.\n");
+  if(progress == NULL){
+    return;
   }
 
-  fseek(file, 0L, SEEK_END);
-  size = ftell(file);
-  sprintf(buffer, "%d", size);
-  write(sockfd, buffer, 256);
-  fseek(file, 0L, SEEK_SET);
+  progress->done += bytes;
+  if(progress->total > 0){
+    curr_percentage = (((double)progress->done)/((double)progress->total))*100;
+  }
+
+  if((curr_percentage > 0) && (curr_percentage > progress->curr_value)) {
+    progress->curr_value = curr_percentage;
+    load_bar(curr_percentage, 100, 20, 100);
+  }
+}
 
-  int count = 0;
-  while(true){
-    bzero(buffer, 256);
-    bytes_read = fread(buffer, 1, 256, file);
+/*
+ * Sends a file range with sendfile(2), a PROGRESS_STEP at a time so the
+ * load bar keeps moving.
+ */
+bool send_body(int sockfd, int filefd, off_t offset, off_t length, struct Progress *progress){
+  struct FileSender sender;
+  enum TransferStatus status;
+  unsigned long long bytes_sent;
+
+  sender_init(&sender, filefd, offset, length);
+  do {
+    bytes_sent = 0;
+    status = sender_pump(&sender, sockfd, PROGRESS_STEP, &bytes_sent);
+    update_progress(progress, bytes_sent);
+  } while(status == TRANSFER_AGAIN);
+
+  sender_free(&sender);
+  return status == TRANSFER_DONE;
+}
 
-    if(bytes_read > 0){
-      bytes_written += bytes_read;
-      curr_percentage = (((double)bytes_written)/((double)size))*100;
+/* Receives exactly length bytes into a file range, spliced when possible. */
+bool recv_body(int sockfd, int filefd, off_t offset, off_t length, struct Progress *progress){
+  struct FileReceiver receiver;
+  enum TransferStatus status;
+  unsigned long long bytes_received;
+
+  receiver_init(&receiver);
+  receiver_start(&receiver, filefd, offset, length);
+  do {
+    bytes_received = 0;
+    status = receiver_pump(&receiver, sockfd, PROGRESS_STEP, &bytes_received);
+    update_progress(progress, bytes_received);
+  } while(status == TRANSFER_AGAIN);
+
+  receiver_free(&receiver);
+  return status == TRANSFER_DONE;
+}
 
-      if((curr_percentage > 0) && (curr_percentage > curr_value)) {
-        curr_value = curr_percentage;
-        load_bar(count, 100, 20, 100);
-        count++;
-      }
+/*
+ * Sends len bytes of an upload from offset as DATA. While the upload keeps
+ * compressing it goes a COMPRESS_BLOCK per frame, otherwise as one frame
+ * from sendfile; only the last frame carries FIN, and only if fin is set.
+ * Returns the payload bytes put on the wire, or -1.
+ */
+off_t send_data(int sockfd, struct Operation *operation, off_t offset, off_t len, bool fin){
+  unsigned char header[FRAME_HEADER_SIZE];
+  struct timespec start;
+  off_t wire = 0, take, rest;
+  int packed = 0;
+  bool last;
+
+  while(operation->compress){
+    take = len < COMPRESS_BLOCK ? len : COMPRESS_BLOCK;
+    if(take > 0 && pread(operation->filefd, packer->block, take, offset) != take){
+      return -1;
+    }
 
-      write(sockfd, buffer, bytes_read);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    if(take > 0){
+      packed = lz_compress(&packer->state, packer->block, take, packer->packed + 4,
+                           COMPRESS_ROOM(take), compress_level);
     }
 
-    if(bytes_read < 256){
-      if(feof(file)){
-        load_bar(count, 100, 20, 100);
-        printf("\n100%% Upload done!\n");
-        free(buffer);
-        fclose(file);
-        return true;
+    operation->cpu_ns += elapsed_ns(&start);
+    last = take == len;
+    if(packed > 0){
+      put_u32(packer->packed, take);
+      operation->misses = 0;
+      if(frame_send(sockfd, OP_DATA, FLAG_COMPRESSED | (fin && last ? FLAG_FIN : 0),
+                    operation->request_id, packer->packed, packed + 4) < 0){
+        return -1;
       }
 
-      if(ferror(file)){
-        printf("Error uploading file.\n");
+      wire += packed + 4;
+    }
+
+    else {
+      operation->compress = ++operation->misses < COMPRESS_GIVE_UP;
+      if(frame_send(sockfd, OP_DATA, fin && last ? FLAG_FIN : 0, operation->request_id,
+                    packer->block, take) < 0){
+        return -1;
       }
+
+      wire += take;
+    }
+
+    update_progress(operation->progress, take);
+    offset += take;
+    len -= take;
+    if(last){
+      operation->wire_bytes += wire;
+      return wire;
     }
   }
 
-  fclose(file);
-  free(buffer);
-  return false;
+  frame_encode(header, OP_DATA, fin ? FLAG_FIN : 0, operation->request_id, len);
+  if(write_full(sockfd, header, FRAME_HEADER_SIZE) < 0 ||
+     !send_body(sockfd, operation->filefd, offset, len, operation->progress)){
+    return -1;
+  }
+
+  rest = len;
+  operation->wire_bytes += wire + rest;
+  return wire + rest;
 }
 
-bool recv_file(int sockfd, char *filename){
-  FILE *file;
-  printf("%s\n", filename);
-  file = fopen(filename, "w+");
+/*
+ * Writes the body of a DATA frame whose header was just read to the
+ * download's offset, decompressing it first if it is FLAG_COMPRESSED.
+ */
+bool recv_data(int sockfd, struct Operation *operation, struct FrameHeader *header){
+  struct timespec start;
+  int len;
+
+  operation->wire_bytes += header->length;
+  if(!(header->flags & FLAG_COMPRESSED)){
+    if(!recv_body(sockfd, operation->filefd, operation->offset, header->length,
+                  operation->progress)){
+      return false;
+    }
+
+    operation->offset += header->length;
+    return true;
+  }
+
+  if(header->length < 4 || header->length > FRAME_MAX_CONTROL ||
+     read_full(sockfd, unpacker->packed, header->length) < 0){
+    return false;
+  }
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+  len = lz_decompress(unpacker->packed + 4, header->length - 4, unpacker->block, COMPRESS_BLOCK);
+  operation->cpu_ns += elapsed_ns(&start);
+  if(len < 0 || (uint32_t)len != get_u32(unpacker->packed) ||
+     pwrite(operation->filefd, unpacker->block, len, operation->offset) != len){
+    return false;
+  }
+
+  update_progress(operation->progress, len);
+  operation->offset += len;
+  return true;
+}
+
+long long elapsed_ns(const struct timespec *start){
+  struct timespec end;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+  return (end.tv_sec - start->tv_sec) * 1000000000LL + end.tv_nsec - start->tv_nsec;
+}
+
+/* With FEATURE_COMPRESS, what compression saved on a transfer and what it cost. */
+void report_compression(struct Operation *operation, off_t raw_bytes){
+  if(!(features & FEATURE_COMPRESS) || operation->wire_bytes == 0){
+    return;
+  }
+
+  printf("%s: %lld bytes as %lld on the wire (%.2fx), %.2f ms CPU\n", operation->filename,
+         (long long)raw_bytes, (long long)operation->wire_bytes,
+         (double)raw_bytes / operation->wire_bytes, operation->cpu_ns / 1e6);
+}
+
+bool send_file(int sockfd, char *filename){
+  struct Progress progress = {0, 0, 0};
+  struct stat file_stats;
+  char buffer[256];
+  bool status;
+  int filefd;
+
+  filefd = open(filename, O_RDONLY);
+  if(filefd < 0 || fstat(filefd, &file_stats) < 0){
+    error_occurred("Error opening file.\n");
+  }
 
-  int bytes_received = 0;
-  char *buffer;
-  buffer = malloc(sizeof(char) * 256);
   bzero(buffer, 256);
+  sprintf(buffer, "%lld", (long long)file_stats.st_size);
+  write(sockfd, buffer, 256);
+
+  progress.total = file_stats.st_size;
+  status = send_body(sockfd, filefd, 0, file_stats.st_size, &progress);
+  close(filefd);
+
+  if(status){
+    printf("\n100%% Upload done!\n");
+  }
+
+  else {
+    printf("Error uploading file.\n");
+  }
+
+  return status;
+}
+
+bool recv_file(int sockfd, char *filename){
+  struct Progress progress = {0, 0, 0};
+  char buffer[257];
+  bool status;
+  int filefd;
 
-  if(file == NULL){
+  printf("%s\n", filename);
+  filefd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(filefd < 0){
     error_occurred("Error opening file.\n");
   }
 
-  read(sockfd, buffer, 256);
-  int size = atoi(buffer);
-  int sum_bytes_received = 0;
-  int remaining_bytes = 0;
-  int curr_percentage = 0;
-  int curr_value = 0;
-  int count = 0;
+  if(read_full(sockfd, buffer, 256) < 0){
+    close(filefd);
+    return false;
+  }
+
+  buffer[256] = '\0';
+  progress.total = atoll(buffer);
+  status = recv_body(sockfd, filefd, 0, progress.total, &progress);
+
+  if(close(filefd) == 0 && status) {
+    load_bar(100, 100, 20, 100);
+    printf("\n100%% Download complete!\n");
+    return true;
+  }
+
+  else {
+    printf("ERROR: File not received.\n");
+  }
+
+  return false;
+}
+
+/*
+ * Offers the framed protocol. A legacy server answers the HELLO frame
+ * with a single plain text "Invalid input" message, which this consumes
+ * before falling back to the text protocol.
+ */
+bool negotiate(int sockfd){
+  unsigned char hello[5];
+  unsigned char response[2048];
+  struct FrameHeader header;
+  ssize_t len, bytes_read;
+
+  // compression is only asked for with -z, and then with its level
+  put_u32(hello, compress_level > 0 ? PROTOCOL_FEATURES : PROTOCOL_FEATURES & ~FEATURE_COMPRESS);
+  hello[4] = compress_level;
+  if(frame_send(sockfd, OP_HELLO, 0, next_request_id++, hello,
+                compress_level > 0 ? 5 : 4) < 0){
+    error_occurred("ERROR writing to socket");
+  }
+
+  len = read(sockfd, response, sizeof(response));
+  if(len <= 0){
+    error_occurred("ERROR reading from socket");
+  }
 
-  while(sum_bytes_received < size) {
-    bzero(buffer, 256);
-    sum_bytes_received += bytes_received;
-    remaining_bytes = size - sum_bytes_received;
-    curr_percentage = (((double)sum_bytes_received)/((double)size))*100;
+  if(response[0] != FRAME_MAGIC){
+    printf("Protocol: legacy text\n");
+    return false;
+  }
 
-    if(remaining_bytes < 256){
-      bytes_received = read(sockfd, buffer, remaining_bytes);
+  while(len < FRAME_HEADER_SIZE + 4){
+    bytes_read = read(sockfd, response + len, FRAME_HEADER_SIZE + 4 - len);
+    if(bytes_read <= 0){
+      error_occurred("ERROR reading from socket");
     }
-    else {
-      bytes_received = read(sockfd, buffer, 256);
+
+    len += bytes_read;
+  }
+
+  if(!frame_decode(response, &header) || header.version != FRAME_VERSION ||
+     header.opcode != OP_HELLO || header.length != 4){
+    error_occurred("ERROR negotiating protocol");
+  }
+
+  features = get_u32(response + FRAME_HEADER_SIZE);
+  printf("Protocol: framed v%d\n", header.version);
+  return true;
+}
+
+/* Reads the payload of a control frame whose header was just read. */
+char *recv_payload(int sockfd, struct FrameHeader *header){
+  char *payload;
+
+  if(header->length > MAX_REPLY){
+    error_occurred("ERROR reading from socket");
+  }
+
+  payload = malloc(header->length + 1);
+  if(read_full(sockfd, payload, header->length) < 0){
+    error_occurred("ERROR reading from socket");
+  }
+
+  payload[header->length] = '\0';
+  return payload;
+}
+
+/* Reads one control frame and returns its payload as a C string. */
+char *recv_reply(int sockfd, struct FrameHeader *header){
+  if(frame_recv(sockfd, header) < 0){
+    error_occurred("ERROR reading from socket");
+  }
+
+  return recv_payload(sockfd, header);
+}
+
+void framed_command(int sockfd, uint8_t opcode){
+  struct Progress progress = {0, 0, 0};
+  struct Operation operation;
+  char *filename = NULL;
+
+  if(opcode == OP_UPLOAD){
+    printf("What file do you want to upload?\n");
+  }
+
+  else if(opcode == OP_DOWNLOAD){
+    printf("What file do you want to download?\n");
+  }
+
+  else if(opcode == OP_DELETE){
+    printf("Which file would you like to delete?\n");
+  }
+
+  if(opcode != OP_LIST){
+    filename = get_input();
+  }
+
+  if(prepare_operation(&operation, opcode, filename)){
+    operation.progress = &progress;
+    if(delta && !dedup && opcode == OP_UPLOAD){
+      prepare_delta(sockfd, &operation);
     }
 
-    if(bytes_received > 0){
-      if((curr_percentage > 0) && (curr_percentage > curr_value)) {
-        curr_value = curr_percentage;
-        load_bar(count, 100, 20, 100);
-        count++;
-      }
+    if(dedup && opcode == OP_UPLOAD){
+      dedup_upload(sockfd, &operation);
+    }
 
-      fwrite(buffer, 1, bytes_received, file);
+    else if(stripe_count > 1 && !operation.delta &&
+            (opcode == OP_UPLOAD || opcode == OP_DOWNLOAD)){
+      run_stripes(&operation);
     }
 
-    if(bytes_received < 0){
-      printf("Error reading file.");
-      break;
+    else if(features & FEATURE_STREAMS){
+      run_streams(sockfd, &operation, 1);
     }
 
-    if(bytes_received == 0){
-      break;
+    else {
+      send_operation(sockfd, &operation);
+      finish_operation(sockfd, &operation);
     }
   }
 
-  free(buffer);
-  int status = fclose(file);
-  if(status == 0) {
-    load_bar(count, 100, 20, 100);
-    printf("\n100%% Download complete!\n");
+  free(filename);
+}
+
+bool prepare_operation(struct Operation *operation, uint8_t opcode, char *filename){
+  struct stat file_stats;
+
+  bzero(operation, sizeof(*operation));
+  operation->opcode = opcode;
+  operation->filename = filename;
+  operation->filefd = -1;
+  operation->request_id = next_request_id++;
+  operation->compress = (features & FEATURE_COMPRESS) != 0;
+
+  // carry on from whatever an earlier attempt left behind
+  if(opcode == OP_DOWNLOAD && resume && stat(filename, &file_stats) == 0 &&
+     S_ISREG(file_stats.st_mode)){
+    operation->offset = file_stats.st_size;
+  }
+
+  if(opcode != OP_UPLOAD){
     return true;
   }
-  else {
-    printf("ERROR: File not closed.\n");
+
+  operation->filefd = open(filename, O_RDONLY);
+  if(operation->filefd < 0 || fstat(operation->filefd, &file_stats) < 0 ||
+     !S_ISREG(file_stats.st_mode)){
+    printf("%s: File does not exist. Aborting upload.\n", filename);
+    if(operation->filefd >= 0){
+      close(operation->filefd);
+    }
+
+    return false;
   }
 
-  fclose(file);
-  return false;
+  operation->size = file_stats.st_size;
+  return true;
+}
+
+/*
+ * Sends the request frame of an operation, without any upload body. With
+ * -r, downloads ask for the range past what is already on disk and
+ * uploads ask the server how much it already has.
+ */
+void request_operation(int sockfd, struct Operation *operation){
+  unsigned char *request;
+  size_t len;
+
+  if(operation->opcode == OP_LIST && paged_list(operation)){
+    len = strlen(list_pattern);
+    request = malloc(LIST_QUERY_SIZE + len + (list_cursor != NULL ? strlen(list_cursor) : 0));
+    bzero(request, LIST_QUERY_SIZE);
+    request[0] = list_order;
+    request[2] = len >> 8;
+    request[3] = len & 0xFF;
+    put_u32(request + 4, list_limit);
+    memcpy(request + LIST_QUERY_SIZE, list_pattern, len);
+
+    // -a takes the "key/name" cursor a previous listing printed
+    if(list_cursor != NULL && strchr(list_cursor, '/') != NULL){
+      put_u64(request + 8, strtoull(list_cursor, NULL, 10));
+      strcpy((char *)request + LIST_QUERY_SIZE + len, strchr(list_cursor, '/') + 1);
+      len += strlen(strchr(list_cursor, '/') + 1);
+    }
+
+    frame_send(sockfd, OP_LIST, 0, operation->request_id, request, LIST_QUERY_SIZE + len);
+    free(request);
+    return;
+  }
+
+  if(operation->opcode == OP_LIST){
+    frame_send(sockfd, OP_LIST, 0, operation->request_id, NULL, 0);
+    return;
+  }
+
+  len = strlen(operation->filename);
+  if(operation->opcode == OP_DOWNLOAD && resume){
+    request = malloc(16 + len);
+    put_u64(request, operation->offset);
+    put_u64(request + 8, 0);
+    memcpy(request + 16, operation->filename, len);
+    frame_send(sockfd, OP_DOWNLOAD, FLAG_RANGE, operation->request_id, request, 16 + len);
+    free(request);
+    return;
+  }
+
+  if(operation->opcode != OP_UPLOAD){
+    frame_send(sockfd, operation->opcode, 0, operation->request_id, operation->filename, len);
+    return;
+  }
+
+  request = malloc(8 + len);
+  put_u64(request, operation->size);
+  memcpy(request + 8, operation->filename, len);
+  frame_send(sockfd, OP_UPLOAD, operation->delta ? FLAG_DELTA : resume ? FLAG_RESUME : 0,
+             operation->request_id, request, 8 + len);
+  free(request);
+
+  if(operation->progress != NULL){
+    operation->progress->total = operation->size;
+  }
+}
+
+/*
+ * Sends the request and, for uploads, the body as a single DATA frame, or
+ * one per block when it is compressed.
+ * Without FEATURE_PIPELINE, or when resuming, the server first has to
+ * answer READY, so this is the one place the sending side ever reads.
+ */
+void send_operation(int sockfd, struct Operation *operation){
+  struct FrameHeader header;
+  char *reply;
+
+  request_operation(sockfd, operation);
+  if(operation->opcode != OP_UPLOAD){
+    return;
+  }
+
+  if(!(features & FEATURE_PIPELINE) || (resume && !operation->delta)){
+    reply = recv_reply(sockfd, &header);
+    if(header.opcode != OP_READY){
+      printf("%s: %s\n", operation->filename, reply);
+      operation->failed = true;
+      close(operation->filefd);
+      free(reply);
+      return;
+    }
+
+    if(header.length >= 8){
+      resume_upload(operation, get_u64((unsigned char *)reply));
+    }
+
+    free(reply);
+  }
+
+  if(send_data(sockfd, operation, operation->offset, operation->size - operation->offset,
+               true) < 0){
+    error_occurred("Error uploading file.\n");
+  }
+
+  close(operation->filefd);
+}
+
+/* READY to a resumed upload: the server already has the first offset bytes. */
+void resume_upload(struct Operation *operation, off_t offset){
+  if(offset > operation->size){
+    offset = 0;
+  }
+
+  operation->offset = offset;
+  operation->resumed = offset;
+  if(operation->progress != NULL){
+    operation->progress->total = operation->size - offset;
+  }
+}
+
+/*
+ * Acts on the OK or ERROR that answers an operation. For a download the
+ * reply only carries the size: the file is opened here and the DATA frames
+ * follow. Returns whether the operation has succeeded so far.
+ */
+bool handle_reply(struct Operation *operation, struct FrameHeader *header, char *reply){
+  char *line;
+  int file_counter = 0;
+  off_t length;
+
+  if(header->opcode != OP_OK){
+    if(operation->filename != NULL){
+      printf("%s: %s\n", operation->filename, reply);
+    }
+
+    else {
+      printf("%s\n", reply);
+    }
+
+    return false;
+  }
+
+  switch(operation->opcode){
+    case OP_LIST:
+      // a paged listing has nothing here yet; the entries follow as DATA
+      if(paged_list(operation)){
+        printf("----------------------------------------------\n");
+        break;
+      }
+
+      for(line = reply; (line = strchr(line, '\n')) != NULL; line++){
+        file_counter++;
+      }
+
+      printf("Files found: %d\n", file_counter);
+      if(file_counter > 0){
+        printf("----------------------------------------------\n");
+        printf("%s", reply);
+        printf("----------------------------------------------\n");
+      }
+      break;
+
+    case OP_UPLOAD:
+      if(operation->progress != NULL){
+        load_bar(100, 100, 20, 100);
+        printf("\n100%% Upload done!\n");
+      }
+
+      else if(operation->delta){
+        printf("%s: uploaded (%lld bytes as a %lld byte delta)\n", operation->filename,
+               (long long)operation->full_size, (long long)operation->size);
+      }
+
+      else {
+        printf("%s: uploaded (%lld bytes)\n", operation->filename,
+               (long long)(operation->size - operation->resumed));
+      }
+
+      if(operation->resumed > 0){
+        printf("%s: resumed at %lld bytes\n", operation->filename, (long long)operation->resumed);
+      }
+
+      report_compression(operation, operation->size - operation->resumed);
+      break;
+
+    case OP_DOWNLOAD:
+      if(header->length < 8){
+        error_occurred("ERROR malformed reply");
+      }
+
+      // a ranged reply adds the offset and length actually being sent
+      operation->size = get_u64((unsigned char *)reply);
+      operation->offset = 0;
+      length = operation->size;
+      if(header->length >= 24){
+        operation->offset = get_u64((unsigned char *)reply + 8);
+        length = get_u64((unsigned char *)reply + 16);
+      }
+
+      operation->resumed = operation->offset;
+      if(operation->progress != NULL){
+        operation->progress->total = length;
+      }
+
+      operation->filefd = open(operation->filename, O_WRONLY | O_CREAT |
+                               (operation->offset == 0 ? O_TRUNC : 0), 0644);
+      if(operation->filefd < 0){
+        error_occurred("Error opening file.\n");
+      }
+      break;
+
+    case OP_DELETE:
+      printf("%s: File deleted successfully!\n", operation->filename);
+      break;
+  }
+
+  return true;
+}
+
+void finish_download(struct Operation *operation){
+  close(operation->filefd);
+  operation->filefd = -1;
+
+  if(operation->progress != NULL){
+    load_bar(100, 100, 20, 100);
+    printf("\n100%% Download complete!\n");
+  }
+
+  else {
+    printf("%s: downloaded (%lld bytes)\n", operation->filename,
+           (long long)(operation->offset - operation->resumed));
+  }
+
+  if(operation->resumed > 0){
+    printf("%s: resumed at %lld bytes\n", operation->filename, (long long)operation->resumed);
+  }
+
+  report_compression(operation, operation->offset - operation->resumed);
+}
+
+/* Reads the final reply to an operation, including any download body. */
+bool finish_operation(int sockfd, struct Operation *operation){
+  struct FrameHeader header;
+  char *reply;
+  bool status;
+
+  if(operation->failed){
+    return false;
+  }
+
+  reply = recv_reply(sockfd, &header);
+  if(header.request_id != operation->request_id){
+    error_occurred("ERROR reply does not match request");
+  }
+
+  status = handle_reply(operation, &header, reply);
+  free(reply);
+  if(!status || (operation->opcode != OP_DOWNLOAD && !paged_list(operation))){
+    return status;
+  }
+
+  // the body arrives as one or more DATA frames, the last one flagged FIN
+  do {
+    if(frame_recv(sockfd, &header) < 0 || header.opcode != OP_DATA ||
+       header.request_id != operation->request_id){
+      error_occurred("ERROR reading from socket");
+    }
+
+    if(operation->opcode == OP_LIST){
+      reply = recv_payload(sockfd, &header);
+      list_entries(operation, (unsigned char *)reply, header.length);
+      free(reply);
+      continue;
+    }
+
+    if(!recv_data(sockfd, operation, &header)){
+      error_occurred("ERROR reading from socket");
+    }
+  } while(!(header.flags & FLAG_FIN));
+
+  if(operation->opcode == OP_LIST){
+    finish_list(operation, header.flags & FLAG_MORE);
+  }
+
+  else {
+    finish_download(operation);
+  }
+
+  return true;
+}
+
+void *send_operations(void *arg){
+  struct Batch *batch = arg;
+  int i;
+
+  for(i = 0; i < batch->count; i++){
+    if(!batch->operations[i].failed){
+      send_operation(batch->sockfd, &batch->operations[i]);
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Transfers the server is still holding a stream for: uploads until their
+ * FIN frame is sent, downloads until theirs arrives.
+ */
+int open_streams(struct Batch *batch){
+  struct Operation *operation;
+  int i, count = 0;
+
+  for(i = 0; i < batch->count; i++){
+    operation = &batch->operations[i];
+    if(!operation->sent){
+      continue;
+    }
+
+    if((operation->opcode == OP_UPLOAD && !operation->fin_sent) ||
+       (operation->opcode == OP_DOWNLOAD && !operation->done) ||
+       (paged_list(operation) && !operation->done)){
+      count++;
+    }
+  }
+
+  return count;
+}
+
+/* Uploads take turns; one may send if it has credit or has to be cut short. */
+struct Operation *next_upload(struct Batch *batch, int *turn){
+  struct Operation *operation;
+  int i;
+
+  for(i = 0; i < batch->count; i++){
+    operation = &batch->operations[(*turn + i) % batch->count];
+    if(operation->opcode == OP_UPLOAD && operation->ready && !operation->fin_sent &&
+       (operation->failed || operation->window > 0 || operation->offset == operation->size)){
+      *turn = (*turn + i + 1) % batch->count;
+      return operation;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Writer side of FEATURE_STREAMS and the only thread writing to the socket
+ * while streams run. Window credit for downloads goes out first, then the
+ * next upload chunk, then the next request while fewer than MAX_STREAMS
+ * transfers are open. The reader never blocks on this thread, so a full
+ * socket in one direction cannot stall the other.
+ */
+void *send_streams(void *arg){
+  struct Batch *batch = arg;
+  struct Operation *operation;
+  unsigned char buffer[FRAME_HEADER_SIZE];
+  int i, next = 0, turn = 0;
+  uint32_t grant;
+  off_t offset, len, wire;
+  bool fin;
+
+  pthread_mutex_lock(&batch->lock);
+  while(batch->finished < batch->count || open_streams(batch) > 0){
+    operation = NULL;
+    for(i = 0; i < batch->count && operation == NULL; i++){
+      if(batch->operations[i].grant > 0){
+        operation = &batch->operations[i];
+      }
+    }
+
+    if(operation != NULL){
+      grant = operation->grant;
+      operation->grant = 0;
+      pthread_mutex_unlock(&batch->lock);
+
+      put_u32(buffer, grant);
+      if(frame_send(batch->sockfd, OP_WINDOW, 0, operation->request_id, buffer, 4) < 0){
+        error_occurred("ERROR writing to socket");
+      }
+
+      pthread_mutex_lock(&batch->lock);
+      continue;
+    }
+
+    operation = next_upload(batch, &turn);
+    if(operation != NULL){
+      // a rejected upload is cut short with an empty FIN frame
+      len = 0;
+      if(!operation->failed){
+        len = operation->size - operation->offset;
+        if(len > operation->window){
+          len = operation->window;
+        }
+
+        if(len > STREAM_CHUNK){
+          len = STREAM_CHUNK;
+        }
+      }
+
+      offset = operation->offset;
+      fin = operation->failed || offset + len == operation->size;
+      operation->offset += len;
+      operation->window -= len;
+      operation->fin_sent = fin;
+      pthread_mutex_unlock(&batch->lock);
+
+      wire = send_data(batch->sockfd, operation, offset, len, fin);
+      if(wire < 0){
+        error_occurred("Error uploading file.\n");
+      }
+
+      if(fin){
+        close(operation->filefd);
+      }
+
+      // the window only counts what compression left of the range
+      pthread_mutex_lock(&batch->lock);
+      operation->window += len - wire;
+      continue;
+    }
+
+    if(next < batch->count && open_streams(batch) < MAX_STREAMS){
+      operation = &batch->operations[next++];
+      if(!operation->done){
+        operation->sent = true;
+        operation->ready = !(operation->opcode == OP_UPLOAD && resume && !operation->delta);
+        operation->window = STREAM_WINDOW;
+        pthread_mutex_unlock(&batch->lock);
+        request_operation(batch->sockfd, operation);
+        pthread_mutex_lock(&batch->lock);
+      }
+
+      continue;
+    }
+
+    pthread_cond_wait(&batch->changed, &batch->lock);
+  }
+
+  pthread_mutex_unlock(&batch->lock);
+  return 0;
+}
+
+struct Operation *find_operation(struct Batch *batch, uint32_t request_id){
+  int i;
+
+  for(i = 0; i < batch->count; i++){
+    if(batch->operations[i].request_id == request_id && batch->operations[i].sent){
+      return &batch->operations[i];
+    }
+  }
+
+  return NULL;
+}
+
+void complete_operation(struct Batch *batch, struct Operation *operation, bool succeeded){
+  pthread_mutex_lock(&batch->lock);
+  operation->failed = !succeeded;
+  operation->done = true;
+
+  // a resumed upload refused instead of READY never opened a stream
+  if(!operation->ready){
+    operation->fin_sent = true;
+  }
+
+  batch->finished++;
+  pthread_cond_broadcast(&batch->changed);
+  pthread_mutex_unlock(&batch->lock);
+}
+
+/*
+ * Reader side of FEATURE_STREAMS: replies, DATA frames and WINDOW credit
+ * arrive in whatever order the server interleaves them and are matched to
+ * their operation by request_id. Received bytes are credited back through
+ * the writer once they are on disk.
+ */
+void read_streams(struct Batch *batch){
+  struct Operation *operation;
+  struct FrameHeader header;
+  unsigned char credit[4];
+  char *reply;
+  bool status;
+
+  // only this thread advances finished
+  while(batch->finished < batch->count){
+    if(frame_recv(batch->sockfd, &header) < 0){
+      error_occurred("ERROR reading from socket");
+    }
+
+    operation = find_operation(batch, header.request_id);
+    if(operation == NULL){
+      error_occurred("ERROR reply does not match request");
+    }
+
+    if(header.opcode == OP_WINDOW){
+      if(header.length != 4 || read_full(batch->sockfd, credit, 4) < 0){
+        error_occurred("ERROR reading from socket");
+      }
+
+      pthread_mutex_lock(&batch->lock);
+      operation->window += get_u32(credit);
+      pthread_cond_broadcast(&batch->changed);
+      pthread_mutex_unlock(&batch->lock);
+      continue;
+    }
+
+    if(header.opcode == OP_DATA && paged_list(operation)){
+      reply = recv_payload(batch->sockfd, &header);
+      list_entries(operation, (unsigned char *)reply, header.length);
+      free(reply);
+    }
+
+    else if(header.opcode == OP_DATA){
+      if(operation->opcode != OP_DOWNLOAD || operation->filefd < 0 ||
+         !recv_data(batch->sockfd, operation, &header)){
+        error_occurred("ERROR reading from socket");
+      }
+    }
+
+    if(header.opcode == OP_DATA){
+      if(header.flags & FLAG_FIN){
+        if(operation->opcode == OP_LIST){
+          finish_list(operation, header.flags & FLAG_MORE);
+        }
+
+        else {
+          finish_download(operation);
+        }
+
+        complete_operation(batch, operation, true);
+        continue;
+      }
+
+      pthread_mutex_lock(&batch->lock);
+      operation->grant += header.length;
+      pthread_cond_broadcast(&batch->changed);
+      pthread_mutex_unlock(&batch->lock);
+      continue;
+    }
+
+    reply = recv_payload(batch->sockfd, &header);
+    if(header.opcode == OP_READY){
+      pthread_mutex_lock(&batch->lock);
+      resume_upload(operation, header.length >= 8 ? get_u64((unsigned char *)reply) : 0);
+      operation->ready = true;
+      pthread_cond_broadcast(&batch->changed);
+      pthread_mutex_unlock(&batch->lock);
+      free(reply);
+      continue;
+    }
+
+    status = handle_reply(operation, &header, reply);
+    free(reply);
+
+    // a download or paged listing is only done once its last DATA frame is in
+    if(!status || (operation->opcode != OP_DOWNLOAD && !paged_list(operation))){
+      complete_operation(batch, operation, status);
+    }
+  }
+}
+
+/*
+ * Runs operations side by side over FEATURE_STREAMS: up to MAX_STREAMS
+ * transfers share the connection, and LIST or DELETE are answered without
+ * waiting behind them. Returns how many operations succeeded.
+ */
+int run_streams(int sockfd, struct Operation *operations, int count){
+  struct Batch batch;
+  pthread_t writer;
+  int i, succeeded = 0;
+
+  batch.sockfd = sockfd;
+  batch.operations = operations;
+  batch.count = count;
+  batch.finished = 0;
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_cond_init(&batch.changed, NULL);
+
+  // operations that failed before anything was sent are already over
+  for(i = 0; i < count; i++){
+    if(operations[i].failed){
+      operations[i].done = true;
+      batch.finished++;
+    }
+  }
+
+  if(pthread_create(&writer, NULL, send_streams, &batch) != 0){
+    error_occurred("ERROR starting writer");
+  }
+
+  read_streams(&batch);
+  pthread_join(writer, NULL);
+  pthread_cond_destroy(&batch.changed);
+  pthread_mutex_destroy(&batch.lock);
+
+  for(i = 0; i < count; i++){
+    if(!operations[i].failed){
+      succeeded++;
+    }
+  }
+
+  return succeeded;
+}
+
+/*
+ * Runs commands given on the command line. With FEATURE_PIPELINE every
+ * request is written without waiting for the previous reply, which takes
+ * the per-request round trips out of small transfers; with FEATURE_STREAMS
+ * the transfers also run side by side. A resumed upload has to hear READY
+ * before sending, so without streams -r runs the batch in lockstep. With
+ * -s each transfer is striped in turn, with -d each upload is sent as
+ * chunks in turn, and the rest runs one operation at a time. With -u the
+ * deltas are worked out first, then go out like any other upload.
+ */
+void run_batch(int sockfd, int count, char *commands[]){
+  struct Operation *operations = calloc(count, sizeof(struct Operation));
+  struct Batch batch;
+  struct timespec start, end;
+  pthread_t writer;
+  bool striped = stripe_count > 1;
+  bool serial = striped || dedup;
+  bool pipelined = (features & FEATURE_PIPELINE) && !resume && !serial;
+  bool multiplexed = (features & FEATURE_STREAMS) && !serial;
+  int i, total = 0, succeeded = 0;
+  uint8_t opcode;
+
+  if(!framed){
+    printf("Batch commands need a server that speaks the framed protocol.\n");
+    return;
+  }
+
+  for(i = 0; i < count; i++){
+    if(strcmp(commands[i], "list") == 0){
+      prepare_operation(&operations[total++], OP_LIST, NULL);
+      continue;
+    }
+
+    if(strcmp(commands[i], "upload") == 0){
+      opcode = OP_UPLOAD;
+    }
+
+    else if(strcmp(commands[i], "download") == 0){
+      opcode = OP_DOWNLOAD;
+    }
+
+    else if(strcmp(commands[i], "delete") == 0){
+      opcode = OP_DELETE;
+    }
+
+    else {
+      printf("Unknown command: %s\n", commands[i]);
+      free(operations);
+      return;
+    }
+
+    if(i + 1 >= count){
+      printf("%s needs a file name.\n", commands[i]);
+      free(operations);
+      return;
+    }
+
+    i++;
+    if(!prepare_operation(&operations[total], opcode, commands[i])){
+      operations[total].failed = true;
+    }
+
+    total++;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for(i = 0; delta && !dedup && i < total; i++){
+    if(operations[i].opcode == OP_UPLOAD && !operations[i].failed){
+      prepare_delta(sockfd, &operations[i]);
+    }
+  }
+
+  batch.sockfd = sockfd;
+  batch.operations = operations;
+  batch.count = total;
+
+  if(multiplexed){
+    succeeded = run_streams(sockfd, operations, total);
+  }
+
+  else if(serial){
+    for(i = 0; i < total; i++){
+      if(operations[i].failed){
+        continue;
+      }
+
+      if(dedup && operations[i].opcode == OP_UPLOAD){
+        succeeded += dedup_upload(sockfd, &operations[i]);
+      }
+
+      else if(striped && !operations[i].delta && (operations[i].opcode == OP_UPLOAD ||
+                                                  operations[i].opcode == OP_DOWNLOAD)){
+        succeeded += run_stripes(&operations[i]);
+      }
+
+      // a long listing needs its window credit handed back
+      else if(features & FEATURE_STREAMS){
+        succeeded += run_streams(sockfd, &operations[i], 1);
+      }
+
+      else {
+        send_operation(sockfd, &operations[i]);
+        succeeded += finish_operation(sockfd, &operations[i]);
+      }
+    }
+  }
+
+  else {
+    if(pipelined && pthread_create(&writer, NULL, send_operations, &batch) != 0){
+      error_occurred("ERROR starting writer");
+    }
+
+    for(i = 0; i < total; i++){
+      if(!pipelined && !operations[i].failed){
+        send_operation(sockfd, &operations[i]);
+      }
+
+      if(finish_operation(sockfd, &operations[i])){
+        succeeded++;
+      }
+    }
+
+    if(pipelined){
+      pthread_join(writer, NULL);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("%d of %d commands succeeded in %.3f s (%s)\n", succeeded, total,
+         (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+         striped ? "striped" : dedup ? "deduplicated" : multiplexed ? "multiplexed" :
+         pipelined ? "pipelined" : "lockstep");
+
+  framed_quit(sockfd);
+  free(operations);
+}
+
+void framed_stats(int sockfd){
+  struct FrameHeader header;
+  char *reply;
+
+  frame_send(sockfd, OP_STATS, 0, next_request_id++, NULL, 0);
+  reply = recv_reply(sockfd, &header);
+  printf("%s%s", reply, header.opcode == OP_OK ? "" : "\n");
+  free(reply);
+}
+
+bool framed_quit(int sockfd){
+  struct FrameHeader header;
+  char *reply;
+
+  frame_send(sockfd, OP_QUIT, 0, next_request_id++, NULL, 0);
+  reply = recv_reply(sockfd, &header);
+  printf("%s\n", reply);
+  free(reply);
+
+  if(header.opcode == OP_OK){
+    printf("Thank you for using BitDrive!\n");
+    return false;
+  }
+
+  return true;
+}
+
+/* With FEATURE_LISTING every LIST is a query, however plain. */
+bool paged_list(struct Operation *operation){
+  return operation->opcode == OP_LIST && (features & FEATURE_LISTING);
+}
+
+bool parse_order(const char *order){
+  uint8_t descending = 0;
+
+  if(order[0] == '-'){
+    descending = LIST_DESCENDING;
+    order++;
+  }
+
+  if(strcmp(order, "name") == 0){
+    list_order = LIST_BY_NAME | descending;
+  }
+
+  else if(strcmp(order, "size") == 0){
+    list_order = LIST_BY_SIZE | descending;
+  }
+
+  else if(strcmp(order, "mtime") == 0){
+    list_order = LIST_BY_MTIME | descending;
+  }
+
+  else {
+    return false;
+  }
+
+  return true;
+}
+
+/*
+ * Prints one page of a listing as it arrives, so only a page is ever held.
+ * The last entry printed becomes the cursor for the next listing.
+ */
+void list_entries(struct Operation *operation, const unsigned char *page, size_t len){
+  char name[NAME_MAX + 1];
+  uint64_t size, mtime, key;
+  size_t name_len, pos = 0;
+
+  while(pos + LIST_ENTRY_SIZE <= len){
+    size = get_u64(page + pos);
+    mtime = get_u64(page + pos + 8);
+    name_len = (page[pos + 16] << 8) | page[pos + 17];
+    if(name_len > NAME_MAX || pos + LIST_ENTRY_SIZE + name_len > len){
+      error_occurred("ERROR malformed listing");
+    }
+
+    memcpy(name, page + pos + LIST_ENTRY_SIZE, name_len);
+    name[name_len] = '\0';
+    pos += LIST_ENTRY_SIZE + name_len;
+
+    printf("%s (%.1f kb)\n", name, size / 1000.0);
+    key = (list_order & ~LIST_DESCENDING) == LIST_BY_SIZE ? size :
+          (list_order & ~LIST_DESCENDING) == LIST_BY_MTIME ? mtime : 0;
+    snprintf(operation->cursor, sizeof(operation->cursor), "%llu/%s",
+             (unsigned long long)key, name);
+    operation->offset++;
+  }
+}
+
+void finish_list(struct Operation *operation, bool more){
+  printf("----------------------------------------------\n");
+  printf("Files found: %lld\n", (long long)operation->offset);
+  if(more){
+    printf("More files match; continue with -a '%s'\n", operation->cursor);
+  }
+}
+
+/*
+ * Opens the extra connections for -s. They offer only what a striped
+ * range needs: without FEATURE_STREAMS each range is one DATA frame and
+ * the requests on a connection simply take turns.
+ */
+bool open_stripes(){
+  unsigned char hello[4];
+  struct FrameHeader header;
+  uint32_t wanted = FEATURE_PIPELINE | FEATURE_RESUME | FEATURE_STRIPE;
+  char *reply;
+  int i;
+
+  if(!framed || (features & wanted) != wanted){
+    return false;
+  }
+
+  put_u32(hello, wanted);
+  for(i = 0; i < stripe_count; i++){
+    stripe_fds[i] = connect_server();
+    if(frame_send(stripe_fds[i], OP_HELLO, 0, 1, hello, sizeof(hello)) < 0){
+      error_occurred("ERROR writing to socket");
+    }
+
+    reply = recv_reply(stripe_fds[i], &header);
+    if(header.opcode != OP_HELLO || header.length != 4 ||
+       (get_u32((unsigned char *)reply) & wanted) != wanted){
+      error_occurred("ERROR negotiating protocol");
+    }
+
+    free(reply);
+  }
+
+  printf("Striping transfers over %d connections, %lld KB at a time\n", stripe_count,
+         (long long)stripe_chunk / 1024);
+  return true;
+}
+
+void close_stripes(){
+  int i;
+
+  for(i = 0; stripe_count > 1 && i < stripe_count; i++){
+    close(stripe_fds[i]);
+  }
+}
+
+/* Hands out the next range; an empty file is still one (empty) range. */
+bool take_range(struct Stripes *stripes, off_t *offset, off_t *length){
+  off_t size = stripes->operation->size;
+  bool taken;
+
+  pthread_mutex_lock(&stripes->lock);
+  taken = !stripes->failed && stripes->next < stripes->chunks;
+  if(taken){
+    *offset = stripes->next * stripe_chunk;
+    *length = size - *offset < stripe_chunk ? size - *offset : stripe_chunk;
+    stripes->next++;
+  }
+
+  pthread_mutex_unlock(&stripes->lock);
+  return taken;
+}
+
+/*
+ * UPLOAD with FLAG_RANGE: u64 size, u64 token, u64 offset, u64 length,
+ * name. The OK says how much of the file the server has so far, from
+ * every connection; the file is in place once that reaches the size.
+ */
+bool upload_range(struct StripeWorker *worker, off_t offset, off_t length){
+  struct Stripes *stripes = worker->stripes;
+  struct Operation *operation = stripes->operation;
+  unsigned char data_header[FRAME_HEADER_SIZE];
+  size_t len = strlen(operation->filename);
+  unsigned char *request = malloc(32 + len);
+  uint32_t request_id = worker->next_request_id++;
+  struct FrameHeader header;
+  char *reply;
+  off_t received;
+
+  put_u64(request, operation->size);
+  put_u64(request + 8, stripes->token);
+  put_u64(request + 16, offset);
+  put_u64(request + 24, length);
+  memcpy(request + 32, operation->filename, len);
+  frame_encode(data_header, OP_DATA, FLAG_FIN, request_id, length);
+  if(frame_send(worker->sockfd, OP_UPLOAD, FLAG_RANGE, request_id, request, 32 + len) < 0 ||
+     write_full(worker->sockfd, data_header, FRAME_HEADER_SIZE) < 0 ||
+     !send_body(worker->sockfd, operation->filefd, offset, length, NULL)){
+    error_occurred("Error uploading file.\n");
+  }
+
+  free(request);
+  reply = recv_reply(worker->sockfd, &header);
+  if(header.opcode != OP_OK || header.length < 8){
+    printf("%s: %s\n", operation->filename, reply);
+    free(reply);
+    return false;
+  }
+
+  received = get_u64((unsigned char *)reply);
+  free(reply);
+
+  pthread_mutex_lock(&stripes->lock);
+  if(received > stripes->received){
+    stripes->received = received;
+  }
+
+  pthread_mutex_unlock(&stripes->lock);
+  return true;
+}
+
+/*
+ * A ranged DOWNLOAD, written into the file at the same offset. The first
+ * range is fetched before the workers start: its reply carries the size
+ * the rest of the ranges are cut from.
+ */
+bool download_range(struct StripeWorker *worker, off_t offset, off_t length){
+  struct Stripes *stripes = worker->stripes;
+  struct Operation *operation = stripes->operation;
+  size_t len = strlen(operation->filename);
+  unsigned char *request = malloc(16 + len);
+  uint32_t request_id = worker->next_request_id++;
+  struct FrameHeader header;
+  off_t start = offset;
+  char *reply;
+  off_t size;
+
+  put_u64(request, offset);
+  put_u64(request + 8, length);
+  memcpy(request + 16, operation->filename, len);
+  if(frame_send(worker->sockfd, OP_DOWNLOAD, FLAG_RANGE, request_id, request, 16 + len) < 0){
+    error_occurred("ERROR writing to socket");
+  }
+
+  free(request);
+  reply = recv_reply(worker->sockfd, &header);
+  if(header.opcode != OP_OK || header.length < 24){
+    printf("%s: %s\n", operation->filename, reply);
+    free(reply);
+    return false;
+  }
+
+  size = get_u64((unsigned char *)reply);
+  free(reply);
+  if(offset == 0){
+    operation->size = size;
+    operation->filefd = open(operation->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(operation->filefd < 0){
+      error_occurred("Error opening file.\n");
+    }
+  }
+
+  // the body follows even if the file changed under us; take it, then fail
+  do {
+    if(frame_recv(worker->sockfd, &header) < 0 || header.opcode != OP_DATA ||
+       header.request_id != request_id ||
+       !recv_body(worker->sockfd, operation->filefd, offset, header.length, NULL)){
+      error_occurred("ERROR reading from socket");
+    }
+
+    offset += header.length;
+  } while(!(header.flags & FLAG_FIN));
+
+  if(size != operation->size){
+    printf("%s: File changed during download.\n", operation->filename);
+    return false;
+  }
+
+  pthread_mutex_lock(&stripes->lock);
+  stripes->received += offset - start;
+  pthread_mutex_unlock(&stripes->lock);
+  return true;
+}
+
+void *run_stripe(void *arg){
+  struct StripeWorker *worker = arg;
+  struct Stripes *stripes = worker->stripes;
+  bool upload = stripes->operation->opcode == OP_UPLOAD;
+  off_t offset, length;
+
+  while(take_range(stripes, &offset, &length)){
+    if(!(upload ? upload_range(worker, offset, length) :
+                  download_range(worker, offset, length))){
+      pthread_mutex_lock(&stripes->lock);
+      stripes->failed = true;
+      pthread_mutex_unlock(&stripes->lock);
+    }
+  }
+
+  return NULL;
+}
+
+/* Moves one file over every stripe connection; returns whether it made it. */
+bool run_stripes(struct Operation *operation){
+  struct StripeWorker workers[MAX_STRIPES];
+  struct Stripes stripes;
+  struct timespec start, end;
+  double seconds;
+  bool succeeded;
+  int i;
+
+  bzero(&stripes, sizeof(stripes));
+  bzero(workers, sizeof(workers));
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  stripes.operation = operation;
+  stripes.token = (uint64_t)getpid() << 48 ^ (uint64_t)start.tv_sec << 20 ^ start.tv_nsec;
+  pthread_mutex_init(&stripes.lock, NULL);
+  for(i = 0; i < stripe_count; i++){
+    workers[i].stripes = &stripes;
+    workers[i].sockfd = stripe_fds[i];
+    workers[i].next_request_id = 1;
+  }
+
+  if(operation->opcode == OP_DOWNLOAD){
+    stripes.next = 1;
+    stripes.failed = !download_range(&workers[0], 0, stripe_chunk);
+  }
+
+  stripes.chunks = (operation->size + stripe_chunk - 1) / stripe_chunk;
+  if(stripes.chunks == 0){
+    stripes.chunks = 1;
+  }
+
+  for(i = 0; i < stripe_count; i++){
+    if(pthread_create(&workers[i].thread, NULL, run_stripe, &workers[i]) != 0){
+      error_occurred("ERROR starting stripe");
+    }
+  }
+
+  for(i = 0; i < stripe_count; i++){
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  pthread_mutex_destroy(&stripes.lock);
+  if(operation->filefd >= 0){
+    close(operation->filefd);
+    operation->filefd = -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  succeeded = !stripes.failed && stripes.received == operation->size;
+  if(succeeded){
+    printf("%s: %s (%lld bytes) over %d connections, %.1f MB/s\n", operation->filename,
+           operation->opcode == OP_UPLOAD ? "uploaded" : "downloaded",
+           (long long)operation->size, stripe_count,
+           seconds > 0 ? operation->size / seconds / (1024 * 1024) : 0.0);
+  }
+
+  else if(!stripes.failed){
+    printf("%s: Transfer incomplete.\n", operation->filename);
+  }
+
+  operation->failed = !succeeded;
+  return succeeded;
+}
+
+/*
+ * Uploads a file as chunks (-d): the file is cut and hashed here, HAVE
+ * finds out which chunks the server lacks, only those are sent, and the
+ * manifest then names the file. Chunks go out from a writer thread while
+ * this one reads their replies, as in a pipelined batch.
+ */
+bool dedup_upload(int sockfd, struct Operation *operation){
+  struct ChunkUpload upload;
+  struct FrameHeader header;
+  pthread_t writer;
+  off_t sent = 0;
+  bool succeeded;
+  char *reply;
+  int i;
+
+  bzero(&upload, sizeof(upload));
+  upload.operation = operation;
+  upload.sockfd = sockfd;
+  succeeded = chunk_file(operation->filefd, &upload.list);
+  if(!succeeded){
+    printf("%s: Error reading file.\n", operation->filename);
+  }
+
+  succeeded = succeeded && find_missing(&upload);
+  for(i = 0; succeeded && i < upload.list.count; i++){
+    if(upload.needed[i]){
+      sent += upload.list.chunks[i].length;
+    }
+  }
+
+  if(operation->progress != NULL){
+    operation->progress->total = sent;
+  }
+
+  upload.first_id = next_request_id;
+  next_request_id += upload.missing;
+  if(succeeded && upload.missing > 0){
+    if(pthread_create(&writer, NULL, send_chunks, &upload) != 0){
+      error_occurred("ERROR starting writer");
+    }
+
+    // every reply is read, even after a failure, so the connection stays in step
+    for(i = 0; i < upload.missing; i++){
+      reply = recv_reply(sockfd, &header);
+      if(header.request_id - upload.first_id >= (uint32_t)upload.missing){
+        error_occurred("ERROR reply does not match request");
+      }
+
+      if(header.opcode != OP_OK && succeeded){
+        printf("%s: %s\n", operation->filename, reply);
+        succeeded = false;
+      }
+
+      free(reply);
+    }
+
+    pthread_join(writer, NULL);
+  }
+
+  succeeded = succeeded && send_manifest(&upload);
+  if(succeeded){
+    if(operation->progress != NULL){
+      load_bar(100, 100, 20, 100);
+      printf("\n100%% Upload done!\n");
+    }
+
+    printf("%s: uploaded (%lld bytes; sent %d of %d chunks, %lld bytes)\n",
+           operation->filename, (long long)upload.list.size, upload.missing,
+           upload.list.count, (long long)sent);
+  }
+
+  close(operation->filefd);
+  operation->filefd = -1;
+  chunk_list_free(&upload.list);
+  free(upload.needed);
+  operation->failed = !succeeded;
+  return succeeded;
+}
+
+int compare_chunks(const void *a, const void *b){
+  const struct Chunk *x = *(const struct Chunk **)a;
+  const struct Chunk *y = *(const struct Chunk **)b;
+  int cmp = memcmp(x->hash, y->hash, SHA256_SIZE);
+
+  return cmp != 0 ? cmp : (x > y) - (x < y);
+}
+
+/*
+ * Asks the server which chunks it has, HAVE_MAX at a time, and marks the
+ * others as needed. A chunk that repeats within the file is sent once.
+ */
+bool find_missing(struct ChunkUpload *upload){
+  struct ChunkList *list = &upload->list;
+  unsigned char *request = malloc(HAVE_MAX * SHA256_SIZE);
+  struct Chunk **sorted = malloc((list->count + 1) * sizeof(struct Chunk *));
+  struct FrameHeader header;
+  int start, count, i;
+  char *reply;
+
+  upload->needed = calloc(list->count + 1, sizeof(bool));
+  if(request == NULL || sorted == NULL || upload->needed == NULL){
+    error_occurred("ERROR allocating chunk list");
+  }
+
+  for(start = 0; start < list->count; start += count){
+    count = list->count - start < HAVE_MAX ? list->count - start : HAVE_MAX;
+    for(i = 0; i < count; i++){
+      memcpy(request + i * SHA256_SIZE, list->chunks[start + i].hash, SHA256_SIZE);
+    }
+
+    if(frame_send(upload->sockfd, OP_HAVE, 0, next_request_id++, request,
+                  count * SHA256_SIZE) < 0){
+      error_occurred("ERROR writing to socket");
+    }
+
+    reply = recv_reply(upload->sockfd, &header);
+    if(header.opcode != OP_OK || header.length < (uint64_t)(count + 7) / 8){
+      printf("%s: %s\n", upload->operation->filename, reply);
+      free(reply);
+      free(sorted);
+      free(request);
+      return false;
+    }
+
+    for(i = 0; i < count; i++){
+      upload->needed[start + i] = !(reply[i / 8] & (0x80 >> (i % 8)));
+    }
+
+    free(reply);
+  }
+
+  // equal hashes sort together, the first in the file leading
+  for(i = 0; i < list->count; i++){
+    sorted[i] = &list->chunks[i];
+  }
+
+  qsort(sorted, list->count, sizeof(struct Chunk *), compare_chunks);
+  for(i = 1; i < list->count; i++){
+    if(memcmp(sorted[i]->hash, sorted[i - 1]->hash, SHA256_SIZE) == 0){
+      upload->needed[sorted[i] - list->chunks] = false;
+    }
+  }
+
+  for(i = 0; i < list->count; i++){
+    upload->missing += upload->needed[i];
+  }
+
+  free(sorted);
+  free(request);
+  return true;
+}
+
+/* Writer side of dedup_upload: every needed chunk as an UPLOAD with FLAG_CHUNK. */
+void *send_chunks(void *arg){
+  struct ChunkUpload *upload = arg;
+  struct Operation *operation = upload->operation;
+  unsigned char request[8 + SHA256_SIZE];
+  unsigned char data_header[FRAME_HEADER_SIZE];
+  uint32_t request_id = upload->first_id;
+  struct Chunk *chunk;
+  int i;
+
+  for(i = 0; i < upload->list.count; i++){
+    if(!upload->needed[i]){
+      continue;
+    }
+
+    // a chunk never outgrows a stream window, so it always fits one frame
+    chunk = &upload->list.chunks[i];
+    put_u64(request, chunk->length);
+    memcpy(request + 8, chunk->hash, SHA256_SIZE);
+    frame_encode(data_header, OP_DATA, FLAG_FIN, request_id, chunk->length);
+    if(frame_send(upload->sockfd, OP_UPLOAD, FLAG_CHUNK, request_id++, request,
+                  sizeof(request)) < 0 ||
+       write_full(upload->sockfd, data_header, FRAME_HEADER_SIZE) < 0 ||
+       !send_body(upload->sockfd, operation->filefd, chunk->offset, chunk->length,
+                  operation->progress)){
+      error_occurred("Error uploading file.\n");
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * UPLOAD with FLAG_MANIFEST: the manifest as the body. With streams one
+ * larger than STREAM_WINDOW has to wait for credit, so a frame read while
+ * sending is either WINDOW or an early ERROR, after which an empty FIN
+ * frame ends the upload.
+ */
+bool send_manifest(struct ChunkUpload *upload){
+  struct Operation *operation = upload->operation;
+  size_t name_len = strlen(operation->filename), len, sent = 0, take;
+  unsigned char *request = malloc(8 + name_len);
+  unsigned char *manifest = manifest_encode(&upload->list, &len);
+  int64_t window = features & FEATURE_STREAMS ? STREAM_WINDOW : INT64_MAX;
+  uint32_t request_id = next_request_id++;
+  struct FrameHeader header;
+  char *reply = NULL;
+  bool fin, succeeded;
+
+  if(request == NULL || manifest == NULL){
+    error_occurred("ERROR allocating manifest");
+  }
+
+  put_u64(request, len);
+  memcpy(request + 8, operation->filename, name_len);
+  if(frame_send(upload->sockfd, OP_UPLOAD, FLAG_MANIFEST, request_id, request,
+                8 + name_len) < 0){
+    error_occurred("ERROR writing to socket");
+  }
+
+  do {
+    take = len - sent;
+    if((features & FEATURE_STREAMS) && take > STREAM_CHUNK){
+      take = STREAM_CHUNK;
+    }
+
+    while(reply == NULL && (int64_t)take > window){
+      reply = recv_reply(upload->sockfd, &header);
+      if(header.opcode == OP_WINDOW && header.length == 4){
+        window += get_u32((unsigned char *)reply);
+        free(reply);
+        reply = NULL;
+      }
+    }
+
+    if(reply != NULL){
+      take = 0;
+    }
+
+    fin = reply != NULL || sent + take == len;
+    if(frame_send(upload->sockfd, OP_DATA, fin ? FLAG_FIN : 0, request_id, manifest + sent,
+                  take) < 0){
+      error_occurred("Error uploading file.\n");
+    }
+
+    sent += take;
+    window -= take;
+  } while(!fin);
+
+  // credit for the frames before the last may still arrive ahead of the reply
+  while(reply == NULL){
+    reply = recv_reply(upload->sockfd, &header);
+    if(header.opcode == OP_WINDOW){
+      free(reply);
+      reply = NULL;
+    }
+  }
+
+  if(header.request_id != request_id){
+    error_occurred("ERROR reply does not match request");
+  }
+
+  succeeded = header.opcode == OP_OK;
+  if(!succeeded){
+    printf("%s: %s\n", operation->filename, reply);
+  }
+
+  free(reply);
+  free(manifest);
+  free(request);
+  return succeeded;
+}
+
+/*
+ * With -u an upload of a file the server already has becomes a delta
+ * against its copy. The signatures are fetched in lockstep and the delta
+ * is written to a temporary file, which then goes out in place of the file
+ * by whatever path a plain upload takes. A file the server lacks, or one
+ * that changed too much for a delta to be smaller, is sent whole.
+ */
+void prepare_delta(int sockfd, struct Operation *operation){
+  char path[] = "/tmp/bitdrive-delta-XXXXXX";
+  struct FrameHeader header;
+  off_t len = -1;
+  char *reply;
+  int deltafd;
+
+  if(frame_send(sockfd, OP_SIGNATURES, 0, next_request_id++, operation->filename,
+                strlen(operation->filename)) < 0){
+    error_occurred("ERROR writing to socket");
+  }
+
+  reply = recv_reply(sockfd, &header);
+  if(header.opcode != OP_OK){
+    free(reply);
+    return;
+  }
+
+  deltafd = mkstemp(path);
+  if(deltafd >= 0){
+    unlink(path);
+    len = delta_encode(operation->filefd, (unsigned char *)reply, header.length, deltafd);
+  }
+
+  free(reply);
+  if(len < 0 || len >= operation->size){
+    if(deltafd >= 0){
+      close(deltafd);
+    }
+
+    return;
+  }
+
+  close(operation->filefd);
+  operation->filefd = deltafd;
+  operation->full_size = operation->size;
+  operation->size = len;
+  operation->delta = true;
 }
 
 void list(int sockfd, char *response){
@@ -0,0 +1,498 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "server.h"
+
+#define MARK_BUCKETS 4096
+
+/*
+ * The chunked store (-D). Every chunk lives once under CHUNK_DIR, named by
+ * the hex of its SHA-256 and sharded like the files of a sharded store;
+ * the name a client sees holds the file's manifest instead of its bytes.
+ * Chunks and manifests are written aside and renamed into place, so a
+ * reader only ever sees whole ones. Nothing is removed while the server
+ * runs: chunks nobody refers to any more are swept at the next start.
+ */
+static atomic_uint next_temp = 0;
+
+static void temp_path(char *path){
+  snprintf(path, PATH_MAX, CHUNK_PARTIAL_DIR "/%d.%u", (int)getpid(),
+           atomic_fetch_add(&next_temp, 1));
+}
+
+void chunk_path(char *path, const unsigned char *hash){
+  char hex[SHA256_SIZE * 2 + 1];
+
+  chunk_hex(hash, hex);
+  layout_path(path, CHUNK_DIR, LAYOUT_SHARDED, hex);
+}
+
+static bool prepare_chunk(const unsigned char *hash){
+  char hex[SHA256_SIZE * 2 + 1];
+
+  chunk_hex(hash, hex);
+  return layout_prepare(CHUNK_DIR, LAYOUT_SHARDED, hex);
+}
+
+bool dedup_has(const unsigned char *hash){
+  char path[PATH_MAX];
+  struct stat chunk_stats;
+
+  chunk_path(path, hash);
+  return stat(path, &chunk_stats) == 0 && S_ISREG(chunk_stats.st_mode);
+}
+
+int dedup_open_chunk(const unsigned char *hash){
+  char path[PATH_MAX];
+
+  chunk_path(path, hash);
+  return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/* Copies one chunk of filefd into the store, unless it is there already. */
+static bool store_chunk(int filefd, const struct Chunk *chunk){
+  char temp[PATH_MAX];
+  char path[PATH_MAX];
+  bool stored;
+  int chunkfd;
+
+  if(dedup_has(chunk->hash)){
+    return true;
+  }
+
+  temp_path(temp);
+  chunkfd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(chunkfd < 0){
+    return false;
+  }
+
+  stored = copy_range(filefd, chunk->offset, chunkfd, chunk->length);
+  stored = close(chunkfd) == 0 && stored;
+  chunk_path(path, chunk->hash);
+  if(!stored || !prepare_chunk(chunk->hash) || rename(temp, path) != 0){
+    unlink(temp);
+    return false;
+  }
+
+  return true;
+}
+
+/* Writes a manifest aside and renames it into place under filename. */
+static bool store_manifest(const struct ChunkList *list, const char *filename){
+  char temp[PATH_MAX];
+  char path[PATH_MAX];
+  unsigned char *manifest;
+  size_t len;
+  bool stored;
+  int filefd;
+
+  manifest = manifest_encode(list, &len);
+  if(manifest == NULL){
+    return false;
+  }
+
+  temp_path(temp);
+  filefd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  stored = filefd >= 0 && write_full(filefd, manifest, len) == 0;
+  stored = filefd >= 0 && close(filefd) == 0 && stored;
+  free(manifest);
+
+  build_path(path, filename);
+  if(!stored || !prepare_path(filename) || rename(temp, path) != 0){
+    unlink(temp);
+    return false;
+  }
+
+  return true;
+}
+
+/*
+ * Puts a finished upload into the store: its body is cut into chunks, the
+ * ones the store lacks are copied in, and the manifest takes the name.
+ * The partial file is removed either way.
+ */
+bool dedup_commit(const char *partial, const char *filename){
+  struct ChunkList list;
+  bool stored;
+  int filefd, i;
+
+  filefd = open(partial, O_RDONLY | O_CLOEXEC);
+  if(filefd < 0){
+    return false;
+  }
+
+  stored = chunk_file(filefd, &list);
+  for(i = 0; stored && i < list.count; i++){
+    stored = store_chunk(filefd, &list.chunks[i]);
+  }
+
+  close(filefd);
+  stored = stored && store_manifest(&list, filename);
+  chunk_list_free(&list);
+  unlink(partial);
+  return stored;
+}
+
+/*
+ * A chunk a client uploaded (FLAG_CHUNK): kept only if its bytes really
+ * hash to the name it was sent under, since every file using the chunk
+ * would otherwise be corrupted.
+ */
+bool dedup_put_chunk(const char *partial, const unsigned char *hash){
+  unsigned char *data = slab_get(&transfer_slab);  // CHUNK_MAX fits a transfer buffer
+  unsigned char digest[SHA256_SIZE];
+  char path[PATH_MAX];
+  struct stat chunk_stats;
+  bool valid = false;
+  int filefd;
+
+  filefd = open(partial, O_RDONLY | O_CLOEXEC);
+  if(data != NULL && filefd >= 0 && fstat(filefd, &chunk_stats) == 0 &&
+     chunk_stats.st_size > 0 && chunk_stats.st_size <= CHUNK_MAX &&
+     pread(filefd, data, chunk_stats.st_size, 0) == chunk_stats.st_size){
+    sha256(data, chunk_stats.st_size, digest);
+    valid = memcmp(digest, hash, SHA256_SIZE) == 0;
+  }
+
+  if(filefd >= 0){
+    close(filefd);
+  }
+
+  slab_put(&transfer_slab, data);
+  chunk_path(path, hash);
+  if(!valid || !prepare_chunk(hash) || rename(partial, path) != 0){
+    unlink(partial);
+    return false;
+  }
+
+  return true;
+}
+
+/* Reads and checks the manifest in an open file. */
+static bool read_manifest(int filefd, struct ChunkList *list){
+  struct stat file_stats;
+  unsigned char *data;
+  bool decoded;
+
+  if(fstat(filefd, &file_stats) < 0 || !S_ISREG(file_stats.st_mode) ||
+     file_stats.st_size < MANIFEST_HEADER){
+    return false;
+  }
+
+  data = malloc(file_stats.st_size);
+  if(data == NULL){
+    return false;
+  }
+
+  decoded = pread(filefd, data, file_stats.st_size, 0) == file_stats.st_size &&
+            manifest_decode(data, file_stats.st_size, list);
+  free(data);
+  return decoded;
+}
+
+/*
+ * A manifest a client uploaded (FLAG_MANIFEST) after sending the chunks
+ * the store lacked. It only takes the name once every chunk it lists is
+ * here with the right length. Returns the file size, or -1 with errno
+ * EINVAL for a malformed manifest and ENOENT for missing chunks.
+ */
+off_t dedup_commit_manifest(const char *partial, const char *filename){
+  char path[PATH_MAX];
+  struct stat chunk_stats;
+  struct ChunkList list;
+  bool valid;
+  off_t size;
+  int filefd, i;
+
+  filefd = open(partial, O_RDONLY | O_CLOEXEC);
+  valid = filefd >= 0 && read_manifest(filefd, &list);
+  if(filefd >= 0){
+    close(filefd);
+  }
+
+  if(!valid){
+    unlink(partial);
+    errno = EINVAL;
+    return -1;
+  }
+
+  for(i = 0; valid && i < list.count; i++){
+    chunk_path(path, list.chunks[i].hash);
+    valid = stat(path, &chunk_stats) == 0 && chunk_stats.st_size == list.chunks[i].length;
+  }
+
+  size = list.size;
+  chunk_list_free(&list);
+  build_path(path, filename);
+  if(!valid || !prepare_path(filename) || rename(partial, path) != 0){
+    unlink(partial);
+    errno = valid ? EIO : ENOENT;
+    return -1;
+  }
+
+  return size;
+}
+
+/* The chunks of a stored file, for serving it; NULL if it is not there. */
+struct ChunkList *dedup_open(const char *filename){
+  struct ChunkList *list = malloc(sizeof(struct ChunkList));
+  char path[PATH_MAX];
+  int filefd;
+
+  if(list == NULL){
+    error_occurred("ERROR allocating chunk list");
+  }
+
+  build_path(path, filename);
+  filefd = open(path, O_RDONLY | O_CLOEXEC);
+  if(filefd < 0 || !read_manifest(filefd, list)){
+    if(filefd >= 0){
+      close(filefd);
+    }
+
+    free(list);
+    return NULL;
+  }
+
+  close(filefd);
+  return list;
+}
+
+void dedup_close(struct ChunkList *list){
+  chunk_list_free(list);
+  free(list);
+}
+
+/*
+ * The whole of a stored file in one unnamed temporary file, for the text
+ * protocol, which can only send a single file. Returns -1 if it is not
+ * there or a chunk is missing.
+ */
+int dedup_assemble(const char *filename){
+  struct ChunkList *list = dedup_open(filename);
+  bool assembled = list != NULL;
+  int filefd = -1, chunkfd, i;
+
+  if(assembled){
+    filefd = open(CHUNK_PARTIAL_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    assembled = filefd >= 0;
+  }
+
+  for(i = 0; assembled && i < list->count; i++){
+    chunkfd = dedup_open_chunk(list->chunks[i].hash);
+    assembled = chunkfd >= 0 && copy_range(chunkfd, 0, filefd, list->chunks[i].length);
+    if(chunkfd >= 0){
+      close(chunkfd);
+    }
+  }
+
+  if(list != NULL){
+    dedup_close(list);
+  }
+
+  if(!assembled && filefd >= 0){
+    close(filefd);
+    filefd = -1;
+  }
+
+  return filefd;
+}
+
+/*
+ * fstatat for the index: a stored file's size is the one its manifest
+ * records. Fails for anything that is not a manifest.
+ */
+bool dedup_stat(int dirfd, const char *name, struct stat *file_stats){
+  unsigned char header[MANIFEST_HEADER];
+  bool valid;
+  int filefd;
+
+  if(fstatat(dirfd, name, file_stats, AT_SYMLINK_NOFOLLOW) < 0 ||
+     !S_ISREG(file_stats->st_mode)){
+    return false;
+  }
+
+  filefd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if(filefd < 0){
+    return false;
+  }
+
+  valid = pread(filefd, header, MANIFEST_HEADER, 0) == MANIFEST_HEADER &&
+          memcmp(header, MANIFEST_MAGIC, 4) == 0;
+  close(filefd);
+  if(valid){
+    file_stats->st_size = get_u64(header + 8);
+  }
+
+  return valid;
+}
+
+/*
+ * The hashes in use, as a set. Only lives for one sweep, so it only ever
+ * grows; the first bytes of a SHA-256 already spread evenly.
+ */
+struct Marks{
+  unsigned char (*hashes)[SHA256_SIZE];
+  size_t capacity;
+  size_t count;
+};
+
+static size_t mark_slot(struct Marks *marks, const unsigned char *hash){
+  size_t slot = get_u64(hash) % marks->capacity;
+  static const unsigned char empty[SHA256_SIZE];
+
+  while(memcmp(marks->hashes[slot], empty, SHA256_SIZE) != 0 &&
+        memcmp(marks->hashes[slot], hash, SHA256_SIZE) != 0){
+    slot = (slot + 1) % marks->capacity;
+  }
+
+  return slot;
+}
+
+static void add_mark(struct Marks *marks, const unsigned char *hash){
+  struct Marks grown;
+  size_t i, slot;
+  static const unsigned char empty[SHA256_SIZE];
+
+  if((marks->count + 1) * 2 > marks->capacity){
+    grown.capacity = marks->capacity * 2;
+    grown.count = 0;
+    grown.hashes = calloc(grown.capacity, SHA256_SIZE);
+    if(grown.hashes == NULL){
+      error_occurred("ERROR allocating chunk marks");
+    }
+
+    for(i = 0; i < marks->capacity; i++){
+      if(memcmp(marks->hashes[i], empty, SHA256_SIZE) != 0){
+        add_mark(&grown, marks->hashes[i]);
+      }
+    }
+
+    free(marks->hashes);
+    *marks = grown;
+  }
+
+  slot = mark_slot(marks, hash);
+  if(memcmp(marks->hashes[slot], hash, SHA256_SIZE) != 0){
+    memcpy(marks->hashes[slot], hash, SHA256_SIZE);
+    marks->count++;
+  }
+}
+
+/* Marks every chunk the manifests in directory use; depth as in the index scan. */
+static void mark_directory(struct Marks *marks, const char *directory, int depth){
+  char path[PATH_MAX];
+  struct ChunkList list;
+  struct dirent *ent;
+  DIR *dir = opendir(directory);
+  int filefd, i;
+
+  if(dir == NULL){
+    return;
+  }
+
+  while((ent = readdir(dir)) != NULL){
+    if(ent->d_name[0] == '.'){
+      continue;
+    }
+
+    snprintf(path, PATH_MAX, "%s/%s", directory, ent->d_name);
+    if(depth > 0 && ent->d_type == DT_DIR){
+      mark_directory(marks, path, depth - 1);
+      continue;
+    }
+
+    filefd = depth == 0 ? open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW) : -1;
+    if(filefd >= 0 && read_manifest(filefd, &list)){
+      for(i = 0; i < list.count; i++){
+        add_mark(marks, list.chunks[i].hash);
+      }
+
+      chunk_list_free(&list);
+    }
+
+    if(filefd >= 0){
+      close(filefd);
+    }
+  }
+
+  closedir(dir);
+}
+
+/* Removes the chunks under directory that are not marked; returns how many. */
+static long sweep_directory(struct Marks *marks, const char *directory, int depth){
+  unsigned char hash[SHA256_SIZE];
+  char path[PATH_MAX];
+  struct dirent *ent;
+  DIR *dir = opendir(directory);
+  long removed = 0;
+
+  if(dir == NULL){
+    return 0;
+  }
+
+  while((ent = readdir(dir)) != NULL){
+    if(ent->d_name[0] == '.'){
+      continue;
+    }
+
+    snprintf(path, PATH_MAX, "%s/%s", directory, ent->d_name);
+    if(depth > 0 && ent->d_type == DT_DIR){
+      removed += sweep_directory(marks, path, depth - 1);
+    }
+
+    else if(depth == 0 && chunk_unhex(ent->d_name, hash) &&
+            memcmp(marks->hashes[mark_slot(marks, hash)], hash, SHA256_SIZE) != 0 &&
+            unlink(path) == 0){
+      removed++;
+    }
+  }
+
+  closedir(dir);
+  return removed;
+}
+
+/*
+ * Starts the chunked store: leftovers of interrupted writes go, and so do
+ * the chunks no manifest refers to any more, which is what DELETE and
+ * overwriting uploads leave behind. Runs before any worker does, so no
+ * upload can be between sending a chunk and its manifest.
+ */
+void dedup_init(){
+  struct Marks marks;
+  struct dirent *ent;
+  char path[PATH_MAX];
+  long removed;
+  DIR *dir;
+
+  mkdir(CHUNK_PARTIAL_DIR, 0755);
+  dir = opendir(CHUNK_PARTIAL_DIR);
+  while(dir != NULL && (ent = readdir(dir)) != NULL){
+    if(ent->d_name[0] != '.'){
+      snprintf(path, PATH_MAX, CHUNK_PARTIAL_DIR "/%s", ent->d_name);
+      unlink(path);
+    }
+  }
+
+  if(dir != NULL){
+    closedir(dir);
+  }
+
+  marks.capacity = MARK_BUCKETS;
+  marks.count = 0;
+  marks.hashes = calloc(marks.capacity, SHA256_SIZE);
+  if(marks.hashes == NULL){
+    error_occurred("ERROR allocating chunk marks");
+  }
+
+  mark_directory(&marks, STORAGE_DIR, config.layout == LAYOUT_SHARDED ? 2 : 0);
+  removed = sweep_directory(&marks, CHUNK_DIR, 2);
+  printf("Chunk store: %zu chunks in use, %ld unused removed\n", marks.count, removed);
+  free(marks.hashes);
+}
@@ -0,0 +1,497 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "delta.h"
+#include "protocol.h"
+#include "transfer.h"
+
+/* The full-size blocks of the server's copy, by weak checksum. */
+struct Lookup{
+  const unsigned char *entries;
+  uint32_t block;
+  uint32_t count;
+  int32_t *heads;
+  int32_t *next;
+  uint32_t mask;
+};
+
+/* Records go out as they are made; a run of consecutive blocks is one COPY. */
+struct DeltaWriter{
+  int fd;
+  off_t len;
+  bool failed;
+  uint32_t first;
+  uint32_t count;
+};
+
+/*
+ * About sqrt(size) like rsync, as a power of two, never below
+ * DELTA_BLOCK_MIN and never so small that there are over DELTA_MAX_BLOCKS.
+ */
+uint32_t delta_block_size(off_t size){
+  uint32_t block = DELTA_BLOCK_MIN;
+
+  while(((off_t)block * block < size || size / block >= DELTA_MAX_BLOCKS) &&
+        block < (1u << 30)){
+    block *= 2;
+  }
+
+  return block;
+}
+
+/* The rsync checksum: a sums the bytes, b sums the running values of a. */
+static void checksum_parts(const unsigned char *data, size_t len, uint32_t *a, uint32_t *b){
+  size_t i;
+
+  *a = 0;
+  *b = 0;
+  for(i = 0; i < len; i++){
+    *a += data[i];
+    *b += *a;
+  }
+}
+
+uint32_t delta_checksum(const unsigned char *data, size_t len){
+  uint32_t a, b;
+
+  checksum_parts(data, len, &a, &b);
+  return (a & 0xFFFF) | (b << 16);
+}
+
+static bool read_block(int fd, unsigned char *buffer, size_t len, off_t offset){
+  ssize_t got;
+
+  while(len > 0){
+    got = pread(fd, buffer, len, offset);
+    if(got < 0 && errno == EINTR){
+      continue;
+    }
+
+    if(got <= 0){
+      return false;
+    }
+
+    buffer += got;
+    offset += got;
+    len -= got;
+  }
+
+  return true;
+}
+
+/* Signatures of the first size bytes of filefd, see delta.h. */
+unsigned char *delta_signatures(int filefd, off_t size, uint64_t version, size_t *len){
+  uint32_t block = delta_block_size(size);
+  size_t count = (size + block - 1) / block, i, take;
+  unsigned char digest[SHA256_SIZE];
+  unsigned char *signatures, *buffer, *entry;
+  off_t offset = 0;
+
+  *len = DELTA_SIGNATURE_HEADER + count * DELTA_SIGNATURE_ENTRY;
+  signatures = malloc(*len);
+  buffer = malloc(block);
+  if(signatures == NULL || buffer == NULL){
+    free(signatures);
+    free(buffer);
+    return NULL;
+  }
+
+  put_u32(signatures, block);
+  put_u64(signatures + 4, size);
+  put_u64(signatures + 12, version);
+  for(i = 0; i < count; i++){
+    take = size - offset < block ? size - offset : block;
+    if(!read_block(filefd, buffer, take, offset)){
+      free(signatures);
+      free(buffer);
+      return NULL;
+    }
+
+    entry = signatures + DELTA_SIGNATURE_HEADER + i * DELTA_SIGNATURE_ENTRY;
+    put_u32(entry, delta_checksum(buffer, take));
+    sha256(buffer, take, digest);
+    memcpy(entry + 4, digest, DELTA_STRONG);
+    offset += take;
+  }
+
+  free(buffer);
+  return signatures;
+}
+
+static uint32_t bucket(const struct Lookup *lookup, uint32_t weak){
+  return (weak ^ (weak >> 16) ^ (weak >> 7)) & lookup->mask;
+}
+
+static bool build_lookup(struct Lookup *lookup, const unsigned char *signatures, size_t len){
+  uint32_t buckets = 1, weak;
+  off_t size;
+  int32_t i;
+
+  if(len < DELTA_SIGNATURE_HEADER || (len - DELTA_SIGNATURE_HEADER) % DELTA_SIGNATURE_ENTRY != 0){
+    return false;
+  }
+
+  lookup->block = get_u32(signatures);
+  size = get_u64(signatures + 4);
+  if(lookup->block != delta_block_size(size) ||
+     (len - DELTA_SIGNATURE_HEADER) / DELTA_SIGNATURE_ENTRY !=
+     (size_t)((size + lookup->block - 1) / lookup->block)){
+    return false;
+  }
+
+  // a short last block is sent as it is
+  lookup->entries = signatures + DELTA_SIGNATURE_HEADER;
+  lookup->count = size / lookup->block;
+  while(buckets < lookup->count * 2){
+    buckets *= 2;
+  }
+
+  lookup->mask = buckets - 1;
+  lookup->heads = malloc(buckets * sizeof(int32_t));
+  lookup->next = malloc((lookup->count + 1) * sizeof(int32_t));
+  if(lookup->heads == NULL || lookup->next == NULL){
+    free(lookup->heads);
+    free(lookup->next);
+    return false;
+  }
+
+  memset(lookup->heads, 0xFF, buckets * sizeof(int32_t));
+  for(i = lookup->count - 1; i >= 0; i--){
+    weak = get_u32(lookup->entries + (size_t)i * DELTA_SIGNATURE_ENTRY);
+    lookup->next[i] = lookup->heads[bucket(lookup, weak)];
+    lookup->heads[bucket(lookup, weak)] = i;
+  }
+
+  return true;
+}
+
+static bool block_matches(const struct Lookup *lookup, int32_t index, uint32_t weak,
+                          const unsigned char *data, unsigned char *digest, bool *hashed){
+  const unsigned char *entry = lookup->entries + (size_t)index * DELTA_SIGNATURE_ENTRY;
+
+  if(get_u32(entry) != weak){
+    return false;
+  }
+
+  if(!*hashed){
+    sha256(data, lookup->block, digest);
+    *hashed = true;
+  }
+
+  return memcmp(entry + 4, digest, DELTA_STRONG) == 0;
+}
+
+/*
+ * The block the window at data is a copy of, or -1. The block after the
+ * last one copied is tried first, so an unchanged stretch stays one run.
+ */
+static int32_t find_block(const struct Lookup *lookup, uint32_t weak, const unsigned char *data,
+                          int32_t preferred){
+  unsigned char digest[SHA256_SIZE];
+  bool hashed = false;
+  int32_t i;
+
+  if(preferred >= 0 && (uint32_t)preferred < lookup->count &&
+     block_matches(lookup, preferred, weak, data, digest, &hashed)){
+    return preferred;
+  }
+
+  for(i = lookup->heads[bucket(lookup, weak)]; i >= 0; i = lookup->next[i]){
+    if(block_matches(lookup, i, weak, data, digest, &hashed)){
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static void flush_copy(struct DeltaWriter *writer){
+  unsigned char record[9];
+
+  if(writer->count == 0){
+    return;
+  }
+
+  record[0] = DELTA_COPY;
+  put_u32(record + 1, writer->first);
+  put_u32(record + 5, writer->count);
+  writer->failed = writer->failed || write_full(writer->fd, record, sizeof(record)) < 0;
+  writer->len += sizeof(record);
+  writer->count = 0;
+}
+
+static void emit_copy(struct DeltaWriter *writer, uint32_t index){
+  if(writer->count > 0 && index == writer->first + writer->count){
+    writer->count++;
+    return;
+  }
+
+  flush_copy(writer);
+  writer->first = index;
+  writer->count = 1;
+}
+
+static void emit_literal(struct DeltaWriter *writer, const unsigned char *data, size_t len){
+  unsigned char record[5];
+  size_t take;
+
+  if(len == 0){
+    return;
+  }
+
+  flush_copy(writer);
+  while(len > 0){
+    take = len < DELTA_LITERAL_MAX ? len : DELTA_LITERAL_MAX;
+    record[0] = DELTA_LITERAL;
+    put_u32(record + 1, take);
+    writer->failed = writer->failed || write_full(writer->fd, record, sizeof(record)) < 0 ||
+                     write_full(writer->fd, data, take) < 0;
+    writer->len += sizeof(record) + take;
+    data += take;
+    len -= take;
+  }
+}
+
+/*
+ * Writes the delta that turns the server's copy described by signatures
+ * into filefd to deltafd, which must be empty. Returns its length, or -1.
+ * The buffer keeps the pending literal behind the window, so its bytes are
+ * still at hand when a match ends it.
+ */
+off_t delta_encode(int filefd, const unsigned char *signatures, size_t len, int deltafd){
+  struct DeltaWriter writer = {deltafd, DELTA_HEADER, false, 0, 0};
+  unsigned char header[DELTA_HEADER];
+  struct Lookup lookup;
+  struct Sha256 whole;
+  unsigned char *buffer;
+  size_t capacity, lit = 0, pos = 0, end = 0;
+  uint32_t a = 0, b = 0, out, in;
+  bool eof = false, rolling = false;
+  off_t offset = 0;
+  int32_t match, preferred = -1;
+  ssize_t got;
+
+  if(!build_lookup(&lookup, signatures, len)){
+    return -1;
+  }
+
+  capacity = DELTA_LITERAL_MAX + 2 * (size_t)lookup.block;
+  buffer = malloc(capacity);
+  memset(header, 0, sizeof(header));
+  if(buffer == NULL || write_full(deltafd, header, sizeof(header)) < 0){
+    free(buffer);
+    free(lookup.heads);
+    free(lookup.next);
+    return -1;
+  }
+
+  sha256_init(&whole);
+  while(!writer.failed){
+    // keep a block and one byte ahead of the window, moving the literal down
+    if(!eof && end - pos <= lookup.block){
+      memmove(buffer, buffer + lit, end - lit);
+      pos -= lit;
+      end -= lit;
+      lit = 0;
+      while(!eof && end < capacity){
+        got = pread(filefd, buffer + end, capacity - end, offset);
+        if(got < 0 && errno == EINTR){
+          continue;
+        }
+
+        if(got < 0){
+          writer.failed = true;
+          break;
+        }
+
+        sha256_update(&whole, buffer + end, got);
+        eof = got == 0;
+        offset += got;
+        end += got;
+      }
+    }
+
+    if(writer.failed || end - pos < lookup.block){
+      break;
+    }
+
+    if(!rolling){
+      checksum_parts(buffer + pos, lookup.block, &a, &b);
+      rolling = true;
+    }
+
+    match = lookup.count > 0 ?
+            find_block(&lookup, (a & 0xFFFF) | (b << 16), buffer + pos, preferred) : -1;
+    if(match >= 0){
+      emit_literal(&writer, buffer + lit, pos - lit);
+      emit_copy(&writer, match);
+      preferred = match + 1;
+      pos += lookup.block;
+      lit = pos;
+      rolling = false;
+      continue;
+    }
+
+    if(pos - lit == DELTA_LITERAL_MAX){
+      emit_literal(&writer, buffer + lit, pos - lit);
+      lit = pos;
+    }
+
+    // slide the window a byte: drop out, take in
+    if(pos + lookup.block < end){
+      out = buffer[pos];
+      in = buffer[pos + lookup.block];
+      a += in - out;
+      b += a - lookup.block * out;
+    }
+
+    else {
+      rolling = false;
+    }
+
+    pos++;
+  }
+
+  emit_literal(&writer, buffer + lit, end - lit);
+  flush_copy(&writer);
+
+  memcpy(header, DELTA_MAGIC, 4);
+  put_u32(header + 4, lookup.block);
+  memcpy(header + 8, signatures + 4, 16);
+  put_u64(header + 24, offset);
+  sha256_final(&whole, header + 32);
+  if(pwrite(deltafd, header, sizeof(header), 0) != sizeof(header)){
+    writer.failed = true;
+  }
+
+  free(buffer);
+  free(lookup.heads);
+  free(lookup.next);
+  return writer.failed ? -1 : writer.len;
+}
+
+/* Checks the rebuilt file against the hash the client took of its copy. */
+static bool verify_file(int filefd, off_t size, const unsigned char *expected){
+  unsigned char digest[SHA256_SIZE];
+  unsigned char *buffer = malloc(TRANSFER_BUFFER_SIZE);
+  struct Sha256 sha;
+  off_t offset = 0;
+  size_t take;
+
+  if(buffer == NULL){
+    return false;
+  }
+
+  sha256_init(&sha);
+  while(offset < size){
+    take = size - offset < TRANSFER_BUFFER_SIZE ? size - offset : TRANSFER_BUFFER_SIZE;
+    if(!read_block(filefd, buffer, take, offset)){
+      free(buffer);
+      return false;
+    }
+
+    sha256_update(&sha, buffer, take);
+    offset += take;
+  }
+
+  free(buffer);
+  sha256_final(&sha, digest);
+  return memcmp(digest, expected, SHA256_SIZE) == 0;
+}
+
+/*
+ * Rebuilds a file from the len byte delta in deltafd and basefd, the copy
+ * its signatures were taken from, appending it to outfd (which must be
+ * readable too). Returns the size of the new file, or -1 with errno set to
+ * ESTALE when the delta was made against another version of the base,
+ * EINVAL when it does not add up and EIO when reading or writing fails.
+ */
+off_t delta_apply(int deltafd, off_t len, int basefd, off_t base_size, uint64_t base_version,
+                  int outfd){
+  uint32_t block = delta_block_size(base_size), first, count;
+  uint64_t blocks = (base_size + block - 1) / block;
+  unsigned char header[DELTA_HEADER];
+  unsigned char record[9];
+  off_t offset = DELTA_HEADER, size = 0, expected, bytes;
+  size_t take;
+
+  if(len < DELTA_HEADER || !read_block(deltafd, header, DELTA_HEADER, 0) ||
+     memcmp(header, DELTA_MAGIC, 4) != 0){
+    errno = EINVAL;
+    return -1;
+  }
+
+  if(get_u64(header + 8) != (uint64_t)base_size || get_u64(header + 16) != base_version){
+    errno = ESTALE;
+    return -1;
+  }
+
+  expected = get_u64(header + 24);
+  if(get_u32(header + 4) != block){
+    errno = EINVAL;
+    return -1;
+  }
+
+  while(offset < len){
+    take = len - offset < (off_t)sizeof(record) ? len - offset : sizeof(record);
+    if(!read_block(deltafd, record, take, offset)){
+      errno = EIO;
+      return -1;
+    }
+
+    if(record[0] == DELTA_LITERAL && take >= 5){
+      bytes = get_u32(record + 1);
+      if(bytes == 0 || bytes > DELTA_LITERAL_MAX || offset + 5 + bytes > len){
+        errno = EINVAL;
+        return -1;
+      }
+
+      if(!copy_range(deltafd, offset + 5, outfd, bytes)){
+        errno = EIO;
+        return -1;
+      }
+
+      offset += 5 + bytes;
+    }
+
+    else if(record[0] == DELTA_COPY && take >= 9){
+      first = get_u32(record + 1);
+      count = get_u32(record + 5);
+      if(count == 0 || first >= blocks || count > blocks - first){
+        errno = EINVAL;
+        return -1;
+      }
+
+      bytes = (off_t)(first + count) * block < base_size ? (off_t)(first + count) * block :
+              base_size;
+      bytes -= (off_t)first * block;
+      if(!copy_range(basefd, (off_t)first * block, outfd, bytes)){
+        errno = EIO;
+        return -1;
+      }
+
+      offset += 9;
+    }
+
+    else {
+      errno = EINVAL;
+      return -1;
+    }
+
+    size += bytes;
+    if(size > expected){
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  if(size != expected || !verify_file(outfd, size, header + 32)){
+    errno = EINVAL;
+    return -1;
+  }
+
+  return size;
+}
@@ -0,0 +1,48 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "sha256.h"
+
+/*
+ * rsync-style delta transfer. The server cuts its copy of a file into
+ * blocks and sends a signature for each: a weak checksum that can be
+ * rolled along a byte at a time, and the first DELTA_STRONG bytes of the
+ * block's SHA-256. The client rolls the weak checksum over its own file;
+ * where it matches a block and the strong hash agrees, it refers to that
+ * block instead of sending the bytes.
+ *
+ * Signatures: DELTA_SIGNATURE_HEADER of u32 block size, u64 size and u64
+ * version (mtime in ns) of the server's copy, then DELTA_SIGNATURE_ENTRY
+ * per block: u32 weak checksum and the strong hash. The last block may be
+ * short.
+ *
+ * Delta: DELTA_HEADER of the magic, u32 block size, the u64 size and
+ * version from the signatures, u64 size and SHA-256 of the new file, then
+ * records: DELTA_LITERAL with u32 length and that many bytes (at most
+ * DELTA_LITERAL_MAX), or DELTA_COPY with u32 first block and u32 count.
+ * Integers are big endian like the protocol.
+ */
+#define DELTA_MAGIC "BDX1"
+#define DELTA_STRONG 16
+#define DELTA_SIGNATURE_HEADER 20
+#define DELTA_SIGNATURE_ENTRY (4 + DELTA_STRONG)
+#define DELTA_HEADER 64
+#define DELTA_LITERAL 'L'
+#define DELTA_COPY 'C'
+#define DELTA_LITERAL_MAX (256 * 1024)
+
+// blocks grow from DELTA_BLOCK_MIN with the file, up to DELTA_MAX_BLOCKS of them
+#define DELTA_BLOCK_MIN 2048
+#define DELTA_MAX_BLOCKS 65536
+
+uint32_t delta_block_size(off_t size);
+uint32_t delta_checksum(const unsigned char *data, size_t len);
+unsigned char *delta_signatures(int filefd, off_t size, uint64_t version, size_t *len);
+off_t delta_encode(int filefd, const unsigned char *signatures, size_t len, int deltafd);
+off_t delta_apply(int deltafd, off_t len, int basefd, off_t base_size, uint64_t base_version,
+                  int outfd);
+
+#endif
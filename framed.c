@@ -0,0 +1,1817 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "server.h"
+#include "delta.h"
+
+void process_frame(struct Session *session, const unsigned char *payload);
+void handle_hello(struct Session *session, const unsigned char *payload);
+void handle_list(struct Session *session, const unsigned char *payload);
+void handle_list_query(struct Session *session, const unsigned char *payload);
+bool schedule_page(struct Session *session, struct Stream *stream);
+void handle_upload(struct Session *session, const unsigned char *payload);
+void handle_download(struct Session *session, const unsigned char *payload);
+void find_download(struct DiskJob *job);
+void download_found(struct Session *session, struct DiskJob *job);
+void handle_delete(struct Session *session, const unsigned char *payload);
+void delete_done(struct Session *session, struct DiskJob *job);
+void handle_quit(struct Session *session);
+void handle_stats(struct Session *session);
+void handle_have(struct Session *session, const unsigned char *payload);
+void handle_data(struct Session *session);
+void handle_packed_data(struct Session *session, const unsigned char *payload);
+void end_data(struct Session *session, struct Stream *stream);
+void save_stream(struct DiskJob *job);
+void stream_saved(struct Session *session, struct DiskJob *job);
+bool schedule_packed(struct Session *session, struct Stream *stream, off_t len);
+bool schedule_stored(struct Session *session, struct Stream *stream, off_t len);
+void end_download(struct Session *session, struct Stream *stream);
+void report_compression(struct Session *session, struct Stream *stream);
+long long elapsed_ns(const struct timespec *start);
+void handle_window(struct Session *session, const unsigned char *payload);
+int open_partial(const char *partial, off_t size, bool resume, off_t *offset);
+void build_upload_partial(char *partial, const char *filename, uint8_t flags);
+void open_upload_framed(struct DiskJob *job);
+void upload_opened_framed(struct Session *session, struct DiskJob *job);
+int reject_upload(struct Session *session, const char *error, bool waits_for_ready);
+void handle_upload_range(struct Session *session, const unsigned char *payload);
+void join_stripe(struct DiskJob *job);
+void stripe_joined(struct Session *session, struct DiskJob *job);
+void finish_range(struct Session *session, struct Stream *stream);
+void complete_range(struct DiskJob *job);
+void range_completed(struct Session *session, struct DiskJob *job);
+void handle_upload_chunk(struct Session *session, const unsigned char *payload);
+void open_chunk(struct DiskJob *job);
+void chunk_opened(struct Session *session, struct DiskJob *job);
+void finish_chunk_upload(struct DiskJob *job);
+void finish_manifest(struct DiskJob *job);
+void handle_signatures(struct Session *session, const unsigned char *payload);
+void read_signatures(struct DiskJob *job);
+void signatures_read(struct Session *session, struct DiskJob *job);
+void finish_delta(struct DiskJob *job);
+int open_base(const char *filename, off_t *size, uint64_t *version);
+bool open_download(const char *filename, struct Stream *stream, off_t *size);
+off_t seek_chunk(struct Stream *stream);
+struct Stream *open_stream(struct Session *session, uint8_t opcode, int filefd);
+struct Stream *find_stream(struct Session *session, uint32_t id);
+bool admit_stream(struct Session *session);
+void move_to_back(struct Session *session, struct Stream *stream);
+void close_stream(struct Session *session, struct Stream *stream);
+void queue_error(struct Session *session, uint32_t request_id, const char *message);
+bool payload_filename(const unsigned char *payload, size_t len, char *filename);
+
+// what a client's frames are called in the trace
+static const char *frame_names[] = {
+  [OP_HELLO] = "HELLO",
+  [OP_LIST] = "LIST",
+  [OP_UPLOAD] = "UPLOAD",
+  [OP_DOWNLOAD] = "DOWNLOAD",
+  [OP_DELETE] = "DELETE",
+  [OP_QUIT] = "QUIT",
+  [OP_HAVE] = "HAVE",
+  [OP_SIGNATURES] = "SIGNATURES",
+  [OP_STATS] = "STATS",
+  [OP_DATA] = "DATA",
+  [OP_WINDOW] = "WINDOW"
+};
+
+void queue_header(struct Session *session, uint8_t opcode, uint8_t flags,
+                  uint32_t request_id, uint64_t length){
+  unsigned char header[FRAME_HEADER_SIZE];
+
+  frame_encode(header, opcode, flags, request_id, length);
+  write_bytes(session, (char *)header, FRAME_HEADER_SIZE);
+}
+
+void queue_frame(struct Session *session, uint8_t opcode, uint8_t flags,
+                 uint32_t request_id, const void *payload, size_t len){
+  queue_header(session, opcode, flags, request_id, len);
+  if(len > 0){
+    write_bytes(session, payload, len);
+  }
+}
+
+void queue_error(struct Session *session, uint32_t request_id, const char *message){
+  log_warn("Client %d: %s", session->watcher.fd, message);
+  queue_frame(session, OP_ERROR, 0, request_id, message, strlen(message));
+}
+
+struct Stream *open_stream(struct Session *session, uint8_t opcode, int filefd){
+  struct Stream *stream = slab_zget(&stream_slab);
+  if(stream == NULL){
+    error_occurred("ERROR allocating stream");
+  }
+
+  stream->id = session->frame.request_id;
+  stream->opcode = opcode;
+  stream->filefd = filefd;
+  stream->window = STREAM_WINDOW;
+  stream->chunk = -1;
+  stream->timing = session->timing;
+  if(opcode != OP_LIST){
+    atomic_fetch_add_explicit(&session->worker->transfers, 1, memory_order_relaxed);
+  }
+
+  session->stream_count++;
+  move_to_back(session, stream);
+  return stream;
+}
+
+struct Stream *find_stream(struct Session *session, uint32_t id){
+  struct Stream *stream;
+
+  for(stream = session->streams; stream != NULL; stream = stream->next){
+    if(stream->id == id){
+      return stream;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * A client that opens more transfers than the protocol allows, or reuses
+ * a live request_id, has lost track of its own streams; there is nothing
+ * sensible to answer, so the session is closed.
+ */
+bool admit_stream(struct Session *session){
+  int limit = session->features & FEATURE_STREAMS ? MAX_STREAMS : 1;
+
+  if(session->stream_count >= limit ||
+     find_stream(session, session->frame.request_id) != NULL){
+    log_warn("Client %d: too many transfers, closing.", session->watcher.fd);
+    session->state = STATE_CLOSING;
+    return false;
+  }
+
+  return true;
+}
+
+/* Unlinks stream if it is listed and appends it, so downloads take turns. */
+void move_to_back(struct Session *session, struct Stream *stream){
+  struct Stream **link = &session->streams;
+
+  while(*link != NULL){
+    if(*link == stream){
+      *link = stream->next;
+      continue;
+    }
+
+    link = &(*link)->next;
+  }
+
+  stream->next = NULL;
+  *link = stream;
+}
+
+void close_stream(struct Session *session, struct Stream *stream){
+  struct Stream **link = &session->streams;
+
+  while(*link != stream){
+    link = &(*link)->next;
+  }
+
+  *link = stream->next;
+  session->stream_count--;
+  if(stream->opcode != OP_LIST){
+    atomic_fetch_sub_explicit(&session->worker->transfers, 1, memory_order_relaxed);
+  }
+  if(stream->filefd >= 0){
+    close(stream->filefd);
+  }
+
+  if(stream->stripe != NULL){
+    stripe_release(stream->stripe);
+  }
+
+  if(stream->chunks != NULL){
+    dedup_close(stream->chunks);
+  }
+
+  if(stream->cached != NULL){
+    cache_release(stream->cached);
+  }
+
+  slab_put(&query_slab, stream->query);
+  slab_put(&stream_slab, stream);
+}
+
+void free_streams(struct Session *session){
+  while(session->streams != NULL){
+    close_stream(session, session->streams);
+  }
+
+  if(session->stripe != NULL){
+    stripe_release(session->stripe);
+    session->stripe = NULL;
+  }
+
+  session->receiving = NULL;
+  session->sending = NULL;
+}
+
+bool payload_filename(const unsigned char *payload, size_t len, char *filename){
+  if(len == 0 || len > NAME_MAX){
+    return false;
+  }
+
+  memcpy(filename, payload, len);
+  filename[len] = '\0';
+
+  // an embedded NUL would make the name we check differ from the one sent
+  return strlen(filename) == len && valid_filename(filename);
+}
+
+/*
+ * Framed counterpart of the legacy loop in process_input. Control frames
+ * are handled once their whole payload is buffered; DATA payloads are
+ * streamed into the open upload by recv_file without being buffered,
+ * unless they are compressed.
+ * Anything that breaks framing closes the session, since there is no way
+ * to find the next frame boundary again.
+ */
+void process_frames(struct Session *session){
+  struct FrameHeader *frame = &session->frame;
+  uint64_t start;
+
+  // replies to pipelined requests queue up until the high water mark
+  while(session->inlen > 0 && session->outlen < OUTBUF_HIGH_WATER && session->job == NULL){
+    if(session->state == STATE_CLOSING || session->state == STATE_DOWNLOAD_BODY){
+      return;
+    }
+
+    if(session->state == STATE_UPLOAD_BODY){
+      recv_file(session);
+      continue;
+    }
+
+    if(session->inlen < FRAME_HEADER_SIZE){
+      return;
+    }
+
+    if(!frame_decode((unsigned char *)session->inbuf, frame)){
+      log_warn("Client %d: bad frame, closing.", session->watcher.fd);
+      session->state = STATE_CLOSING;
+      return;
+    }
+
+    // frames of another version may be laid out differently; none of them is read
+    if(frame->version != FRAME_VERSION){
+      queue_error(session, frame->request_id, "Unsupported protocol version.");
+      session->state = STATE_CLOSING;
+      return;
+    }
+
+    // a compressed block is small enough to be buffered whole
+    if(frame->opcode == OP_DATA && !(frame->flags & FLAG_COMPRESSED)){
+      consume_input(session, FRAME_HEADER_SIZE);
+      handle_data(session);
+      continue;
+    }
+
+    if(frame->length > FRAME_MAX_CONTROL){
+      log_warn("Client %d: oversized frame, closing.", session->watcher.fd);
+      session->state = STATE_CLOSING;
+      return;
+    }
+
+    if(session->inlen < FRAME_HEADER_SIZE + frame->length){
+      return;
+    }
+
+    start = tracing ? trace_now() : 0;
+    process_frame(session, (unsigned char *)session->inbuf + FRAME_HEADER_SIZE);
+    if(tracing){
+      trace_span(frame->opcode < sizeof(frame_names) / sizeof(frame_names[0]) &&
+                 frame_names[frame->opcode] != NULL ? frame_names[frame->opcode] : "frame",
+                 "request", session->watcher.fd, start, frame->length, NULL);
+    }
+
+    consume_input(session, FRAME_HEADER_SIZE + frame->length);
+  }
+}
+
+void process_frame(struct Session *session, const unsigned char *payload){
+  session->timing.start = metrics_now();
+  session->timing.disk_ns = 0;
+  session->timing.client = session->watcher.fd;
+
+  switch(session->frame.opcode){
+    case OP_HELLO:
+      handle_hello(session, payload);
+      break;
+    case OP_LIST:
+      handle_list(session, payload);
+      break;
+    case OP_UPLOAD:
+      handle_upload(session, payload);
+      break;
+    case OP_DOWNLOAD:
+      handle_download(session, payload);
+      break;
+    case OP_DELETE:
+      handle_delete(session, payload);
+      break;
+    case OP_QUIT:
+      handle_quit(session);
+      break;
+    case OP_HAVE:
+      handle_have(session, payload);
+      break;
+    case OP_SIGNATURES:
+      handle_signatures(session, payload);
+      break;
+    case OP_STATS:
+      handle_stats(session);
+      break;
+    case OP_WINDOW:
+      handle_window(session, payload);
+      break;
+    case OP_DATA:
+      handle_packed_data(session, payload);
+      break;
+    default:
+      queue_error(session, session->frame.request_id, "Invalid input. Please try again.");
+      break;
+  }
+}
+
+void handle_hello(struct Session *session, const unsigned char *payload){
+  unsigned char response[4];
+  uint32_t features = 0;
+
+  if(session->frame.length >= 4){
+    features = get_u32(payload) & PROTOCOL_FEATURES;
+  }
+
+  if(!(features & FEATURE_PIPELINE)){
+    features &= ~(FEATURE_STREAMS | FEATURE_DEDUP);
+  }
+
+  if(!config.dedup){
+    features &= ~FEATURE_DEDUP;
+  }
+
+  // an optional u8 compression level follows the feature bits
+  session->level = COMPRESS_LEVEL_DEFAULT;
+  if(session->frame.length >= 5 && payload[4] >= LZ_LEVEL_MIN){
+    session->level = payload[4] < LZ_LEVEL_MAX ? payload[4] : LZ_LEVEL_MAX;
+  }
+
+  session->features = features;
+  log_info("Client %d: HELLO (version %d)", session->watcher.fd, session->frame.version);
+  put_u32(response, features);
+  queue_frame(session, OP_HELLO, 0, session->frame.request_id, response, sizeof(response));
+}
+
+void handle_list(struct Session *session, const unsigned char *payload){
+  struct ArenaMark mark = arena_mark(&session->arena);
+  char *list_string;
+  int file_counter;
+
+  if((session->features & FEATURE_LISTING) && session->frame.length > 0){
+    handle_list_query(session, payload);
+    return;
+  }
+
+  log_info("Client %d: LIST", session->watcher.fd);
+  list_string = index_list(&session->arena, &file_counter);
+
+  log_info("Files found: %d", file_counter);
+  queue_frame(session, OP_OK, 0, session->frame.request_id, list_string, strlen(list_string));
+  arena_release(&session->arena, mark);
+  metrics_record(session->worker, CMD_LIST, &session->timing, true);
+}
+
+/*
+ * A LIST query (see FEATURE_LISTING). Nothing is counted up front; the
+ * entries go out a page at a time from schedule_chunk, so a huge listing
+ * never sits in memory on either side and a limited one costs no more than
+ * its pages.
+ */
+void handle_list_query(struct Session *session, const unsigned char *payload){
+  uint32_t request_id = session->frame.request_id;
+  size_t len = session->frame.length;
+  struct ListQuery *query;
+  struct Stream *stream;
+  size_t pattern_len;
+  uint32_t limit;
+
+  if(!admit_stream(session)){
+    return;
+  }
+
+  pattern_len = len >= LIST_QUERY_SIZE ? get_u32(payload) & 0xFFFF : 0;
+  if(len < LIST_QUERY_SIZE || (payload[0] & ~LIST_DESCENDING) > LIST_BY_MTIME ||
+     pattern_len > NAME_MAX || len - LIST_QUERY_SIZE - pattern_len > NAME_MAX ||
+     pattern_len > len - LIST_QUERY_SIZE){
+    queue_error(session, request_id, "Invalid query.");
+    metrics_record(session->worker, CMD_LIST, &session->timing, false);
+    return;
+  }
+
+  query = slab_zget(&query_slab);
+  if(query == NULL){
+    error_occurred("ERROR allocating query");
+  }
+
+  query->order = payload[0];
+  limit = get_u32(payload + 4);
+  query->after_key = get_u64(payload + 8);
+  memcpy(query->pattern, payload + LIST_QUERY_SIZE, pattern_len);
+  memcpy(query->after_name, payload + LIST_QUERY_SIZE + pattern_len,
+         len - LIST_QUERY_SIZE - pattern_len);
+
+  log_info("Client %d: LIST %s", session->watcher.fd, query->pattern);
+  queue_frame(session, OP_OK, 0, request_id, NULL, 0);
+
+  // offset counts the entries sent, size how many may be
+  stream = open_stream(session, OP_LIST, -1);
+  stream->query = query;
+  stream->size = limit > 0 ? limit : INT64_MAX;
+  if(!(session->features & FEATURE_STREAMS)){
+    stream->window = INT64_MAX;
+    session->state = STATE_DOWNLOAD_BODY;
+  }
+
+  // the first page goes out in the same write as the OK
+  schedule_page(session, stream);
+}
+
+/*
+ * UPLOAD payload: u64 size, then the file name. The body is written under
+ * PARTIAL_DIR; with FLAG_RESUME whatever an earlier attempt left there is
+ * kept and READY tells the client where to carry on. The partial file is
+ * opened on the disk pool.
+ */
+void handle_upload(struct Session *session, const unsigned char *payload){
+  bool manifest = (session->features & FEATURE_DEDUP) && (session->frame.flags & FLAG_MANIFEST);
+  bool delta = (session->features & FEATURE_DELTA) && (session->frame.flags & FLAG_DELTA);
+  bool resume = (session->features & FEATURE_RESUME) && (session->frame.flags & FLAG_RESUME) &&
+                !manifest && !delta;
+  struct DiskJob *job;
+
+  if(!admit_stream(session)){
+    return;
+  }
+
+  if((session->features & FEATURE_STRIPE) && (session->frame.flags & FLAG_RANGE)){
+    handle_upload_range(session, payload);
+    return;
+  }
+
+  if((session->features & FEATURE_DEDUP) && (session->frame.flags & FLAG_CHUNK)){
+    handle_upload_chunk(session, payload);
+    return;
+  }
+
+  job = new_job(session);
+  job->request_id = session->frame.request_id;
+  job->flags = (manifest ? FLAG_MANIFEST : delta ? FLAG_DELTA : 0) | (resume ? FLAG_RESUME : 0);
+  if(session->frame.length < 8 ||
+     !payload_filename(payload + 8, session->frame.length - 8, job->filename)){
+    job->error = "Invalid file name.";
+    upload_opened_framed(session, job);
+    free_job(job);
+    return;
+  }
+
+  job->size = get_u64(payload);
+  log_info("Client %d: UPLOAD %s%s", session->watcher.fd, job->filename,
+           manifest ? " (chunked)" : delta ? " (delta)" : "");
+  start_job(session, job, "open upload", open_upload_framed, upload_opened_framed);
+}
+
+/*
+ * Where an upload is written. A delta goes to DELTA_PARTIAL_DIR, where no
+ * plain upload can reach it, so it never passes for the start of a
+ * resumed one.
+ */
+void build_upload_partial(char *partial, const char *filename, uint8_t flags){
+  if(flags & FLAG_DELTA){
+    snprintf(partial, PATH_MAX, DELTA_PARTIAL_DIR "/%s", filename);
+  }
+
+  else {
+    build_partial_path(partial, filename);
+  }
+}
+
+/* On the disk pool: opens and locks the partial file; see open_partial. */
+void open_upload_framed(struct DiskJob *job){
+  char partial[PATH_MAX];
+
+  build_upload_partial(partial, job->filename, job->flags);
+  job->filefd = open_partial(partial, job->size, (job->flags & FLAG_RESUME) != 0, &job->offset);
+  if(job->filefd < 0){
+    job->error = errno == EWOULDBLOCK ? "File is being uploaded." : "Error opening file.";
+  }
+}
+
+/* The partial file is open, or the upload refused; the stream takes over the file. */
+void upload_opened_framed(struct Session *session, struct DiskJob *job){
+  bool resume = (job->flags & FLAG_RESUME) != 0;
+  unsigned char response[8];
+  struct Stream *stream;
+  int filefd = job->filefd;
+
+  if(job->error != NULL){
+    // the refusal is recorded with the time it waited for the disk
+    session->timing = job->timing;
+    filefd = reject_upload(session, job->error, resume);
+    if(filefd < 0){
+      return;
+    }
+  }
+
+  job->filefd = -1;
+  stream = open_stream(session, OP_UPLOAD, filefd);
+  stream->id = job->request_id;
+  stream->timing = job->timing;
+  stream->offset = job->offset;
+  stream->size = job->size;
+  stream->discard = job->error != NULL;
+  stream->flags = job->flags & (FLAG_MANIFEST | FLAG_DELTA);
+  if(!stream->discard){
+    build_path(stream->path, job->filename);
+    build_upload_partial(stream->partial, job->filename, job->flags);
+  }
+
+  if(resume || !(session->features & FEATURE_PIPELINE)){
+    if(resume && job->offset > 0){
+      log_info("Client %d: resuming at %lld bytes", session->watcher.fd, (long long)job->offset);
+    }
+
+    put_u64(response, job->offset);
+    queue_frame(session, OP_READY, 0, job->request_id, response, sizeof(response));
+  }
+}
+
+/*
+ * Answers an UPLOAD that cannot be stored. Unless the client waits for
+ * READY (lockstep, or a resume), its DATA frames are already on their way
+ * and are sunk into /dev/null; that descriptor is returned, or -1 if
+ * there is nothing to sink.
+ */
+int reject_upload(struct Session *session, const char *error, bool waits_for_ready){
+  int filefd;
+
+  queue_error(session, session->frame.request_id, error);
+  metrics_record(session->worker, CMD_UPLOAD, &session->timing, false);
+  if(waits_for_ready || !(session->features & FEATURE_PIPELINE)){
+    return -1;
+  }
+
+  filefd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  if(filefd < 0){
+    session->state = STATE_CLOSING;
+  }
+
+  return filefd;
+}
+
+/*
+ * UPLOAD with FLAG_RANGE: one range of a striped upload. The session keeps
+ * a reference to the last stripe it sent to, so the upload outlives the
+ * gaps between one range and the next on the same connection. The first
+ * range of a file creates its partial file, so joining the stripe is done
+ * on the disk pool.
+ */
+void handle_upload_range(struct Session *session, const unsigned char *payload){
+  struct DiskJob *job = new_job(session);
+
+  job->request_id = session->frame.request_id;
+  if(session->frame.length < 32 ||
+     !payload_filename(payload + 32, session->frame.length - 32, job->filename)){
+    job->error = "Invalid file name.";
+  }
+
+  else {
+    job->size = get_u64(payload);
+    job->token = get_u64(payload + 8);
+    job->offset = get_u64(payload + 16);
+    job->length = get_u64(payload + 24);
+    if(job->size < 0 || job->offset < 0 || job->length < 0 || job->offset > job->size ||
+       job->length > job->size - job->offset){
+      job->error = "Invalid range.";
+    }
+  }
+
+  if(job->error != NULL){
+    stripe_joined(session, job);
+    free_job(job);
+    return;
+  }
+
+  start_job(session, job, "open range", join_stripe, stripe_joined);
+}
+
+/* On the disk pool: joins the stripe, with a descriptor of its own for the range. */
+void join_stripe(struct DiskJob *job){
+  job->stripe = stripe_acquire(job->filename, job->token, job->size);
+  if(job->stripe == NULL){
+    job->error = errno == EWOULDBLOCK ? "File is being uploaded." : "Error opening file.";
+  }
+
+  else if((job->filefd = dup(job->stripe->filefd)) < 0){
+    stripe_release(job->stripe);
+    job->stripe = NULL;
+    job->error = "Error opening file.";
+  }
+}
+
+void stripe_joined(struct Session *session, struct DiskJob *job){
+  struct Stripe *stripe = job->stripe;
+  struct Stream *stream;
+  int filefd = job->filefd;
+
+  if(job->error != NULL){
+    session->timing = job->timing;
+    filefd = reject_upload(session, job->error, false);
+    if(filefd < 0){
+      return;
+    }
+  }
+
+  else if(session->stripe != stripe){
+    if(session->stripe != NULL){
+      stripe_release(session->stripe);
+    }
+
+    log_info("Client %d: UPLOAD %s (striped)", session->watcher.fd, job->filename);
+    stripe_retain(stripe);
+    session->stripe = stripe;
+  }
+
+  // the stream's reference is the job's
+  job->filefd = -1;
+  job->stripe = NULL;
+  stream = open_stream(session, OP_UPLOAD, filefd);
+  stream->id = job->request_id;
+  stream->timing = job->timing;
+  stream->start = job->offset;
+  stream->offset = job->offset;
+  stream->size = job->offset + job->length;
+  stream->stripe = stripe;
+  stream->discard = job->error != NULL;
+
+  if(!(session->features & FEATURE_PIPELINE)){
+    queue_frame(session, OP_READY, 0, job->request_id, NULL, 0);
+  }
+}
+
+/*
+ * The last DATA frame of a striped range is in. Recording it may commit
+ * the whole file (see stripe_complete), so that is done on the disk pool.
+ */
+void finish_range(struct Session *session, struct Stream *stream){
+  struct DiskJob *job;
+
+  if(stream->offset != stream->size){
+    queue_error(session, stream->id, "Upload incomplete.");
+    metrics_record(session->worker, CMD_UPLOAD, &stream->timing, false);
+    close_stream(session, stream);
+    return;
+  }
+
+  job = new_job(session);
+  job->stream = stream;
+  job->timing = stream->timing;
+  strcpy(job->filename, stream->stripe->name);
+  start_job(session, job, "commit range", complete_range, range_completed);
+}
+
+void complete_range(struct DiskJob *job){
+  struct Stream *stream = job->stream;
+
+  job->size = stripe_complete(stream->stripe, stream->start, stream->size);
+  if(job->size < 0){
+    job->error = "Error saving file.";
+  }
+}
+
+void range_completed(struct Session *session, struct DiskJob *job){
+  struct Stream *stream = job->stream;
+  unsigned char response[8];
+
+  if(job->error != NULL){
+    queue_error(session, stream->id, job->error);
+  }
+
+  else {
+    if(job->size == stream->stripe->size){
+      log_info("File received!");
+    }
+
+    put_u64(response, job->size);
+    queue_frame(session, OP_OK, 0, stream->id, response, sizeof(response));
+  }
+
+  metrics_record(session->worker, CMD_UPLOAD, &job->timing, job->error == NULL);
+  close_stream(session, stream);
+}
+
+/*
+ * UPLOAD with FLAG_CHUNK: u64 length, then the chunk's hash. Every upload
+ * gets its own partial file, since two clients may well send the same
+ * chunk at once; whichever is renamed into place last wins, and they are
+ * the same bytes. The file is created on the disk pool.
+ */
+void handle_upload_chunk(struct Session *session, const unsigned char *payload){
+  struct DiskJob *job = new_job(session);
+  char hex[SHA256_SIZE * 2 + 1];
+
+  job->request_id = session->frame.request_id;
+  if(session->frame.length != 8 + SHA256_SIZE || (job->size = get_u64(payload)) <= 0 ||
+     job->size > CHUNK_MAX){
+    job->error = "Invalid chunk.";
+    chunk_opened(session, job);
+    free_job(job);
+    return;
+  }
+
+  // the partial file's name, in CHUNK_PARTIAL_DIR
+  chunk_hex(payload + 8, hex);
+  snprintf(job->filename, sizeof(job->filename), "%s.%d.%u", hex, session->watcher.fd,
+           job->request_id);
+  memcpy(job->opened.hash, payload + 8, SHA256_SIZE);
+  start_job(session, job, "open chunk", open_chunk, chunk_opened);
+}
+
+void open_chunk(struct DiskJob *job){
+  char partial[PATH_MAX];
+
+  snprintf(partial, PATH_MAX, CHUNK_PARTIAL_DIR "/%s", job->filename);
+  job->filefd = open(partial, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(job->filefd < 0){
+    job->error = "Error opening file.";
+  }
+}
+
+void chunk_opened(struct Session *session, struct DiskJob *job){
+  struct Stream *stream;
+  int filefd = job->filefd;
+
+  if(job->error != NULL){
+    session->timing = job->timing;
+    filefd = reject_upload(session, job->error, false);
+    if(filefd < 0){
+      return;
+    }
+  }
+
+  job->filefd = -1;
+  stream = open_stream(session, OP_UPLOAD, filefd);
+  stream->id = job->request_id;
+  stream->timing = job->timing;
+  stream->size = job->size;
+  stream->discard = job->error != NULL;
+  stream->flags = FLAG_CHUNK;
+  if(!stream->discard){
+    memcpy(stream->hash, job->opened.hash, SHA256_SIZE);
+    snprintf(stream->partial, sizeof(stream->partial), CHUNK_PARTIAL_DIR "/%s", job->filename);
+  }
+}
+
+/* A FLAG_CHUNK upload is complete; see dedup_put_chunk. */
+void finish_chunk_upload(struct DiskJob *job){
+  struct Stream *stream = job->stream;
+
+  if(!dedup_put_chunk(stream->partial, stream->hash)){
+    job->error = "Chunk does not match its hash.";
+    return;
+  }
+
+  job->size = stream->size;
+}
+
+/* A FLAG_MANIFEST upload is complete; see dedup_commit_manifest. */
+void finish_manifest(struct DiskJob *job){
+  struct Stream *stream = job->stream;
+  const char *filename = strrchr(stream->path, '/') + 1;
+
+  job->size = dedup_commit_manifest(stream->partial, filename);
+  if(job->size < 0){
+    job->error = errno == ENOENT ? "Missing chunks." :
+                 errno == EINVAL ? "Invalid manifest." : "Error saving file.";
+    return;
+  }
+
+  index_update(filename);
+}
+
+/*
+ * A FLAG_DELTA upload is complete: the new version is rebuilt from the
+ * stored copy into a fresh temporary file next to the delta, then
+ * committed like a plain upload. The file is created exclusively and
+ * locked, so it can neither clobber a delta that happens to have its
+ * name nor be taken over by one.
+ */
+void finish_delta(struct DiskJob *job){
+  struct Stream *stream = job->stream;
+  const char *filename = strrchr(stream->path, '/') + 1;
+  char rebuilt[PATH_MAX];
+  int basefd, deltafd, outfd, saved_errno;
+  off_t base_size, size = -1;
+  uint64_t version;
+
+  snprintf(rebuilt, PATH_MAX, DELTA_PARTIAL_DIR "/XXXXXX");
+  errno = ENOENT;
+  basefd = open_base(filename, &base_size, &version);
+  deltafd = open(stream->partial, O_RDONLY | O_CLOEXEC);
+  outfd = mkostemp(rebuilt, O_CLOEXEC);
+  if(outfd >= 0 && (flock(outfd, LOCK_EX | LOCK_NB) < 0 || fchmod(outfd, 0644) < 0)){
+    close(outfd);
+    unlink(rebuilt);
+    outfd = -1;
+  }
+
+  if(basefd >= 0 && deltafd >= 0 && outfd >= 0){
+    size = delta_apply(deltafd, stream->size, basefd, base_size, version, outfd);
+  }
+
+  else if(basefd >= 0){
+    errno = EIO;
+  }
+
+  saved_errno = errno;
+  if(basefd >= 0){
+    close(basefd);
+  }
+
+  if(deltafd >= 0){
+    close(deltafd);
+  }
+
+  unlink(stream->partial);
+  if(size >= 0 && !commit_file(rebuilt, filename)){
+    size = -1;
+    saved_errno = EIO;
+  }
+
+  // the lock is held until the file is committed or gone
+  if(size < 0 && outfd >= 0){
+    unlink(rebuilt);
+  }
+
+  if(outfd >= 0){
+    close(outfd);
+  }
+
+  if(size < 0){
+    job->error = saved_errno == ENOENT ? "File does not exist." :
+                 saved_errno == ESTALE ? "File changed on the server." :
+                 saved_errno == EINVAL ? "Invalid delta." : "Error saving file.";
+    return;
+  }
+
+  index_update(filename);
+  job->size = size;
+}
+
+/*
+ * Opens the stored copy of a file a delta is made against, with its size
+ * and version: the mtime of what build_path names, so the manifest in a
+ * chunked store. It is taken before opening, so a commit in between makes
+ * the version look older, never newer, than the copy.
+ */
+int open_base(const char *filename, off_t *size, uint64_t *version){
+  struct stat file_stats, base_stats;
+  char path[PATH_MAX];
+  int filefd;
+
+  build_path(path, filename);
+  if(stat(path, &file_stats) < 0 || !S_ISREG(file_stats.st_mode)){
+    return -1;
+  }
+
+  filefd = open_stored(filename);
+  if(filefd < 0){
+    return -1;
+  }
+
+  if(fstat(filefd, &base_stats) < 0){
+    close(filefd);
+    return -1;
+  }
+
+  *size = base_stats.st_size;
+  *version = (uint64_t)file_stats.st_mtim.tv_sec * 1000000000 + file_stats.st_mtim.tv_nsec;
+  return filefd;
+}
+
+/*
+ * Opens and locks the file an upload is written to; a second upload of the
+ * same name fails with EWOULDBLOCK until the first one is over. When
+ * resuming, what is there is kept unless it is longer than the announced
+ * size, in which case it cannot be the start of this file.
+ */
+int open_partial(const char *partial, off_t size, bool resume, off_t *offset){
+  struct stat file_stats;
+  int filefd, saved_errno;
+
+  *offset = 0;
+  filefd = open(partial, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if(filefd < 0){
+    return -1;
+  }
+
+  if(flock(filefd, LOCK_EX | LOCK_NB) < 0 || fstat(filefd, &file_stats) < 0){
+    saved_errno = errno;
+    close(filefd);
+    errno = saved_errno;
+    return -1;
+  }
+
+  if(resume && file_stats.st_size <= size){
+    *offset = file_stats.st_size;
+  }
+
+  else if(ftruncate(filefd, 0) < 0){
+    close(filefd);
+    return -1;
+  }
+
+  return filefd;
+}
+
+void handle_data(struct Session *session){
+  struct FrameHeader *frame = &session->frame;
+  struct Stream *stream = find_stream(session, frame->request_id);
+
+  if(stream == NULL || stream->opcode != OP_UPLOAD){
+    log_warn("Client %d: unexpected data, closing.", session->watcher.fd);
+    session->state = STATE_CLOSING;
+    return;
+  }
+
+  if(session->features & FEATURE_STREAMS){
+    if(frame->length > (uint64_t)stream->window){
+      log_warn("Client %d: stream window exceeded, closing.", session->watcher.fd);
+      session->state = STATE_CLOSING;
+      return;
+    }
+
+    stream->window -= frame->length;
+  }
+
+  stream->raw_bytes += frame->length;
+  stream->wire_bytes += frame->length;
+  receiver_start(&session->receiver, stream->filefd, stream->offset, frame->length);
+  session->receiving = stream;
+  session->state = STATE_UPLOAD_BODY;
+  recv_file(session);
+}
+
+/* WINDOW payload: u32 increment for a download or listing the client made room for. */
+void handle_window(struct Session *session, const unsigned char *payload){
+  struct Stream *stream = find_stream(session, session->frame.request_id);
+
+  // the download may have finished while the update was in flight
+  if(session->frame.length == 4 && stream != NULL &&
+     (stream->opcode == OP_DOWNLOAD || stream->opcode == OP_LIST)){
+    stream->window += get_u32(payload);
+  }
+}
+
+/*
+ * Called by recv_file when a DATA payload has been fully written. The
+ * upload completes on the FIN frame, once the byte count matches the size
+ * the client announced; earlier frames of a stream are credited back.
+ */
+enum TransferStatus finish_data(struct Session *session){
+  struct Stream *stream = session->receiving;
+
+  session->state = STATE_COMMAND;
+  session->receiving = NULL;
+  stream->offset = session->receiver.offset;
+  end_data(session, stream);
+  return TRANSFER_DONE;
+}
+
+/* The part of finish_data compressed frames share once they are written. */
+void end_data(struct Session *session, struct Stream *stream){
+  unsigned char response[8];
+  struct DiskJob *job;
+  const char *path;
+
+  if(!(session->frame.flags & FLAG_FIN)){
+    // the bytes are on disk, so the client may send as many again
+    if(session->features & FEATURE_STREAMS){
+      stream->window += session->frame.length;
+      put_u32(response, session->frame.length);
+      queue_frame(session, OP_WINDOW, 0, stream->id, response, 4);
+    }
+
+    return;
+  }
+
+  // a rejected pipelined upload was already answered
+  if(stream->discard){
+    close_stream(session, stream);
+    return;
+  }
+
+  if(stream->stripe != NULL){
+    finish_range(session, stream);
+    return;
+  }
+
+  report_compression(session, stream);
+
+  // closing may flush, and committing may copy or pack the whole file
+  job = new_job(session);
+  job->stream = stream;
+  job->timing = stream->timing;
+  path = stream->flags & FLAG_CHUNK ? stream->partial : stream->path;
+  strcpy(job->filename, strrchr(path, '/') + 1);
+  start_job(session, job, "commit upload", save_stream, stream_saved);
+}
+
+/*
+ * On the disk pool: puts a complete upload in place. The stream stays
+ * listed but untouched meanwhile, as the session reads no frames.
+ */
+void save_stream(struct DiskJob *job){
+  struct Stream *stream = job->stream;
+  bool complete;
+
+  complete = close(stream->filefd) == 0 && stream->offset == stream->size;
+  stream->filefd = -1;
+  if(!complete){
+    unlink(stream->partial);
+    job->error = "Upload incomplete.";
+  }
+
+  else if(stream->flags & FLAG_CHUNK){
+    finish_chunk_upload(job);
+  }
+
+  else if(stream->flags & FLAG_MANIFEST){
+    finish_manifest(job);
+  }
+
+  else if(stream->flags & FLAG_DELTA){
+    finish_delta(job);
+  }
+
+  // readers of the old file keep it until they are done
+  else if(!commit_file(stream->partial, strrchr(stream->path, '/') + 1)){
+    job->error = "Error saving file.";
+  }
+
+  else {
+    index_update(strrchr(stream->path, '/') + 1);
+    job->size = stream->offset;
+  }
+}
+
+void stream_saved(struct Session *session, struct DiskJob *job){
+  struct Stream *stream = job->stream;
+  unsigned char response[8];
+
+  if(job->error != NULL){
+    queue_error(session, stream->id, job->error);
+  }
+
+  else {
+    if(!(stream->flags & FLAG_CHUNK)){
+      log_info("File received!");
+    }
+
+    put_u64(response, job->size);
+    queue_frame(session, OP_OK, 0, stream->id, response, sizeof(response));
+  }
+
+  metrics_record(session->worker, CMD_UPLOAD, &job->timing, job->error == NULL);
+  close_stream(session, stream);
+}
+
+/*
+ * A DATA frame with FLAG_COMPRESSED. It was buffered like a control frame,
+ * so the block is decompressed into the worker's scratch buffer and
+ * written out in one go.
+ */
+void handle_packed_data(struct Session *session, const unsigned char *payload){
+  struct FrameHeader *frame = &session->frame;
+  struct Stream *stream = find_stream(session, frame->request_id);
+  unsigned char *block = session->worker->scratch;
+  struct timespec start;
+  uint64_t traced;
+  ssize_t written;
+  int len = -1;
+
+  if(stream == NULL || stream->opcode != OP_UPLOAD ||
+     !(session->features & FEATURE_COMPRESS) || frame->length < 4){
+    log_warn("Client %d: unexpected data, closing.", session->watcher.fd);
+    session->state = STATE_CLOSING;
+    return;
+  }
+
+  if(session->features & FEATURE_STREAMS){
+    if(frame->length > (uint64_t)stream->window){
+      log_warn("Client %d: stream window exceeded, closing.", session->watcher.fd);
+      session->state = STATE_CLOSING;
+      return;
+    }
+
+    stream->window -= frame->length;
+  }
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+  if(get_u32(payload) <= COMPRESS_BLOCK){
+    len = lz_decompress(payload + 4, frame->length - 4, block, COMPRESS_BLOCK);
+  }
+
+  stream->cpu_ns += elapsed_ns(&start);
+  if(len < 0 || (uint32_t)len != get_u32(payload)){
+    log_warn("Client %d: bad compressed data, closing.", session->watcher.fd);
+    session->state = STATE_CLOSING;
+    return;
+  }
+
+  traced = tracing ? trace_now() : 0;
+  written = stream->discard ? len : pwrite(stream->filefd, block, len, stream->offset);
+  if(tracing){
+    trace_span("write block", "disk", session->watcher.fd, traced, written, NULL);
+  }
+
+  if(written != len){
+    log_error("Error reading file.");
+    session->state = STATE_CLOSING;
+    return;
+  }
+
+  stream->offset += len;
+  stream->raw_bytes += len;
+  stream->wire_bytes += frame->length;
+  end_data(session, stream);
+}
+
+long long elapsed_ns(const struct timespec *start){
+  struct timespec end;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+  return (end.tv_sec - start->tv_sec) * 1000000000LL + end.tv_nsec - start->tv_nsec;
+}
+
+/* With FEATURE_COMPRESS, what compression saved on a transfer and what it cost. */
+void report_compression(struct Session *session, struct Stream *stream){
+  if((!(session->features & FEATURE_COMPRESS) && !stream->packed) || stream->wire_bytes == 0){
+    return;
+  }
+
+  log_info("Client %d: %lld bytes as %lld on the wire (%.2fx), %.2f ms CPU",
+           session->watcher.fd, (long long)stream->raw_bytes, (long long)stream->wire_bytes,
+           (double)stream->raw_bytes / stream->wire_bytes, stream->cpu_ns / 1e6);
+}
+
+/*
+ * DOWNLOAD payload: the file name, preceded by u64 offset and u64 length
+ * (0 = to the end) when FLAG_RANGE is set.
+ */
+void handle_download(struct Session *session, const unsigned char *payload){
+  uint32_t request_id = session->frame.request_id;
+  size_t len = session->frame.length;
+  bool ranged = (session->features & FEATURE_RESUME) && (session->frame.flags & FLAG_RANGE);
+  struct DiskJob *job;
+  off_t offset = 0, length = 0;
+
+  if(!admit_stream(session)){
+    return;
+  }
+
+  if(ranged){
+    if(len < 16){
+      queue_error(session, request_id, "Invalid range.");
+      metrics_record(session->worker, CMD_DOWNLOAD, &session->timing, false);
+      return;
+    }
+
+    offset = get_u64(payload);
+    length = get_u64(payload + 8);
+    payload += 16;
+    len -= 16;
+  }
+
+  job = new_job(session);
+  if(!payload_filename(payload, len, job->filename)){
+    free_job(job);
+    queue_error(session, request_id, "File does not exist.");
+    metrics_record(session->worker, CMD_DOWNLOAD, &session->timing, false);
+    return;
+  }
+
+  job->request_id = request_id;
+  job->offset = offset;
+  job->length = length;
+  job->ranged = ranged;
+  job->opened.compress = (session->features & FEATURE_COMPRESS) != 0;
+  start_job(session, job, "open download", find_download, download_found);
+}
+
+void find_download(struct DiskJob *job){
+  if(!open_download(job->filename, &job->opened, &job->size)){
+    job->error = "File does not exist.";
+  }
+}
+
+/* The download is open; the stream takes over what the job opened. */
+void download_found(struct Session *session, struct DiskJob *job){
+  off_t offset = job->offset, length = job->length, size = job->size;
+  unsigned char response[24];
+  struct Stream *stream;
+
+  if(job->error != NULL){
+    queue_error(session, job->request_id, job->error);
+    metrics_record(session->worker, CMD_DOWNLOAD, &job->timing, false);
+    return;
+  }
+
+  if(offset < 0 || offset > size){
+    queue_error(session, job->request_id, "Invalid range.");
+    metrics_record(session->worker, CMD_DOWNLOAD, &job->timing, false);
+    return;
+  }
+
+  if(length <= 0 || length > size - offset){
+    length = size - offset;
+  }
+
+  stream = open_stream(session, OP_DOWNLOAD, job->opened.filefd);
+  stream->id = job->request_id;
+  stream->timing = job->timing;
+  stream->compress = job->opened.compress;
+  stream->cached = job->opened.cached;
+  stream->chunks = job->opened.chunks;
+  stream->packed = job->opened.packed;
+  stream->file_size = job->opened.file_size;
+  job->opened.filefd = -1;
+  job->opened.cached = NULL;
+  job->opened.chunks = NULL;
+
+  log_info("Client %d: DOWNLOAD %s%s", session->watcher.fd, job->filename,
+           stream->cached != NULL ? " (cached)" : "");
+
+  // the size now; schedule_chunk sends the body once the socket is free
+  put_u64(response, size);
+  put_u64(response + 8, offset);
+  put_u64(response + 16, length);
+  queue_frame(session, OP_OK, 0, job->request_id, response, job->ranged ? 24 : 8);
+
+  stream->offset = offset;
+  stream->size = offset + length;
+
+  // without streams the whole body is one DATA frame ahead of any reply
+  if(!(session->features & FEATURE_STREAMS)){
+    stream->window = length;
+    session->state = STATE_DOWNLOAD_BODY;
+  }
+}
+
+/*
+ * Opens what a download reads from: its entry in the hot-file cache, the
+ * file itself, or in a chunked store its manifest, leaving the chunks to
+ * be opened as the download gets to them. Sets the size of the file, which
+ * in a packed store is the one in its header. A packed store already has
+ * the blocks a client with the codec wants, so those skip the cache.
+ */
+bool open_download(const char *filename, struct Stream *stream, off_t *size){
+  char path[PATH_MAX];
+  struct stat file_stats;
+
+  if(!(config.packed && stream->compress)){
+    stream->cached = cache_open(filename);
+    if(stream->cached != NULL){
+      *size = stream->cached->size;
+      return true;
+    }
+  }
+
+  if(config.dedup){
+    stream->chunks = dedup_open(filename);
+    if(stream->chunks == NULL){
+      return false;
+    }
+
+    *size = stream->chunks->size;
+    return true;
+  }
+
+  build_path(path, filename);
+  stream->filefd = open(path, O_RDONLY | O_CLOEXEC);
+  if(stream->filefd < 0 || fstat(stream->filefd, &file_stats) < 0 ||
+     !S_ISREG(file_stats.st_mode)){
+    return false;
+  }
+
+  *size = file_stats.st_size;
+  if(config.packed){
+    stream->packed = true;
+    stream->file_size = *size = pack_size(stream->filefd);
+  }
+
+  return *size >= 0;
+}
+
+/*
+ * Points a chunked download at the chunk its offset is in, opening it if
+ * the last frame came from another one. Returns how much of the chunk is
+ * left, or -1 if the chunk is gone.
+ */
+off_t seek_chunk(struct Stream *stream){
+  struct ChunkList *chunks = stream->chunks;
+  struct Chunk *chunk;
+  int low = 0, high = chunks->count - 1, middle;
+
+  if(stream->chunk < 0 || stream->offset < stream->base ||
+     stream->offset >= stream->base + chunks->chunks[stream->chunk].length){
+    // the last chunk that starts at or before the offset
+    while(low < high){
+      middle = (low + high + 1) / 2;
+      if(chunks->chunks[middle].offset <= stream->offset){
+        low = middle;
+      }
+
+      else {
+        high = middle - 1;
+      }
+    }
+
+    if(stream->filefd >= 0){
+      close(stream->filefd);
+    }
+
+    stream->chunk = low;
+    stream->base = chunks->chunks[low].offset;
+    stream->filefd = dedup_open_chunk(chunks->chunks[low].hash);
+    if(stream->filefd < 0){
+      return -1;
+    }
+  }
+
+  chunk = &chunks->chunks[stream->chunk];
+  return chunk->offset + chunk->length - stream->offset;
+}
+
+/* The stream whose turn it is to send, or NULL if every one waits for its window. */
+struct Stream *next_sender(struct Session *session){
+  struct Stream *stream;
+
+  for(stream = session->streams; stream != NULL; stream = stream->next){
+    if((stream->opcode == OP_DOWNLOAD || stream->opcode == OP_LIST) &&
+       (stream->window > 0 || stream->offset == stream->size)){
+      break;
+    }
+  }
+
+  return stream;
+}
+
+/*
+ * Starts the next DATA frame once outbuf has drained: the header is queued
+ * and flush_session sends the body after it with sendfile. Downloads take
+ * turns a chunk at a time, and one that used up its window waits for the
+ * client's WINDOW frame. Returns false if there is nothing to send.
+ */
+bool schedule_chunk(struct Session *session){
+  struct Stream *stream = next_sender(session);
+  off_t len, chunk_left;
+
+  if(stream == NULL){
+    return false;
+  }
+
+  if(stream->opcode == OP_LIST){
+    return schedule_page(session, stream);
+  }
+
+  len = stream->size - stream->offset;
+  if(len > stream->window){
+    len = stream->window;
+  }
+
+  if((session->features & FEATURE_STREAMS) && len > STREAM_CHUNK){
+    len = STREAM_CHUNK;
+  }
+
+  // a frame of a chunked file never spans two chunks
+  if(stream->chunks != NULL && len > 0){
+    chunk_left = seek_chunk(stream);
+    if(chunk_left < 0){
+      log_warn("Client %d: chunk missing, closing.", session->watcher.fd);
+      session->state = STATE_CLOSING;
+      return false;
+    }
+
+    if(len > chunk_left){
+      len = chunk_left;
+    }
+  }
+
+  if(stream->packed){
+    return schedule_stored(session, stream, len);
+  }
+
+  if(stream->compress){
+    return schedule_packed(session, stream, len);
+  }
+
+  stream->window -= len;
+  stream->raw_bytes += len;
+  stream->wire_bytes += len;
+  move_to_back(session, stream);
+
+  queue_header(session, OP_DATA, stream->offset + len == stream->size ? FLAG_FIN : 0,
+               stream->id, len);
+  session->outmark = session->outlen;
+  if(stream->cached != NULL){
+    sender_init_memory(&session->sender, stream->cached->data, stream->offset, len);
+  }
+
+  else {
+    sender_init(&session->sender, stream->filefd, stream->offset - stream->base, len);
+  }
+
+  session->sending = stream;
+  return true;
+}
+
+/*
+ * The compressing counterpart of the sendfile path: a block of the file is
+ * read and compressed here and queued as a whole DATA frame. A download
+ * that keeps not compressing goes back to sendfile.
+ */
+bool schedule_packed(struct Session *session, struct Stream *stream, off_t len){
+  unsigned char *block = session->worker->scratch;
+  unsigned char *packed = block + COMPRESS_BLOCK;
+  struct timespec start;
+  uint64_t traced;
+  int packed_len = 0;
+  ssize_t bytes_read;
+  size_t wire;
+  bool fin;
+
+  if(len > COMPRESS_BLOCK){
+    len = COMPRESS_BLOCK;
+  }
+
+  if(stream->cached != NULL){
+    block = (unsigned char *)stream->cached->data + stream->offset;
+  }
+
+  else if(len > 0){
+    traced = tracing ? trace_now() : 0;
+    bytes_read = pread(stream->filefd, block, len, stream->offset - stream->base);
+    if(tracing){
+      trace_span("read block", "disk", session->watcher.fd, traced, bytes_read, NULL);
+    }
+
+    if(bytes_read != len){
+      log_error("Client %d: Error reading file, closing.", session->watcher.fd);
+      session->state = STATE_CLOSING;
+      return false;
+    }
+  }
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+  if(len > 0){
+    packed_len = lz_compress(session->worker->lz, block, len, packed + 4, COMPRESS_ROOM(len),
+                             session->level);
+  }
+
+  stream->cpu_ns += elapsed_ns(&start);
+  fin = stream->offset + len == stream->size;
+  if(packed_len > 0){
+    put_u32(packed, len);
+    wire = packed_len + 4;
+    queue_frame(session, OP_DATA, FLAG_COMPRESSED | (fin ? FLAG_FIN : 0), stream->id,
+                packed, wire);
+    stream->misses = 0;
+  }
+
+  else {
+    wire = len;
+    queue_frame(session, OP_DATA, fin ? FLAG_FIN : 0, stream->id, block, wire);
+    stream->compress = ++stream->misses < COMPRESS_GIVE_UP;
+  }
+
+  stream->offset += len;
+  stream->window -= wire;
+  stream->raw_bytes += len;
+  stream->wire_bytes += wire;
+  if(!fin){
+    move_to_back(session, stream);
+    return true;
+  }
+
+  end_download(session, stream);
+  return true;
+}
+
+/*
+ * Queues the next DATA frame of a download from the packed store, never
+ * more than a block. A whole block goes out as it is stored with sendfile,
+ * compressed or not; only a compressed block for a client without the
+ * codec, or part of one, is unpacked here.
+ */
+bool schedule_stored(struct Session *session, struct Stream *stream, off_t len){
+  unsigned char *data = session->worker->scratch;
+  struct PackBlock block;
+  struct timespec start;
+  uint64_t traced;
+  off_t skip, wire = len;
+  bool whole, fin, unpacked;
+
+  if(len == 0){
+    queue_frame(session, OP_DATA, FLAG_FIN, stream->id, NULL, 0);
+    end_download(session, stream);
+    return true;
+  }
+
+  if(!pack_block(stream->filefd, stream->file_size, stream->offset, &block)){
+    log_error("Client %d: Error reading file, closing.", session->watcher.fd);
+    session->state = STATE_CLOSING;
+    return false;
+  }
+
+  // a compressed block goes as stored once the window is open at all, which
+  // may take the window below zero, by less than a block
+  skip = stream->offset - block.offset;
+  whole = block.compressed && skip == 0 && stream->size - stream->offset >= block.length &&
+          (session->features & FEATURE_COMPRESS);
+  if(whole || len > block.length - skip){
+    len = wire = block.length - skip;
+  }
+
+  fin = stream->offset + len == stream->size;
+  if(block.compressed && !whole){
+    traced = tracing ? trace_now() : 0;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    unpacked = pack_read(stream->filefd, &block, data, data + COMPRESS_BLOCK);
+    stream->cpu_ns += elapsed_ns(&start);
+    if(tracing){
+      trace_span("unpack block", "disk", session->watcher.fd, traced, block.length, NULL);
+    }
+    if(!unpacked){
+      log_error("Client %d: Error reading file, closing.", session->watcher.fd);
+      session->state = STATE_CLOSING;
+      return false;
+    }
+
+    queue_frame(session, OP_DATA, fin ? FLAG_FIN : 0, stream->id, data + skip, len);
+  }
+
+  else if(block.compressed){
+    wire = block.stored;
+    queue_header(session, OP_DATA, FLAG_COMPRESSED | (fin ? FLAG_FIN : 0), stream->id, wire);
+    session->outmark = session->outlen;
+    sender_init(&session->sender, stream->filefd, block.start, wire);
+    session->sending = stream;
+  }
+
+  else {
+    queue_header(session, OP_DATA, fin ? FLAG_FIN : 0, stream->id, len);
+    session->outmark = session->outlen;
+    sender_init(&session->sender, stream->filefd, block.start + skip, len);
+    session->sending = stream;
+  }
+
+  // finish_chunk cannot tell the offset from the packed file's, so it moves now
+  stream->offset += len;
+  stream->window -= wire;
+  stream->raw_bytes += len;
+  stream->wire_bytes += wire;
+  if(session->sending == stream || !fin){
+    move_to_back(session, stream);
+    return true;
+  }
+
+  end_download(session, stream);
+  return true;
+}
+
+void end_download(struct Session *session, struct Stream *stream){
+  log_info("Download done!");
+  report_compression(session, stream);
+  metrics_record(session->worker, CMD_DOWNLOAD, &stream->timing, true);
+  close_stream(session, stream);
+  if(session->state == STATE_DOWNLOAD_BODY){
+    session->state = STATE_COMMAND;
+  }
+}
+
+/*
+ * Queues the next page of a LIST query as one DATA frame. The listing ends
+ * at the limit or at the first short page, whichever comes first; the page
+ * that reaches the limit asks for one entry more, to tell the client
+ * whether anything was left out.
+ */
+bool schedule_page(struct Session *session, struct Stream *stream){
+  struct ArenaMark mark = arena_mark(&session->arena);
+  struct ListEntry *entries = arena_alloc(&session->arena,
+                                          (LIST_PAGE + 1) * sizeof(struct ListEntry));
+  unsigned char *page = arena_alloc(&session->arena, LIST_PAGE * (LIST_ENTRY_SIZE + NAME_MAX));
+  int i, count, wanted = LIST_PAGE;
+  size_t len = 0, name_len;
+  bool fin, more = false;
+
+  if(stream->size - stream->offset <= wanted){
+    wanted = stream->size - stream->offset;
+    count = index_page(stream->query, entries, wanted + 1);
+    more = count > wanted;
+    if(more){
+      count = wanted;
+    }
+  }
+
+  else {
+    count = index_page(stream->query, entries, wanted);
+  }
+
+  for(i = 0; i < count; i++){
+    name_len = strlen(entries[i].name);
+    put_u64(page + len, entries[i].size);
+    put_u64(page + len + 8, entries[i].mtime);
+    page[len + 16] = name_len >> 8;
+    page[len + 17] = name_len & 0xFF;
+    memcpy(page + len + LIST_ENTRY_SIZE, entries[i].name, name_len);
+    len += LIST_ENTRY_SIZE + name_len;
+  }
+
+  stream->offset += count;
+  stream->window -= len;
+  fin = count < wanted || stream->offset == stream->size;
+  queue_frame(session, OP_DATA, (fin ? FLAG_FIN : 0) | (more ? FLAG_MORE : 0), stream->id,
+              page, len);
+  arena_release(&session->arena, mark);
+
+  if(!fin){
+    move_to_back(session, stream);
+    return true;
+  }
+
+  metrics_record(session->worker, CMD_LIST, &stream->timing, true);
+  close_stream(session, stream);
+  if(session->state == STATE_DOWNLOAD_BODY){
+    session->state = STATE_COMMAND;
+  }
+
+  return true;
+}
+
+/* Called by send_file once the body of a DATA frame has gone out. */
+enum TransferStatus finish_chunk(struct Session *session, enum TransferStatus status){
+  struct Stream *stream = session->sending;
+
+  session->sending = NULL;
+  sender_free(&session->sender);
+  if(status == TRANSFER_ERROR){
+    log_error("Error uploading file.");
+    metrics_record(session->worker, CMD_DOWNLOAD, &stream->timing, false);
+    return status;
+  }
+
+  if(!stream->packed){
+    stream->offset = stream->base + session->sender.offset;
+  }
+
+  if(stream->offset == stream->size){
+    end_download(session, stream);
+  }
+
+  return status;
+}
+
+void handle_delete(struct Session *session, const unsigned char *payload){
+  struct DiskJob *job = new_job(session);
+
+  job->request_id = session->frame.request_id;
+  if(!payload_filename(payload, session->frame.length, job->filename)){
+    free_job(job);
+    queue_error(session, session->frame.request_id, "Invalid file name.");
+    metrics_record(session->worker, CMD_DELETE, &session->timing, false);
+    return;
+  }
+
+  log_info("Client %d: DELETE %s", session->watcher.fd, job->filename);
+  start_job(session, job, "delete", delete_stored, delete_done);
+}
+
+void delete_done(struct Session *session, struct DiskJob *job){
+  metrics_record(session->worker, CMD_DELETE, &job->timing, job->error == NULL);
+  if(job->error != NULL){
+    queue_error(session, job->request_id, job->error);
+    return;
+  }
+
+  queue_frame(session, OP_OK, 0, job->request_id, NULL, 0);
+}
+
+/*
+ * HAVE payload: chunk hashes. The OK is a bitmap of the ones the store
+ * already has, so the client only sends the rest.
+ */
+void handle_have(struct Session *session, const unsigned char *payload){
+  uint32_t request_id = session->frame.request_id;
+  size_t count = session->frame.length / SHA256_SIZE;
+  struct ArenaMark mark;
+  unsigned char *bitmap;
+  size_t i, have = 0;
+
+  if(!(session->features & FEATURE_DEDUP) || session->frame.length % SHA256_SIZE != 0 ||
+     count > HAVE_MAX){
+    queue_error(session, request_id, "Invalid input. Please try again.");
+    metrics_record(session->worker, CMD_HAVE, &session->timing, false);
+    return;
+  }
+
+  mark = arena_mark(&session->arena);
+  bitmap = arena_alloc(&session->arena, (count + 7) / 8 + 1);
+  memset(bitmap, 0, (count + 7) / 8 + 1);
+
+  for(i = 0; i < count; i++){
+    if(dedup_has(payload + i * SHA256_SIZE)){
+      bitmap[i / 8] |= 0x80 >> (i % 8);
+      have++;
+    }
+  }
+
+  log_info("Client %d: HAVE %zu of %zu chunks", session->watcher.fd, have, count);
+  queue_frame(session, OP_OK, 0, request_id, bitmap, (count + 7) / 8);
+  arena_release(&session->arena, mark);
+  metrics_record(session->worker, CMD_HAVE, &session->timing, true);
+}
+
+/*
+ * SIGNATURES payload: a file name. The OK carries the signatures of the
+ * stored copy, for a FLAG_DELTA upload to refer to.
+ */
+void handle_signatures(struct Session *session, const unsigned char *payload){
+  struct DiskJob *job = new_job(session);
+
+  job->request_id = session->frame.request_id;
+  if(!(session->features & FEATURE_DELTA) ||
+     !payload_filename(payload, session->frame.length, job->filename)){
+    free_job(job);
+    queue_error(session, session->frame.request_id, "Invalid file name.");
+    metrics_record(session->worker, CMD_SIGNATURES, &session->timing, false);
+    return;
+  }
+
+  log_info("Client %d: SIGNATURES %s", session->watcher.fd, job->filename);
+  start_job(session, job, "signatures", read_signatures, signatures_read);
+}
+
+/* Reads the whole stored copy, so it runs on the disk pool. */
+void read_signatures(struct DiskJob *job){
+  uint64_t version;
+  off_t size;
+
+  job->filefd = open_base(job->filename, &size, &version);
+  if(job->filefd < 0){
+    job->error = "File does not exist.";
+    return;
+  }
+
+  job->payload = delta_signatures(job->filefd, size, version, &job->len);
+  if(job->payload == NULL){
+    job->error = "Error reading file.";
+  }
+}
+
+void signatures_read(struct Session *session, struct DiskJob *job){
+  metrics_record(session->worker, CMD_SIGNATURES, &job->timing, job->error == NULL);
+  if(job->error != NULL){
+    queue_error(session, job->request_id, job->error);
+    return;
+  }
+
+  queue_frame(session, OP_OK, 0, job->request_id, job->payload, job->len);
+}
+
+void handle_quit(struct Session *session){
+  char *response = "Disconnecting...";
+
+  log_info("Client %d: QUIT", session->watcher.fd);
+  queue_frame(session, OP_OK, 0, session->frame.request_id, response, strlen(response));
+  session->state = STATE_CLOSING;
+}
+
+/* STATS: the OK carries the metrics summary (see metrics.c). */
+void handle_stats(struct Session *session){
+  struct ArenaMark mark = arena_mark(&session->arena);
+  char *text = metrics_text(&session->arena);
+
+  log_info("Client %d: STATS", session->watcher.fd);
+  queue_frame(session, OP_OK, 0, session->frame.request_id, text, strlen(text));
+  arena_release(&session->arena, mark);
+  metrics_record(session->worker, CMD_STATS, &session->timing, true);
+}
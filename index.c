@@ -0,0 +1,773 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "server.h"
+
+#define INDEX_BUCKETS 1024
+#define VIEW_BLOCK 512
+#define INOTIFY_EVENTS (IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_TO | \
+                        IN_MOVED_FROM | IN_DELETE)
+
+/*
+ * The files in server_files, kept in memory so LIST never touches the
+ * disk. It is built once at startup and then kept current by the server's
+ * own uploads and deletes, and by an inotify thread for anything changed
+ * behind the server's back. Workers only ever take the read lock to list.
+ * Every change also drops the file from the hot-file cache.
+ */
+struct IndexEntry{
+  char *name;
+  off_t size;
+  time_t mtime;
+  struct IndexEntry *next;
+};
+
+/*
+ * The index sorted for LIST queries, one view per LIST_BY_* order. Views
+ * are sorted once, when a scan has built the index and before it is
+ * swapped in; after that every change moves just the entries it touches,
+ * under the write lock, so a query after an upload never sorts anything.
+ * A view is a run of blocks of up to VIEW_BLOCK entries, so an insert or
+ * a removal shifts at most one block and the table of blocks, never the
+ * whole index, and a place in it is a block and a slot in that block.
+ * Queries hold the read lock while they walk a view, so neither the view
+ * nor its entries can change under them.
+ */
+struct ViewBlock{
+  size_t count;
+  struct IndexEntry *entries[VIEW_BLOCK];
+};
+
+struct View{
+  struct ViewBlock **blocks;
+  size_t block_count;
+  size_t block_capacity;
+};
+
+// past the last entry is { block_count, 0 }
+struct ViewCursor{
+  size_t block;
+  size_t slot;
+};
+
+// whether entry sorts before what a search is looking for
+typedef bool (*view_before_cb)(const struct IndexEntry *entry, const void *target);
+
+struct ViewTarget{
+  const struct IndexEntry *entry;
+  int by;
+};
+
+struct Index{
+  struct IndexEntry **buckets;
+  size_t bucket_count;
+  size_t count;
+  struct View views[LIST_BY_MTIME + 1];
+  bool sorted;              // the views are built and kept up to date
+};
+
+static struct Index index_table;
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int inotify_fd = -1;
+
+static void index_sort(struct Index *index);
+static void view_insert(struct Index *index, int by, struct IndexEntry *entry);
+static void view_remove(struct Index *index, int by, struct IndexEntry *entry);
+
+static size_t hash_name(const char *name){
+  size_t hash = 14695981039346656037ULL;
+
+  while(*name != '\0'){
+    hash = (hash ^ (unsigned char)*name++) * 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+static void index_alloc(struct Index *index, size_t bucket_count){
+  index->buckets = calloc(bucket_count, sizeof(struct IndexEntry *));
+  if(index->buckets == NULL){
+    error_occurred("ERROR allocating file index");
+  }
+
+  index->bucket_count = bucket_count;
+  index->count = 0;
+  memset(index->views, 0, sizeof(index->views));
+  index->sorted = false;
+}
+
+static void index_free(struct Index *index){
+  struct IndexEntry *entry;
+  size_t i;
+  int by;
+
+  for(by = LIST_BY_NAME; by <= LIST_BY_MTIME; by++){
+    for(i = 0; i < index->views[by].block_count; i++){
+      free(index->views[by].blocks[i]);
+    }
+
+    free(index->views[by].blocks);
+  }
+
+  for(i = 0; i < index->bucket_count; i++){
+    while((entry = index->buckets[i]) != NULL){
+      index->buckets[i] = entry->next;
+      free(entry->name);
+      free(entry);
+    }
+  }
+
+  free(index->buckets);
+}
+
+static struct IndexEntry **find_entry(struct Index *index, const char *name){
+  struct IndexEntry **link = &index->buckets[hash_name(name) % index->bucket_count];
+
+  while(*link != NULL && strcmp((*link)->name, name) != 0){
+    link = &(*link)->next;
+  }
+
+  return link;
+}
+
+/* Doubles the table once chains get long; the entries themselves move over. */
+static void index_grow(struct Index *index){
+  struct Index grown;
+  struct IndexEntry *entry, **link;
+  size_t i;
+
+  index_alloc(&grown, index->bucket_count * 2);
+  for(i = 0; i < index->bucket_count; i++){
+    while((entry = index->buckets[i]) != NULL){
+      index->buckets[i] = entry->next;
+      link = &grown.buckets[hash_name(entry->name) % grown.bucket_count];
+      entry->next = *link;
+      *link = entry;
+    }
+  }
+
+  free(index->buckets);
+  index->buckets = grown.buckets;
+  index->bucket_count = grown.bucket_count;
+}
+
+static void index_put(struct Index *index, const char *name, const struct stat *file_stats){
+  struct IndexEntry **link = find_entry(index, name);
+  struct IndexEntry *entry = *link;
+
+  if(entry == NULL){
+    entry = malloc(sizeof(struct IndexEntry));
+    if(entry == NULL || (entry->name = strdup(name)) == NULL){
+      error_occurred("ERROR allocating file index");
+    }
+
+    entry->next = NULL;
+    entry->size = file_stats->st_size;
+    entry->mtime = file_stats->st_mtime;
+    *link = entry;
+    if(++index->count > index->bucket_count * 2){
+      index_grow(index);
+    }
+
+    if(index->sorted){
+      view_insert(index, LIST_BY_NAME, entry);
+      view_insert(index, LIST_BY_SIZE, entry);
+      view_insert(index, LIST_BY_MTIME, entry);
+    }
+
+    return;
+  }
+
+  // a new size or mtime moves the entry in the views sorted by them
+  if(index->sorted){
+    view_remove(index, LIST_BY_SIZE, entry);
+    view_remove(index, LIST_BY_MTIME, entry);
+  }
+
+  entry->size = file_stats->st_size;
+  entry->mtime = file_stats->st_mtime;
+  if(index->sorted){
+    view_insert(index, LIST_BY_SIZE, entry);
+    view_insert(index, LIST_BY_MTIME, entry);
+  }
+}
+
+static void index_delete(struct Index *index, const char *name){
+  struct IndexEntry **link = find_entry(index, name);
+  struct IndexEntry *entry = *link;
+
+  if(entry != NULL){
+    if(index->sorted){
+      view_remove(index, LIST_BY_NAME, entry);
+      view_remove(index, LIST_BY_SIZE, entry);
+      view_remove(index, LIST_BY_MTIME, entry);
+    }
+
+    *link = entry->next;
+    index->count--;
+    free(entry->name);
+    free(entry);
+  }
+}
+
+/*
+ * A stored file's size and mtime; in a chunked or packed store the size its
+ * manifest or header records.
+ */
+static bool stat_file(int dirfd, const char *name, struct stat *file_stats){
+  if(config.dedup){
+    return dedup_stat(dirfd, name, file_stats);
+  }
+
+  if(config.packed){
+    return pack_stat(dirfd, name, file_stats);
+  }
+
+  return fstatat(dirfd, name, file_stats, AT_SYMLINK_NOFOLLOW) == 0 &&
+         S_ISREG(file_stats->st_mode);
+}
+
+/*
+ * Adds the regular files in directory to index. depth is how many levels
+ * of shard directories are still above the files.
+ */
+static void scan_directory(struct Index *index, const char *directory, int depth){
+  char path[PATH_MAX];
+  struct stat file_stats;
+  struct dirent *ent;
+  DIR *dir = opendir(directory);
+
+  if(dir == NULL){
+    return;
+  }
+
+  while((ent = readdir(dir)) != NULL){
+    if(depth > 0 && ent->d_name[0] != '.' && ent->d_type == DT_DIR){
+      snprintf(path, PATH_MAX, "%s/%s", directory, ent->d_name);
+      scan_directory(index, path, depth - 1);
+    }
+
+    else if(depth == 0 && stat_file(dirfd(dir), ent->d_name, &file_stats)){
+      index_put(index, ent->d_name, &file_stats);
+    }
+  }
+
+  closedir(dir);
+}
+
+/*
+ * Builds a fresh index from the store, sorted, and swaps it in, so listing
+ * stays available while the scan and the sorts run. Used at startup and
+ * whenever the kernel dropped inotify events.
+ */
+static void index_scan(){
+  struct Index scanned, old;
+
+  index_alloc(&scanned, INDEX_BUCKETS);
+  scan_directory(&scanned, STORAGE_DIR, config.layout == LAYOUT_SHARDED ? 2 : 0);
+  index_sort(&scanned);
+  cache_clear();
+
+  pthread_rwlock_wrlock(&index_lock);
+  old = index_table;
+  index_table = scanned;
+  pthread_rwlock_unlock(&index_lock);
+
+  if(old.buckets != NULL){
+    index_free(&old);
+  }
+}
+
+static void *watch_directory(void *arg){
+  char events[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *event;
+  ssize_t len;
+  char *p;
+
+  while(true){
+    len = read(inotify_fd, events, sizeof(events));
+    if(len < 0 && errno == EINTR){
+      continue;
+    }
+
+    if(len <= 0){
+      perror("ERROR watching server_files");
+      return NULL;
+    }
+
+    for(p = events; p < events + len; p += sizeof(struct inotify_event) + event->len){
+      event = (const struct inotify_event *)p;
+      if(event->mask & IN_Q_OVERFLOW){
+        index_scan();
+      }
+
+      else if(event->len == 0 || (event->mask & IN_ISDIR)){
+        continue;
+      }
+
+      else if(event->mask & (IN_DELETE | IN_MOVED_FROM)){
+        index_remove(event->name);
+      }
+
+      else {
+        index_update(event->name);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Starts watching before the first scan, so nothing that changes while it
+ * runs is missed. Without inotify the index still follows the server's
+ * own uploads and deletes; that is all a sharded store gets, since its
+ * layout belongs to the server and watching 65536 directories would cost
+ * more than it saves.
+ */
+void index_init(){
+  pthread_t watcher;
+
+  if(config.layout == LAYOUT_SHARDED){
+    index_scan();
+    return;
+  }
+
+  inotify_fd = inotify_init1(IN_CLOEXEC);
+  if(inotify_fd < 0 || inotify_add_watch(inotify_fd, STORAGE_DIR, INOTIFY_EVENTS) < 0){
+    perror("WARNING: not watching server_files for outside changes");
+  }
+
+  else if(pthread_create(&watcher, NULL, watch_directory, NULL) != 0){
+    error_occurred("ERROR starting directory watcher");
+  }
+
+  else {
+    pthread_detach(watcher);
+  }
+
+  index_scan();
+}
+
+/* Picks up the current size of a file, or forgets it if it is gone. */
+void index_update(const char *name){
+  char path[PATH_MAX];
+  struct stat file_stats;
+
+  build_path(path, name);
+  if(!stat_file(AT_FDCWD, path, &file_stats)){
+    index_remove(name);
+    return;
+  }
+
+  pthread_rwlock_wrlock(&index_lock);
+  index_put(&index_table, name, &file_stats);
+  pthread_rwlock_unlock(&index_lock);
+  cache_drop(name);
+}
+
+void index_remove(const char *name){
+  pthread_rwlock_wrlock(&index_lock);
+  index_delete(&index_table, name);
+  pthread_rwlock_unlock(&index_lock);
+  cache_drop(name);
+}
+
+/* The size the index has for a file, if it has the file. */
+bool index_size(const char *name, off_t *size){
+  struct IndexEntry *entry;
+
+  pthread_rwlock_rdlock(&index_lock);
+  entry = *find_entry(&index_table, name);
+  if(entry != NULL){
+    *size = entry->size;
+  }
+
+  pthread_rwlock_unlock(&index_lock);
+  return entry != NULL;
+}
+
+/* The LIST text: one "name (size kb)" line per file. */
+char *index_list(struct Arena *arena, int *file_counter){
+  struct IndexEntry *entry;
+  char *list_string;
+  size_t i, size = 1, len = 0;
+
+  pthread_rwlock_rdlock(&index_lock);
+  for(i = 0; i < index_table.bucket_count; i++){
+    for(entry = index_table.buckets[i]; entry != NULL; entry = entry->next){
+      size += strlen(entry->name) + 32;
+    }
+  }
+
+  list_string = arena_alloc(arena, size);
+  list_string[0] = '\0';
+  for(i = 0; i < index_table.bucket_count; i++){
+    for(entry = index_table.buckets[i]; entry != NULL; entry = entry->next){
+      len += snprintf(list_string + len, size - len, "%s (%.1f kb)\n", entry->name,
+                      entry->size / 1000.0);
+    }
+  }
+
+  *file_counter = index_table.count;
+  pthread_rwlock_unlock(&index_lock);
+  return list_string;
+}
+
+static uint64_t entry_key(const struct IndexEntry *entry, int by){
+  if(by == LIST_BY_SIZE){
+    return entry->size;
+  }
+
+  return by == LIST_BY_MTIME ? (uint64_t)entry->mtime : 0;
+}
+
+static int compare_entries(const void *a, const void *b, void *by){
+  const struct IndexEntry *entry_a = *(struct IndexEntry * const *)a;
+  const struct IndexEntry *entry_b = *(struct IndexEntry * const *)b;
+  uint64_t key_a = entry_key(entry_a, *(int *)by);
+  uint64_t key_b = entry_key(entry_b, *(int *)by);
+
+  if(key_a != key_b){
+    return key_a < key_b ? -1 : 1;
+  }
+
+  return strcmp(entry_a->name, entry_b->name);
+}
+
+/* Where entry sorts relative to the cursor, ascending. */
+static int compare_cursor(const struct IndexEntry *entry, const struct ListQuery *query){
+  uint64_t key = entry_key(entry, query->order & ~LIST_DESCENDING);
+
+  if(key != query->after_key){
+    return key < query->after_key ? -1 : 1;
+  }
+
+  return strcmp(entry->name, query->after_name);
+}
+
+/* A new, empty block at position in the view. */
+static struct ViewBlock *view_add_block(struct View *view, size_t position){
+  struct ViewBlock *block = malloc(sizeof(struct ViewBlock));
+
+  if(block == NULL){
+    error_occurred("ERROR allocating file index");
+  }
+
+  if(view->block_count == view->block_capacity){
+    view->block_capacity = view->block_capacity == 0 ? 16 : view->block_capacity * 2;
+    view->blocks = realloc(view->blocks, view->block_capacity * sizeof(struct ViewBlock *));
+    if(view->blocks == NULL){
+      error_occurred("ERROR allocating file index");
+    }
+  }
+
+  memmove(&view->blocks[position + 1], &view->blocks[position],
+          (view->block_count - position) * sizeof(struct ViewBlock *));
+  view->blocks[position] = block;
+  view->block_count++;
+  block->count = 0;
+  return block;
+}
+
+/* Sorts every view of an index no one else can see yet. */
+static void index_sort(struct Index *index){
+  struct IndexEntry **sorted, *entry;
+  struct ViewBlock *block = NULL;
+  struct View *view;
+  size_t i, count = 0;
+  int by;
+
+  sorted = malloc((index->count + 1) * sizeof(struct IndexEntry *));
+  if(sorted == NULL){
+    error_occurred("ERROR allocating file index");
+  }
+
+  for(i = 0; i < index->bucket_count; i++){
+    for(entry = index->buckets[i]; entry != NULL; entry = entry->next){
+      sorted[count++] = entry;
+    }
+  }
+
+  for(by = LIST_BY_NAME; by <= LIST_BY_MTIME; by++){
+    qsort_r(sorted, count, sizeof(struct IndexEntry *), compare_entries, &by);
+    view = &index->views[by];
+    for(i = 0; i < count; i++){
+      // blocks start three quarters full, so inserts split few of them
+      if(i % (VIEW_BLOCK * 3 / 4) == 0){
+        block = view_add_block(view, view->block_count);
+      }
+
+      block->entries[block->count++] = sorted[i];
+    }
+  }
+
+  free(sorted);
+  index->sorted = true;
+}
+
+/*
+ * The first place in the view whose entry does not sort before target:
+ * first the block, by its last entry, then the slot in it.
+ */
+static struct ViewCursor view_bound(const struct View *view, view_before_cb before,
+                                    const void *target){
+  struct ViewCursor cursor;
+  struct ViewBlock *block;
+  size_t low = 0, high = view->block_count, middle;
+
+  while(low < high){
+    middle = low + (high - low) / 2;
+    block = view->blocks[middle];
+    if(before(block->entries[block->count - 1], target)){
+      low = middle + 1;
+    }
+
+    else {
+      high = middle;
+    }
+  }
+
+  cursor.block = low;
+  cursor.slot = 0;
+  if(low == view->block_count){
+    return cursor;
+  }
+
+  block = view->blocks[low];
+  low = 0;
+  high = block->count;
+  while(low < high){
+    middle = low + (high - low) / 2;
+    if(before(block->entries[middle], target)){
+      low = middle + 1;
+    }
+
+    else {
+      high = middle;
+    }
+  }
+
+  cursor.slot = low;
+  return cursor;
+}
+
+static struct IndexEntry *view_at(const struct View *view, struct ViewCursor cursor){
+  return view->blocks[cursor.block]->entries[cursor.slot];
+}
+
+static int cursor_compare(struct ViewCursor a, struct ViewCursor b){
+  if(a.block != b.block){
+    return a.block < b.block ? -1 : 1;
+  }
+
+  return a.slot < b.slot ? -1 : a.slot > b.slot;
+}
+
+static struct ViewCursor cursor_next(const struct View *view, struct ViewCursor cursor){
+  if(++cursor.slot == view->blocks[cursor.block]->count){
+    cursor.block++;
+    cursor.slot = 0;
+  }
+
+  return cursor;
+}
+
+static struct ViewCursor cursor_previous(const struct View *view, struct ViewCursor cursor){
+  if(cursor.slot == 0){
+    cursor.block--;
+    cursor.slot = view->blocks[cursor.block]->count;
+  }
+
+  cursor.slot--;
+  return cursor;
+}
+
+static bool entry_before(const struct IndexEntry *entry, const void *target){
+  const struct ViewTarget *view_target = target;
+  int by = view_target->by;
+
+  return compare_entries(&entry, &view_target->entry, &by) < 0;
+}
+
+static void view_insert(struct Index *index, int by, struct IndexEntry *entry){
+  struct View *view = &index->views[by];
+  struct ViewTarget target = { entry, by };
+  struct ViewCursor cursor = view_bound(view, entry_before, &target);
+  struct ViewBlock *block, *half;
+
+  if(view->block_count == 0){
+    view_add_block(view, 0);
+  }
+
+  // past the end goes at the end of the last block
+  if(cursor.block == view->block_count){
+    cursor.block--;
+    cursor.slot = view->blocks[cursor.block]->count;
+  }
+
+  // a full block gives its upper half to a new one after it
+  block = view->blocks[cursor.block];
+  if(block->count == VIEW_BLOCK){
+    half = view_add_block(view, cursor.block + 1);
+    half->count = VIEW_BLOCK / 2;
+    block->count = VIEW_BLOCK - half->count;
+    memcpy(half->entries, &block->entries[block->count],
+           half->count * sizeof(struct IndexEntry *));
+    if(cursor.slot > block->count){
+      cursor.slot -= block->count;
+      block = half;
+    }
+  }
+
+  memmove(&block->entries[cursor.slot + 1], &block->entries[cursor.slot],
+          (block->count - cursor.slot) * sizeof(struct IndexEntry *));
+  block->entries[cursor.slot] = entry;
+  block->count++;
+}
+
+/* Called before the entry's keys change, while it still sorts where it is. */
+static void view_remove(struct Index *index, int by, struct IndexEntry *entry){
+  struct View *view = &index->views[by];
+  struct ViewTarget target = { entry, by };
+  struct ViewCursor cursor = view_bound(view, entry_before, &target);
+  struct ViewBlock *block;
+
+  if(cursor.block == view->block_count || view_at(view, cursor) != entry){
+    return;
+  }
+
+  block = view->blocks[cursor.block];
+  block->count--;
+  memmove(&block->entries[cursor.slot], &block->entries[cursor.slot + 1],
+          (block->count - cursor.slot) * sizeof(struct IndexEntry *));
+
+  if(block->count == 0){
+    free(block);
+    view->block_count--;
+    memmove(&view->blocks[cursor.block], &view->blocks[cursor.block + 1],
+            (view->block_count - cursor.block) * sizeof(struct ViewBlock *));
+  }
+}
+
+static bool list_match(const struct ListQuery *query, const char *name){
+  if(query->pattern[0] == '\0'){
+    return true;
+  }
+
+  if(strpbrk(query->pattern, "*?[") != NULL){
+    return fnmatch(query->pattern, name, FNM_PERIOD) == 0;
+  }
+
+  return strncmp(name, query->pattern, strlen(query->pattern)) == 0;
+}
+
+static bool name_before(const struct IndexEntry *entry, const void *prefix){
+  return strncmp(entry->name, prefix, strlen(prefix)) < 0;
+}
+
+static bool name_not_past(const struct IndexEntry *entry, const void *prefix){
+  return strncmp(entry->name, prefix, strlen(prefix)) <= 0;
+}
+
+static bool before_cursor(const struct IndexEntry *entry, const void *query){
+  return compare_cursor(entry, query) < 0;
+}
+
+static bool not_past_cursor(const struct IndexEntry *entry, const void *query){
+  return compare_cursor(entry, query) <= 0;
+}
+
+/*
+ * Walks the view from just past the cursor in the query's direction,
+ * copying up to max matching entries into entries and moving the cursor
+ * past them. Returns how many matched. By name, a prefix narrows the walk
+ * to the names that have it.
+ */
+static int walk_view(struct ListQuery *query, struct ListEntry *entries, int max){
+  int by = query->order & ~LIST_DESCENDING;
+  bool descending = query->order & LIST_DESCENDING;
+  struct IndexEntry *entry = NULL, *candidate;
+  struct ViewCursor first, last, at;
+  struct View *view;
+  int matched = 0;
+
+  pthread_rwlock_rdlock(&index_lock);
+  view = &index_table.views[by];
+
+  first.block = 0;
+  first.slot = 0;
+  last.block = view->block_count;
+  last.slot = 0;
+  if(by == LIST_BY_NAME && strpbrk(query->pattern, "*?[") == NULL){
+    first = view_bound(view, name_before, query->pattern);
+    last = view_bound(view, name_not_past, query->pattern);
+  }
+
+  // the first entry that sorts after the cursor (descending: not before it)
+  if(query->after_name[0] == '\0'){
+    at = descending ? last : first;
+  }
+
+  else {
+    at = view_bound(view, descending ? before_cursor : not_past_cursor, query);
+    if(cursor_compare(at, first) < 0){
+      at = first;
+    }
+
+    if(cursor_compare(at, last) > 0){
+      at = last;
+    }
+  }
+
+  while(matched < max){
+    if(descending){
+      if(cursor_compare(at, first) <= 0){
+        break;
+      }
+
+      at = cursor_previous(view, at);
+      candidate = view_at(view, at);
+    }
+
+    else {
+      if(cursor_compare(at, last) >= 0){
+        break;
+      }
+
+      candidate = view_at(view, at);
+      at = cursor_next(view, at);
+    }
+
+    if(!list_match(query, candidate->name)){
+      continue;
+    }
+
+    entry = candidate;
+    strcpy(entries[matched].name, entry->name);
+    entries[matched].size = entry->size;
+    entries[matched].mtime = entry->mtime;
+    matched++;
+  }
+
+  if(entry != NULL){
+    query->after_key = entry_key(entry, by);
+    strcpy(query->after_name, entry->name);
+  }
+
+  pthread_rwlock_unlock(&index_lock);
+  return matched;
+}
+
+/* The next page of a query; the cursor moves past what is returned. */
+int index_page(struct ListQuery *query, struct ListEntry *entries, int max){
+  return walk_view(query, entries, max);
+}
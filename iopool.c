@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include "iopool.h"
+
+struct PoolThread{
+  struct IoPool *pool;
+  int id;
+};
+
+static void *run_pool_thread(void *arg);
+static struct IoJob *take_job(struct IoPool *pool, int id);
+static void record_wait(struct IoPool *pool, struct IoJob *job);
+static void post_done(struct IoJob *job);
+static void run_done(struct Reactor *reactor, struct Watcher *watcher, uint32_t events);
+
+/*
+ * Starts threads pool threads, which run for as long as the server does.
+ * Returns -1 if one could not be started.
+ */
+int iopool_start(struct IoPool *pool, int threads, int depth){
+  struct PoolThread *thread;
+  pthread_t id;
+  int i;
+
+  pool->threads = threads;
+  pool->depth = depth;
+  pool->queues = calloc(threads, sizeof(struct IoQueue));
+  if(pool->queues == NULL){
+    return -1;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  for(i = 0; i < threads; i++){
+    pthread_mutex_init(&pool->queues[i].lock, NULL);
+  }
+
+  for(i = 0; i < threads; i++){
+    thread = malloc(sizeof(struct PoolThread));
+    if(thread == NULL){
+      return -1;
+    }
+
+    thread->pool = pool;
+    thread->id = i;
+    if(pthread_create(&id, NULL, run_pool_thread, thread) != 0){
+      free(thread);
+      return -1;
+    }
+
+    pthread_detach(id);
+  }
+
+  return 0;
+}
+
+/*
+ * Queues job; its done callback runs on the event loop target belongs to.
+ * Over the queue depth the work is done right here, but done still comes
+ * later from the event loop, so callers see one order of events either way.
+ */
+void iopool_submit(struct IoPool *pool, struct IoJob *job, struct IoDone *target){
+  struct IoQueue *queue;
+
+  job->target = target;
+  job->next = NULL;
+  clock_gettime(CLOCK_MONOTONIC, &job->queued);
+
+  if(atomic_load_explicit(&pool->queued, memory_order_relaxed) >= pool->depth){
+    atomic_fetch_add_explicit(&pool->inline_jobs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pool->jobs, 1, memory_order_relaxed);
+    job->work(job);
+    post_done(job);
+    return;
+  }
+
+  queue = &pool->queues[atomic_fetch_add_explicit(&pool->next, 1, memory_order_relaxed) %
+                        pool->threads];
+  pthread_mutex_lock(&queue->lock);
+  if(queue->tail != NULL){
+    queue->tail->next = job;
+  }
+
+  else {
+    queue->head = job;
+  }
+
+  queue->tail = job;
+  pthread_mutex_unlock(&queue->lock);
+
+  // counted under the lock the threads sleep on, so none misses the wakeup
+  pthread_mutex_lock(&pool->lock);
+  atomic_fetch_add_explicit(&pool->queued, 1, memory_order_relaxed);
+  pthread_cond_signal(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void *run_pool_thread(void *arg){
+  struct PoolThread *thread = arg;
+  struct IoPool *pool = thread->pool;
+  struct IoJob *job;
+
+  while(true){
+    job = take_job(pool, thread->id);
+    if(job == NULL){
+      pthread_mutex_lock(&pool->lock);
+      while(atomic_load_explicit(&pool->queued, memory_order_relaxed) == 0){
+        pthread_cond_wait(&pool->wake, &pool->lock);
+      }
+
+      pthread_mutex_unlock(&pool->lock);
+      continue;
+    }
+
+    record_wait(pool, job);
+    job->work(job);
+    post_done(job);
+  }
+
+  return NULL;
+}
+
+/* The oldest job of the thread's own queue, or else of the next one that has any. */
+static struct IoJob *take_job(struct IoPool *pool, int id){
+  struct IoQueue *queue;
+  struct IoJob *job;
+  int i;
+
+  for(i = 0; i < pool->threads; i++){
+    queue = &pool->queues[(id + i) % pool->threads];
+    pthread_mutex_lock(&queue->lock);
+    job = queue->head;
+    if(job != NULL){
+      queue->head = job->next;
+      if(queue->head == NULL){
+        queue->tail = NULL;
+      }
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+    if(job != NULL){
+      atomic_fetch_sub_explicit(&pool->queued, 1, memory_order_relaxed);
+      atomic_fetch_add_explicit(&pool->jobs, 1, memory_order_relaxed);
+      if(i > 0){
+        atomic_fetch_add_explicit(&pool->stolen, 1, memory_order_relaxed);
+      }
+
+      return job;
+    }
+  }
+
+  return NULL;
+}
+
+static void record_wait(struct IoPool *pool, struct IoJob *job){
+  struct timespec now;
+  unsigned long long wait, max, us;
+  int bucket;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  wait = (now.tv_sec - job->queued.tv_sec) * 1000000000ULL + now.tv_nsec - job->queued.tv_nsec;
+  atomic_fetch_add_explicit(&pool->wait_ns, wait, memory_order_relaxed);
+
+  us = wait / 1000;
+  bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+  if(bucket >= IO_WAIT_BUCKETS){
+    bucket = IO_WAIT_BUCKETS - 1;
+  }
+
+  atomic_fetch_add_explicit(&pool->wait_buckets[bucket], 1, memory_order_relaxed);
+
+  max = atomic_load_explicit(&pool->max_wait_ns, memory_order_relaxed);
+  while(wait > max &&
+        !atomic_compare_exchange_weak_explicit(&pool->max_wait_ns, &max, wait,
+                                               memory_order_relaxed, memory_order_relaxed)){
+  }
+}
+
+static void post_done(struct IoJob *job){
+  struct IoDone *done = job->target;
+  uint64_t one = 1;
+  bool first;
+
+  job->next = NULL;
+  pthread_mutex_lock(&done->lock);
+  first = done->head == NULL;
+  if(done->tail != NULL){
+    done->tail->next = job;
+  }
+
+  else {
+    done->head = job;
+  }
+
+  done->tail = job;
+  pthread_mutex_unlock(&done->lock);
+
+  // the event loop takes the whole list at once, so one wakeup covers it
+  if(first){
+    while(write(done->watcher.fd, &one, sizeof(one)) < 0 && errno == EINTR){
+    }
+  }
+}
+
+/*
+ * Sets up done for the event loop of reactor. Returns -1 if the eventfd
+ * could not be created or watched.
+ */
+int iodone_init(struct IoDone *done, struct Reactor *reactor){
+  pthread_mutex_init(&done->lock, NULL);
+  done->head = NULL;
+  done->tail = NULL;
+  done->watcher.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  done->watcher.callback = run_done;
+  if(done->watcher.fd < 0){
+    return -1;
+  }
+
+  return reactor_add(reactor, &done->watcher, EPOLLIN);
+}
+
+static void run_done(struct Reactor *reactor, struct Watcher *watcher, uint32_t events){
+  struct IoDone *done = (struct IoDone *)watcher;
+  struct IoJob *job, *next;
+  uint64_t count;
+
+  if(read(watcher->fd, &count, sizeof(count)) < 0 && errno != EAGAIN){
+    return;
+  }
+
+  pthread_mutex_lock(&done->lock);
+  job = done->head;
+  done->head = NULL;
+  done->tail = NULL;
+  pthread_mutex_unlock(&done->lock);
+
+  for(; job != NULL; job = next){
+    next = job->next;
+    job->done(job);
+  }
+}
+
+/*
+ * Jobs run so far, and how long the ones queued since the last report
+ * waited for a thread, on average and at most.
+ */
+void iopool_report(struct IoPool *pool){
+  unsigned long long jobs, queued_jobs, wait_ns, max;
+
+  jobs = atomic_load_explicit(&pool->jobs, memory_order_relaxed);
+  queued_jobs = jobs - atomic_load_explicit(&pool->inline_jobs, memory_order_relaxed);
+  wait_ns = atomic_load_explicit(&pool->wait_ns, memory_order_relaxed);
+  max = atomic_exchange_explicit(&pool->max_wait_ns, 0, memory_order_relaxed);
+
+  printf("Disk pool: %d threads, %llu jobs (%llu stolen, %llu run inline), %d queued, "
+         "wait %.3f ms avg, %.3f ms max\n", pool->threads, jobs,
+         atomic_load_explicit(&pool->stolen, memory_order_relaxed),
+         atomic_load_explicit(&pool->inline_jobs, memory_order_relaxed),
+         atomic_load_explicit(&pool->queued, memory_order_relaxed),
+         queued_jobs > pool->reported_jobs ?
+           (wait_ns - pool->reported_wait_ns) / 1e6 / (queued_jobs - pool->reported_jobs) : 0.0,
+         max / 1e6);
+  pool->reported_jobs = queued_jobs;
+  pool->reported_wait_ns = wait_ns;
+}
@@ -0,0 +1,84 @@
+#ifndef IOPOOL_H
+#define IOPOOL_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "reactor.h"
+
+#define IO_THREADS_DEFAULT 4
+#define IO_DEPTH_DEFAULT 1024
+
+// bucket i counts queue waits under 2^i microseconds, the last one all longer ones
+#define IO_WAIT_BUCKETS 28
+
+struct IoJob;
+
+typedef void (*io_job_cb)(struct IoJob *job);
+
+/*
+ * A blocking filesystem operation handed off by an event loop. work runs
+ * on a pool thread, done back on the event loop that submitted it, once
+ * work has returned. Embed it as the first member of the job's own struct.
+ */
+struct IoJob{
+  io_job_cb work;
+  io_job_cb done;
+  struct IoDone *target;
+  struct timespec queued;
+  struct IoJob *next;
+};
+
+/*
+ * Where finished jobs go back to one event loop: an eventfd the loop
+ * watches, and the jobs in the order they finished.
+ */
+struct IoDone{
+  struct Watcher watcher;
+  pthread_mutex_t lock;
+  struct IoJob *head;
+  struct IoJob *tail;
+};
+
+/*
+ * Threads that run IoJobs. Each has its own queue, which submissions are
+ * spread over in turn; a thread whose queue is empty takes the oldest job
+ * of another one, so one slow disk call never holds up the jobs queued
+ * behind it while other threads are idle. Once depth jobs are waiting a
+ * submission runs on the caller instead, so a stuck disk slows the event
+ * loops down rather than letting the queues grow without bound.
+ */
+struct IoQueue{
+  pthread_mutex_t lock;
+  struct IoJob *head;
+  struct IoJob *tail;
+};
+
+struct IoPool{
+  int threads;
+  int depth;
+  struct IoQueue *queues;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  atomic_int queued;
+  atomic_uint next;
+
+  atomic_ullong jobs;
+  atomic_ullong stolen;
+  atomic_ullong inline_jobs;
+  atomic_ullong wait_ns;
+  atomic_ullong max_wait_ns;
+  atomic_ullong wait_buckets[IO_WAIT_BUCKETS];
+
+  // where the last iopool_report left off; only the reporter uses them
+  unsigned long long reported_jobs;
+  unsigned long long reported_wait_ns;
+};
+
+int iopool_start(struct IoPool *pool, int threads, int depth);
+void iopool_submit(struct IoPool *pool, struct IoJob *job, struct IoDone *target);
+void iopool_report(struct IoPool *pool);
+int iodone_init(struct IoDone *done, struct Reactor *reactor);
+
+#endif
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "layout.h"
+
+// FNV-1a; only needs to spread names evenly and never change
+static uint32_t shard_hash(const char *filename){
+  uint32_t hash = 2166136261u;
+
+  while(*filename != '\0'){
+    hash = (hash ^ (unsigned char)*filename++) * 16777619u;
+  }
+
+  return hash;
+}
+
+enum Layout layout_detect(const char *root){
+  char marker[PATH_MAX];
+  struct stat marker_stats;
+
+  snprintf(marker, PATH_MAX, "%s/" LAYOUT_MARKER, root);
+  if(stat(marker, &marker_stats) == 0 && S_ISDIR(marker_stats.st_mode)){
+    return LAYOUT_SHARDED;
+  }
+
+  return LAYOUT_FLAT;
+}
+
+bool layout_mark(const char *root){
+  char marker[PATH_MAX];
+
+  snprintf(marker, PATH_MAX, "%s/" LAYOUT_MARKER, root);
+  return mkdir(marker, 0755) == 0 || errno == EEXIST;
+}
+
+/* Whether root holds any files the flat way, directly inside it. */
+bool layout_has_flat_files(const char *root){
+  struct dirent *ent;
+  bool found = false;
+  DIR *dir = opendir(root);
+
+  if(dir == NULL){
+    return false;
+  }
+
+  while(!found && (ent = readdir(dir)) != NULL){
+    found = ent->d_type == DT_REG;
+  }
+
+  closedir(dir);
+  return found;
+}
+
+/*
+ * Whether root holds any files in either layout. Shard directories are
+ * only ever made for a file, so one of those counts as well.
+ */
+bool layout_has_files(const char *root){
+  struct dirent *ent;
+  bool found = false;
+  DIR *dir = opendir(root);
+
+  if(dir == NULL){
+    return false;
+  }
+
+  while(!found && (ent = readdir(dir)) != NULL){
+    found = ent->d_type == DT_REG || (ent->d_type == DT_DIR && ent->d_name[0] != '.');
+  }
+
+  closedir(dir);
+  return found;
+}
+
+void layout_path(char *path, const char *root, enum Layout layout, const char *filename){
+  uint32_t hash;
+
+  if(layout == LAYOUT_FLAT){
+    snprintf(path, PATH_MAX, "%s/%s", root, filename);
+    return;
+  }
+
+  hash = shard_hash(filename);
+  snprintf(path, PATH_MAX, "%s/%02x/%02x/%s", root, hash >> 24, (hash >> 16) & 0xFF,
+           filename);
+}
+
+/* Creates the shard directories filename goes in, if they are not there yet. */
+bool layout_prepare(const char *root, enum Layout layout, const char *filename){
+  char path[PATH_MAX];
+  uint32_t hash;
+
+  if(layout == LAYOUT_FLAT){
+    return true;
+  }
+
+  hash = shard_hash(filename);
+  snprintf(path, PATH_MAX, "%s/%02x", root, hash >> 24);
+  if(mkdir(path, 0755) < 0 && errno != EEXIST){
+    return false;
+  }
+
+  snprintf(path, PATH_MAX, "%s/%02x/%02x", root, hash >> 24, (hash >> 16) & 0xFF);
+  return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
@@ -0,0 +1,31 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <stdbool.h>
+
+/*
+ * Where a stored file lives under the storage root. LAYOUT_FLAT keeps every
+ * file directly in the root, as BitDrive always has. LAYOUT_SHARDED spreads
+ * them over 256 x 256 subdirectories picked by a hash of the name, so no
+ * directory grows past a few dozen entries per million files:
+ *
+ *   server_files/3f/a2/report.pdf
+ *
+ * Clients still only ever see the name. A sharded root is marked by an
+ * empty LAYOUT_MARKER directory, so a flat store is never misread.
+ */
+enum Layout{
+  LAYOUT_FLAT,
+  LAYOUT_SHARDED
+};
+
+#define LAYOUT_MARKER ".sharded"
+
+enum Layout layout_detect(const char *root);
+bool layout_mark(const char *root);
+bool layout_has_flat_files(const char *root);
+bool layout_has_files(const char *root);
+void layout_path(char *path, const char *root, enum Layout layout, const char *filename);
+bool layout_prepare(const char *root, enum Layout layout, const char *filename);
+
+#endif
@@ -0,0 +1,187 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "logger.h"
+
+/*
+ * One thread's lines, as a stream of bytes: the thread appends at head,
+ * the writer takes everything up to head and moves tail after it. Both
+ * only grow; their difference is what is waiting.
+ */
+struct LogRing{
+  char data[LOG_RING];
+  atomic_size_t head;
+  atomic_size_t tail;
+  atomic_ullong dropped;
+  struct LogRing *next;
+
+  // only the owning thread touches these
+  time_t second;
+  char stamp[32];
+  int this_second;
+};
+
+enum LogLevel log_level = LOG_INFO;
+
+static const char *level_names[] = { "OFF", "ERROR", "WARN", "INFO", "DEBUG" };
+
+static int log_rate = LOG_RATE_DEFAULT;
+static _Atomic(struct LogRing *) rings;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct LogRing *own_ring;
+
+static struct LogRing *thread_ring();
+static void push(struct LogRing *ring, const char *line, size_t len);
+static void *run_writer(void *arg);
+
+/*
+ * Starts the writer. Lines logged before it are kept and written once it
+ * runs; what is still in the rings at exit is written then. Returns -1 if
+ * the thread could not be started.
+ */
+int logger_start(enum LogLevel level, int rate){
+  pthread_t id;
+
+  log_level = level;
+  log_rate = rate;
+  if(pthread_create(&id, NULL, run_writer, NULL) != 0){
+    return -1;
+  }
+
+  pthread_detach(id);
+  atexit(logger_flush);
+  return 0;
+}
+
+/* The level named name, or -1 if there is none. */
+int logger_parse_level(const char *name){
+  int level;
+
+  for(level = LOG_OFF; level <= LOG_DEBUG; level++){
+    if(strcasecmp(name, level_names[level]) == 0){
+      return level;
+    }
+  }
+
+  return -1;
+}
+
+void log_write(enum LogLevel level, const char *format, ...){
+  struct LogRing *ring = thread_ring();
+  char line[LOG_LINE + 1];
+  struct timespec now;
+  struct tm local;
+  va_list args;
+  int len, written;
+
+  if(ring == NULL){
+    return;
+  }
+
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+  if(now.tv_sec != ring->second){
+    ring->second = now.tv_sec;
+    ring->this_second = 0;
+    localtime_r(&now.tv_sec, &local);
+    strftime(ring->stamp, sizeof(ring->stamp), "%Y-%m-%d %H:%M:%S", &local);
+  }
+
+  if(level >= LOG_INFO && log_rate > 0 && ++ring->this_second > log_rate){
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  len = snprintf(line, LOG_LINE, "%s.%03ld %-5s ", ring->stamp, now.tv_nsec / 1000000,
+                 level_names[level]);
+  va_start(args, format);
+  written = vsnprintf(line + len, LOG_LINE - len, format, args);
+  va_end(args);
+  if(written > 0){
+    len = len + written < LOG_LINE ? len + written : LOG_LINE - 1;
+  }
+
+  line[len++] = '\n';
+  push(ring, line, len);
+}
+
+/* Writes out everything logged so far. */
+void logger_flush(){
+  unsigned long long dropped = 0;
+  struct LogRing *ring;
+  size_t head, tail, start, first;
+
+  pthread_mutex_lock(&drain_lock);
+  for(ring = atomic_load(&rings); ring != NULL; ring = ring->next){
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    dropped += atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    if(head == tail){
+      continue;
+    }
+
+    start = tail % LOG_RING;
+    first = head - tail < LOG_RING - start ? head - tail : LOG_RING - start;
+    fwrite(ring->data + start, 1, first, stdout);
+    fwrite(ring->data, 1, head - tail - first, stdout);
+    atomic_store_explicit(&ring->tail, head, memory_order_release);
+  }
+
+  if(dropped > 0){
+    printf("Log: %llu lines dropped\n", dropped);
+  }
+
+  fflush(stdout);
+  pthread_mutex_unlock(&drain_lock);
+}
+
+/* The calling thread's ring, set up the first time it logs. */
+static struct LogRing *thread_ring(){
+  struct LogRing *ring = own_ring;
+
+  if(ring != NULL){
+    return ring;
+  }
+
+  ring = calloc(1, sizeof(struct LogRing));
+  if(ring == NULL){
+    return NULL;
+  }
+
+  ring->next = atomic_load(&rings);
+  while(!atomic_compare_exchange_weak(&rings, &ring->next, ring));
+  own_ring = ring;
+  return ring;
+}
+
+static void push(struct LogRing *ring, const char *line, size_t len){
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  size_t start = head % LOG_RING, first;
+
+  if(LOG_RING - (head - tail) < len){
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  first = len < LOG_RING - start ? len : LOG_RING - start;
+  memcpy(ring->data + start, line, first);
+  memcpy(ring->data, line + first, len - first);
+  atomic_store_explicit(&ring->head, head + len, memory_order_release);
+}
+
+static void *run_writer(void *arg){
+  struct timespec pause = { 0, LOG_DRAIN_MS * 1000000L };
+
+  while(true){
+    nanosleep(&pause, NULL);
+    logger_flush();
+  }
+
+  return NULL;
+}
@@ -0,0 +1,43 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+
+#define LOG_RING (256 * 1024)
+#define LOG_LINE 1024
+#define LOG_RATE_DEFAULT 10000
+#define LOG_DRAIN_MS 20
+
+enum LogLevel{
+  LOG_OFF,
+  LOG_ERROR,
+  LOG_WARN,
+  LOG_INFO,
+  LOG_DEBUG
+};
+
+/*
+ * Leveled logging that never waits on stdout. Each thread formats its lines
+ * into a ring of its own, which a background writer empties every
+ * LOG_DRAIN_MS and writes out in batches. Producers take no locks: when a
+ * ring is full, because stdout is slow or a thread is logging faster than
+ * it drains, the line is dropped and counted instead. Info and debug lines
+ * are also limited to rate per thread per second (0 for no limit), so a
+ * flood of requests cannot flood the log; errors and warnings are not.
+ * Lines from different threads come out in the order the writer finds
+ * them, each stamped with the time it was logged.
+ */
+extern enum LogLevel log_level;
+
+#define log_error(...) do{ if(log_level >= LOG_ERROR) log_write(LOG_ERROR, __VA_ARGS__); }while(0)
+#define log_warn(...) do{ if(log_level >= LOG_WARN) log_write(LOG_WARN, __VA_ARGS__); }while(0)
+#define log_info(...) do{ if(log_level >= LOG_INFO) log_write(LOG_INFO, __VA_ARGS__); }while(0)
+#define log_debug(...) do{ if(log_level >= LOG_DEBUG) log_write(LOG_DEBUG, __VA_ARGS__); }while(0)
+
+int logger_start(enum LogLevel level, int rate);
+int logger_parse_level(const char *name);
+void log_write(enum LogLevel level, const char *format, ...)
+  __attribute__((format(printf, 2, 3)));
+void logger_flush();
+
+#endif
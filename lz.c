@@ -0,0 +1,232 @@
+#include <string.h>
+#include "lz.h"
+
+static inline uint32_t read32(const unsigned char *p){
+  uint32_t value;
+
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static inline uint32_t hash4(const unsigned char *p){
+  return (read32(p) * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* How far the bytes at a and b agree, up to limit, a word at a time. */
+static inline int common_length(const unsigned char *a, const unsigned char *b, int limit){
+  uint64_t x, y;
+  int len = 0;
+
+  while(len + 8 <= limit){
+    memcpy(&x, a + len, 8);
+    memcpy(&y, b + len, 8);
+    if(x != y){
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      return len + (__builtin_clzll(x ^ y) >> 3);
+#else
+      return len + (__builtin_ctzll(x ^ y) >> 3);
+#endif
+    }
+
+    len += 8;
+  }
+
+  while(len < limit && a[len] == b[len]){
+    len++;
+  }
+
+  return len;
+}
+
+static inline void insert(struct LzState *state, const unsigned char *src, int pos){
+  uint32_t h = hash4(src + pos);
+
+  state->chain[pos] = state->head[h] >= 0 ? pos - state->head[h] : 0;
+  state->head[h] = pos;
+}
+
+static unsigned char *put_length(unsigned char *op, int len){
+  while(len >= 255){
+    *op++ = 255;
+    len -= 255;
+  }
+
+  *op++ = len;
+  return op;
+}
+
+/*
+ * Writes one sequence, or returns NULL if it would pass end. A match_len
+ * of 0 makes it the closing, literals only sequence.
+ */
+static unsigned char *put_sequence(unsigned char *op, unsigned char *end,
+                                   const unsigned char *literals, int lit_len,
+                                   int match_len, int distance){
+  int match_code = match_len - LZ_MIN_MATCH;
+  unsigned char *token = op;
+
+  if(end - op < 1 + lit_len + lit_len / 255 + 1 + 2 + (match_len / 255 + 1)){
+    return NULL;
+  }
+
+  op++;
+  *token = (lit_len < 15 ? lit_len : 15) << 4;
+  if(lit_len >= 15){
+    op = put_length(op, lit_len - 15);
+  }
+
+  memcpy(op, literals, lit_len);
+  op += lit_len;
+  if(match_len == 0){
+    return op;
+  }
+
+  *op++ = distance & 0xFF;
+  *op++ = distance >> 8;
+  *token |= match_code < 15 ? match_code : 15;
+  if(match_code >= 15){
+    op = put_length(op, match_code - 15);
+  }
+
+  return op;
+}
+
+/*
+ * Compresses len (at most LZ_WINDOW) bytes into dst. Returns the
+ * compressed length, or 0 if it does not fit in capacity, which callers
+ * use to send data that does not compress as it is.
+ */
+int lz_compress(struct LzState *state, const unsigned char *src, int len,
+                unsigned char *dst, int capacity, int level){
+  unsigned char *op = dst, *end = dst + capacity;
+  int pos = 0, anchor = 0, candidate, best_len, best_distance, match_len, attempts, p;
+
+  memset(state->head, 0xFF, sizeof(state->head));
+  while(pos + LZ_MIN_MATCH <= len){
+    candidate = state->head[hash4(src + pos)];
+    insert(state, src, pos);
+
+    best_len = 0;
+    best_distance = 0;
+    attempts = level <= LZ_LEVEL_MIN ? 1 : 1 << (level < LZ_LEVEL_MAX ? level : LZ_LEVEL_MAX);
+    while(candidate >= 0 && attempts-- > 0){
+      if(read32(src + candidate) == read32(src + pos)){
+        match_len = LZ_MIN_MATCH + common_length(src + candidate + LZ_MIN_MATCH,
+                                                 src + pos + LZ_MIN_MATCH,
+                                                 len - pos - LZ_MIN_MATCH);
+        if(match_len > best_len){
+          best_len = match_len;
+          best_distance = pos - candidate;
+          if(pos + match_len == len){
+            break;
+          }
+        }
+      }
+
+      if(state->chain[candidate] == 0){
+        break;
+      }
+
+      candidate -= state->chain[candidate];
+    }
+
+    if(best_len == 0){
+      // the longer nothing has matched, the bigger the steps at level 1
+      pos += level <= LZ_LEVEL_MIN ? 1 + ((pos - anchor) >> 6) : 1;
+      continue;
+    }
+
+    op = put_sequence(op, end, src + anchor, pos - anchor, best_len, best_distance);
+    if(op == NULL){
+      return 0;
+    }
+
+    // deeper levels also index the positions a match covers
+    if(level > LZ_LEVEL_MIN){
+      for(p = pos + 1; p < pos + best_len && p + LZ_MIN_MATCH <= len; p++){
+        insert(state, src, p);
+      }
+    }
+
+    pos += best_len;
+    anchor = pos;
+  }
+
+  op = put_sequence(op, end, src + anchor, len - anchor, 0, 0);
+  return op == NULL ? 0 : op - dst;
+}
+
+static int get_length(const unsigned char *src, int len, int *ip, int value){
+  unsigned char byte;
+
+  do {
+    if(*ip >= len){
+      return -1;
+    }
+
+    byte = src[(*ip)++];
+    value += byte;
+  } while(byte == 255);
+
+  return value;
+}
+
+/*
+ * Decompresses a block into dst. Every length and distance is checked
+ * against both buffers, since the block comes off the network. Returns the
+ * decompressed length, or -1 if the block is malformed or does not fit.
+ */
+int lz_decompress(const unsigned char *src, int len, unsigned char *dst, int capacity){
+  int ip = 0, op = 0, lit_len, match_len, distance, i;
+  unsigned char token;
+
+  while(ip < len){
+    token = src[ip++];
+    lit_len = token >> 4;
+    if(lit_len == 15 && (lit_len = get_length(src, len, &ip, lit_len)) < 0){
+      return -1;
+    }
+
+    if(lit_len > len - ip || lit_len > capacity - op){
+      return -1;
+    }
+
+    memcpy(dst + op, src + ip, lit_len);
+    ip += lit_len;
+    op += lit_len;
+    if(ip == len){
+      break;
+    }
+
+    if(len - ip < 2){
+      return -1;
+    }
+
+    distance = src[ip] | src[ip + 1] << 8;
+    ip += 2;
+    match_len = token & 15;
+    if(match_len == 15 && (match_len = get_length(src, len, &ip, match_len)) < 0){
+      return -1;
+    }
+
+    match_len += LZ_MIN_MATCH;
+    if(distance == 0 || distance > op || match_len > capacity - op){
+      return -1;
+    }
+
+    // a match may overlap what it produces, so copy forwards
+    if(distance >= match_len){
+      memcpy(dst + op, dst + op - distance, match_len);
+    }
+
+    else {
+      for(i = 0; i < match_len; i++){
+        dst[op + i] = dst[op + i - distance];
+      }
+    }
+
+    op += match_len;
+  }
+
+  return op;
+}
@@ -0,0 +1,36 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+
+/*
+ * A small LZ77 codec in the style of LZ4, for blocks of up to LZ_WINDOW
+ * bytes compressed independently. A block is a run of sequences: a token
+ * byte whose high nibble is the literal count and low nibble the match
+ * length minus LZ_MIN_MATCH (15 in either means more length bytes follow,
+ * each adding up to 255), the literals, then a u16 little endian match
+ * distance. The last sequence stops after its literals.
+ *
+ * The level sets how hard the compressor looks for matches: level 1
+ * takes the first candidate and skips ahead faster over data that does
+ * not match, higher levels walk a hash chain up to 2^level candidates.
+ */
+#define LZ_WINDOW 65536
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 15
+#define LZ_LEVEL_MIN 1
+#define LZ_LEVEL_MAX 9
+
+// the most a block can grow: a length byte per 255 literals, and a token
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+struct LzState{
+  int32_t head[1 << LZ_HASH_BITS];
+  uint16_t chain[LZ_WINDOW];
+};
+
+int lz_compress(struct LzState *state, const unsigned char *src, int len,
+                unsigned char *dst, int capacity, int level);
+int lz_decompress(const unsigned char *src, int len, unsigned char *dst, int capacity);
+
+#endif
@@ -0,0 +1,386 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "server.h"
+
+#define METRICS_REQUEST 1024
+
+/*
+ * Live metrics: per command counts, errors and latency histograms, kept
+ * per worker in struct Worker next to its session and byte counters (see
+ * struct CommandStats). Recording is a few relaxed atomic adds to lines
+ * only that worker writes; readers add the workers up without locking, so
+ * a snapshot may be a command or two out of step between counters.
+ *
+ * The disk pool keeps a histogram of how long its jobs waited for a thread
+ * the same way (see struct IoPool), which is reported next to them.
+ *
+ * They can be read with the STATS command, as the same text the -s report
+ * prints, or over HTTP from a listener on 127.0.0.1 (-m port), which
+ * serves /metrics in the Prometheus text format and that text otherwise.
+ */
+static const char *command_names[CMD_COUNT] = {
+  "list", "upload", "download", "delete", "have", "signatures", "stats"
+};
+
+struct CommandTotals{
+  unsigned long long count;
+  unsigned long long errors;
+  unsigned long long total_ns;
+  unsigned long long disk_ns;
+  unsigned long long buckets[LATENCY_BUCKETS];
+};
+
+struct Totals{
+  struct CommandTotals commands[CMD_COUNT];
+  unsigned long long accepted;
+  unsigned long long bytes_in;
+  unsigned long long bytes_out;
+  int active;
+  int transfers;
+  unsigned long long disk_waits;
+  unsigned long long disk_wait_ns;
+  unsigned long long disk_wait_buckets[IO_WAIT_BUCKETS];
+};
+
+static void *serve_metrics(void *arg);
+
+uint64_t metrics_now(){
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Counts a command that just completed, ok or not, on the worker it ran on,
+ * and traces it from its request to now.
+ */
+void metrics_record(struct Worker *worker, enum Command command, const struct Timing *timing,
+                    bool ok){
+  struct CommandStats *stats = &worker->commands[command];
+  uint64_t elapsed = metrics_now() - timing->start;
+  uint64_t us = elapsed / 1000;
+  int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+
+  if(bucket >= LATENCY_BUCKETS){
+    bucket = LATENCY_BUCKETS - 1;
+  }
+
+  atomic_fetch_add_explicit(&stats->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&stats->total_ns, elapsed, memory_order_relaxed);
+  atomic_fetch_add_explicit(&stats->disk_ns, timing->disk_ns, memory_order_relaxed);
+  atomic_fetch_add_explicit(&stats->buckets[bucket], 1, memory_order_relaxed);
+  if(!ok){
+    atomic_fetch_add_explicit(&stats->errors, 1, memory_order_relaxed);
+  }
+
+  if(tracing){
+    trace_span(command_names[command], "command", timing->client, timing->start, -1,
+               ok ? NULL : "failed");
+  }
+}
+
+static void add_up(struct Totals *totals){
+  struct CommandStats *stats;
+  struct CommandTotals *command;
+  int i, c, b;
+
+  memset(totals, 0, sizeof(*totals));
+  for(i = 0; i < config.workers; i++){
+    totals->accepted += atomic_load_explicit(&workers[i].accepted, memory_order_relaxed);
+    totals->active += atomic_load_explicit(&workers[i].active, memory_order_relaxed);
+    totals->transfers += atomic_load_explicit(&workers[i].transfers, memory_order_relaxed);
+    totals->bytes_in += atomic_load_explicit(&workers[i].bytes_in, memory_order_relaxed);
+    totals->bytes_out += atomic_load_explicit(&workers[i].bytes_out, memory_order_relaxed);
+
+    for(c = 0; c < CMD_COUNT; c++){
+      stats = &workers[i].commands[c];
+      command = &totals->commands[c];
+      command->count += atomic_load_explicit(&stats->count, memory_order_relaxed);
+      command->errors += atomic_load_explicit(&stats->errors, memory_order_relaxed);
+      command->total_ns += atomic_load_explicit(&stats->total_ns, memory_order_relaxed);
+      command->disk_ns += atomic_load_explicit(&stats->disk_ns, memory_order_relaxed);
+      for(b = 0; b < LATENCY_BUCKETS; b++){
+        command->buckets[b] += atomic_load_explicit(&stats->buckets[b], memory_order_relaxed);
+      }
+    }
+  }
+
+  totals->disk_wait_ns = atomic_load_explicit(&disk_pool.wait_ns, memory_order_relaxed);
+  for(b = 0; b < IO_WAIT_BUCKETS; b++){
+    totals->disk_wait_buckets[b] = atomic_load_explicit(&disk_pool.wait_buckets[b],
+                                                        memory_order_relaxed);
+    totals->disk_waits += totals->disk_wait_buckets[b];
+  }
+}
+
+/*
+ * The upper bound of the bucket the given share of count samples falls in,
+ * in milliseconds, so within a factor of two of the real percentile.
+ */
+static double percentile(const unsigned long long *buckets, int bucket_count,
+                         unsigned long long count, double share){
+  unsigned long long seen = 0, rank = count * share;
+  int b;
+
+  for(b = 0; b < bucket_count - 1; b++){
+    seen += buckets[b];
+    if(seen > rank){
+      break;
+    }
+  }
+
+  return (1ULL << b) / 1000.0;
+}
+
+static void append(char *buffer, size_t size, size_t *len, const char *format, ...){
+  va_list args;
+  int written;
+
+  va_start(args, format);
+  written = vsnprintf(buffer + *len, size - *len, format, args);
+  va_end(args);
+  if(written > 0){
+    *len = *len + written < size ? *len + written : size - 1;
+  }
+}
+
+static void append_commands(char *buffer, size_t size, size_t *len,
+                            const struct Totals *totals){
+  const struct CommandTotals *command;
+  int c;
+
+  append(buffer, size, len, "%-10s  %8s  %6s  %8s  %8s  %8s  %8s  %8s  %8s\n", "Command",
+         "count", "errors", "avg ms", "disk ms", "net ms", "p50 ms", "p99 ms", "p99.9 ms");
+  for(c = 0; c < CMD_COUNT; c++){
+    command = &totals->commands[c];
+    if(command->count == 0){
+      continue;
+    }
+
+    append(buffer, size, len, "%-10s  %8llu  %6llu  %8.3f  %8.3f  %8.3f  %8.3f  %8.3f  %8.3f\n",
+           command_names[c], command->count, command->errors,
+           command->total_ns / 1e6 / command->count, command->disk_ns / 1e6 / command->count,
+           (command->total_ns - command->disk_ns) / 1e6 / command->count,
+           percentile(command->buckets, LATENCY_BUCKETS, command->count, 0.50),
+           percentile(command->buckets, LATENCY_BUCKETS, command->count, 0.99),
+           percentile(command->buckets, LATENCY_BUCKETS, command->count, 0.999));
+  }
+}
+
+/*
+ * A summary for people: sessions, transfers and bytes, how long disk jobs
+ * queued for a thread, then one line per command seen so far. disk ms is
+ * the average time a command waited on the disk pool, net ms the rest of
+ * its time.
+ */
+char *metrics_text(struct Arena *arena){
+  size_t size = (CMD_COUNT + 5) * 128, len = 0;
+  char *buffer = arena_alloc(arena, size);
+  struct Totals totals;
+
+  add_up(&totals);
+  append(buffer, size, &len, "Sessions: %d active, %llu accepted; %d transfers in flight\n",
+         totals.active, totals.accepted, totals.transfers);
+  append(buffer, size, &len, "Bytes: %.1f MB in, %.1f MB out\n", totals.bytes_in / 1e6,
+         totals.bytes_out / 1e6);
+  append(buffer, size, &len, "Disk queue: %llu jobs waited %.3f ms avg, p50 %.3f ms, "
+         "p99 %.3f ms, p99.9 %.3f ms; %d queued now\n", totals.disk_waits,
+         totals.disk_waits > 0 ? totals.disk_wait_ns / 1e6 / totals.disk_waits : 0.0,
+         percentile(totals.disk_wait_buckets, IO_WAIT_BUCKETS, totals.disk_waits, 0.50),
+         percentile(totals.disk_wait_buckets, IO_WAIT_BUCKETS, totals.disk_waits, 0.99),
+         percentile(totals.disk_wait_buckets, IO_WAIT_BUCKETS, totals.disk_waits, 0.999),
+         atomic_load_explicit(&disk_pool.queued, memory_order_relaxed));
+  append_commands(buffer, size, &len, &totals);
+  return buffer;
+}
+
+/* The same in the Prometheus text exposition format. */
+char *metrics_prometheus(struct Arena *arena){
+  size_t size = (CMD_COUNT * (LATENCY_BUCKETS + 8) + IO_WAIT_BUCKETS + 40) * 128, len = 0;
+  char *buffer = arena_alloc(arena, size);
+  const struct CommandTotals *command;
+  unsigned long long cumulative;
+  struct Totals totals;
+  int c, b;
+
+  buffer[0] = '\0';
+  add_up(&totals);
+  append(buffer, size, &len,
+         "# HELP bitdrive_sessions_active Open client sessions.\n"
+         "# TYPE bitdrive_sessions_active gauge\n"
+         "bitdrive_sessions_active %d\n"
+         "# HELP bitdrive_sessions_accepted_total Client sessions accepted.\n"
+         "# TYPE bitdrive_sessions_accepted_total counter\n"
+         "bitdrive_sessions_accepted_total %llu\n"
+         "# HELP bitdrive_transfers_in_flight Uploads and downloads under way.\n"
+         "# TYPE bitdrive_transfers_in_flight gauge\n"
+         "bitdrive_transfers_in_flight %d\n"
+         "# HELP bitdrive_received_bytes_total Bytes read from clients.\n"
+         "# TYPE bitdrive_received_bytes_total counter\n"
+         "bitdrive_received_bytes_total %llu\n"
+         "# HELP bitdrive_sent_bytes_total Bytes written to clients.\n"
+         "# TYPE bitdrive_sent_bytes_total counter\n"
+         "bitdrive_sent_bytes_total %llu\n"
+         "# HELP bitdrive_disk_jobs_queued Disk pool jobs waiting for a thread.\n"
+         "# TYPE bitdrive_disk_jobs_queued gauge\n"
+         "bitdrive_disk_jobs_queued %d\n",
+         totals.active, totals.accepted, totals.transfers, totals.bytes_in, totals.bytes_out,
+         atomic_load_explicit(&disk_pool.queued, memory_order_relaxed));
+
+  append(buffer, size, &len,
+         "# HELP bitdrive_disk_queue_wait_seconds Time disk pool jobs waited for a thread.\n"
+         "# TYPE bitdrive_disk_queue_wait_seconds histogram\n");
+  cumulative = 0;
+  for(b = 0; b < IO_WAIT_BUCKETS - 1; b++){
+    cumulative += totals.disk_wait_buckets[b];
+    append(buffer, size, &len, "bitdrive_disk_queue_wait_seconds_bucket{le=\"%.6f\"} %llu\n",
+           (1ULL << b) / 1e6, cumulative);
+  }
+
+  append(buffer, size, &len,
+         "bitdrive_disk_queue_wait_seconds_bucket{le=\"+Inf\"} %llu\n"
+         "bitdrive_disk_queue_wait_seconds_sum %.9f\n"
+         "bitdrive_disk_queue_wait_seconds_count %llu\n",
+         totals.disk_waits, totals.disk_wait_ns / 1e9, totals.disk_waits);
+
+  append(buffer, size, &len,
+         "# HELP bitdrive_command_errors_total Commands that failed.\n"
+         "# TYPE bitdrive_command_errors_total counter\n");
+  for(c = 0; c < CMD_COUNT; c++){
+    append(buffer, size, &len, "bitdrive_command_errors_total{command=\"%s\"} %llu\n",
+           command_names[c], totals.commands[c].errors);
+  }
+
+  append(buffer, size, &len,
+         "# HELP bitdrive_command_disk_seconds_total Time commands waited on the disk pool.\n"
+         "# TYPE bitdrive_command_disk_seconds_total counter\n");
+  for(c = 0; c < CMD_COUNT; c++){
+    append(buffer, size, &len, "bitdrive_command_disk_seconds_total{command=\"%s\"} %.9f\n",
+           command_names[c], totals.commands[c].disk_ns / 1e9);
+  }
+
+  append(buffer, size, &len,
+         "# HELP bitdrive_command_duration_seconds Time from request to last reply byte.\n"
+         "# TYPE bitdrive_command_duration_seconds histogram\n");
+  for(c = 0; c < CMD_COUNT; c++){
+    command = &totals.commands[c];
+    cumulative = 0;
+    for(b = 0; b < LATENCY_BUCKETS - 1; b++){
+      cumulative += command->buckets[b];
+      append(buffer, size, &len,
+             "bitdrive_command_duration_seconds_bucket{command=\"%s\",le=\"%.6f\"} %llu\n",
+             command_names[c], (1ULL << b) / 1e6, cumulative);
+    }
+
+    append(buffer, size, &len,
+           "bitdrive_command_duration_seconds_bucket{command=\"%s\",le=\"+Inf\"} %llu\n"
+           "bitdrive_command_duration_seconds_sum{command=\"%s\"} %.9f\n"
+           "bitdrive_command_duration_seconds_count{command=\"%s\"} %llu\n",
+           command_names[c], command->count, command_names[c], command->total_ns / 1e9,
+           command_names[c], command->count);
+  }
+
+  return buffer;
+}
+
+/* The command table of the -s report. */
+void report_metrics(){
+  struct Arena arena = {0};
+  size_t size = (CMD_COUNT + 1) * 128, len = 0;
+  char *buffer = arena_alloc(&arena, size);
+  struct Totals totals;
+
+  add_up(&totals);
+  append_commands(buffer, size, &len, &totals);
+  printf("%s", buffer);
+  arena_reset(&arena);
+}
+
+/*
+ * Starts the metrics listener on 127.0.0.1:port. One thread answers one
+ * request at a time; scrapes are rare and cheap, and it never touches a
+ * worker.
+ */
+void metrics_start(int port){
+  struct sockaddr_in addr;
+  pthread_t thread;
+  int listenfd, optval = 1;
+
+  listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(listenfd < 0){
+    error_occurred("ERROR opening metrics socket");
+  }
+
+  setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+  bzero(&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if(bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenfd, 16) < 0){
+    error_occurred("ERROR on binding metrics socket");
+  }
+
+  if(pthread_create(&thread, NULL, serve_metrics, (void *)(intptr_t)listenfd) != 0){
+    error_occurred("ERROR starting metrics listener");
+  }
+
+  pthread_detach(thread);
+}
+
+static void *serve_metrics(void *arg){
+  int listenfd = (intptr_t)arg, clientfd;
+  struct timeval timeout = {1, 0};
+  char request[METRICS_REQUEST], header[256];
+  struct Arena arena = {0};
+  ssize_t len;
+  char *body;
+
+  while(true){
+    clientfd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+    if(clientfd < 0){
+      if(errno != EINTR && errno != ECONNABORTED){
+        perror("ERROR accepting metrics request");
+        sleep(1);
+      }
+
+      continue;
+    }
+
+    // a client that never sends its request only holds us up this long
+    setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(clientfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    len = read(clientfd, request, METRICS_REQUEST - 1);
+    request[len > 0 ? len : 0] = '\0';
+
+    if(strncmp(request, "GET /metrics", 12) == 0){
+      body = metrics_prometheus(&arena);
+    }
+
+    else {
+      body = metrics_text(&arena);
+    }
+
+    snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+             "Content-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %zu\r\n"
+             "Connection: close\r\n\r\n", strlen(body));
+    if(write_full(clientfd, header, strlen(header)) == 0){
+      write_full(clientfd, body, strlen(body));
+    }
+
+    close(clientfd);
+    arena_reset(&arena);
+  }
+
+  return NULL;
+}
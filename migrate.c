@@ -0,0 +1,80 @@
+/*
+ * Converts a flat BitDrive store into the sharded layout (see layout.h):
+ * every file directly inside the store is renamed into its shard
+ * directory, and the store is marked sharded once all of them are moved.
+ * Renames stay inside one file system, so no data is copied. If it is
+ * interrupted, running it again carries on with the files still left.
+ * The server must not be running while it works.
+ *
+ * Usage: ./migrate [store]   (default server_files)
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <time.h>
+#include "layout.h"
+
+void error_occurred(const char *msg){
+  perror(msg);
+  exit(1);
+}
+
+int main(int argc, char *argv[]){
+  const char *root = argc > 1 ? argv[1] : "server_files";
+  char from[PATH_MAX];
+  char to[PATH_MAX];
+  struct timespec start, end;
+  struct dirent *ent;
+  long moved = 0, failed = 0;
+  DIR *dir;
+
+  if(layout_detect(root) == LAYOUT_SHARDED && !layout_has_flat_files(root)){
+    printf("%s is already sharded.\n", root);
+    return 0;
+  }
+
+  dir = opendir(root);
+  if(dir == NULL){
+    error_occurred("ERROR opening store");
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while((ent = readdir(dir)) != NULL){
+    if(ent->d_type != DT_REG){
+      continue;
+    }
+
+    snprintf(from, PATH_MAX, "%s/%s", root, ent->d_name);
+    layout_path(to, root, LAYOUT_SHARDED, ent->d_name);
+    if(!layout_prepare(root, LAYOUT_SHARDED, ent->d_name) || rename(from, to) != 0){
+      perror(from);
+      failed++;
+      continue;
+    }
+
+    if(++moved % 100000 == 0){
+      printf("%ld files moved\n", moved);
+    }
+  }
+
+  closedir(dir);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("%ld files moved in %.3f s\n", moved,
+         (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+  // a store is only marked once nothing is left behind in the flat part
+  if(failed > 0){
+    printf("%ld files could not be moved; fix them and run this again.\n", failed);
+    return 1;
+  }
+
+  if(!layout_mark(root)){
+    error_occurred("ERROR marking store");
+  }
+
+  printf("%s is now sharded.\n", root);
+  return 0;
+}
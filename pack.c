@@ -0,0 +1,245 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "server.h"
+
+/*
+ * The packed store (-Z). Every file is kept as PACK_HEADER (the magic, u32
+ * block size and u64 size of the file), a table of u64 positions where each
+ * COMPRESS_BLOCK of the file is stored plus one for the end, then the
+ * blocks. A block stored shorter than it is is compressed, and stored just
+ * as it travels in a FLAG_COMPRESSED DATA frame: u32 length and the LZ
+ * block. Any other block is stored as it is. So a download can send what
+ * is on disk either way, and only clients without the codec cost a
+ * decompression.
+ */
+static atomic_uint next_temp = 0;
+
+static void temp_path(char *path){
+  snprintf(path, PATH_MAX, PACK_DIR "/%d.%u", (int)getpid(), atomic_fetch_add(&next_temp, 1));
+}
+
+static off_t block_count(off_t size){
+  return (size + COMPRESS_BLOCK - 1) / COMPRESS_BLOCK;
+}
+
+/* Writes the packed form of filefd's size bytes to packfd. */
+static bool pack_blocks(int filefd, off_t size, int packfd){
+  struct LzState *state = slab_get(&lz_slab);
+  unsigned char *block = slab_get(&block_slab);
+  unsigned char *packed = slab_get(&block_slab);
+  off_t count = block_count(size), i, position, offset = 0;
+  unsigned char *table = calloc(count + 1, 8);
+  unsigned char header[PACK_HEADER];
+  bool written = state != NULL && block != NULL && packed != NULL && table != NULL;
+  int len, packed_len;
+
+  position = PACK_HEADER + (count + 1) * 8;
+  for(i = 0; written && i < count; i++){
+    len = size - offset < COMPRESS_BLOCK ? size - offset : COMPRESS_BLOCK;
+    written = pread(filefd, block, len, offset) == len;
+    if(!written){
+      break;
+    }
+
+    // a stored block must come out shorter than the original to read as compressed
+    packed_len = lz_compress(state, block, len, packed + 4, COMPRESS_ROOM(len),
+                             config.pack_level);
+    put_u64(table + i * 8, position);
+    if(packed_len > 0 && packed_len + 4 < len){
+      put_u32(packed, len);
+      written = pwrite(packfd, packed, packed_len + 4, position) == packed_len + 4;
+      position += packed_len + 4;
+    }
+
+    else {
+      written = pwrite(packfd, block, len, position) == len;
+      position += len;
+    }
+
+    offset += len;
+  }
+
+  put_u64(table + count * 8, position);
+  memcpy(header, PACK_MAGIC, 4);
+  put_u32(header + 4, COMPRESS_BLOCK);
+  put_u64(header + 8, size);
+  written = written && pwrite(packfd, header, PACK_HEADER, 0) == PACK_HEADER &&
+            pwrite(packfd, table, (count + 1) * 8, PACK_HEADER) == (count + 1) * 8;
+
+  slab_put(&lz_slab, state);
+  slab_put(&block_slab, block);
+  slab_put(&block_slab, packed);
+  free(table);
+  return written;
+}
+
+/*
+ * Puts a finished upload into the store: it is packed aside and the packed
+ * file renamed into place under filename. The partial file is removed
+ * either way.
+ */
+bool pack_commit(const char *partial, const char *filename){
+  char temp[PATH_MAX], path[PATH_MAX];
+  struct stat file_stats;
+  bool committed = false;
+  int filefd, packfd = -1;
+
+  filefd = open(partial, O_RDONLY | O_CLOEXEC);
+  if(filefd >= 0 && fstat(filefd, &file_stats) == 0){
+    temp_path(temp);
+    packfd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  }
+
+  if(packfd >= 0){
+    build_path(path, filename);
+    committed = pack_blocks(filefd, file_stats.st_size, packfd) && close(packfd) == 0 &&
+                prepare_path(filename) && rename(temp, path) == 0;
+    if(!committed){
+      unlink(temp);
+    }
+  }
+
+  if(filefd >= 0){
+    close(filefd);
+  }
+
+  unlink(partial);
+  return committed;
+}
+
+/* The size of the file a packed file holds, or -1 if it is not one. */
+off_t pack_size(int filefd){
+  unsigned char header[PACK_HEADER];
+
+  if(pread(filefd, header, PACK_HEADER, 0) != PACK_HEADER ||
+     memcmp(header, PACK_MAGIC, 4) != 0 || get_u32(header + 4) != COMPRESS_BLOCK){
+    return -1;
+  }
+
+  return get_u64(header + 8);
+}
+
+/*
+ * Finds where the block holding offset of a packed file of size bytes is
+ * stored. Fails if the table points outside the file's own blocks.
+ */
+bool pack_block(int filefd, off_t size, off_t offset, struct PackBlock *block){
+  unsigned char entries[16];
+  off_t index = offset / COMPRESS_BLOCK;
+
+  if(offset < 0 || offset >= size ||
+     pread(filefd, entries, 16, PACK_HEADER + index * 8) != 16){
+    return false;
+  }
+
+  block->offset = index * COMPRESS_BLOCK;
+  block->length = size - block->offset < COMPRESS_BLOCK ? size - block->offset : COMPRESS_BLOCK;
+  block->start = get_u64(entries);
+  block->stored = get_u64(entries + 8) - block->start;
+  block->compressed = block->stored < block->length;
+  return block->start >= PACK_HEADER + (block_count(size) + 1) * 8 && block->stored > 0 &&
+         block->stored <= block->length;
+}
+
+/*
+ * Reads a block into data, COMPRESS_BLOCK long, decompressing it through
+ * scratch, FRAME_MAX_CONTROL long, if it is stored compressed.
+ */
+bool pack_read(int filefd, const struct PackBlock *block, unsigned char *data,
+               unsigned char *scratch){
+  if(!block->compressed){
+    return pread(filefd, data, block->length, block->start) == block->length;
+  }
+
+  return pread(filefd, scratch, block->stored, block->start) == block->stored &&
+         get_u32(scratch) == block->length &&
+         lz_decompress(scratch + 4, block->stored - 4, data, COMPRESS_BLOCK) == block->length;
+}
+
+/*
+ * The whole of a stored file, unpacked into an unnamed temporary file for
+ * the text protocol and for making deltas against. Returns -1 if it is not
+ * there or does not unpack.
+ */
+int pack_assemble(const char *filename){
+  unsigned char *data = slab_get(&block_slab);
+  unsigned char *scratch = slab_get(&block_slab);
+  char path[PATH_MAX];
+  struct PackBlock block;
+  int packfd, filefd = -1;
+  off_t size = -1, offset = 0;
+
+  build_path(path, filename);
+  packfd = open(path, O_RDONLY | O_CLOEXEC);
+  if(packfd >= 0 && data != NULL && scratch != NULL){
+    size = pack_size(packfd);
+  }
+
+  if(size >= 0){
+    filefd = open(PACK_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  }
+
+  while(filefd >= 0 && offset < size){
+    if(!pack_block(packfd, size, offset, &block) || !pack_read(packfd, &block, data, scratch) ||
+       pwrite(filefd, data, block.length, offset) != block.length){
+      close(filefd);
+      filefd = -1;
+      break;
+    }
+
+    offset += block.length;
+  }
+
+  if(packfd >= 0){
+    close(packfd);
+  }
+
+  slab_put(&block_slab, data);
+  slab_put(&block_slab, scratch);
+  return filefd;
+}
+
+/* fstatat for the index: a stored file's size is the one its header records. */
+bool pack_stat(int dirfd, const char *name, struct stat *file_stats){
+  off_t size = -1;
+  int filefd;
+
+  if(fstatat(dirfd, name, file_stats, AT_SYMLINK_NOFOLLOW) < 0 ||
+     !S_ISREG(file_stats->st_mode)){
+    return false;
+  }
+
+  filefd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if(filefd >= 0){
+    size = pack_size(filefd);
+    close(filefd);
+  }
+
+  file_stats->st_size = size;
+  return size >= 0;
+}
+
+/* Starts the packed store: files an interrupted pack left in PACK_DIR go. */
+void pack_init(){
+  struct dirent *ent;
+  char path[PATH_MAX];
+  DIR *dir = opendir(PACK_DIR);
+
+  while(dir != NULL && (ent = readdir(dir)) != NULL){
+    if(ent->d_name[0] != '.'){
+      snprintf(path, PATH_MAX, PACK_DIR "/%s", ent->d_name);
+      unlink(path);
+    }
+  }
+
+  if(dir != NULL){
+    closedir(dir);
+  }
+}
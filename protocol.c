@@ -0,0 +1,132 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "protocol.h"
+
+#define FRAME_SMALL_PAYLOAD 512
+
+void put_u32(unsigned char *buffer, uint32_t value){
+  buffer[0] = value >> 24;
+  buffer[1] = value >> 16;
+  buffer[2] = value >> 8;
+  buffer[3] = value;
+}
+
+void put_u64(unsigned char *buffer, uint64_t value){
+  put_u32(buffer, value >> 32);
+  put_u32(buffer + 4, (uint32_t)value);
+}
+
+uint32_t get_u32(const unsigned char *buffer){
+  return ((uint32_t)buffer[0] << 24) | ((uint32_t)buffer[1] << 16) |
+         ((uint32_t)buffer[2] << 8) | buffer[3];
+}
+
+uint64_t get_u64(const unsigned char *buffer){
+  return ((uint64_t)get_u32(buffer) << 32) | get_u32(buffer + 4);
+}
+
+void frame_encode(unsigned char *buffer, uint8_t opcode, uint8_t flags,
+                  uint32_t request_id, uint64_t length){
+  buffer[0] = FRAME_MAGIC;
+  buffer[1] = FRAME_VERSION;
+  buffer[2] = opcode;
+  buffer[3] = flags;
+  put_u32(buffer + 4, request_id);
+  put_u64(buffer + 8, length);
+}
+
+bool frame_decode(const unsigned char *buffer, struct FrameHeader *header){
+  if(buffer[0] != FRAME_MAGIC){
+    return false;
+  }
+
+  header->version = buffer[1];
+  header->opcode = buffer[2];
+  header->flags = buffer[3];
+  header->request_id = get_u32(buffer + 4);
+  header->length = get_u64(buffer + 8);
+  return true;
+}
+
+int read_full(int fd, void *buffer, size_t len){
+  char *position = buffer;
+  ssize_t bytes_read;
+
+  while(len > 0){
+    bytes_read = read(fd, position, len);
+    if(bytes_read < 0 && errno == EINTR){
+      continue;
+    }
+
+    if(bytes_read <= 0){
+      return -1;
+    }
+
+    position += bytes_read;
+    len -= bytes_read;
+  }
+
+  return 0;
+}
+
+int write_full(int fd, const void *buffer, size_t len){
+  const char *position = buffer;
+  ssize_t bytes_written;
+
+  while(len > 0){
+    bytes_written = write(fd, position, len);
+    if(bytes_written < 0 && errno == EINTR){
+      continue;
+    }
+
+    if(bytes_written <= 0){
+      return -1;
+    }
+
+    position += bytes_written;
+    len -= bytes_written;
+  }
+
+  return 0;
+}
+
+/*
+ * Blocking helpers for the client: one header plus an in-memory payload.
+ * Small frames go out in a single write, since a header written on its own
+ * can sit in Nagle's queue waiting for a delayed ACK.
+ */
+int frame_send(int fd, uint8_t opcode, uint8_t flags, uint32_t request_id,
+               const void *payload, uint64_t len){
+  unsigned char buffer[FRAME_HEADER_SIZE + FRAME_SMALL_PAYLOAD];
+
+  frame_encode(buffer, opcode, flags, request_id, len);
+  if(len <= FRAME_SMALL_PAYLOAD){
+    if(len > 0){
+      memcpy(buffer + FRAME_HEADER_SIZE, payload, len);
+    }
+
+    return write_full(fd, buffer, FRAME_HEADER_SIZE + len);
+  }
+
+  if(write_full(fd, buffer, FRAME_HEADER_SIZE) < 0){
+    return -1;
+  }
+
+  return write_full(fd, payload, len);
+}
+
+int frame_recv(int fd, struct FrameHeader *header){
+  unsigned char buffer[FRAME_HEADER_SIZE];
+
+  if(read_full(fd, buffer, FRAME_HEADER_SIZE) < 0){
+    return -1;
+  }
+
+  if(!frame_decode(buffer, header) || header->version != FRAME_VERSION){
+    errno = EPROTO;
+    return -1;
+  }
+
+  return 0;
+}
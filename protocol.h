@@ -0,0 +1,215 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * BitDrive framed protocol.
+ *
+ * Every message is a 16 byte header followed by length bytes of payload:
+ *
+ *   0  magic       0xBD (never the first byte of a legacy text command)
+ *   1  version
+ *   2  opcode
+ *   3  flags
+ *   4  request_id  echoed back in every reply to that request
+ *   8  length      payload size, 64 bits
+ *
+ * All integers are big endian. A client opens with HELLO; a server that
+ * answers in plain text is a legacy server and the client falls back to
+ * the text protocol. Every frame carries FRAME_VERSION; a server answers
+ * a frame of any other version with ERROR and closes the connection, so a
+ * future version has to be told apart before it is spoken.
+ */
+#define FRAME_MAGIC 0xBD
+#define FRAME_VERSION 1
+#define FRAME_HEADER_SIZE 16
+
+// largest payload accepted for anything but DATA
+#define FRAME_MAX_CONTROL (60 * 1024)
+
+enum Opcode{
+  OP_HELLO = 0x01,
+  OP_LIST = 0x02,
+  OP_UPLOAD = 0x03,
+  OP_DOWNLOAD = 0x04,
+  OP_DELETE = 0x05,
+  OP_QUIT = 0x06,
+  OP_HAVE = 0x07,
+  OP_SIGNATURES = 0x08,
+  OP_STATS = 0x09,
+
+  OP_DATA = 0x10,
+  OP_WINDOW = 0x11,
+
+  OP_OK = 0x20,
+  OP_ERROR = 0x21,
+  OP_READY = 0x22
+};
+
+/*
+ * STATS has no payload; its OK carries the server's metrics as text: open
+ * sessions, transfers and bytes, and per command counts and latencies.
+ */
+
+// last DATA frame of a transfer
+#define FLAG_FIN 0x01
+
+/*
+ * FEATURE_RESUME only. A DOWNLOAD with FLAG_RANGE carries u64 offset and
+ * u64 length (0 = to the end) before the name, and its OK adds the offset
+ * and length actually sent after the file size. An UPLOAD with FLAG_RESUME
+ * is always answered with READY carrying the u64 count of bytes the server
+ * already holds; the client sends the rest from there.
+ */
+#define FLAG_RANGE 0x02
+#define FLAG_RESUME 0x04
+
+/*
+ * HELLO carries a u32 of optional feature bits each side supports; the
+ * server answers with the subset it will use on this connection.
+ *
+ * FEATURE_PIPELINE: UPLOAD is not acknowledged with READY; the client
+ * sends the request and its DATA frames back to back and may queue any
+ * number of requests. Replies come back in request order. A rejected
+ * upload gets its ERROR right away and its DATA frames are dropped.
+ */
+#define FEATURE_PIPELINE 0x00000001
+
+/*
+ * FEATURE_STREAMS (only together with FEATURE_PIPELINE): every upload and
+ * download is a stream named by its request_id, and replies come back as
+ * soon as they are ready instead of in request order. Bodies move in DATA
+ * frames of at most STREAM_CHUNK bytes, interleaved across streams. Each
+ * side may only have STREAM_WINDOW unacknowledged DATA bytes in flight per
+ * stream; the receiver hands credit back with WINDOW frames (u32 increment)
+ * as it writes the data out. At most MAX_STREAMS transfers are open at once.
+ */
+#define FEATURE_STREAMS 0x00000002
+
+#define STREAM_CHUNK (256 * 1024)
+#define STREAM_WINDOW (1024 * 1024)
+#define MAX_STREAMS 16
+
+// the FLAG_RANGE and FLAG_RESUME requests above
+#define FEATURE_RESUME 0x00000004
+
+/*
+ * FEATURE_STRIPE: an UPLOAD with FLAG_RANGE is one range of a file sent
+ * over several connections at once. Payload: u64 size, u64 token, u64
+ * offset, u64 length, then the name; the client picks one random token per
+ * file. Each range is answered with OK carrying the u64 count of bytes
+ * received so far; the file is committed before the reply that reports
+ * all of it.
+ */
+#define FEATURE_STRIPE 0x00000008
+
+/*
+ * FEATURE_LISTING: a LIST with a payload is a query, answered a page at a
+ * time. Payload: u8 order (LIST_BY_* | LIST_DESCENDING), u8 reserved, u16
+ * pattern length, u32 limit (0 = no limit), u64 cursor key, the pattern,
+ * then the cursor name. A pattern with *, ? or [ in it is a glob, anything
+ * else a prefix. Only entries that sort after the cursor are listed; the
+ * cursor is the key (size or mtime, 0 by name) and name of the last entry
+ * the client has seen, and an empty name starts from the top. An empty OK
+ * is followed by DATA frames with up to LIST_PAGE entries each: u64 size,
+ * u64 mtime, u16 name length, name. The last one is flagged FIN, and also
+ * FLAG_MORE when the limit cut the listing short of entries that match.
+ * With FEATURE_STREAMS they count against the stream window like download
+ * data.
+ */
+#define FEATURE_LISTING 0x00000010
+
+#define LIST_BY_NAME 0
+#define LIST_BY_SIZE 1
+#define LIST_BY_MTIME 2
+#define LIST_DESCENDING 0x80
+#define LIST_QUERY_SIZE 16
+#define LIST_ENTRY_SIZE 18
+#define LIST_PAGE 256
+#define FLAG_MORE 0x80
+
+/*
+ * FEATURE_DEDUP (only together with FEATURE_PIPELINE, and only from a
+ * server with a chunked store): files can be uploaded as content-defined
+ * chunks (see chunk.h), sending only the chunks the server lacks.
+ *
+ * HAVE carries up to HAVE_MAX chunk hashes; its OK is a bitmap, one bit
+ * per hash in order, most significant bit first, set for the chunks the
+ * server has. An UPLOAD with FLAG_CHUNK sends one chunk: payload u64
+ * length and its hash, body the chunk; the server checks the hash before
+ * keeping it and answers OK with the length. An UPLOAD with FLAG_MANIFEST
+ * then names the file: payload as a plain UPLOAD, body the manifest. Its
+ * OK carries the u64 file size; it fails if any chunk is missing.
+ */
+#define FEATURE_DEDUP 0x00000020
+
+#define FLAG_CHUNK 0x08
+#define FLAG_MANIFEST 0x10
+#define HAVE_MAX 1024
+
+/*
+ * FEATURE_DELTA: a file the server already has can be updated by sending
+ * only what changed (see delta.h). SIGNATURES carries a file name; its OK
+ * carries the signatures of the server's copy. An UPLOAD with FLAG_DELTA
+ * then has the plain UPLOAD payload, with the length of the delta as the
+ * size, and the delta as its body. The server rebuilds the file from its
+ * copy and the delta, checks it and answers OK with the u64 size of the new
+ * file, or ERROR if its copy changed since the signatures were taken.
+ */
+#define FEATURE_DELTA 0x00000040
+
+#define FLAG_DELTA 0x20
+
+/*
+ * FEATURE_COMPRESS: DATA frames of uploads and downloads may be compressed
+ * (see lz.h). HELLO may carry a u8 level after the feature bits, which the
+ * server compresses downloads with. The sender compresses COMPRESS_BLOCK
+ * bytes at a time; a DATA frame with FLAG_COMPRESSED carries the u32
+ * length of the block, then the block compressed, and is never larger
+ * than FRAME_MAX_CONTROL. A block that does not save a sixteenth of its
+ * size goes out as a plain DATA frame instead, and after COMPRESS_GIVE_UP
+ * of those in a row the sender stops trying for that transfer. Stream
+ * windows count the bytes on the wire.
+ */
+#define FEATURE_COMPRESS 0x00000080
+
+#define FLAG_COMPRESSED 0x40
+#define COMPRESS_BLOCK (64 * 1024)
+#define COMPRESS_GIVE_UP 4
+#define COMPRESS_LEVEL_DEFAULT 1
+
+// what a len byte block may compress to, leaving room for its u32 length
+#define COMPRESS_ROOM(len) (((len) - (len) / 16 < FRAME_MAX_CONTROL ? \
+                             (len) - (len) / 16 : FRAME_MAX_CONTROL) - 4)
+
+#define PROTOCOL_FEATURES (FEATURE_PIPELINE | FEATURE_STREAMS | FEATURE_RESUME | \
+                           FEATURE_STRIPE | FEATURE_LISTING | FEATURE_DEDUP | \
+                           FEATURE_DELTA | FEATURE_COMPRESS)
+
+struct FrameHeader{
+  uint8_t version;
+  uint8_t opcode;
+  uint8_t flags;
+  uint32_t request_id;
+  uint64_t length;
+};
+
+void put_u32(unsigned char *buffer, uint32_t value);
+void put_u64(unsigned char *buffer, uint64_t value);
+uint32_t get_u32(const unsigned char *buffer);
+uint64_t get_u64(const unsigned char *buffer);
+
+void frame_encode(unsigned char *buffer, uint8_t opcode, uint8_t flags,
+                  uint32_t request_id, uint64_t length);
+bool frame_decode(const unsigned char *buffer, struct FrameHeader *header);
+
+int read_full(int fd, void *buffer, size_t len);
+int write_full(int fd, const void *buffer, size_t len);
+int frame_send(int fd, uint8_t opcode, uint8_t flags, uint32_t request_id,
+               const void *payload, uint64_t len);
+int frame_recv(int fd, struct FrameHeader *header);
+
+#endif
@@ -0,0 +1,800 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "reactor.h"
+#include "uring.h"
+
+#define TAG_POLL 1
+#define TAG_ACCEPT 2
+#define TAG_OP 3
+#define TAG_MASK 7
+
+/*
+ * What the io_uring backend knows about a watcher. Completions name the
+ * slot and its generation rather than the watcher, which its owner may
+ * have freed by the time the kernel reports on it: the generation moves
+ * on whenever a slot is let go, so anything still in flight for the old
+ * watcher is recognised and dropped.
+ */
+struct Slot{
+  struct Watcher *watcher;
+  uint32_t generation;
+  uint32_t armed;
+  bool pending;
+  bool listening;
+  int next_free;
+};
+
+/*
+ * An operation of reactor_send in flight. It is the first member of what
+ * it belongs to, and its address (tagged TAG_OP) is the user_data.
+ */
+struct RingOp{
+  void (*done)(struct Reactor *reactor, struct RingOp *op, int result);
+};
+
+/* One registered buffer's worth of a download: read in, then written out. */
+struct RingBlock{
+  struct RingOp op;
+  struct RingSend *send;
+  int buffer;
+  off_t offset;
+  size_t length;
+  size_t filled;
+  size_t written;
+  bool busy;
+};
+
+/*
+ * A download reactor_send moves in the background. Up to RING_DEPTH blocks
+ * are read ahead of the socket at once; the oldest is written as soon as it
+ * is in, so the socket never waits on the disk while there is a block to
+ * send. Writes go out one at a time, in file order. Once abandoned the
+ * watcher is NULL and the RingSend frees itself when the kernel is done
+ * with the last operation.
+ */
+struct RingSend{
+  struct RingOp wait;
+  struct Reactor *reactor;
+  struct Watcher *watcher;
+  int sockfd;
+  int filefd;
+  off_t next_read;
+  off_t end;
+  struct RingBlock blocks[RING_DEPTH];
+  int head;
+  int count;
+  bool writing;
+  bool waiting;
+  int inflight;
+  off_t sent;
+  int error;
+};
+
+struct Slab send_slab = SLAB_INIT("Ring sends", sizeof(struct RingSend), 64, 16);
+
+static void accept_ready(struct Reactor *reactor, struct Watcher *watcher, uint32_t events){
+  int clientfd;
+
+  while(true){
+    clientfd = accept4(watcher->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(clientfd < 0){
+      if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+        // e.g. EMFILE: keep serving the sessions we already have
+        perror("ERROR on accept");
+      }
+
+      return;
+    }
+
+    watcher->accepted(reactor, watcher, clientfd);
+  }
+}
+
+#ifdef HAVE_IO_URING
+
+static int ring_init(struct Reactor *reactor){
+  const int ops[] = {IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL, IORING_OP_ACCEPT,
+                     IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED,
+                     IORING_OP_WRITE_FIXED};
+  struct iovec iovecs[RING_BUFFERS];
+  int i;
+
+  reactor->ring = malloc(sizeof(struct Uring));
+  if(reactor->ring == NULL){
+    return -1;
+  }
+
+  if(uring_init(reactor->ring, RING_ENTRIES) < 0){
+    free(reactor->ring);
+    reactor->ring = NULL;
+    return -1;
+  }
+
+  if(!uring_supports(reactor->ring, ops, sizeof(ops) / sizeof(ops[0])) ||
+     posix_memalign((void **)&reactor->buffers, 4096, (size_t)RING_BUFFERS * RING_BUFFER_SIZE) != 0){
+    reactor->buffers = NULL;
+    uring_close(reactor->ring);
+    free(reactor->ring);
+    reactor->ring = NULL;
+    return -1;
+  }
+
+  for(i = 0; i < RING_BUFFERS; i++){
+    iovecs[i].iov_base = reactor->buffers + (size_t)i * RING_BUFFER_SIZE;
+    iovecs[i].iov_len = RING_BUFFER_SIZE;
+    reactor->free_buffers[i] = i;
+  }
+
+  // pinning counts against RLIMIT_MEMLOCK; without it the same buffers are just copied through
+  reactor->registered = uring_register_buffers(reactor->ring, iovecs, RING_BUFFERS) == 0;
+  reactor->buffers_free = RING_BUFFERS;
+  return 0;
+}
+
+static struct io_uring_sqe *ring_sqe(struct Reactor *reactor){
+  struct io_uring_sqe *sqe = uring_sqe(reactor->ring);
+
+  if(sqe == NULL){
+    fprintf(stderr, "ERROR queueing io_uring request\n");
+  }
+
+  return sqe;
+}
+
+static uint64_t slot_data(struct Reactor *reactor, int slot){
+  struct Slot *entry = &reactor->slots[slot];
+
+  return (uint64_t)entry->generation << 32 | (uint64_t)slot << 3 |
+         (entry->listening ? TAG_ACCEPT : TAG_POLL);
+}
+
+static void cancel(struct Reactor *reactor, uint64_t data){
+  struct io_uring_sqe *sqe = ring_sqe(reactor);
+
+  if(sqe != NULL){
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = data;
+  }
+}
+
+/* Queues the poll (or accept, for listeners) a watcher waits on. */
+static void arm(struct Reactor *reactor, int slot){
+  struct Slot *entry = &reactor->slots[slot];
+  struct io_uring_sqe *sqe = ring_sqe(reactor);
+
+  if(sqe == NULL){
+    return;
+  }
+
+  sqe->fd = entry->watcher->fd;
+  sqe->user_data = slot_data(reactor, slot);
+  if(entry->listening){
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->ioprio = reactor->single_accept ? 0 : IORING_ACCEPT_MULTISHOT;
+  }
+
+  else {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = entry->watcher->events;
+    entry->armed = entry->watcher->events;
+  }
+
+  entry->pending = true;
+}
+
+static int take_slot(struct Reactor *reactor, struct Watcher *watcher){
+  struct Slot *slots;
+  int i, count;
+
+  if(reactor->free_slot < 0){
+    count = reactor->slot_count > 0 ? reactor->slot_count * 2 : 64;
+    slots = realloc(reactor->slots, count * sizeof(struct Slot));
+    if(slots == NULL){
+      return -1;
+    }
+
+    for(i = reactor->slot_count; i < count; i++){
+      memset(&slots[i], 0, sizeof(struct Slot));
+      slots[i].next_free = i + 1 < count ? i + 1 : -1;
+    }
+
+    reactor->free_slot = reactor->slot_count;
+    reactor->slots = slots;
+    reactor->slot_count = count;
+  }
+
+  i = reactor->free_slot;
+  reactor->free_slot = reactor->slots[i].next_free;
+  reactor->slots[i].watcher = watcher;
+  reactor->slots[i].pending = false;
+  reactor->slots[i].listening = false;
+  watcher->slot = i;
+  return i;
+}
+
+/*
+ * A poll or accept of a watcher completed. Polls are one-shot, so unless
+ * the callback let go of the watcher it is armed again with whatever it
+ * asks for now; a poll cancelled because the interest changed just gets
+ * re-armed.
+ */
+static void slot_done(struct Reactor *reactor, uint64_t data, int result, unsigned flags){
+  uint32_t generation = data >> 32, events;
+  int slot = (uint32_t)data >> 3;
+  struct Slot *entry = slot < reactor->slot_count ? &reactor->slots[slot] : NULL;
+  struct Watcher *watcher;
+
+  if(entry == NULL || entry->watcher == NULL || entry->generation != generation){
+    return;
+  }
+
+  watcher = entry->watcher;
+  if(entry->listening){
+    if(!(flags & IORING_CQE_F_MORE)){
+      entry->pending = false;
+    }
+
+    if(result >= 0){
+      watcher->accepted(reactor, watcher, result);
+    }
+
+    else if(result == -EINVAL && !reactor->single_accept){
+      // a kernel without multishot accept: one accept per submission then
+      reactor->single_accept = true;
+    }
+
+    else if(result != -EAGAIN && result != -EINTR && result != -ECANCELED){
+      errno = -result;
+      perror("ERROR on accept");
+    }
+  }
+
+  else {
+    entry->pending = false;
+    events = result < 0 ? EPOLLERR : (uint32_t)result & (watcher->events | EPOLLERR | EPOLLHUP);
+    if(result != -ECANCELED && events != 0){
+      watcher->callback(reactor, watcher, events);
+    }
+  }
+
+  // the slot table may have grown, and the slot changed hands, meanwhile
+  entry = &reactor->slots[slot];
+  if(entry->watcher != NULL && entry->generation == generation && !entry->pending){
+    arm(reactor, slot);
+  }
+}
+
+static void ring_run(struct Reactor *reactor){
+  struct io_uring_cqe *cqe;
+  uint64_t data;
+  unsigned flags;
+  int result;
+
+  while(reactor->running){
+    if(uring_submit(reactor->ring, 1) < 0 && errno != EINTR && errno != EBUSY &&
+       errno != EAGAIN){
+      perror("ERROR on io_uring_enter");
+      break;
+    }
+
+    while((cqe = uring_cqe(reactor->ring)) != NULL){
+      data = cqe->user_data;
+      result = cqe->res;
+      flags = cqe->flags;
+      uring_seen(reactor->ring);
+
+      if((data & TAG_MASK) == TAG_OP){
+        struct RingOp *op = (struct RingOp *)(uintptr_t)(data & ~(uint64_t)TAG_MASK);
+        op->done(reactor, op, result);
+      }
+
+      else if(data != 0){
+        slot_done(reactor, data, result, flags);
+      }
+    }
+  }
+}
+
+static char *buffer_at(struct Reactor *reactor, int buffer){
+  return reactor->buffers + (size_t)buffer * RING_BUFFER_SIZE;
+}
+
+/* Queues the read or, once it is all in, the write of a block. */
+static bool submit_block(struct RingSend *send, struct RingBlock *block){
+  struct Reactor *reactor = send->reactor;
+  struct io_uring_sqe *sqe = ring_sqe(reactor);
+  char *data = buffer_at(reactor, block->buffer);
+
+  if(sqe == NULL){
+    send->error = -EBUSY;
+    return false;
+  }
+
+  if(block->filled < block->length){
+    sqe->opcode = reactor->registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = send->filefd;
+    sqe->addr = (uintptr_t)(data + block->filled);
+    sqe->len = block->length - block->filled;
+    sqe->off = block->offset + block->filled;
+  }
+
+  else {
+    sqe->opcode = reactor->registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = send->sockfd;
+    sqe->addr = (uintptr_t)(data + block->written);
+    sqe->len = block->length - block->written;
+  }
+
+  if(reactor->registered){
+    sqe->buf_index = block->buffer;
+  }
+
+  sqe->user_data = (uintptr_t)&block->op | TAG_OP;
+  block->busy = true;
+  send->inflight++;
+  return true;
+}
+
+static void fill(struct RingSend *send){
+  struct Reactor *reactor = send->reactor;
+  struct RingBlock *block;
+
+  while(send->error == 0 && send->count < RING_DEPTH && send->next_read < send->end &&
+        reactor->buffers_free > 0){
+    block = &send->blocks[(send->head + send->count) % RING_DEPTH];
+    block->buffer = reactor->free_buffers[--reactor->buffers_free];
+    block->offset = send->next_read;
+    block->length = send->end - send->next_read < RING_BUFFER_SIZE ?
+                    send->end - send->next_read : RING_BUFFER_SIZE;
+    block->filled = 0;
+    block->written = 0;
+    if(!submit_block(send, block)){
+      reactor->free_buffers[reactor->buffers_free++] = block->buffer;
+      block->buffer = -1;
+      return;
+    }
+
+    send->next_read += block->length;
+    send->count++;
+  }
+}
+
+static void write_next(struct RingSend *send){
+  struct RingBlock *block = &send->blocks[send->head];
+
+  if(send->error == 0 && !send->writing && !send->waiting && send->count > 0 &&
+     !block->busy && block->filled == block->length && submit_block(send, block)){
+    send->writing = true;
+  }
+}
+
+/* Gives back the buffers the kernel is done with; frees an abandoned send once it all is. */
+static void settle(struct RingSend *send){
+  struct Reactor *reactor = send->reactor;
+  struct RingBlock *block;
+  int i;
+
+  for(i = 0; i < send->count; i++){
+    block = &send->blocks[(send->head + i) % RING_DEPTH];
+    if(!block->busy && block->buffer >= 0){
+      reactor->free_buffers[reactor->buffers_free++] = block->buffer;
+      block->buffer = -1;
+    }
+  }
+
+  if(send->inflight == 0){
+    slab_put(&send_slab, send);
+  }
+}
+
+/* Tells the owner the body is out or failed; it may free the send, so this comes last. */
+static void finish_op(struct RingSend *send){
+  if(send->error != 0 || (send->count == 0 && send->next_read == send->end)){
+    send->watcher->callback(send->reactor, send->watcher, EPOLLOUT);
+  }
+}
+
+static void wait_done(struct Reactor *reactor, struct RingOp *op, int result){
+  struct RingSend *send = (struct RingSend *)op;
+
+  send->waiting = false;
+  send->inflight--;
+  if(send->watcher == NULL){
+    settle(send);
+    return;
+  }
+
+  if(result < 0){
+    send->error = result;
+  }
+
+  write_next(send);
+  finish_op(send);
+}
+
+/* The socket was full: a poll for it to drain stands in for the write. */
+static void wait_socket(struct RingSend *send){
+  struct io_uring_sqe *sqe = ring_sqe(send->reactor);
+
+  if(sqe == NULL){
+    send->error = -EBUSY;
+    return;
+  }
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = send->sockfd;
+  sqe->poll32_events = EPOLLOUT;
+  sqe->user_data = (uintptr_t)&send->wait | TAG_OP;
+  send->waiting = true;
+  send->inflight++;
+}
+
+static void block_done(struct Reactor *reactor, struct RingOp *op, int result){
+  struct RingBlock *block = (struct RingBlock *)op;
+  struct RingSend *send = block->send;
+  bool written = block->filled == block->length;
+
+  block->busy = false;
+  send->inflight--;
+  if(send->watcher == NULL){
+    settle(send);
+    return;
+  }
+
+  if(written){
+    send->writing = false;
+  }
+
+  if(result == -EAGAIN && written){
+    wait_socket(send);
+  }
+
+  else if(result <= 0){
+    // a read of 0 means the file shrank under us
+    send->error = result < 0 ? result : -EIO;
+  }
+
+  else if(!written){
+    block->filled += result;
+    if(block->filled < block->length){
+      submit_block(send, block);
+    }
+  }
+
+  else {
+    block->written += result;
+    send->sent += result;
+    if(block->written == block->length){
+      reactor->free_buffers[reactor->buffers_free++] = block->buffer;
+      block->buffer = -1;
+      send->head = (send->head + 1) % RING_DEPTH;
+      send->count--;
+      fill(send);
+    }
+  }
+
+  write_next(send);
+  finish_op(send);
+}
+
+static struct RingSend *start_send(struct Reactor *reactor, struct Watcher *watcher,
+                                   struct FileSender *sender){
+  struct RingSend *send;
+  int i;
+
+  if(reactor->buffers_free == 0 || (send = slab_zget(&send_slab)) == NULL){
+    return NULL;
+  }
+
+  send->wait.done = wait_done;
+  send->reactor = reactor;
+  send->watcher = watcher;
+  send->sockfd = watcher->fd;
+  send->filefd = sender->filefd;
+  send->next_read = sender->offset;
+  send->end = sender->offset + sender->remaining;
+  for(i = 0; i < RING_DEPTH; i++){
+    send->blocks[i].op.done = block_done;
+    send->blocks[i].send = send;
+    send->blocks[i].buffer = -1;
+  }
+
+  fill(send);
+  if(send->count == 0){
+    slab_put(&send_slab, send);
+    return NULL;
+  }
+
+  return send;
+}
+
+#else
+
+static int ring_init(struct Reactor *reactor){
+  errno = ENOSYS;
+  return -1;
+}
+
+#endif
+
+/*
+ * Starts an event loop on backend. BACKEND_URING falls back to epoll when
+ * the server was built without io_uring or the kernel does not offer every
+ * operation it needs; reactor->backend says which one runs.
+ */
+int reactor_init(struct Reactor *reactor, enum Backend backend){
+  memset(reactor, 0, sizeof(*reactor));
+  reactor->epollfd = -1;
+  reactor->free_slot = -1;
+  reactor->backend = BACKEND_EPOLL;
+  if(backend == BACKEND_URING && ring_init(reactor) == 0){
+    reactor->backend = BACKEND_URING;
+    return 0;
+  }
+
+  reactor->epollfd = epoll_create1(EPOLL_CLOEXEC);
+  if(reactor->epollfd < 0){
+    return -1;
+  }
+
+  return 0;
+}
+
+void reactor_close(struct Reactor *reactor){
+  if(reactor->epollfd >= 0){
+    close(reactor->epollfd);
+    reactor->epollfd = -1;
+  }
+
+#ifdef HAVE_IO_URING
+  if(reactor->ring != NULL){
+    uring_close(reactor->ring);
+    free(reactor->ring);
+    reactor->ring = NULL;
+  }
+#endif
+
+  free(reactor->slots);
+  free(reactor->buffers);
+  reactor->slots = NULL;
+  reactor->buffers = NULL;
+}
+
+const char *reactor_backend(struct Reactor *reactor){
+  return reactor->backend == BACKEND_URING ? "io_uring" : "epoll";
+}
+
+int reactor_add(struct Reactor *reactor, struct Watcher *watcher, uint32_t events){
+  struct epoll_event event;
+
+  watcher->events = events;
+#ifdef HAVE_IO_URING
+  if(reactor->backend == BACKEND_URING){
+    if(take_slot(reactor, watcher) < 0){
+      return -1;
+    }
+
+    arm(reactor, watcher->slot);
+    return 0;
+  }
+#endif
+
+  event.events = events;
+  event.data.ptr = watcher;
+  return epoll_ctl(reactor->epollfd, EPOLL_CTL_ADD, watcher->fd, &event);
+}
+
+/* Watches a listening socket and calls accepted with every connection it takes. */
+int reactor_listen(struct Reactor *reactor, struct Watcher *watcher, accept_cb accepted){
+  watcher->accepted = accepted;
+  watcher->callback = accept_ready;
+#ifdef HAVE_IO_URING
+  if(reactor->backend == BACKEND_URING){
+    if(take_slot(reactor, watcher) < 0){
+      return -1;
+    }
+
+    watcher->events = EPOLLIN;
+    reactor->slots[watcher->slot].listening = true;
+    arm(reactor, watcher->slot);
+    return 0;
+  }
+#endif
+
+  return reactor_add(reactor, watcher, EPOLLIN);
+}
+
+int reactor_update(struct Reactor *reactor, struct Watcher *watcher, uint32_t events){
+  struct epoll_event event;
+
+  // nothing to do if the interest set did not change
+  if(watcher->events == events){
+    return 0;
+  }
+
+  watcher->events = events;
+#ifdef HAVE_IO_URING
+  if(reactor->backend == BACKEND_URING){
+    struct Slot *entry = &reactor->slots[watcher->slot];
+
+    // a poll for more than is wanted now only wakes us once more; one for less must go
+    if(entry->pending && (events & ~entry->armed) != 0){
+      cancel(reactor, slot_data(reactor, watcher->slot));
+    }
+
+    return 0;
+  }
+#endif
+
+  event.events = events;
+  event.data.ptr = watcher;
+  return epoll_ctl(reactor->epollfd, EPOLL_CTL_MOD, watcher->fd, &event);
+}
+
+void reactor_remove(struct Reactor *reactor, struct Watcher *watcher){
+#ifdef HAVE_IO_URING
+  if(reactor->backend == BACKEND_URING){
+    struct Slot *entry = &reactor->slots[watcher->slot];
+
+    if(entry->pending){
+      cancel(reactor, slot_data(reactor, watcher->slot));
+    }
+
+    entry->watcher = NULL;
+    entry->generation++;
+    entry->next_free = reactor->free_slot;
+    reactor->free_slot = watcher->slot;
+    return;
+  }
+#endif
+
+  // events for it may still be waiting further on in this round
+  epoll_ctl(reactor->epollfd, EPOLL_CTL_DEL, watcher->fd, NULL);
+  watcher->callback = NULL;
+}
+
+/*
+ * Calls release with a removed watcher once nothing the reactor holds can
+ * name it any more, so its owner may free it there. With io_uring the
+ * slot generation already guards against late completions; epoll waits
+ * until the events of the current round have all been dispatched.
+ */
+void reactor_release(struct Reactor *reactor, struct Watcher *watcher, release_cb release){
+  if(reactor->backend == BACKEND_URING){
+    release(watcher);
+    return;
+  }
+
+  watcher->release = release;
+  watcher->next_released = reactor->released;
+  reactor->released = watcher;
+}
+
+void reactor_run(struct Reactor *reactor){
+  struct epoll_event events[MAX_EVENTS];
+  int i, count;
+
+  reactor->running = true;
+#ifdef HAVE_IO_URING
+  if(reactor->backend == BACKEND_URING){
+    ring_run(reactor);
+    return;
+  }
+#endif
+
+  while(reactor->running){
+    count = epoll_wait(reactor->epollfd, events, MAX_EVENTS, -1);
+    if(count < 0){
+      if(errno == EINTR){
+        continue;
+      }
+
+      perror("ERROR on epoll_wait");
+      break;
+    }
+
+    for(i = 0; i < count; i++){
+      struct Watcher *watcher = events[i].data.ptr;
+      if(watcher->callback != NULL){
+        watcher->callback(reactor, watcher, events[i].events);
+      }
+    }
+
+    while(reactor->released != NULL){
+      struct Watcher *watcher = reactor->released;
+      reactor->released = watcher->next_released;
+      watcher->release(watcher);
+    }
+  }
+}
+
+void reactor_stop(struct Reactor *reactor){
+  reactor->running = false;
+}
+
+/*
+ * Sends what is left of sender on watcher's socket. The io_uring backend
+ * moves a file range through registered buffers in the background, with
+ * reads of several blocks and the write of the oldest in flight, and
+ * returns TRANSFER_PENDING until the watcher is called back with EPOLLOUT
+ * because the body is out or failed; each call reports the progress made
+ * since the last one. Memory senders, epoll and a ring out of buffers all
+ * take the sender_pump path.
+ */
+enum TransferStatus reactor_send(struct Reactor *reactor, struct Watcher *watcher,
+                                 struct FileSender *sender, size_t budget,
+                                 unsigned long long *bytes_sent){
+#ifdef HAVE_IO_URING
+  struct RingSend *send = sender->ring;
+  int error;
+
+  if(send == NULL){
+    if(reactor->backend != BACKEND_URING || sender->data != NULL || sender->remaining == 0 ||
+       (send = start_send(reactor, watcher, sender)) == NULL){
+      return sender_pump(sender, watcher->fd, budget, bytes_sent);
+    }
+
+    sender->ring = send;
+  }
+
+  sender->offset += send->sent;
+  sender->remaining -= send->sent;
+  if(bytes_sent != NULL){
+    *bytes_sent += send->sent;
+  }
+
+  send->sent = 0;
+  if(send->error != 0){
+    error = -send->error;
+    reactor_abandon(reactor, sender);
+    errno = error;
+    return TRANSFER_ERROR;
+  }
+
+  if(sender->remaining == 0){
+    slab_put(&send_slab, send);
+    sender->ring = NULL;
+    return TRANSFER_DONE;
+  }
+
+  return TRANSFER_PENDING;
+#else
+  return sender_pump(sender, watcher->fd, budget, bytes_sent);
+#endif
+}
+
+/*
+ * Lets go of a sender whose owner is going away: whatever it still has in
+ * flight is cancelled and cleaned up as the kernel reports back.
+ */
+void reactor_abandon(struct Reactor *reactor, struct FileSender *sender){
+#ifdef HAVE_IO_URING
+  struct RingSend *send = sender->ring;
+  int i;
+
+  if(send == NULL){
+    return;
+  }
+
+  sender->ring = NULL;
+  send->watcher = NULL;
+  for(i = 0; i < RING_DEPTH; i++){
+    if(send->blocks[i].busy){
+      cancel(reactor, (uintptr_t)&send->blocks[i].op | TAG_OP);
+    }
+  }
+
+  if(send->waiting){
+    cancel(reactor, (uintptr_t)&send->wait | TAG_OP);
+  }
+
+  settle(send);
+#endif
+}
@@ -0,0 +1,93 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include "transfer.h"
+#include "slab.h"
+
+#define MAX_EVENTS 256
+#define RING_ENTRIES 1024
+#define RING_BUFFERS 16
+#define RING_BUFFER_SIZE (128 * 1024)
+#define RING_DEPTH 4
+
+struct Reactor;
+struct Watcher;
+struct Uring;
+struct Slot;
+
+typedef void (*watcher_cb)(struct Reactor *reactor, struct Watcher *watcher,
+                           uint32_t events);
+typedef void (*accept_cb)(struct Reactor *reactor, struct Watcher *watcher, int clientfd);
+typedef void (*release_cb)(struct Watcher *watcher);
+
+/*
+ * A Watcher is embedded as the first member of anything the reactor polls
+ * (the listening socket, client sessions), so the callback can cast it back
+ * to the owning struct. A listening socket added with reactor_listen gets
+ * accepted called with every new connection instead. Once removed, the
+ * owner hands it to reactor_release rather than freeing it: epoll may have
+ * more events for it in the round being dispatched.
+ */
+struct Watcher{
+  int fd;
+  uint32_t events;
+  watcher_cb callback;
+  accept_cb accepted;
+  release_cb release;
+  struct Watcher *next_released;
+  int slot;
+};
+
+/*
+ * The event loop of one worker. BACKEND_EPOLL waits for readiness with
+ * epoll(7). BACKEND_URING waits on an io_uring instead: readiness comes
+ * from one-shot polls that are re-armed after every callback, so watchers
+ * see the same level-triggered events as with epoll, connections are
+ * accepted by a multishot accept, and file downloads move through
+ * reactor_send. Every poll, accept and transfer step queued while the
+ * callbacks of one round run goes to the kernel in the single system call
+ * that waits for the next round.
+ */
+enum Backend{
+  BACKEND_EPOLL,
+  BACKEND_URING
+};
+
+struct Reactor{
+  enum Backend backend;
+  int epollfd;
+  bool running;
+  struct Uring *ring;
+  struct Slot *slots;
+  int slot_count;
+  int free_slot;
+  bool single_accept;
+  char *buffers;
+  bool registered;
+  int free_buffers[RING_BUFFERS];
+  int buffers_free;
+  struct Watcher *released;
+};
+
+int reactor_init(struct Reactor *reactor, enum Backend backend);
+void reactor_close(struct Reactor *reactor);
+int reactor_add(struct Reactor *reactor, struct Watcher *watcher, uint32_t events);
+int reactor_listen(struct Reactor *reactor, struct Watcher *watcher, accept_cb accepted);
+int reactor_update(struct Reactor *reactor, struct Watcher *watcher, uint32_t events);
+void reactor_remove(struct Reactor *reactor, struct Watcher *watcher);
+void reactor_release(struct Reactor *reactor, struct Watcher *watcher, release_cb release);
+void reactor_run(struct Reactor *reactor);
+void reactor_stop(struct Reactor *reactor);
+const char *reactor_backend(struct Reactor *reactor);
+
+enum TransferStatus reactor_send(struct Reactor *reactor, struct Watcher *watcher,
+                                 struct FileSender *sender, size_t budget,
+                                 unsigned long long *bytes_sent);
+void reactor_abandon(struct Reactor *reactor, struct FileSender *sender);
+
+extern struct Slab send_slab;
+
+#endif
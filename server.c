@@ -1,50 +1,293 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <dirent.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <sys/stat.h>
-#include <pthread.h>
-
-const int NUM_CLIENTS = 2;
-int client_number;
-struct File{
-  char *filename;
-  float size;
-  struct File *next;
+#include "server.h"
+
+struct Config config;
+struct Worker *workers;
+struct IoPool disk_pool;
+struct Slab session_slab = SLAB_INIT("Sessions", sizeof(struct Session), 64, 16);
+struct Slab inbuf_slab = SLAB_INIT("Input buffers", INBUF_SIZE + 1, 4096, 8);
+struct Slab outbuf_slab = SLAB_INIT("Output buffers", OUTBUF_SIZE, 4096, 8);
+struct Slab stream_slab = SLAB_INIT("Streams", sizeof(struct Stream), 64, 16);
+struct Slab job_slab = SLAB_INIT("Disk jobs", sizeof(struct DiskJob), 64, 16);
+struct Slab query_slab = SLAB_INIT("List queries", sizeof(struct ListQuery), 64, 16);
+struct Slab block_slab = SLAB_INIT("Block buffers", BLOCK_BUFFER_SIZE, 4096, 8);
+struct Slab lz_slab = SLAB_INIT("Compressors", sizeof(struct LzState), 64, 2);
+
+// what a text protocol line in each state is, for the trace
+static const char *state_names[] = {
+  [STATE_COMMAND] = "command",
+  [STATE_LIST_ACK] = "list ack",
+  [STATE_UPLOAD_NAME] = "upload name",
+  [STATE_UPLOAD_HEADER] = "upload header",
+  [STATE_UPLOAD_BODY] = "upload body",
+  [STATE_DOWNLOAD_NAME] = "download name",
+  [STATE_DOWNLOAD_ACK] = "download ack",
+  [STATE_DOWNLOAD_BODY] = "download body",
+  [STATE_DELETE_NAME] = "delete name",
+  [STATE_CLOSING] = "closing"
 };
 
-char *read_request(int sockfd, char *buffer);
-void write_response(int clientfd, char *response);
-void *recv_file(int clientfd, char *filename);
-void *send_file(int clientfd, char *filename);
-void *communicate(void *newsockfd);
-void start_server(int port);
-void free_list(struct File *head);
-struct File* create_list();
-void list(struct File *root, int clientfd);
-void upload(int clientfd, char *request);
-void download(int clientfd, char *request);
-void delete(int clientfd, char *request);
-void quit(int clientfd);
-void invalid_input(int clientfd);
-void process_request(char *request, int sockfd);
+void communicate(struct Reactor *reactor, struct Watcher *watcher, uint32_t events);
+void accept_client(struct Reactor *reactor, struct Watcher *watcher, int clientfd);
+struct Session *create_session(struct Worker *worker, int clientfd);
+void close_session(struct Session *session);
+void release_session(struct Watcher *watcher);
+bool flush_session(struct Session *session);
+bool body_pending(struct Session *session);
+void wait_writable(struct Session *session);
+void wait_sent(struct Session *session);
+void watch_output(struct Session *session, uint32_t events);
+void run_job(struct IoJob *io);
+void job_done(struct IoJob *io);
+void process_input(struct Session *session);
+void start_server();
+int open_listener(int port, int backlog);
+void *run_worker(void *arg);
+void report_workers();
+void report_memory();
+void parse_options(int argc, char *argv[]);
+void choose_layout(const char *requested);
+void choose_storage(bool requested, int pack_level);
+void list(struct Session *session);
+void send_list(struct Session *session, char *request);
+void upload(struct Session *session, char *request);
+void upload_filename(struct Session *session, char *request);
+void open_upload(struct DiskJob *job);
+void upload_opened(struct Session *session, struct DiskJob *job);
+void save_upload(struct DiskJob *job);
+void upload_saved(struct Session *session, struct DiskJob *job);
+void upload_header(struct Session *session);
+void download(struct Session *session, char *request);
+void download_filename(struct Session *session, char *request);
+void load_download(struct DiskJob *job);
+void download_loaded(struct Session *session, struct DiskJob *job);
+void download_ready(struct Session *session, char *request);
+void release_download(struct Session *session);
+void delete(struct Session *session, char *request);
+void delete_filename(struct Session *session, char *request);
+void file_deleted(struct Session *session, struct DiskJob *job);
+void quit(struct Session *session);
+void stats(struct Session *session);
+void set_transferring(struct Session *session, bool transferring);
+void invalid_input(struct Session *session);
+void process_request(char *request, struct Session *session);
 void display_welcome();
 void set_sockaddr(struct sockaddr_in *socket_addr, int port);
-void error_occurred(const char *msg);
 
 int main(int argc, char* argv[]) {
-  if(argc < 2) {
+  parse_options(argc, argv);
+  display_welcome();
+  start_server();
+  return 0;
+}
+
+void parse_options(int argc, char *argv[]){
+  const char *layout = NULL;
+  bool dedup = false;
+  int pack_level = 0, option, level;
+
+  config.workers = 1;
+  config.backlog = DEFAULT_BACKLOG;
+  config.stats_interval = 0;
+  config.cache_size = (size_t)CACHE_DEFAULT_MB * 1024 * 1024;
+  config.backend = BACKEND_EPOLL;
+  config.io_threads = IO_THREADS_DEFAULT;
+  config.io_depth = IO_DEPTH_DEFAULT;
+  config.metrics_port = 0;
+  config.log_level = LOG_INFO;
+  config.log_rate = LOG_RATE_DEFAULT;
+  config.trace_path = NULL;
+
+  while((option = getopt(argc, argv, "w:b:s:L:DZ:C:E:t:q:m:v:r:T:")) != -1){
+    switch(option){
+      case 'w':
+        config.workers = atoi(optarg);
+        break;
+      case 'b':
+        config.backlog = atoi(optarg);
+        break;
+      case 's':
+        config.stats_interval = atoi(optarg);
+        break;
+      case 'L':
+        layout = optarg;
+        break;
+      case 'D':
+        dedup = true;
+        break;
+      case 'Z':
+        pack_level = atoi(optarg);
+        if(pack_level < LZ_LEVEL_MIN || pack_level > LZ_LEVEL_MAX){
+          printf("The compression level must be between %d and %d.\n", LZ_LEVEL_MIN, LZ_LEVEL_MAX);
+          exit(1);
+        }
+        break;
+      case 'C':
+        config.cache_size = (size_t)atoi(optarg) * 1024 * 1024;
+        break;
+      case 'E':
+        if(strcmp(optarg, "uring") == 0){
+          config.backend = BACKEND_URING;
+        }
+
+        else if(strcmp(optarg, "epoll") == 0){
+          config.backend = BACKEND_EPOLL;
+        }
+
+        else {
+          printf("Unknown event loop %s; use epoll or uring.\n", optarg);
+          exit(1);
+        }
+        break;
+      case 't':
+        config.io_threads = atoi(optarg);
+        break;
+      case 'q':
+        config.io_depth = atoi(optarg);
+        break;
+      case 'm':
+        config.metrics_port = atoi(optarg);
+        break;
+      case 'v':
+        level = logger_parse_level(optarg);
+        if(level < 0){
+          printf("Unknown log level %s; use off, error, warn, info or debug.\n", optarg);
+          exit(1);
+        }
+
+        config.log_level = level;
+        break;
+      case 'r':
+        config.log_rate = atoi(optarg);
+        break;
+      case 'T':
+        config.trace_path = optarg;
+        break;
+      default:
+        printf("Usage: %s <port> [-w workers] [-b backlog] [-s stats_seconds] "
+               "[-L flat|sharded] [-D] [-Z level] [-C cache_mb] [-E epoll|uring] "
+               "[-t io_threads] [-q io_depth] [-m metrics_port] "
+               "[-v off|error|warn|info|debug] [-r log_lines_per_second] [-T trace_file]\n",
+               argv[0]);
+        exit(1);
+    }
+  }
+
+  if(optind >= argc) {
     error_occurred("No port was provided");
   }
 
-  display_welcome();
-  start_server(atoi(argv[1]));
-  return 0;
+  config.port = atoi(argv[optind]);
+
+  // -w 0 means one worker per online core
+  if(config.workers <= 0){
+    config.workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if(config.workers <= 0){
+      config.workers = 1;
+    }
+  }
+
+  if(config.backlog <= 0){
+    config.backlog = DEFAULT_BACKLOG;
+  }
+
+  if(config.io_threads <= 0){
+    config.io_threads = IO_THREADS_DEFAULT;
+  }
+
+  if(config.io_depth <= 0){
+    config.io_depth = IO_DEPTH_DEFAULT;
+  }
+
+  mkdir(STORAGE_DIR, 0755);
+  choose_layout(layout);
+  choose_storage(dedup, pack_level);
+}
+
+/*
+ * The layout of an existing store is read from the store itself; -L only
+ * picks one for a store that has no files yet. Switching an existing
+ * flat store over is the job of ./migrate.
+ */
+void choose_layout(const char *requested){
+  config.layout = layout_detect(STORAGE_DIR);
+  if(requested == NULL){
+    return;
+  }
+
+  if(strcmp(requested, "sharded") == 0 && config.layout == LAYOUT_FLAT){
+    if(layout_has_flat_files(STORAGE_DIR)){
+      printf("%s holds a flat store; convert it with ./migrate first.\n", STORAGE_DIR);
+      exit(1);
+    }
+
+    if(!layout_mark(STORAGE_DIR)){
+      error_occurred("ERROR marking sharded store");
+    }
+
+    config.layout = LAYOUT_SHARDED;
+  }
+
+  else if(strcmp(requested, "flat") == 0 && config.layout == LAYOUT_SHARDED){
+    printf("%s holds a sharded store.\n", STORAGE_DIR);
+    exit(1);
+  }
+
+  else if(strcmp(requested, "flat") != 0 && strcmp(requested, "sharded") != 0){
+    printf("Unknown layout %s; use flat or sharded.\n", requested);
+    exit(1);
+  }
+}
+
+/*
+ * Like the layout, whether files are kept whole, as chunks (see dedup.c)
+ * or packed (see pack.c) belongs to the store, which is chunked once it
+ * has a CHUNK_DIR and packed once it has a PACK_DIR. -D and -Z can only
+ * change a store before it holds any files; -Z also sets the level files
+ * are packed at from then on.
+ */
+void choose_storage(bool requested, int pack_level){
+  struct stat dir_stats;
+
+  config.dedup = stat(CHUNK_DIR, &dir_stats) == 0 && S_ISDIR(dir_stats.st_mode);
+  config.packed = stat(PACK_DIR, &dir_stats) == 0 && S_ISDIR(dir_stats.st_mode);
+  config.pack_level = pack_level > 0 ? pack_level : PACK_LEVEL_DEFAULT;
+  if((requested && config.packed) || (pack_level > 0 && config.dedup) ||
+     (requested && pack_level > 0)){
+    printf("A store is either chunked (-D) or packed (-Z), not both.\n");
+    exit(1);
+  }
+
+  if((!requested && pack_level == 0) || config.dedup || config.packed){
+    return;
+  }
+
+  if(layout_has_files(STORAGE_DIR)){
+    printf("%s already holds files; %s needs an empty store.\n", STORAGE_DIR,
+           requested ? "-D" : "-Z");
+    exit(1);
+  }
+
+  if(mkdir(requested ? CHUNK_DIR : PACK_DIR, 0755) < 0){
+    error_occurred("ERROR creating store");
+  }
+
+  config.dedup = requested;
+  config.packed = !requested;
 }
 
 void display_welcome(){
@@ -53,72 +296,706 @@ void display_welcome(){
   printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
 }
 
-void start_server(int port){
-  /* Initialization of Variables */
-  struct sockaddr_in server_addr, client_addr;
-  socklen_t client_len;
-  int sockfd, newsockfd, status;
-  pthread_t thread_id[NUM_CLIENTS];
+void start_server(){
+  int i;
 
   /* Initial Values */
+  signal(SIGPIPE, SIG_IGN);
+  if(logger_start(config.log_level, config.log_rate) < 0){
+    error_occurred("ERROR starting logger");
+  }
+
+  if(config.trace_path != NULL && trace_start(config.trace_path) < 0){
+    error_occurred("ERROR starting trace");
+  }
+
+  mkdir(PARTIAL_DIR, 0755);
+  mkdir(DELTA_PARTIAL_DIR, 0755);
+  if(config.dedup){
+    dedup_init();
+  }
+
+  if(config.packed){
+    pack_init();
+  }
+
+  index_init();
+
+  if(iopool_start(&disk_pool, config.io_threads, config.io_depth) < 0){
+    error_occurred("ERROR starting disk pool");
+  }
+
+  workers = calloc(config.workers, sizeof(struct Worker));
+  if(workers == NULL){
+    error_occurred("ERROR allocating workers");
+  }
+
+  for(i = 0; i < config.workers; i++){
+    struct Worker *worker = &workers[i];
+    worker->id = i;
+    worker->lz = malloc(sizeof(struct LzState));
+    worker->scratch = malloc(COMPRESS_BLOCK + FRAME_MAX_CONTROL);
+    if(worker->lz == NULL || worker->scratch == NULL){
+      error_occurred("ERROR allocating workers");
+    }
+
+    if(reactor_init(&worker->reactor, config.backend) < 0){
+      error_occurred("ERROR creating event loop");
+    }
+
+    if(iodone_init(&worker->done, &worker->reactor) < 0){
+      error_occurred("ERROR watching disk pool");
+    }
+
+    worker->listener.worker = worker;
+    worker->listener.watcher.fd = open_listener(config.port, config.backlog);
+    if(reactor_listen(&worker->reactor, &worker->listener.watcher, accept_client) < 0){
+      error_occurred("ERROR watching socket");
+    }
+  }
+
+  printf("Server has started.\n");
+  printf("Now listening to port: %d \n", config.port);
+  printf("Workers: %d, backlog: %d\n", config.workers, config.backlog);
+  printf("Event loop: %s\n", reactor_backend(&workers[0].reactor));
+  printf("Disk pool: %d threads, queue depth %d\n", config.io_threads, config.io_depth);
+
+  // workers exist by now, so the first scrape finds their counters
+  if(config.metrics_port > 0){
+    metrics_start(config.metrics_port);
+    printf("Metrics: http://127.0.0.1:%d/metrics\n", config.metrics_port);
+  }
+
+  if(tracing){
+    printf("Tracing to %s\n", config.trace_path);
+  }
+
+  /* Waiting for clients to connect */
+  for(i = 0; i < config.workers; i++){
+    if(pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0){
+      error_occurred("ERROR starting worker");
+    }
+  }
+
+  if(config.stats_interval > 0){
+    while(true){
+      sleep(config.stats_interval);
+      report_workers();
+    }
+  }
+
+  for(i = 0; i < config.workers; i++){
+    pthread_join(workers[i].thread, NULL);
+  }
+}
+
+int open_listener(int port, int backlog){
+  struct sockaddr_in server_addr;
+  int sockfd, status, optval;
+
   set_sockaddr(&server_addr, htons(port));
-  client_len = sizeof(client_addr);
 
-  sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
   if(sockfd < 0) {
     error_occurred("ERROR opening socket");
   }
 
+  // every worker binds the same port; the kernel balances accepts
+  optval = 1;
+  setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+  if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0){
+    error_occurred("ERROR setting SO_REUSEPORT");
+  }
+
   status = bind(sockfd, (struct sockaddr *) &server_addr, sizeof(server_addr));
   if(status < 0) {
     error_occurred("ERROR on binding");
   }
 
-  listen(sockfd, 5);
-  printf("Server has started.\n");
-  printf("Now listening to port: %d \n", port);
-
-  /* Waiting for client to connect */
-  client_number = 0;
-  while(true) {
-    if(client_number < NUM_CLIENTS){
-      newsockfd = accept(sockfd, (struct sockaddr *) &client_addr, &client_len);
-      if (newsockfd < 0) {
-        error_occurred("ERROR on accept");
+  if(listen(sockfd, backlog) < 0){
+    error_occurred("ERROR on listen");
+  }
+
+  return sockfd;
+}
+
+void *run_worker(void *arg){
+  struct Worker *worker = arg;
+  char name[32];
+
+  if(tracing){
+    snprintf(name, sizeof(name), "worker %d", worker->id);
+    trace_thread(name);
+  }
+
+  reactor_run(&worker->reactor);
+  reactor_close(&worker->reactor);
+  close(worker->listener.watcher.fd);
+  return 0;
+}
+
+void report_workers(){
+  unsigned long long accepted, bytes_in, bytes_out;
+  unsigned long long total_in = 0, total_out = 0;
+  int i, active, total_active = 0;
+
+  printf("---------------------------- Workers ----------------------------\n");
+  for(i = 0; i < config.workers; i++){
+    accepted = atomic_load_explicit(&workers[i].accepted, memory_order_relaxed);
+    active = atomic_load_explicit(&workers[i].active, memory_order_relaxed);
+    bytes_in = atomic_load_explicit(&workers[i].bytes_in, memory_order_relaxed);
+    bytes_out = atomic_load_explicit(&workers[i].bytes_out, memory_order_relaxed);
+
+    printf("Worker %d: %d active, %llu accepted, %.1f MB in, %.1f MB out\n",
+           i, active, accepted, bytes_in / 1e6, bytes_out / 1e6);
+
+    total_active += active;
+    total_in += bytes_in;
+    total_out += bytes_out;
+  }
+
+  printf("Total: %d active, %.1f MB in, %.1f MB out\n",
+         total_active, total_in / 1e6, total_out / 1e6);
+  report_metrics();
+  report_cache();
+  iopool_report(&disk_pool);
+  report_memory();
+  fflush(stdout);
+}
+
+void report_memory(){
+  slab_report(&session_slab);
+  slab_report(&inbuf_slab);
+  slab_report(&outbuf_slab);
+  slab_report(&stream_slab);
+  slab_report(&job_slab);
+  slab_report(&query_slab);
+  slab_report(&transfer_slab);
+  slab_report(&block_slab);
+  slab_report(&lz_slab);
+  slab_report(&send_slab);
+  arena_report();
+}
+
+void accept_client(struct Reactor *reactor, struct Watcher *watcher, int clientfd){
+  struct Worker *worker = ((struct Listener *)watcher)->worker;
+
+  if(create_session(worker, clientfd) == NULL){
+    close(clientfd);
+  }
+}
+
+struct Session *create_session(struct Worker *worker, int clientfd){
+  struct Reactor *reactor = &worker->reactor;
+  int one = 1;
+  struct Session *session = slab_zget(&session_slab);
+  if(session == NULL){
+    return NULL;
+  }
+
+  session->inbuf = slab_get(&inbuf_slab);
+  session->outbase = slab_get(&outbuf_slab);
+  if(session->inbuf == NULL || session->outbase == NULL){
+    if(session->inbuf != NULL){
+      slab_put(&inbuf_slab, session->inbuf);
+    }
+
+    if(session->outbase != NULL){
+      slab_put(&outbuf_slab, session->outbase);
+    }
+
+    slab_put(&session_slab, session);
+    return NULL;
+  }
+
+  session->outbuf = session->outbase;
+  session->outcap = OUTBUF_SIZE;
+
+  session->watcher.fd = clientfd;
+  session->watcher.callback = communicate;
+  session->worker = worker;
+  session->reactor = reactor;
+  session->state = STATE_COMMAND;
+  session->filefd = -1;
+  receiver_init(&session->receiver);
+
+  // replies are only ever written whole, so Nagle can only hold back the tail of one
+  setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if(reactor_add(reactor, &session->watcher, EPOLLIN | EPOLLRDHUP) < 0){
+    slab_put(&inbuf_slab, session->inbuf);
+    slab_put(&outbuf_slab, session->outbase);
+    slab_put(&session_slab, session);
+    return NULL;
+  }
+
+  atomic_fetch_add_explicit(&worker->accepted, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&worker->active, 1, memory_order_relaxed);
+  log_info("Connected to client %d...", clientfd);
+  return session;
+}
+
+/*
+ * A session with a disk job in flight only lets go of its connection here;
+ * the files the job works on are released once job_done comes back.
+ */
+void close_session(struct Session *session){
+  if(!session->closed){
+    log_info("Client %d disconnected.", session->watcher.fd);
+    set_transferring(session, false);
+    reactor_remove(session->reactor, &session->watcher);
+    reactor_abandon(session->reactor, &session->sender);
+    close(session->watcher.fd);
+    session->closed = true;
+  }
+
+  if(session->job != NULL){
+    return;
+  }
+
+  if(session->filefd >= 0){
+    close(session->filefd);
+  }
+
+  if(session->cached != NULL){
+    cache_release(session->cached);
+  }
+
+  free_streams(session);
+  sender_free(&session->sender);
+  receiver_free(&session->receiver);
+
+  atomic_fetch_sub_explicit(&session->worker->active, 1, memory_order_relaxed);
+  arena_reset(&session->arena);
+  arena_reset(&session->output);
+  slab_put(&inbuf_slab, session->inbuf);
+  slab_put(&outbuf_slab, session->outbase);
+  reactor_release(session->reactor, &session->watcher, release_session);
+}
+
+void release_session(struct Watcher *watcher){
+  slab_put(&session_slab, (struct Session *)watcher);
+}
+
+void communicate(struct Reactor *reactor, struct Watcher *watcher, uint32_t events){
+  struct Session *session = (struct Session *)watcher;
+  ssize_t bytes_received;
+  uint64_t start;
+
+  if(events & EPOLLERR){
+    close_session(session);
+    return;
+  }
+
+  if(events & EPOLLOUT){
+    if(!flush_session(session)){
+      close_session(session);
+      return;
+    }
+  }
+
+  // upload bodies skip inbuf and are spliced straight into the file
+  if((events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)) &&
+     session->state == STATE_UPLOAD_BODY && session->inlen == 0){
+    if(recv_file(session) == TRANSFER_DONE && !flush_session(session)){
+      close_session(session);
+      return;
+    }
+  }
+
+  // a full buffer means we are waiting on our own output, not the client
+  else if((events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)) && session->inlen < INBUF_SIZE){
+    start = tracing ? trace_now() : 0;
+    bytes_received = read(watcher->fd, session->inbuf + session->inlen,
+                          INBUF_SIZE - session->inlen);
+    if(tracing){
+      trace_span("read", "net", watcher->fd, start, bytes_received, NULL);
+    }
+
+    if(bytes_received == 0){
+      close_session(session);
+      return;
+    }
+
+    if(bytes_received < 0){
+      if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+        close_session(session);
       }
 
-      pthread_create(&thread_id[client_number],
-                    NULL, communicate, (void*) &newsockfd);
+      return;
+    }
+
+    session->inlen += bytes_received;
+    atomic_fetch_add_explicit(&session->worker->bytes_in, bytes_received,
+                              memory_order_relaxed);
+    process_input(session);
+
+    if(!flush_session(session)){
+      close_session(session);
+      return;
+    }
+  }
+
+  if(session->state == STATE_CLOSING && session->outlen == 0){
+    close_session(session);
+  }
+}
+
+/*
+ * Consumes as much buffered input as the current state allows. Text
+ * messages are delimited the way the client sends them (one write per
+ * message), while the upload header and body are consumed by byte count
+ * so a header coalesced with file data is split correctly.
+ */
+void process_input(struct Session *session){
+  char request[REQUEST_SIZE + 1];
+  enum SessionState state;
+  uint64_t start;
+  size_t len;
+
+  if(session->protocol == PROTOCOL_UNKNOWN && session->inlen > 0){
+    if((unsigned char)session->inbuf[0] == FRAME_MAGIC){
+      session->protocol = PROTOCOL_FRAMED;
+    }
+
+    else {
+      session->protocol = PROTOCOL_LEGACY;
+    }
+  }
+
+  if(session->protocol == PROTOCOL_FRAMED){
+    process_frames(session);
+    return;
+  }
+
+  while(session->inlen > 0 && session->outlen == 0 && session->job == NULL){
+    if(session->state == STATE_CLOSING || session->state == STATE_DOWNLOAD_BODY){
+      return;
+    }
+
+    if(session->state == STATE_UPLOAD_HEADER){
+      if(session->inlen < HEADER_SIZE){
+        return;
+      }
+
+      upload_header(session);
+      continue;
+    }
+
+    if(session->state == STATE_UPLOAD_BODY){
+      recv_file(session);
+      continue;
+    }
+
+    len = session->inlen < REQUEST_SIZE ? session->inlen : REQUEST_SIZE;
+    memcpy(request, session->inbuf, len);
+    request[len] = '\0';
+    session->inlen = 0;
+    state = session->state;
+    start = tracing ? trace_now() : 0;
+
+    switch(session->state){
+      case STATE_COMMAND:
+        process_request(request, session);
+        break;
+      case STATE_LIST_ACK:
+        send_list(session, request);
+        break;
+      case STATE_UPLOAD_NAME:
+        upload_filename(session, request);
+        break;
+      case STATE_DOWNLOAD_NAME:
+        download_filename(session, request);
+        break;
+      case STATE_DOWNLOAD_ACK:
+        download_ready(session, request);
+        break;
+      case STATE_DELETE_NAME:
+        delete_filename(session, request);
+        break;
+      default:
+        break;
+    }
+
+    // each step of a text protocol exchange, so round trips show as gaps between them
+    if(tracing){
+      trace_span(state_names[state], "request", session->watcher.fd, start, len, request);
+    }
+  }
+}
+
+/*
+ * Writes queued responses and file bodies. A body is sent with sendfile
+ * right after its header, which ends at outmark; replies queued while it
+ * is going out wait behind it. Framed sessions then start the next DATA
+ * frame, a bounded number per call. Returns false if the connection failed
+ * and must be closed.
+ */
+bool flush_session(struct Session *session){
+  enum TransferStatus status;
+  ssize_t bytes_written;
+  uint64_t start;
+  size_t end;
+  int chunks = 0;
+
+  while(true){
+    end = body_pending(session) ? session->outmark : session->outlen;
+    while(session->outoff < end){
+      start = tracing ? trace_now() : 0;
+      bytes_written = write(session->watcher.fd, session->outbuf + session->outoff,
+                            end - session->outoff);
+      if(tracing){
+        trace_span("write", "net", session->watcher.fd, start, bytes_written, NULL);
+      }
+
+      if(bytes_written < 0){
+        if(errno == EAGAIN || errno == EWOULDBLOCK){
+          wait_writable(session);
+          return true;
+        }
+
+        if(errno == EINTR){
+          continue;
+        }
+
+        return false;
+      }
+
+      session->outoff += bytes_written;
+      atomic_fetch_add_explicit(&session->worker->bytes_out, bytes_written,
+                                memory_order_relaxed);
+    }
+
+    if(body_pending(session)){
+      status = send_file(session);
+      if(status == TRANSFER_AGAIN){
+        wait_writable(session);
+        return true;
+      }
+
+      if(status == TRANSFER_PENDING){
+        wait_sent(session);
+        return true;
+      }
+
+      if(status == TRANSFER_ERROR){
+        return false;
+      }
+
+      // whatever was queued behind the body
+      continue;
+    }
+
+    session->outoff = 0;
+    session->outlen = 0;
+    if(session->outbuf != session->outbase){
+      arena_reset(&session->output);
+      session->outbuf = session->outbase;
+      session->outcap = OUTBUF_SIZE;
+    }
+
+    if(session->protocol != PROTOCOL_FRAMED || !schedule_chunk(session)){
+      break;
+    }
+
+    // let other sessions on this worker have a turn
+    if(++chunks > EVENT_BUDGET / STREAM_CHUNK){
+      wait_writable(session);
+      return true;
+    }
+  }
+
+  // a session waiting for its disk job with inbuf full reads on once it is back
+  if(session->job != NULL && session->inlen >= INBUF_SIZE){
+    reactor_update(session->reactor, &session->watcher, EPOLLRDHUP);
+  }
+
+  else {
+    reactor_update(session->reactor, &session->watcher, EPOLLIN | EPOLLRDHUP);
+  }
 
-      client_number++;
+  // input may have queued up behind the response we just finished; a
+  // WINDOW in it answers nothing but lets a download send on
+  if(session->inlen > 0){
+    process_input(session);
+    if(session->outlen > 0 || (session->protocol == PROTOCOL_FRAMED &&
+                               session->state != STATE_CLOSING && next_sender(session) != NULL)){
+      return flush_session(session);
     }
   }
+
+  return true;
 }
 
-void process_request(char *request, int clientfd){
-  printf("Client %d: %s\n", clientfd, request);
+bool body_pending(struct Session *session){
+  if(session->protocol == PROTOCOL_FRAMED){
+    return session->sending != NULL;
+  }
+
+  return session->state == STATE_DOWNLOAD_BODY;
+}
+
+/* Waits for the socket to drain. */
+void wait_writable(struct Session *session){
+  watch_output(session, EPOLLOUT);
+}
+
+/* Waits for a body the reactor sends in the background; it calls back once it is out. */
+void wait_sent(struct Session *session){
+  watch_output(session, 0);
+}
+
+/*
+ * Waits for output to go out. Framed sessions keep reading meanwhile, so
+ * pipelined requests are parsed while earlier replies are still going out;
+ * a full inbuf stops that until the reply backlog clears.
+ */
+void watch_output(struct Session *session, uint32_t events){
+  events |= EPOLLRDHUP;
+
+  if(session->protocol == PROTOCOL_FRAMED && session->state != STATE_CLOSING &&
+     session->inlen < INBUF_SIZE){
+    events |= EPOLLIN;
+  }
+
+  reactor_update(session->reactor, &session->watcher, events);
+}
+
+struct DiskJob *new_job(struct Session *session){
+  struct DiskJob *job = slab_zget(&job_slab);
+  if(job == NULL){
+    error_occurred("ERROR allocating disk job");
+  }
+
+  job->session = session;
+  job->timing = session->timing;
+  job->filefd = -1;
+  job->opened.filefd = -1;
+  job->opened.chunk = -1;
+  return job;
+}
+
+/*
+ * Hands job to the disk pool. The session reads no further requests until
+ * finish has run, which resumes it. operation, a string literal, names the
+ * job in the trace.
+ */
+void start_job(struct Session *session, struct DiskJob *job, const char *operation,
+               void (*work)(struct DiskJob *job),
+               void (*finish)(struct Session *session, struct DiskJob *job)){
+  job->operation = operation;
+  job->work = work;
+  job->finish = finish;
+  job->io.work = run_job;
+  job->io.done = job_done;
+  session->job = job;
+  iopool_submit(&disk_pool, &job->io, &session->worker->done);
+}
+
+void run_job(struct IoJob *io){
+  struct DiskJob *job = (struct DiskJob *)io;
+  uint64_t start;
+
+  if(!tracing){
+    job->work(job);
+    return;
+  }
+
+  start = trace_now();
+  trace_thread("disk pool");
+  trace_span("queued", "disk", job->timing.client,
+             (uint64_t)io->queued.tv_sec * 1000000000 + io->queued.tv_nsec, -1, job->filename);
+  job->work(job);
+  trace_span(job->operation, "disk", job->timing.client, start, -1, job->filename);
+}
+
+/* Back on the worker: answers the client and picks up its next requests. */
+void job_done(struct IoJob *io){
+  struct DiskJob *job = (struct DiskJob *)io;
+  struct Session *session = job->session;
+
+  // from being queued until now counts as disk time of the command
+  job->timing.disk_ns += metrics_now() - ((uint64_t)io->queued.tv_sec * 1000000000 +
+                                          io->queued.tv_nsec);
+
+  // a text protocol command runs its jobs one after another; all count towards it
+  if(session->protocol == PROTOCOL_LEGACY){
+    session->timing = job->timing;
+  }
+
+  session->job = NULL;
+  if(session->closed){
+    free_job(job);
+    close_session(session);
+    return;
+  }
+
+  job->finish(session, job);
+  free_job(job);
+
+  if(!flush_session(session) || (session->state == STATE_CLOSING && session->outlen == 0)){
+    close_session(session);
+  }
+}
+
+/* Releases whatever the job opened that finish did not take over. */
+void free_job(struct DiskJob *job){
+  if(job->filefd >= 0){
+    close(job->filefd);
+  }
+
+  if(job->opened.filefd >= 0){
+    close(job->opened.filefd);
+  }
+
+  if(job->opened.cached != NULL){
+    cache_release(job->opened.cached);
+  }
+
+  if(job->opened.chunks != NULL){
+    dedup_close(job->opened.chunks);
+  }
+
+  if(job->stripe != NULL){
+    stripe_release(job->stripe);
+  }
+
+  free(job->payload);
+  slab_put(&job_slab, job);
+}
+
+void process_request(char *request, struct Session *session){
+  log_info("Client %d: %s", session->watcher.fd, request);
+  session->timing.start = metrics_now();
+  session->timing.disk_ns = 0;
+  session->timing.client = session->watcher.fd;
+
   if(strcmp(request, "LIST") == 0){
-    list(create_list(), clientfd);
+    list(session);
   }
 
   else if(strcmp(request, "UPLOAD") == 0){
-    upload(clientfd, request);
+    upload(session, request);
   }
 
   else if(strcmp(request, "DOWNLOAD") == 0){
-    download(clientfd, request);
+    download(session, request);
   }
 
   else if(strcmp(request, "DELETE") == 0){
-    delete(clientfd, request);
+    delete(session, request);
   }
 
   else if(strcmp(request, "QUIT") == 0){
-    quit(clientfd);
+    quit(session);
+  }
+
+  else if(strcmp(request, "STATS") == 0){
+    stats(session);
   }
 
   else {
-    invalid_input(clientfd);
+    invalid_input(session);
   }
 }
 
@@ -134,371 +1011,563 @@ void error_occurred(const char *msg){
   exit(1);
 }
 
-void *recv_file(int clientfd, char *filename){
-  char *path = malloc(sizeof(char) * 13 + sizeof(filename));
-  strcpy(path, "server_files/");
-  FILE *file;
-  file = fopen(strcat(path, filename), "w+");
+bool valid_filename(const char *filename){
+  if(filename[0] == '\0' || strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0){
+    return false;
+  }
+
+  return strchr(filename, '/') == NULL && strlen(filename) <= NAME_MAX;
+}
+
+void build_path(char *path, const char *filename){
+  layout_path(path, STORAGE_DIR, config.layout, filename);
+}
+
+/* Makes sure the directory build_path puts filename in exists. */
+bool prepare_path(const char *filename){
+  return layout_prepare(STORAGE_DIR, config.layout, filename);
+}
 
-  int bytes_received = 0;
-  char *buffer;
-  buffer = malloc(sizeof(char) * 256);
-  bzero(buffer, 256);
+void build_partial_path(char *path, const char *filename){
+  snprintf(path, PATH_MAX, PARTIAL_DIR "/%s", filename);
+}
+
+/*
+ * Puts a finished upload in place under filename. A chunked store takes
+ * it apart into chunks and only its manifest gets the name; a packed
+ * store packs it.
+ */
+bool commit_file(const char *partial, const char *filename){
+  char path[PATH_MAX];
+
+  if(config.dedup){
+    return dedup_commit(partial, filename);
+  }
 
-  if(file == NULL){
-    error_occurred("Error opening file.\n");
+  if(config.packed){
+    return pack_commit(partial, filename);
   }
 
-  read(clientfd, buffer, 256);
-  int size = atoi(buffer);
-  int sum_bytes_received = 0;
-  int remaining_bytes = 0;
+  build_path(path, filename);
+  return prepare_path(filename) && rename(partial, path) == 0;
+}
+
+/*
+ * Opens the content of a stored file for reading. From a chunked or a
+ * packed store that is a temporary copy put together from its chunks or
+ * unpacked.
+ */
+int open_stored(const char *filename){
+  char path[PATH_MAX];
+
+  if(config.dedup){
+    return dedup_assemble(filename);
+  }
+
+  if(config.packed){
+    return pack_assemble(filename);
+  }
 
-  while(sum_bytes_received < size) {
-    bzero(buffer, 256);
-    sum_bytes_received += bytes_received;
-    remaining_bytes = size - sum_bytes_received;
+  build_path(path, filename);
+  return open(path, O_RDONLY | O_CLOEXEC);
+}
 
-    if(remaining_bytes < 256){
-      bytes_received = read(clientfd, buffer, remaining_bytes);
+/*
+ * Receives the upload body. Bytes that arrived together with the size
+ * header are written from inbuf; everything after that is spliced from the
+ * socket into the file without passing through user space. A failed
+ * upload closes the session since the rest of the stream is unusable.
+ */
+enum TransferStatus recv_file(struct Session *session){
+  struct FileReceiver *receiver = &session->receiver;
+  unsigned long long bytes_received = 0;
+  enum TransferStatus status = TRANSFER_DONE;
+  struct DiskJob *job;
+  uint64_t start;
+  int len;
+
+  if(session->inlen > 0){
+    len = receiver_feed(receiver, session->inbuf, session->inlen);
+    if(len < 0){
+      status = TRANSFER_ERROR;
     }
 
     else {
-      bytes_received = read(clientfd, buffer, 256);
+      consume_input(session, len);
     }
+  }
 
-    if(bytes_received > 0){
-      fwrite(buffer, 1, bytes_received, file);
+  else if(receiver->remaining > 0){
+    start = tracing ? trace_now() : 0;
+    status = receiver_pump(receiver, session->watcher.fd, EVENT_BUDGET, &bytes_received);
+    if(tracing){
+      trace_span("receive body", "net", session->watcher.fd, start, bytes_received, NULL);
     }
 
-    if(bytes_received < 0){
-      printf("Error reading file.");
-      break;
+    atomic_fetch_add_explicit(&session->worker->bytes_in, bytes_received,
+                              memory_order_relaxed);
+  }
+
+  if(status == TRANSFER_ERROR){
+    log_error("Error reading file.");
+    if(session->filefd >= 0){
+      close(session->filefd);
+      session->filefd = -1;
     }
 
-    if(bytes_received == 0){
-      break;
+    if(session->protocol == PROTOCOL_LEGACY){
+      set_transferring(session, false);
+      metrics_record(session->worker, CMD_UPLOAD, &session->timing, false);
     }
+
+    session->state = STATE_CLOSING;
+    return status;
   }
 
-  int status = fclose(file);
-  if(status == 0) {
-    printf("File received!\n");
+  if(receiver->remaining > 0){
+    return TRANSFER_AGAIN;
   }
-  else {
-    printf("ERROR: File not closed.\n");
+
+  if(session->protocol == PROTOCOL_FRAMED){
+    return finish_data(session);
   }
 
-  free(buffer);
-  free(path);
-  return 0;
+  // closing may flush, and committing may copy the whole file
+  set_transferring(session, false);
+  job = new_job(session);
+  job->filefd = session->filefd;
+  session->filefd = -1;
+  strcpy(job->filename, session->upload_name);
+  session->state = STATE_COMMAND;
+  start_job(session, job, "commit upload", save_upload, upload_saved);
+  return TRANSFER_DONE;
 }
 
-void *send_file(int clientfd, char *filename){
-  FILE *file;
-  file = fopen(filename, "rb");
+void save_upload(struct DiskJob *job){
+  char partial[PATH_MAX];
+  int close_status = close(job->filefd);
+
+  job->filefd = -1;
+  if(close_status != 0){
+    job->error = "Error saving file.";
+  }
 
-  int bytes_read = 0;
-  char *buffer = malloc(sizeof(char) * 256);
-  bzero(buffer, 256);
+  if(job->filename[0] != '\0'){
+    build_partial_path(partial, job->filename);
+    if((config.dedup || config.packed) && !commit_file(partial, job->filename)){
+      job->error = "Error saving file.";
+    }
 
-  if(file == NULL){
-    error_occurred("Error opening file.\n");
+    index_update(job->filename);
   }
+}
 
-  fseek(file, 0L, SEEK_END);
-  int size = ftell(file);
-  sprintf(buffer, "%d", size);
-  write(clientfd, buffer, 256);
-  fseek(file, 0L, SEEK_SET);
+void upload_saved(struct Session *session, struct DiskJob *job){
+  if(job->filename[0] == '\0'){
+    log_error("File not closed.");
+  }
 
-  while(true){
-    bzero(buffer, 256);
-    bytes_read = fread(buffer, 1, 256, file);
+  else if(job->error != NULL){
+    log_error("%s", job->error);
+  }
 
-    if(bytes_read > 0){
-      write(clientfd, buffer, bytes_read);
-    }
+  else {
+    log_info("File received!");
+  }
 
-    if(bytes_read < 256){
-      if(feof(file)){
-        printf("Download done!\n");
-      }
+  metrics_record(session->worker, CMD_UPLOAD, &session->timing,
+                 job->filename[0] != '\0' && job->error == NULL);
+}
 
-      if(ferror(file)){
-        printf("Error uploading file.\n");
-      }
+/*
+ * Streams the download body straight from the page cache with sendfile(2),
+ * a budget at a time, and reports TRANSFER_AGAIN so the reactor resumes it
+ * when the socket drains. On io_uring the reactor moves it instead and
+ * reports TRANSFER_PENDING until it calls back with the body out.
+ */
+enum TransferStatus send_file(struct Session *session){
+  unsigned long long bytes_sent = 0;
+  enum TransferStatus status;
+  uint64_t start;
+
+  start = tracing ? trace_now() : 0;
+  status = reactor_send(session->reactor, &session->watcher, &session->sender, EVENT_BUDGET,
+                        &bytes_sent);
+  if(tracing){
+    // a body the reactor moves itself went out since it was last handed over
+    trace_span("send body", "net", session->watcher.fd,
+               session->ring_send != 0 ? session->ring_send : start, bytes_sent, NULL);
+    session->ring_send = status == TRANSFER_PENDING ? trace_now() : 0;
+  }
 
-      break;
-    }
+  atomic_fetch_add_explicit(&session->worker->bytes_out, bytes_sent,
+                            memory_order_relaxed);
+
+  if(status == TRANSFER_AGAIN || status == TRANSFER_PENDING){
+    return status;
   }
 
-  fclose(file);
-  free(buffer);
-  return 0;
-}
+  if(session->protocol == PROTOCOL_FRAMED){
+    return finish_chunk(session, status);
+  }
 
-void write_response(int clientfd, char *response){
-  int status = write(clientfd, response, strlen(response));
-  if(status < 0) {
-    error_occurred("ERROR writing to socket");
+  if(status == TRANSFER_DONE){
+    log_info("Download done!");
+    session->state = STATE_COMMAND;
   }
-}
 
-char *read_request(int sockfd, char *buffer){
-  bzero(buffer, 1024);
-  int status = read(sockfd, buffer, 1024);
-  if(status < 0) {
-    error_occurred("ERROR reading from socket");
+  else {
+    log_error("Error uploading file.");
   }
 
-  return buffer;
+  set_transferring(session, false);
+  metrics_record(session->worker, CMD_DOWNLOAD, &session->timing, status == TRANSFER_DONE);
+  release_download(session);
+  return status;
 }
 
-void *communicate(void *newsockfd){
-  int sockfd = *((int*)newsockfd);
-  printf("Connected to client %d...\n", sockfd);
-  bool server_run = true;
-  char *buffer = malloc(sizeof(char) * 1024);
-  bzero(buffer, 1024);
+/* Lets go of what a text protocol download was sent from. */
+void release_download(struct Session *session){
+  if(session->cached != NULL){
+    cache_release(session->cached);
+    session->cached = NULL;
+  }
 
-  while(server_run) {
-    buffer = read_request(sockfd, buffer);
-    process_request(buffer, sockfd);
-    if(strcmp(buffer, "QUIT") == 0){
-      server_run = false;
+  if(session->filefd >= 0){
+    close(session->filefd);
+    session->filefd = -1;
+  }
+
+  sender_free(&session->sender);
+}
+
+/*
+ * Queues len bytes of output. What does not fit moves outbuf into the
+ * output arena, doubled until it does; flush_session goes back to outbase
+ * once everything is written.
+ */
+void write_bytes(struct Session *session, const char *data, size_t len){
+  size_t capacity;
+  char *grown;
+
+  if(session->outlen + len > session->outcap){
+    capacity = session->outcap * 2;
+    while(capacity < session->outlen + len){
+      capacity *= 2;
     }
+
+    grown = arena_alloc(&session->output, capacity);
+    memcpy(grown, session->outbuf, session->outlen);
+    session->outbuf = grown;
+    session->outcap = capacity;
   }
 
-  free(buffer);
-  close(sockfd);
-  return 0;
+  memcpy(session->outbuf + session->outlen, data, len);
+  session->outlen += len;
+}
+
+void write_response(struct Session *session, char *response){
+  write_bytes(session, response, strlen(response));
+}
+
+void consume_input(struct Session *session, size_t len){
+  session->inlen -= len;
+  memmove(session->inbuf, session->inbuf + len, session->inlen);
 }
 
-void upload(int clientfd, char *request){
+void upload(struct Session *session, char *request){
   char *response = "ready_upload";
-  printf("Client %d: %s\n", clientfd, response);
-  write_response(clientfd, response);
+  log_info("Client %d: %s", session->watcher.fd, response);
+  write_response(session, response);
+  session->state = STATE_UPLOAD_NAME;
+}
+
+void upload_filename(struct Session *session, char *request){
+  struct DiskJob *job;
 
   // get filename
-  request = read_request(clientfd, request);
   if(strcmp(request, "filename_error") == 0){
-    printf("File does not exist. Aborting upload.\n");
+    log_warn("File does not exist. Aborting upload.");
+    metrics_record(session->worker, CMD_UPLOAD, &session->timing, false);
+    session->state = STATE_COMMAND;
     return;
   }
 
-  printf("Client %d: %s\n", clientfd, request);
+  log_info("Client %d: %s", session->watcher.fd, request);
+
+  session->filefd = -1;
+  session->upload_name[0] = '\0';
+  job = new_job(session);
+  if(valid_filename(request)){
+    strcpy(job->filename, request);
+  }
+
+  start_job(session, job, "open upload", open_upload, upload_opened);
+}
+
+/*
+ * The client starts sending as soon as it sees ready_filename, so a name
+ * we cannot store still gets that answer and the bytes are discarded.
+ */
+void open_upload(struct DiskJob *job){
+  char path[PATH_MAX];
+
+  if(job->filename[0] != '\0' && prepare_path(job->filename)){
+    build_path(path, job->filename);
+
+    // a chunked or packed store only commits the body once it is all in
+    if(config.dedup || config.packed){
+      build_partial_path(path, job->filename);
+    }
+
+    job->filefd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  }
+
+  if(job->filefd >= 0){
+    if(!config.dedup && !config.packed){
+      index_update(job->filename);
+    }
+  }
+
+  else {
+    job->error = "Error opening file.";
+    job->filename[0] = '\0';
+    job->filefd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  }
+}
+
+void upload_opened(struct Session *session, struct DiskJob *job){
+  if(job->error != NULL){
+    log_error("%s", job->error);
+  }
+
+  session->filefd = job->filefd;
+  job->filefd = -1;
+  strcpy(session->upload_name, job->filename);
 
   // ready to receive
-  response = "ready_filename";
-  printf("Client %d: %s\n", clientfd, response);
-  write_response(clientfd, response);
+  char *response = "ready_filename";
+  log_info("Client %d: %s", session->watcher.fd, response);
+  write_response(session, response);
+  session->state = STATE_UPLOAD_HEADER;
+}
+
+void upload_header(struct Session *session){
+  char header[HEADER_SIZE + 1];
+
+  memcpy(header, session->inbuf, HEADER_SIZE);
+  header[HEADER_SIZE] = '\0';
+  consume_input(session, HEADER_SIZE);
+
+  receiver_start(&session->receiver, session->filefd, 0, atoll(header));
+  session->state = STATE_UPLOAD_BODY;
+  set_transferring(session, true);
 
   // receive the file
-  recv_file(clientfd, request);
+  if(session->receiver.remaining <= 0){
+    session->receiver.remaining = 0;
+    recv_file(session);
+  }
 }
 
-void download(int clientfd, char *request){
-  printf("Client %d: %s\n", clientfd, "ready_download");
-  write_response(clientfd, "ready_download");
+void download(struct Session *session, char *request){
+  log_info("Client %d: %s", session->watcher.fd, "ready_download");
+  write_response(session, "ready_download");
+  session->state = STATE_DOWNLOAD_NAME;
+}
 
-  // get filename
-  request = read_request(clientfd, request);
-  char *path = malloc(sizeof(char) * 13 + sizeof(request));
-  strcpy(path, "server_files/");
-  strcat(path, request);
-
-  FILE *file = fopen(path, "r");
-  if(file == NULL){
-    printf("File does not exist. Aborting download.\n");
-    write_response(clientfd, "filename_error");
+void download_filename(struct Session *session, char *request){
+  struct DiskJob *job = new_job(session);
+
+  session->filefd = -1;
+  if(valid_filename(request)){
+    strcpy(job->filename, request);
+  }
+
+  start_job(session, job, "open download", load_download, download_loaded);
+}
+
+/* A file in the hot-file cache is sent from memory. */
+void load_download(struct DiskJob *job){
+  struct stat file_stats;
+
+  if(job->filename[0] == '\0'){
+    job->error = "File does not exist.";
     return;
   }
 
-  fclose(file);
-  printf("Client %d: %s\n", clientfd, request);
+  job->opened.cached = cache_open(job->filename);
+  if(job->opened.cached != NULL){
+    return;
+  }
 
-  // ready to send
-  write_response(clientfd, "ready_to_send");
-  printf("Client %d: %s\n", clientfd, "ready_to_send");
+  job->filefd = open_stored(job->filename);
+  if(job->filefd < 0 || fstat(job->filefd, &file_stats) < 0 || !S_ISREG(file_stats.st_mode)){
+    job->error = "File does not exist.";
+    return;
+  }
 
-  request = read_request(clientfd, request);
-  printf("Client %d: %s\n", clientfd, request);
+  job->size = file_stats.st_size;
+}
 
-  if(strcmp(request, "ready_to_receive") == 0){
-    send_file(clientfd, path);
+void download_loaded(struct Session *session, struct DiskJob *job){
+  if(job->error != NULL){
+    log_warn("File does not exist. Aborting download.");
+    metrics_record(session->worker, CMD_DOWNLOAD, &session->timing, false);
+    write_response(session, "filename_error");
+    session->state = STATE_COMMAND;
+    return;
+  }
+
+  log_info("Client %d: %s", session->watcher.fd, job->filename);
+  if(job->opened.cached != NULL){
+    session->cached = job->opened.cached;
+    job->opened.cached = NULL;
+    sender_init_memory(&session->sender, session->cached->data, 0, session->cached->size);
   }
 
   else {
-    printf("Client not ready. Aborting download.\n");
+    session->filefd = job->filefd;
+    job->filefd = -1;
+    sender_init(&session->sender, session->filefd, 0, job->size);
   }
 
-  free(path);
+  // ready to send
+  write_response(session, "ready_to_send");
+  log_info("Client %d: %s", session->watcher.fd, "ready_to_send");
+  session->state = STATE_DOWNLOAD_ACK;
 }
 
-void delete(int clientfd, char *request){
-  char *response = "ready_delete";
-  char *path = malloc(sizeof(char) * 13);
-  strcpy(path, "server_files/");
-  write_response(clientfd, response);
+void download_ready(struct Session *session, char *request){
+  char header[HEADER_SIZE];
 
-  // get file to delete
-  request = read_request(clientfd, request);
-  printf("Client %d: %s\n", clientfd, request);
+  log_info("Client %d: %s", session->watcher.fd, request);
 
-  // delete file
-  char *file_path = malloc(strlen(path) + strlen(request) + 1);
-  strcpy(file_path, path);
-  strcat(file_path, request);
-
-  if(remove(file_path) == 0){
-    response = "delete_success";
+  if(strcmp(request, "ready_to_receive") == 0){
+    bzero(header, HEADER_SIZE);
+    sprintf(header, "%lld", (long long)session->sender.remaining);
+    write_bytes(session, header, HEADER_SIZE);
+    session->outmark = session->outlen;
+    session->state = STATE_DOWNLOAD_BODY;
+    set_transferring(session, true);
   }
 
   else {
-    response = "delete_error";
+    log_warn("Client not ready. Aborting download.");
+    metrics_record(session->worker, CMD_DOWNLOAD, &session->timing, false);
+    release_download(session);
+    session->state = STATE_COMMAND;
   }
-
-  free(file_path);
-  free(path);
-  write_response(clientfd, response);
 }
 
-void quit(int clientfd){
-  char *response = "Disconnecting...";
-  write_response(clientfd, response);
-  client_number--;
+void delete(struct Session *session, char *request){
+  char *response = "ready_delete";
+  write_response(session, response);
+  session->state = STATE_DELETE_NAME;
 }
 
-void invalid_input(int clientfd){
-  char *response = "Invalid input. Please try again.";
-  write_response(clientfd, response);
+void delete_filename(struct Session *session, char *request){
+  struct DiskJob *job = new_job(session);
+
+  // get file to delete
+  log_info("Client %d: %s", session->watcher.fd, request);
+  if(valid_filename(request)){
+    strcpy(job->filename, request);
+  }
+
+  start_job(session, job, "delete", delete_stored, file_deleted);
 }
 
-void free_list(struct File* head){
-  struct File *tmp;
-  int counter = 0;
-  while (head != NULL) {
-    tmp = head;
-    counter++;
+/* Removes the file job names; framed DELETE shares it. */
+void delete_stored(struct DiskJob *job){
+  char file_path[PATH_MAX];
 
-    head = head->next;
-    free(tmp->filename);
-    free(tmp);
+  if(job->filename[0] != '\0'){
+    build_path(file_path, job->filename);
   }
 
-  free(head);
-}
+  if(job->filename[0] == '\0' || remove(file_path) != 0){
+    job->error = "File could not be deleted.";
+    return;
+  }
 
-struct File* create_list(){
-  struct stat file_stats;
-  struct File *root;
-  char *directory = "server_files";
-  char *path = "server_files/";
-
-  root = (struct File *)malloc(sizeof(struct File));
-  root->next = NULL;
-  root->filename = NULL;
-
-  struct File *current;
-  current = root;
-
-  DIR *dir;
-  struct dirent *ent;
-  dir = opendir(directory);
-
-  if(dir){
-    while((ent = readdir(dir)) != NULL){
-      if(ent->d_type == 8){
-        if(current->filename != NULL){
-          struct File *file;
-          file = (struct File *)malloc(sizeof(struct File));
-          current->next = file;
-          current = file;
-          current->next = NULL;
-        }
+  index_remove(job->filename);
+}
 
-        char *file_path = malloc(strlen(path) + strlen(ent->d_name) + 1);
-        char *filename = malloc(strlen(ent->d_name) + 1);
-        strcpy(filename, ent->d_name);
-        strcpy(file_path, path);
-        strcat(file_path, ent->d_name);
-        stat(file_path, &file_stats);
+void file_deleted(struct Session *session, struct DiskJob *job){
+  metrics_record(session->worker, CMD_DELETE, &session->timing, job->error == NULL);
+  write_response(session, job->error == NULL ? "delete_success" : "delete_error");
+  session->state = STATE_COMMAND;
+}
 
-        current->filename = filename;
-        current->size = (float)(file_stats.st_size/1000.0);
-        free(file_path);
-      }
-    }
+void quit(struct Session *session){
+  char *response = "Disconnecting...";
+  write_response(session, response);
+  session->state = STATE_CLOSING;
+}
 
-    closedir(dir);
-  }
+void stats(struct Session *session){
+  arena_reset(&session->arena);
+  write_response(session, metrics_text(&session->arena));
+  arena_reset(&session->arena);
+  metrics_record(session->worker, CMD_STATS, &session->timing, true);
+}
 
-  else {
-    printf("There are no files available for download.\n");
+/* Counts a text protocol transfer in flight while its body moves. */
+void set_transferring(struct Session *session, bool transferring){
+  if(session->transferring != transferring){
+    session->transferring = transferring;
+    atomic_fetch_add_explicit(&session->worker->transfers, transferring ? 1 : -1,
+                              memory_order_relaxed);
   }
+}
 
-  free(ent);
-  return root;
+void invalid_input(struct Session *session){
+  char *response = "Invalid input. Please try again.";
+  write_response(session, response);
 }
 
-void list(struct File *root, int clientfd){
-  struct File *current;
-  current = root;
-  float size = 0;
+void list(struct Session *session){
+  char buffer[32];
   int file_counter = 0;
+  char *list_string;
+
+  arena_reset(&session->arena);
+  list_string = index_list(&session->arena, &file_counter);
 
   // check if list of files is empty first
-  if(current->filename == NULL){
-    printf("No files found.\n");
-    write_response(clientfd, "0");
-    free_list(root);
+  if(file_counter == 0){
+    log_info("No files found.");
+    write_response(session, "0");
+    arena_reset(&session->arena);
+    metrics_record(session->worker, CMD_LIST, &session->timing, true);
     return;
   }
 
-  // get size for malloc
-  while (current != NULL){
-    size += sizeof(*current);
-    file_counter++;
-    current = current->next;
-  }
-
-  char *list_string = malloc(size + (20*file_counter) + file_counter);
-  char *buffer = malloc(sizeof(char) * 1024);
   sprintf(buffer, "%d", file_counter);
-  write_response(clientfd, buffer);
-  printf("Files found: %s\n", buffer);
+  write_response(session, buffer);
+  log_info("Files found: %s", buffer);
 
-  bzero(buffer, 1024);
-  read(clientfd, buffer, 1024);
-  printf("%s\n", buffer);
-
-  if(strcmp(buffer, "file_count_received") != 0){
-    printf("Client not ready. Aborting command.\n");
-    free(buffer);
-    free(list_string);
-  }
-
-  free(buffer);
+  // the listing goes out once the client acknowledges the count
+  session->list_string = list_string;
+  session->state = STATE_LIST_ACK;
+}
 
-  strcpy(list_string, "\0");
-  current = root;
-  while (current != NULL){
-    //convert current->size to string
-    char *file_size = malloc(sizeof(float) * current->size);
-    sprintf(file_size, "%.1f", current->size);
+void send_list(struct Session *session, char *request){
+  log_info("Client %d: %s", session->watcher.fd, request);
+  session->state = STATE_COMMAND;
 
-    strcat(list_string, current->filename);
-    strcat(list_string, " (");
-    strcat(list_string, file_size);
-    strcat(list_string, " kb)\n");
-    current = current->next;
-    free(file_size);
+  if(strcmp(request, "file_count_received") != 0){
+    log_warn("Client not ready. Aborting command.");
+    session->list_string = NULL;
+    arena_reset(&session->arena);
+    metrics_record(session->worker, CMD_LIST, &session->timing, false);
+    return;
   }
 
-  free_list(root);
-
-  printf("Files found:\n%s\n", list_string);
-  write_response(clientfd, list_string);
-  free(list_string);
+  log_debug("Files found:\n%s", session->list_string);
+  write_response(session, session->list_string);
+  session->list_string = NULL;
+  arena_reset(&session->arena);
+  metrics_record(session->worker, CMD_LIST, &session->timing, true);
 }
@@ -0,0 +1,451 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include "reactor.h"
+#include "transfer.h"
+#include "protocol.h"
+#include "layout.h"
+#include "chunk.h"
+#include "lz.h"
+#include "iopool.h"
+#include "slab.h"
+#include "arena.h"
+#include "logger.h"
+#include "trace.h"
+
+#define INBUF_SIZE 65536
+#define OUTBUF_SIZE 16384
+#define REQUEST_SIZE 1024
+#define HEADER_SIZE 256
+#define EVENT_BUDGET (4 * 1024 * 1024)
+#define OUTBUF_HIGH_WATER (256 * 1024)
+#define DEFAULT_BACKLOG 128
+#define STORAGE_DIR "server_files"
+#define PARTIAL_DIR STORAGE_DIR "/.partial"
+#define CHUNK_DIR STORAGE_DIR "/.chunks"
+#define CHUNK_PARTIAL_DIR CHUNK_DIR "/.partial"
+#define DELTA_PARTIAL_DIR STORAGE_DIR "/.delta"
+#define PACK_DIR STORAGE_DIR "/.packed"
+#define PACK_MAGIC "BDP1"
+#define PACK_HEADER 16
+#define PACK_LEVEL_DEFAULT 6
+#define CACHE_DEFAULT_MB 64
+#define CACHE_FILE_SHARE 8
+#define BLOCK_BUFFER_SIZE (COMPRESS_BLOCK > FRAME_MAX_CONTROL ? COMPRESS_BLOCK : FRAME_MAX_CONTROL)
+
+/*
+ * Every connection is driven by the reactor as a state machine. The state
+ * records which message of the LIST/UPLOAD/DOWNLOAD/DELETE handshakes the
+ * session is waiting for, so a client that goes quiet mid-command only
+ * parks its own session instead of a thread. Framed sessions only use
+ * STATE_COMMAND (next frame header), the BODY states and STATE_CLOSING.
+ */
+enum SessionState{
+  STATE_COMMAND,
+  STATE_LIST_ACK,
+  STATE_UPLOAD_NAME,
+  STATE_UPLOAD_HEADER,
+  STATE_UPLOAD_BODY,
+  STATE_DOWNLOAD_NAME,
+  STATE_DOWNLOAD_ACK,
+  STATE_DOWNLOAD_BODY,
+  STATE_DELETE_NAME,
+  STATE_CLOSING
+};
+
+// decided by the first byte a client sends
+enum Protocol{
+  PROTOCOL_UNKNOWN,
+  PROTOCOL_LEGACY,
+  PROTOCOL_FRAMED
+};
+
+/*
+ * What the metrics count requests as; a framed request and its text
+ * protocol counterpart are the same command.
+ */
+enum Command{
+  CMD_LIST,
+  CMD_UPLOAD,
+  CMD_DOWNLOAD,
+  CMD_DELETE,
+  CMD_HAVE,
+  CMD_SIGNATURES,
+  CMD_STATS,
+  CMD_COUNT
+};
+
+// bucket i counts latencies under 2^i microseconds, the last one all longer ones
+#define LATENCY_BUCKETS 28
+
+/*
+ * The commands of one kind a worker completed: how many, how many failed,
+ * and how long they took from the request coming in to its reply, or the
+ * last byte of its body, being handed to the socket. disk_ns is the part
+ * of that spent waiting on the disk pool; the rest is network and event
+ * loop time.
+ */
+struct CommandStats{
+  atomic_ullong count;
+  atomic_ullong errors;
+  atomic_ullong total_ns;
+  atomic_ullong disk_ns;
+  atomic_ullong buckets[LATENCY_BUCKETS];
+};
+
+// when a command came in, from whom, and how long it has waited on the disk pool so far
+struct Timing{
+  uint64_t start;
+  uint64_t disk_ns;
+  int client;
+};
+
+/*
+ * A striped upload: ranges of one file arriving over several connections,
+ * possibly on different workers. They all write to the same partial file,
+ * which is renamed into place once the received ranges cover all of it.
+ * Each stream and each session that sent a range holds a reference, so a
+ * client that keeps its connections open until every range is answered
+ * never sees the upload forgotten between two of its ranges.
+ */
+struct Range{
+  off_t start;
+  off_t end;
+  struct Range *next;
+};
+
+struct Stripe{
+  char name[NAME_MAX + 1];
+  uint64_t token;
+  int filefd;
+  off_t size;
+  struct Range *ranges;
+  bool committed;
+  int refs;
+  struct Stripe *next;
+};
+
+/*
+ * A FEATURE_LISTING query: the filter and order, and the cursor, which is
+ * the last entry already listed (an empty after_name: none yet).
+ */
+struct ListQuery{
+  uint8_t order;
+  char pattern[NAME_MAX + 1];
+  uint64_t after_key;
+  char after_name[NAME_MAX + 1];
+};
+
+/*
+ * Where a block of a file in the packed store is: offset and length in the
+ * file, start and length of what is stored, which is shorter if compressed.
+ */
+struct PackBlock{
+  off_t offset;
+  off_t length;
+  off_t start;
+  off_t stored;
+  bool compressed;
+};
+
+/*
+ * A file in the hot-file cache (see cache.c): its whole content, as a
+ * download sends it. refs counts the downloads sending from it; cached is
+ * cleared once it is evicted or dropped.
+ */
+struct CacheEntry{
+  char *name;
+  char *data;
+  off_t size;
+  int refs;
+  bool cached;
+  struct CacheEntry *next;
+  struct CacheEntry *newer;
+  struct CacheEntry *older;
+};
+
+struct ListEntry{
+  char name[NAME_MAX + 1];
+  off_t size;
+  time_t mtime;
+};
+
+/*
+ * An upload or download in progress on a framed session, named by the
+ * request_id that opened it. Uploads are written to a file under
+ * PARTIAL_DIR and renamed into place once complete, so an interrupted one
+ * can be resumed and never shows up half written. Without FEATURE_STREAMS
+ * there is at most one and it holds up the requests behind it; with it, up
+ * to MAX_STREAMS run side by side and take turns on the socket a DATA
+ * frame at a time. A range of a striped upload also points at its stripe,
+ * and a paged LIST is a stream too, its pages produced from the query.
+ * In a chunked store a download walks the file's chunks: filefd is the
+ * chunk being sent, and base where it starts in the file. In a packed
+ * store it reads the packed file a block at a time. A download of a file
+ * in the hot-file cache sends from cached instead.
+ */
+struct Stream{
+  uint32_t id;
+  uint8_t opcode;
+  int filefd;
+  off_t offset;   // next byte to move
+  off_t size;     // where the transfer ends
+  int64_t window;
+  bool discard;
+  char path[PATH_MAX];
+  char partial[PATH_MAX];
+  struct Stripe *stripe;
+  off_t start;    // first byte of a striped range
+  struct ListQuery *query;
+  uint8_t flags;  // FLAG_CHUNK or FLAG_MANIFEST uploads
+  unsigned char hash[SHA256_SIZE];
+  struct ChunkList *chunks;
+  int chunk;
+  off_t base;
+  bool packed;        // reads a file of the packed store
+  off_t file_size;    // of the file a packed download reads
+  struct CacheEntry *cached;
+  bool compress;      // FEATURE_COMPRESS: still compressing the download
+  int misses;         // blocks in a row that did not compress
+  off_t raw_bytes;
+  off_t wire_bytes;
+  long long cpu_ns;
+  struct Timing timing;
+  struct Stream *next;
+};
+
+/*
+ * A worker owns one event loop and its own SO_REUSEPORT listener, so the
+ * kernel spreads incoming connections across workers and a session never
+ * leaves the thread that accepted it. Counters are written by the worker
+ * and read by the stats reporter and the metrics (see metrics.c).
+ * Compression state and its scratch buffer belong to the worker too, since
+ * a block is always compressed or decompressed in one go. Blocking disk
+ * calls are handed to the shared disk pool and finish back on the worker
+ * through done.
+ */
+struct Worker{
+  int id;
+  pthread_t thread;
+  struct Reactor reactor;
+  struct Listener{
+    struct Watcher watcher;
+    struct Worker *worker;
+  } listener;
+
+  atomic_ullong accepted;
+  atomic_int active;
+  atomic_ullong bytes_in;
+  atomic_ullong bytes_out;
+  atomic_int transfers;
+  struct CommandStats commands[CMD_COUNT];
+
+  struct LzState *lz;
+  unsigned char *scratch;   // COMPRESS_BLOCK, then room for a compressed frame
+  struct IoDone done;       // disk jobs of its sessions that finished
+};
+
+struct Config{
+  int port;
+  int workers;
+  int backlog;
+  int stats_interval;
+  enum Layout layout;
+  bool dedup;
+  bool packed;
+  int pack_level;
+  size_t cache_size;
+  enum Backend backend;
+  int io_threads;
+  int io_depth;
+  int metrics_port;
+  enum LogLevel log_level;
+  int log_rate;
+  const char *trace_path;
+};
+
+/*
+ * A disk operation a session waits for: work runs on the disk pool and
+ * must only touch the job and what the session left to it, finish runs
+ * back on the worker to answer the client. The session reads no further
+ * requests until then, so the order of replies stays the one of the
+ * requests. What the job opened and finish did not take over is released
+ * with it, also when the client is gone by then.
+ */
+struct DiskJob{
+  struct IoJob io;
+  struct Session *session;
+  void (*work)(struct DiskJob *job);
+  void (*finish)(struct Session *session, struct DiskJob *job);
+  const char *operation;    // what the job does, e.g. "open download"; names its trace span
+  uint32_t request_id;
+  char filename[NAME_MAX + 1];
+  struct Stream *stream;    // an upload that is complete
+  struct Stream opened;     // what a download reads from
+  struct Stripe *stripe;    // a striped upload joined, with a reference
+  int filefd;
+  off_t offset;
+  off_t length;
+  off_t size;
+  uint64_t token;           // of a striped upload
+  uint8_t flags;            // of the UPLOAD frame
+  bool ranged;
+  const char *error;
+  unsigned char *payload;
+  size_t len;
+  struct Timing timing;     // of the command, disk time included once done
+};
+
+struct Session{
+  struct Watcher watcher;
+  struct Worker *worker;
+  struct Reactor *reactor;
+  enum SessionState state;
+  enum Protocol protocol;
+
+  char *inbuf;
+  size_t inlen;
+
+  char *outbuf;     // outbase, or in output while a reply outgrows it
+  char *outbase;    // OUTBUF_SIZE bytes from outbuf_slab
+  size_t outlen;
+  size_t outoff;
+  size_t outcap;
+  size_t outmark;   // end of the header a file body is sent right after
+
+  int filefd;
+  struct CacheEntry *cached;
+  struct FileSender sender;
+  struct FileReceiver receiver;
+  char *list_string;        // in arena until the client acknowledges the count
+  char upload_name[NAME_MAX + 1];
+  struct Arena arena;       // scratch of the request being handled
+  struct Arena output;      // outbuf past OUTBUF_SIZE, until it has drained
+
+  /* framed protocol */
+  struct FrameHeader frame;
+  uint32_t features;
+  uint8_t level;
+  struct Stream *streams;
+  int stream_count;
+  struct Stream *receiving;
+  struct Stream *sending;
+  struct Stripe *stripe;
+
+  struct DiskJob *job;
+  bool closed;
+
+  struct Timing timing;     // of the request being handled
+  bool transferring;        // a text protocol body is moving
+  uint64_t ring_send;       // traced: since when the reactor has been sending a body
+};
+
+extern struct Config config;
+extern struct Worker *workers;
+extern struct IoPool disk_pool;
+
+/*
+ * Everything a session, a transfer or a disk job allocates comes from
+ * these, so a server under steady load allocates nothing (see slab.h).
+ */
+extern struct Slab session_slab;
+extern struct Slab inbuf_slab;
+extern struct Slab stream_slab;
+extern struct Slab job_slab;
+extern struct Slab query_slab;
+extern struct Slab block_slab;
+extern struct Slab lz_slab;
+
+void write_response(struct Session *session, char *response);
+void write_bytes(struct Session *session, const char *data, size_t len);
+void consume_input(struct Session *session, size_t len);
+enum TransferStatus recv_file(struct Session *session);
+enum TransferStatus send_file(struct Session *session);
+bool valid_filename(const char *filename);
+void build_path(char *path, const char *filename);
+bool prepare_path(const char *filename);
+void build_partial_path(char *path, const char *filename);
+bool commit_file(const char *partial, const char *filename);
+int open_stored(const char *filename);
+void error_occurred(const char *msg);
+struct DiskJob *new_job(struct Session *session);
+void start_job(struct Session *session, struct DiskJob *job, const char *operation,
+               void (*work)(struct DiskJob *job),
+               void (*finish)(struct Session *session, struct DiskJob *job));
+void free_job(struct DiskJob *job);
+void delete_stored(struct DiskJob *job);
+
+/* framed.c */
+void process_frames(struct Session *session);
+void queue_header(struct Session *session, uint8_t opcode, uint8_t flags,
+                  uint32_t request_id, uint64_t length);
+void queue_frame(struct Session *session, uint8_t opcode, uint8_t flags,
+                 uint32_t request_id, const void *payload, size_t len);
+enum TransferStatus finish_data(struct Session *session);
+enum TransferStatus finish_chunk(struct Session *session, enum TransferStatus status);
+struct Stream *next_sender(struct Session *session);
+bool schedule_chunk(struct Session *session);
+void free_streams(struct Session *session);
+
+/* index.c */
+void index_init();
+void index_update(const char *name);
+void index_remove(const char *name);
+char *index_list(struct Arena *arena, int *file_counter);
+int index_page(struct ListQuery *query, struct ListEntry *entries, int max);
+bool index_size(const char *name, off_t *size);
+
+/* metrics.c */
+uint64_t metrics_now();
+void metrics_record(struct Worker *worker, enum Command command, const struct Timing *timing,
+                    bool ok);
+char *metrics_text(struct Arena *arena);
+char *metrics_prometheus(struct Arena *arena);
+void report_metrics();
+void metrics_start(int port);
+
+/* cache.c */
+struct CacheEntry *cache_open(const char *filename);
+void cache_release(struct CacheEntry *entry);
+void cache_drop(const char *filename);
+void cache_clear();
+void report_cache();
+
+/* dedup.c */
+void dedup_init();
+void chunk_path(char *path, const unsigned char *hash);
+bool dedup_has(const unsigned char *hash);
+int dedup_open_chunk(const unsigned char *hash);
+bool dedup_commit(const char *partial, const char *filename);
+bool dedup_put_chunk(const char *partial, const unsigned char *hash);
+off_t dedup_commit_manifest(const char *partial, const char *filename);
+struct ChunkList *dedup_open(const char *filename);
+void dedup_close(struct ChunkList *list);
+int dedup_assemble(const char *filename);
+bool dedup_stat(int dirfd, const char *name, struct stat *file_stats);
+
+/* pack.c */
+void pack_init();
+bool pack_commit(const char *partial, const char *filename);
+off_t pack_size(int filefd);
+bool pack_block(int filefd, off_t size, off_t offset, struct PackBlock *block);
+bool pack_read(int filefd, const struct PackBlock *block, unsigned char *data,
+               unsigned char *scratch);
+int pack_assemble(const char *filename);
+bool pack_stat(int dirfd, const char *name, struct stat *file_stats);
+
+/* stripe.c */
+struct Stripe *stripe_acquire(const char *name, uint64_t token, off_t size);
+void stripe_retain(struct Stripe *stripe);
+void stripe_release(struct Stripe *stripe);
+off_t stripe_complete(struct Stripe *stripe, off_t start, off_t end);
+
+#endif
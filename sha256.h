@@ -0,0 +1,22 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_SIZE 32
+
+/* FIPS 180-4 SHA-256, fed any number of times before sha256_final. */
+struct Sha256{
+  uint32_t state[8];
+  uint64_t length;
+  unsigned char block[64];
+  size_t used;
+};
+
+void sha256_init(struct Sha256 *sha);
+void sha256_update(struct Sha256 *sha, const void *data, size_t len);
+void sha256_final(struct Sha256 *sha, unsigned char *digest);
+void sha256(const void *data, size_t len, unsigned char *digest);
+
+#endif
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "slab.h"
+
+/* Adds a batch of objects to the free list. Called with the lock held. */
+static int slab_grow(struct Slab *slab){
+  size_t stride = (slab->size + slab->align - 1) / slab->align * slab->align;
+  char *objects = aligned_alloc(slab->align, stride * slab->batch);
+  int i;
+
+  if(objects == NULL){
+    return -1;
+  }
+
+  for(i = slab->batch - 1; i >= 0; i--){
+    *(void **)(objects + i * stride) = slab->free_list;
+    slab->free_list = objects + i * stride;
+  }
+
+  atomic_fetch_add_explicit(&slab->grows, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&slab->reserved, slab->batch, memory_order_relaxed);
+  return 0;
+}
+
+/* An object of the slab's size, uninitialized, or NULL if memory ran out. */
+void *slab_get(struct Slab *slab){
+  void *object = NULL;
+
+  pthread_mutex_lock(&slab->lock);
+  if(slab->free_list != NULL || slab_grow(slab) == 0){
+    object = slab->free_list;
+    slab->free_list = *(void **)object;
+  }
+
+  pthread_mutex_unlock(&slab->lock);
+  if(object != NULL){
+    atomic_fetch_add_explicit(&slab->taken, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&slab->in_use, 1, memory_order_relaxed);
+  }
+
+  return object;
+}
+
+/* slab_get, zeroed like calloc. */
+void *slab_zget(struct Slab *slab){
+  void *object = slab_get(slab);
+
+  if(object != NULL){
+    memset(object, 0, slab->size);
+  }
+
+  return object;
+}
+
+void slab_put(struct Slab *slab, void *object){
+  if(object == NULL){
+    return;
+  }
+
+  pthread_mutex_lock(&slab->lock);
+  *(void **)object = slab->free_list;
+  slab->free_list = object;
+  pthread_mutex_unlock(&slab->lock);
+  atomic_fetch_sub_explicit(&slab->in_use, 1, memory_order_relaxed);
+}
+
+void slab_report(struct Slab *slab){
+  printf("%s: %lld in use of %lld, %llu taken, %llu allocations\n", slab->name,
+         atomic_load_explicit(&slab->in_use, memory_order_relaxed),
+         atomic_load_explicit(&slab->reserved, memory_order_relaxed),
+         atomic_load_explicit(&slab->taken, memory_order_relaxed),
+         atomic_load_explicit(&slab->grows, memory_order_relaxed));
+}
@@ -0,0 +1,37 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * A pool of same-sized objects shared by all threads. Objects come from
+ * malloc batch at a time, aligned to align, and go back on a free list
+ * instead of to malloc, so once a workload has reached its peak taking and
+ * returning objects allocates nothing. The counters say whether it has:
+ * grows only moves while the pool is still growing.
+ */
+struct Slab{
+  const char *name;
+  size_t size;
+  size_t align;
+  int batch;
+  pthread_mutex_t lock;
+  void *free_list;
+
+  atomic_ullong taken;
+  atomic_ullong grows;
+  atomic_llong in_use;
+  atomic_llong reserved;
+};
+
+#define SLAB_INIT(name, size, align, batch) \
+  { (name), (size), (align), (batch), PTHREAD_MUTEX_INITIALIZER, NULL }
+
+void *slab_get(struct Slab *slab);
+void *slab_zget(struct Slab *slab);
+void slab_put(struct Slab *slab, void *object);
+void slab_report(struct Slab *slab);
+
+#endif
@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include "server.h"
+
+/*
+ * Striped uploads in progress. The ranges of one file may arrive on
+ * connections owned by different workers, so the list is shared and every
+ * access goes through stripes_lock. Range bodies themselves are written
+ * with positional writes on each stream's own descriptor, outside the lock.
+ */
+static struct Stripe *stripes = NULL;
+static pthread_mutex_t stripes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void unlink_stripe(struct Stripe *stripe){
+  struct Stripe **link = &stripes;
+
+  while(*link != NULL && *link != stripe){
+    link = &(*link)->next;
+  }
+
+  if(*link != NULL){
+    *link = stripe->next;
+  }
+}
+
+static struct Stripe *create_stripe(const char *name, uint64_t token, off_t size){
+  struct Stripe *stripe;
+  char partial[PATH_MAX];
+  int filefd;
+
+  // the same lock a plain upload of this name takes
+  build_partial_path(partial, name);
+  filefd = open(partial, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if(filefd < 0){
+    return NULL;
+  }
+
+  if(flock(filefd, LOCK_EX | LOCK_NB) < 0 ||
+     ftruncate(filefd, 0) < 0 || ftruncate(filefd, size) < 0){
+    int saved_errno = errno;
+    close(filefd);
+    errno = saved_errno;
+    return NULL;
+  }
+
+  stripe = calloc(1, sizeof(struct Stripe));
+  if(stripe == NULL){
+    error_occurred("ERROR allocating stripe");
+  }
+
+  strcpy(stripe->name, name);
+  stripe->token = token;
+  stripe->filefd = filefd;
+  stripe->size = size;
+  stripe->next = stripes;
+  stripes = stripe;
+  return stripe;
+}
+
+/*
+ * Joins the striped upload named by name and token, starting it if this
+ * is its first range. Returns NULL with EWOULDBLOCK if the name is busy
+ * with another upload. Every successful call needs a stripe_release.
+ */
+struct Stripe *stripe_acquire(const char *name, uint64_t token, off_t size){
+  struct Stripe *stripe;
+
+  pthread_mutex_lock(&stripes_lock);
+  for(stripe = stripes; stripe != NULL; stripe = stripe->next){
+    if(strcmp(stripe->name, name) == 0){
+      break;
+    }
+  }
+
+  if(stripe != NULL && (stripe->token != token || stripe->size != size)){
+    stripe = NULL;
+    errno = EWOULDBLOCK;
+  }
+
+  else if(stripe == NULL){
+    stripe = create_stripe(name, token, size);
+  }
+
+  if(stripe != NULL){
+    stripe->refs++;
+  }
+
+  pthread_mutex_unlock(&stripes_lock);
+  return stripe;
+}
+
+void stripe_retain(struct Stripe *stripe){
+  pthread_mutex_lock(&stripes_lock);
+  stripe->refs++;
+  pthread_mutex_unlock(&stripes_lock);
+}
+
+void stripe_release(struct Stripe *stripe){
+  struct Range *range;
+
+  pthread_mutex_lock(&stripes_lock);
+  if(--stripe->refs > 0){
+    pthread_mutex_unlock(&stripes_lock);
+    return;
+  }
+
+  // nobody is sending ranges any more; whatever is missing stays missing
+  unlink_stripe(stripe);
+  pthread_mutex_unlock(&stripes_lock);
+
+  close(stripe->filefd);
+  while(stripe->ranges != NULL){
+    range = stripe->ranges;
+    stripe->ranges = range->next;
+    free(range);
+  }
+
+  free(stripe);
+}
+
+/* Adds [start, end) to the sorted list of received ranges, merging overlaps. */
+static void add_range(struct Stripe *stripe, off_t start, off_t end){
+  struct Range **link = &stripe->ranges;
+  struct Range *range, *next;
+
+  while(*link != NULL && (*link)->end < start){
+    link = &(*link)->next;
+  }
+
+  range = *link;
+  if(range == NULL || range->start > end){
+    range = malloc(sizeof(struct Range));
+    if(range == NULL){
+      error_occurred("ERROR allocating range");
+    }
+
+    range->start = start;
+    range->end = end;
+    range->next = *link;
+    *link = range;
+    return;
+  }
+
+  if(start < range->start){
+    range->start = start;
+  }
+
+  if(end > range->end){
+    range->end = end;
+  }
+
+  // the grown range may now reach the ones after it
+  while((next = range->next) != NULL && next->start <= range->end){
+    if(next->end > range->end){
+      range->end = next->end;
+    }
+
+    range->next = next->next;
+    free(next);
+  }
+}
+
+/*
+ * Records a range that is fully on disk. Once the received ranges cover
+ * the whole file it is renamed into place, before any reply says so.
+ * Returns the number of bytes received so far, or -1 if the commit failed.
+ */
+off_t stripe_complete(struct Stripe *stripe, off_t start, off_t end){
+  char partial[PATH_MAX];
+  struct Range *range;
+  off_t received = 0;
+
+  pthread_mutex_lock(&stripes_lock);
+  add_range(stripe, start, end);
+  for(range = stripe->ranges; range != NULL; range = range->next){
+    received += range->end - range->start;
+  }
+
+  if(received == stripe->size && !stripe->committed){
+    stripe->committed = true;
+    build_partial_path(partial, stripe->name);
+    if(!commit_file(partial, stripe->name)){
+      received = -1;
+    }
+
+    else {
+      index_update(stripe->name);
+    }
+
+    // a new upload of the name may start while late streams wind down
+    unlink_stripe(stripe);
+  }
+
+  pthread_mutex_unlock(&stripes_lock);
+  return received;
+}
@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+/*
+ * One thread's spans: the thread fills slots at head, the writer takes
+ * them up to head and moves tail after them. Both only grow.
+ */
+struct TraceRing{
+  struct TraceEvent events[TRACE_EVENTS];
+  atomic_size_t head;
+  atomic_size_t tail;
+  atomic_ullong dropped;
+  struct TraceRing *next;
+  int tid;
+  char name[32];
+  _Atomic bool named;
+  bool name_written;        // by the writer
+};
+
+bool tracing = false;
+
+static FILE *trace_file;
+static _Atomic(struct TraceRing *) rings;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct TraceRing *own_ring;
+
+static struct TraceRing *thread_ring();
+static void write_event(const struct TraceRing *ring, const struct TraceEvent *event);
+static void write_string(const char *string);
+static void *run_writer(void *arg);
+
+/*
+ * Opens path and starts recording. Returns -1 if the file could not be
+ * created or the writer not started.
+ */
+int trace_start(const char *path){
+  pthread_t id;
+
+  trace_file = fopen(path, "w");
+  if(trace_file == NULL){
+    return -1;
+  }
+
+  setvbuf(trace_file, NULL, _IOFBF, 1024 * 1024);
+  fputs("[\n", trace_file);
+  if(pthread_create(&id, NULL, run_writer, NULL) != 0){
+    fclose(trace_file);
+    return -1;
+  }
+
+  pthread_detach(id);
+  atexit(trace_flush);
+  tracing = true;
+  return 0;
+}
+
+/* Names the calling thread in the viewer; the first name it is given sticks. */
+void trace_thread(const char *name){
+  struct TraceRing *ring;
+
+  if(!tracing || (ring = thread_ring()) == NULL || atomic_load(&ring->named)){
+    return;
+  }
+
+  snprintf(ring->name, sizeof(ring->name), "%s", name);
+  atomic_store_explicit(&ring->named, true, memory_order_release);
+}
+
+uint64_t trace_now(){
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Records a span from start until now on the calling thread. detail, which
+ * may be NULL, is copied and cut to TRACE_DETAIL - 1 characters.
+ */
+void trace_span(const char *name, const char *category, int client, uint64_t start,
+                long long bytes, const char *detail){
+  struct TraceRing *ring = thread_ring();
+  struct TraceEvent *event;
+  size_t head, tail;
+
+  if(!tracing || ring == NULL){
+    return;
+  }
+
+  head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if(head - tail == TRACE_EVENTS){
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  event = &ring->events[head % TRACE_EVENTS];
+  event->name = name;
+  event->category = category;
+  event->client = client;
+  event->start = start;
+  event->end = trace_now();
+  event->bytes = bytes;
+  snprintf(event->detail, TRACE_DETAIL, "%s", detail != NULL ? detail : "");
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/* Writes out every span recorded so far. */
+void trace_flush(){
+  unsigned long long dropped = 0;
+  struct TraceRing *ring;
+  size_t head, tail;
+
+  if(!tracing){
+    return;
+  }
+
+  pthread_mutex_lock(&drain_lock);
+  for(ring = atomic_load(&rings); ring != NULL; ring = ring->next){
+    if(!ring->name_written && atomic_load_explicit(&ring->named, memory_order_acquire)){
+      fprintf(trace_file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+              "\"args\":{\"name\":", (int)getpid(), ring->tid);
+      write_string(ring->name);
+      fputs("}},\n", trace_file);
+      ring->name_written = true;
+    }
+
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    for(; tail != head; tail++){
+      write_event(ring, &ring->events[tail % TRACE_EVENTS]);
+    }
+
+    atomic_store_explicit(&ring->tail, head, memory_order_release);
+    dropped += atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+  }
+
+  // a marker where spans went missing, so a gap is not mistaken for idle time
+  if(dropped > 0){
+    fprintf(trace_file, "{\"name\":\"dropped\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%.3f,"
+            "\"pid\":%d,\"tid\":0,\"args\":{\"spans\":%llu}},\n", trace_now() / 1e3,
+            (int)getpid(), dropped);
+  }
+
+  fflush(trace_file);
+  pthread_mutex_unlock(&drain_lock);
+}
+
+/* The calling thread's ring, set up the first time it records. */
+static struct TraceRing *thread_ring(){
+  struct TraceRing *ring = own_ring;
+
+  if(ring != NULL || !tracing){
+    return ring;
+  }
+
+  ring = calloc(1, sizeof(struct TraceRing));
+  if(ring == NULL){
+    return NULL;
+  }
+
+  ring->tid = syscall(SYS_gettid);
+  ring->next = atomic_load(&rings);
+  while(!atomic_compare_exchange_weak(&rings, &ring->next, ring));
+  own_ring = ring;
+  return ring;
+}
+
+static void write_event(const struct TraceRing *ring, const struct TraceEvent *event){
+  fprintf(trace_file, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+          "\"pid\":%d,\"tid\":%d,\"args\":{", event->name, event->category, event->start / 1e3,
+          (event->end - event->start) / 1e3, (int)getpid(), ring->tid);
+  fprintf(trace_file, "\"client\":%d", event->client);
+  if(event->bytes >= 0){
+    fprintf(trace_file, ",\"bytes\":%lld", event->bytes);
+  }
+
+  if(event->detail[0] != '\0'){
+    fputs(",\"detail\":", trace_file);
+    write_string(event->detail);
+  }
+
+  fputs("}},\n", trace_file);
+}
+
+/* string as a JSON string; file names may hold quotes and control characters. */
+static void write_string(const char *string){
+  const unsigned char *c;
+
+  fputc('"', trace_file);
+  for(c = (const unsigned char *)string; *c != '\0'; c++){
+    if(*c == '"' || *c == '\\'){
+      fputc('\\', trace_file);
+      fputc(*c, trace_file);
+    }
+
+    else if(*c < 0x20){
+      fprintf(trace_file, "\\u%04x", *c);
+    }
+
+    else {
+      fputc(*c, trace_file);
+    }
+  }
+
+  fputc('"', trace_file);
+}
+
+static void *run_writer(void *arg){
+  struct timespec pause = { 0, TRACE_DRAIN_MS * 1000000L };
+
+  while(true){
+    nanosleep(&pause, NULL);
+    trace_flush();
+  }
+
+  return NULL;
+}
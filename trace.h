@@ -0,0 +1,40 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_EVENTS 16384
+#define TRACE_DETAIL 48
+#define TRACE_DRAIN_MS 100
+
+/*
+ * Opt-in spans for finding out where a slow request spent its time, in the
+ * Chrome trace event format that chrome://tracing and ui.perfetto.dev open.
+ * Each thread records into a ring of its own, without locks, and a writer
+ * thread turns them into JSON in the background; a full ring drops spans
+ * rather than wait. Times are CLOCK_MONOTONIC nanoseconds, as from
+ * trace_now(). The file is a JSON array left open at the end, which the
+ * format allows, so it can be read while the server runs or after it was
+ * killed.
+ */
+struct TraceEvent{
+  const char *name;         // a string literal; only the pointer is kept
+  const char *category;
+  uint64_t start;
+  uint64_t end;
+  long long bytes;          // -1 if there are none
+  int client;               // -1 if it is no one's
+  char detail[TRACE_DETAIL];
+};
+
+extern bool tracing;
+
+int trace_start(const char *path);
+void trace_thread(const char *name);
+uint64_t trace_now();
+void trace_span(const char *name, const char *category, int client, uint64_t start,
+                long long bytes, const char *detail);
+void trace_flush();
+
+#endif
@@ -0,0 +1,398 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include "transfer.h"
+
+struct Slab transfer_slab = SLAB_INIT("Transfer buffers", TRANSFER_BUFFER_SIZE, 4096, 4);
+
+void sender_init(struct FileSender *sender, int filefd, off_t offset, off_t length){
+  sender->filefd = filefd;
+  sender->data = NULL;
+  sender->offset = offset;
+  sender->remaining = length;
+  sender->use_sendfile = true;
+  sender->buffer = NULL;
+  sender->ring = NULL;
+}
+
+void sender_init_memory(struct FileSender *sender, const char *data, off_t offset,
+                        off_t length){
+  sender_init(sender, -1, offset, length);
+  sender->data = data;
+}
+
+void sender_free(struct FileSender *sender){
+  slab_put(&transfer_slab, sender->buffer);
+  sender->buffer = NULL;
+}
+
+/*
+ * Copy fallback for files sendfile(2) refuses. The unsent tail of a short
+ * write is read again on the next call rather than kept around.
+ */
+static ssize_t copy_chunk(struct FileSender *sender, int sockfd, size_t len){
+  ssize_t bytes_read;
+
+  if(sender->buffer == NULL){
+    sender->buffer = slab_get(&transfer_slab);
+    if(sender->buffer == NULL){
+      return -1;
+    }
+  }
+
+  if(len > TRANSFER_BUFFER_SIZE){
+    len = TRANSFER_BUFFER_SIZE;
+  }
+
+  bytes_read = pread(sender->filefd, sender->buffer, len, sender->offset);
+  if(bytes_read <= 0){
+    // the file shrank under us; treat it as an I/O error
+    if(bytes_read == 0){
+      errno = EIO;
+    }
+
+    return -1;
+  }
+
+  return write(sockfd, sender->buffer, bytes_read);
+}
+
+/*
+ * Sends at most budget bytes (0 = no limit) so one fast download cannot
+ * monopolise an event loop. Returns TRANSFER_AGAIN when the socket is full
+ * or the budget ran out.
+ */
+enum TransferStatus sender_pump(struct FileSender *sender, int sockfd,
+                                size_t budget, unsigned long long *bytes_sent){
+  size_t sent_now = 0;
+  size_t len;
+  ssize_t bytes_written;
+
+  while(sender->remaining > 0){
+    if(budget > 0 && sent_now >= budget){
+      return TRANSFER_AGAIN;
+    }
+
+    len = sender->remaining > TRANSFER_BUFFER_SIZE * 16 ?
+          TRANSFER_BUFFER_SIZE * 16 : (size_t)sender->remaining;
+
+    if(sender->data != NULL){
+      bytes_written = write(sockfd, sender->data + sender->offset, len);
+      if(bytes_written > 0){
+        sender->offset += bytes_written;
+      }
+    }
+
+    else if(sender->use_sendfile){
+      bytes_written = sendfile(sockfd, sender->filefd, &sender->offset, len);
+      if(bytes_written < 0 && (errno == EINVAL || errno == ENOSYS)){
+        sender->use_sendfile = false;
+        continue;
+      }
+    }
+
+    else {
+      bytes_written = copy_chunk(sender, sockfd, len);
+      if(bytes_written > 0){
+        sender->offset += bytes_written;
+      }
+    }
+
+    if(bytes_written < 0){
+      if(errno == EINTR){
+        continue;
+      }
+
+      if(errno == EAGAIN || errno == EWOULDBLOCK){
+        return TRANSFER_AGAIN;
+      }
+
+      return TRANSFER_ERROR;
+    }
+
+    if(bytes_written == 0){
+      errno = EIO;
+      return TRANSFER_ERROR;
+    }
+
+    sender->remaining -= bytes_written;
+    sent_now += bytes_written;
+    if(bytes_sent != NULL){
+      *bytes_sent += bytes_written;
+    }
+  }
+
+  return TRANSFER_DONE;
+}
+
+void receiver_init(struct FileReceiver *receiver){
+  receiver->filefd = -1;
+  receiver->offset = 0;
+  receiver->remaining = 0;
+  receiver->pipefd[0] = -1;
+  receiver->pipefd[1] = -1;
+  receiver->piped = 0;
+  receiver->use_splice = true;
+  receiver->buffer = NULL;
+}
+
+void receiver_start(struct FileReceiver *receiver, int filefd, off_t offset, off_t length){
+  receiver->filefd = filefd;
+  receiver->offset = offset;
+  receiver->remaining = length;
+  receiver->piped = 0;
+}
+
+void receiver_free(struct FileReceiver *receiver){
+  if(receiver->pipefd[0] >= 0){
+    close(receiver->pipefd[0]);
+    close(receiver->pipefd[1]);
+  }
+
+  slab_put(&transfer_slab, receiver->buffer);
+  receiver_init(receiver);
+}
+
+static int pwrite_all(int filefd, const char *buffer, size_t len, off_t offset){
+  ssize_t bytes_written;
+
+  while(len > 0){
+    bytes_written = pwrite(filefd, buffer, len, offset);
+    if(bytes_written < 0){
+      if(errno == EINTR){
+        continue;
+      }
+
+      return -1;
+    }
+
+    buffer += bytes_written;
+    len -= bytes_written;
+    offset += bytes_written;
+  }
+
+  return 0;
+}
+
+/*
+ * Gives up on splice. Whatever is already sitting in the pipe is copied
+ * out by hand so no payload bytes are lost in the switch.
+ */
+static int disable_splice(struct FileReceiver *receiver){
+  ssize_t bytes_read;
+
+  receiver->use_splice = false;
+  if(receiver->buffer == NULL){
+    receiver->buffer = slab_get(&transfer_slab);
+    if(receiver->buffer == NULL){
+      return -1;
+    }
+  }
+
+  while(receiver->piped > 0){
+    bytes_read = read(receiver->pipefd[0], receiver->buffer,
+                      receiver->piped < TRANSFER_BUFFER_SIZE ?
+                      receiver->piped : TRANSFER_BUFFER_SIZE);
+    if(bytes_read <= 0){
+      return -1;
+    }
+
+    if(pwrite_all(receiver->filefd, receiver->buffer, bytes_read, receiver->offset) < 0){
+      return -1;
+    }
+
+    receiver->offset += bytes_read;
+    receiver->piped -= bytes_read;
+  }
+
+  return 0;
+}
+
+static int open_pipe(struct FileReceiver *receiver){
+  if(receiver->pipefd[0] >= 0){
+    return 0;
+  }
+
+  if(pipe2(receiver->pipefd, O_CLOEXEC | O_NONBLOCK) < 0){
+    return -1;
+  }
+
+  // a bigger pipe means fewer splice round trips; the default is fine too
+  fcntl(receiver->pipefd[1], F_SETPIPE_SZ, TRANSFER_BUFFER_SIZE * 4);
+  return 0;
+}
+
+/*
+ * One splice step: socket -> pipe (as much as is readable), then
+ * pipe -> file. Returns bytes moved into the file, 0 on EOF, or -1.
+ */
+static ssize_t splice_chunk(struct FileReceiver *receiver, int sockfd, size_t len){
+  ssize_t bytes_spliced;
+
+  if(receiver->piped == 0){
+    bytes_spliced = splice(sockfd, NULL, receiver->pipefd[1], NULL, len,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(bytes_spliced <= 0){
+      return bytes_spliced;
+    }
+
+    receiver->piped = bytes_spliced;
+  }
+
+  bytes_spliced = splice(receiver->pipefd[0], NULL, receiver->filefd, &receiver->offset,
+                         receiver->piped, SPLICE_F_MOVE);
+  if(bytes_spliced < 0){
+    return -1;
+  }
+
+  receiver->piped -= bytes_spliced;
+  return bytes_spliced;
+}
+
+static ssize_t read_chunk(struct FileReceiver *receiver, int sockfd, size_t len){
+  ssize_t bytes_read;
+
+  if(receiver->buffer == NULL){
+    receiver->buffer = slab_get(&transfer_slab);
+    if(receiver->buffer == NULL){
+      return -1;
+    }
+  }
+
+  if(len > TRANSFER_BUFFER_SIZE){
+    len = TRANSFER_BUFFER_SIZE;
+  }
+
+  bytes_read = read(sockfd, receiver->buffer, len);
+  if(bytes_read <= 0){
+    return bytes_read;
+  }
+
+  if(pwrite_all(receiver->filefd, receiver->buffer, bytes_read, receiver->offset) < 0){
+    return -1;
+  }
+
+  receiver->offset += bytes_read;
+  return bytes_read;
+}
+
+/*
+ * Receives at most budget bytes (0 = no limit) and never reads past the
+ * end of the range, so whatever follows the body stays in the socket.
+ */
+enum TransferStatus receiver_pump(struct FileReceiver *receiver, int sockfd,
+                                  size_t budget, unsigned long long *bytes_received){
+  size_t received_now = 0;
+  size_t len;
+  ssize_t bytes_moved;
+
+  if(receiver->use_splice && open_pipe(receiver) < 0){
+    receiver->use_splice = false;
+  }
+
+  while(receiver->remaining > 0){
+    if(budget > 0 && received_now >= budget){
+      return TRANSFER_AGAIN;
+    }
+
+    len = receiver->remaining > TRANSFER_BUFFER_SIZE * 4 ?
+          TRANSFER_BUFFER_SIZE * 4 : (size_t)receiver->remaining;
+
+    if(receiver->use_splice){
+      bytes_moved = splice_chunk(receiver, sockfd, len);
+      if(bytes_moved < 0 && (errno == EINVAL || errno == ENOSYS)){
+        if(disable_splice(receiver) < 0){
+          return TRANSFER_ERROR;
+        }
+
+        continue;
+      }
+    }
+
+    else {
+      bytes_moved = read_chunk(receiver, sockfd, len);
+    }
+
+    if(bytes_moved < 0){
+      if(errno == EINTR){
+        continue;
+      }
+
+      if(errno == EAGAIN || errno == EWOULDBLOCK){
+        return TRANSFER_AGAIN;
+      }
+
+      return TRANSFER_ERROR;
+    }
+
+    if(bytes_moved == 0){
+      // the peer closed before the whole body arrived
+      errno = ECONNRESET;
+      return TRANSFER_ERROR;
+    }
+
+    receiver->remaining -= bytes_moved;
+    received_now += bytes_moved;
+    if(bytes_received != NULL){
+      *bytes_received += bytes_moved;
+    }
+  }
+
+  return TRANSFER_DONE;
+}
+
+/*
+ * Writes body bytes that were already read into user space (e.g. the part
+ * of a payload that arrived together with its header).
+ */
+int receiver_feed(struct FileReceiver *receiver, const char *data, size_t len){
+  if((off_t)len > receiver->remaining){
+    len = receiver->remaining;
+  }
+
+  if(pwrite_all(receiver->filefd, data, len, receiver->offset) < 0){
+    return -1;
+  }
+
+  receiver->offset += len;
+  receiver->remaining -= len;
+  return len;
+}
+
+/* Copies len bytes at offset of in to the end of out, in the kernel if it can. */
+bool copy_range(int in, off_t offset, int out, size_t len){
+  char buffer[64 * 1024];
+  ssize_t copied;
+  size_t take;
+
+  while(len > 0){
+    copied = copy_file_range(in, &offset, out, NULL, len, 0);
+    if(copied < 0 && errno == EINTR){
+      continue;
+    }
+
+    if(copied <= 0){
+      break;
+    }
+
+    len -= copied;
+  }
+
+  // older kernels, or two file systems that cannot copy between them
+  while(len > 0){
+    take = len < sizeof(buffer) ? len : sizeof(buffer);
+    copied = pread(in, buffer, take, offset);
+    if(copied <= 0 || write(out, buffer, copied) != copied){
+      return false;
+    }
+
+    offset += copied;
+    len -= copied;
+  }
+
+  return true;
+}
@@ -0,0 +1,75 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "slab.h"
+
+#define TRANSFER_BUFFER_SIZE (256 * 1024)
+
+enum TransferStatus{
+  TRANSFER_DONE,
+  TRANSFER_AGAIN,
+  TRANSFER_PENDING,
+  TRANSFER_ERROR
+};
+
+struct RingSend;
+
+/*
+ * Moves a byte range of a file to a socket. sendfile(2) is used while the
+ * kernel accepts it; otherwise a pread/write loop over one large buffer
+ * takes over. Both paths only advance offset by what the socket actually
+ * took, so a short write on a non-blocking socket simply resumes there.
+ * A sender started with sender_init_memory writes from data instead.
+ * On an io_uring event loop reactor_send moves the range in the background
+ * through ring (see reactor.c) and reports TRANSFER_PENDING meanwhile; the
+ * owner must reactor_abandon such a sender before freeing it.
+ */
+struct FileSender{
+  int filefd;
+  const char *data;
+  off_t offset;
+  off_t remaining;
+  bool use_sendfile;
+  char *buffer;
+  struct RingSend *ring;
+};
+
+/*
+ * Moves bytes from a socket into a file range. With splice(2) the payload
+ * goes socket -> pipe -> file inside the kernel; the pipe belongs to the
+ * receiver and is reused for every upload on the connection. If splice is
+ * not supported for either end, a read/pwrite loop over one large buffer
+ * is used instead.
+ */
+struct FileReceiver{
+  int filefd;
+  off_t offset;
+  off_t remaining;
+  int pipefd[2];
+  size_t piped;
+  bool use_splice;
+  char *buffer;
+};
+
+void sender_init(struct FileSender *sender, int filefd, off_t offset, off_t length);
+void sender_init_memory(struct FileSender *sender, const char *data, off_t offset,
+                        off_t length);
+void sender_free(struct FileSender *sender);
+enum TransferStatus sender_pump(struct FileSender *sender, int sockfd,
+                                size_t budget, unsigned long long *bytes_sent);
+
+void receiver_init(struct FileReceiver *receiver);
+void receiver_start(struct FileReceiver *receiver, int filefd, off_t offset, off_t length);
+void receiver_free(struct FileReceiver *receiver);
+int receiver_feed(struct FileReceiver *receiver, const char *data, size_t len);
+enum TransferStatus receiver_pump(struct FileReceiver *receiver, int sockfd,
+                                  size_t budget, unsigned long long *bytes_received);
+
+bool copy_range(int in, off_t offset, int out, size_t len);
+
+// the copy fallbacks' buffers, shared by every transfer of the process
+extern struct Slab transfer_slab;
+
+#endif
@@ -0,0 +1,194 @@
+#ifdef HAVE_IO_URING
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+static int ring_setup(unsigned entries, struct io_uring_params *params){
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ring_enter(int fd, unsigned to_submit, unsigned wait, unsigned flags){
+  return syscall(__NR_io_uring_enter, fd, to_submit, wait, flags, NULL, 0);
+}
+
+static int ring_register(int fd, unsigned opcode, const void *arg, unsigned count){
+  return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+/*
+ * Sets up a ring of entries submissions. Returns -1 with errno set if the
+ * kernel has no io_uring or does not let us have one (seccomp, sysctl).
+ */
+int uring_init(struct Uring *ring, unsigned entries){
+  struct io_uring_params params;
+  char *sq, *cq;
+
+  memset(ring, 0, sizeof(*ring));
+  memset(&params, 0, sizeof(params));
+  ring->fd = ring_setup(entries, &params);
+  if(ring->fd < 0){
+    return -1;
+  }
+
+  ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP){
+    if(ring->cq_map_len > ring->sq_map_len){
+      ring->sq_map_len = ring->cq_map_len;
+    }
+
+    ring->cq_map_len = ring->sq_map_len;
+  }
+
+  ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if(ring->sq_map == MAP_FAILED){
+    ring->sq_map = NULL;
+    uring_close(ring);
+    return -1;
+  }
+
+  if(params.features & IORING_FEAT_SINGLE_MMAP){
+    ring->cq_map = ring->sq_map;
+  }
+
+  else {
+    ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if(ring->cq_map == MAP_FAILED){
+      ring->cq_map = NULL;
+      uring_close(ring);
+      return -1;
+    }
+  }
+
+  ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if(ring->sqes == MAP_FAILED){
+    ring->sqes = NULL;
+    uring_close(ring);
+    return -1;
+  }
+
+  sq = ring->sq_map;
+  cq = ring->cq_map;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  ring->sq_entries = params.sq_entries;
+  ring->tail = *ring->sq_tail;
+  return 0;
+}
+
+void uring_close(struct Uring *ring){
+  if(ring->sqes != NULL){
+    munmap(ring->sqes, ring->sqes_len);
+  }
+
+  if(ring->cq_map != NULL && ring->cq_map != ring->sq_map){
+    munmap(ring->cq_map, ring->cq_map_len);
+  }
+
+  if(ring->sq_map != NULL){
+    munmap(ring->sq_map, ring->sq_map_len);
+  }
+
+  if(ring->fd >= 0){
+    close(ring->fd);
+  }
+
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+/* Whether the kernel knows every one of the count opcodes in ops. */
+bool uring_supports(struct Uring *ring, const int *ops, int count){
+  size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, len);
+  bool supported = probe != NULL &&
+                   ring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+  int i;
+
+  for(i = 0; supported && i < count; i++){
+    supported = ops[i] <= probe->last_op &&
+                (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+
+  free(probe);
+  return supported;
+}
+
+/* Pins count buffers for READ_FIXED and WRITE_FIXED; buf_index is their position. */
+int uring_register_buffers(struct Uring *ring, const struct iovec *iovecs, unsigned count){
+  return ring_register(ring->fd, IORING_REGISTER_BUFFERS, iovecs, count);
+}
+
+/*
+ * A cleared submission entry for the caller to fill in. A full ring is
+ * submitted first to make room; NULL means even that did not help.
+ */
+struct io_uring_sqe *uring_sqe(struct Uring *ring){
+  struct io_uring_sqe *sqe;
+  unsigned index;
+
+  if(ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries){
+    uring_submit(ring, 0);
+    if(ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries){
+      return NULL;
+    }
+  }
+
+  index = ring->tail & *ring->sq_mask;
+  ring->sq_array[index] = index;
+  sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->tail++;
+  return sqe;
+}
+
+/*
+ * Hands every entry taken since the last call to the kernel and, if wait
+ * is set, sleeps until at least that many completions are there. Returns
+ * -1 with errno set on failure; EINTR just means to call again.
+ */
+int uring_submit(struct Uring *ring, unsigned wait){
+  unsigned pending;
+
+  __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+  pending = ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if(pending == 0 && wait == 0){
+    return 0;
+  }
+
+  return ring_enter(ring->fd, pending, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+}
+
+/* The oldest completion not yet seen, or NULL if there is none. */
+struct io_uring_cqe *uring_cqe(struct Uring *ring){
+  unsigned head = *ring->cq_head;
+
+  if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)){
+    return NULL;
+  }
+
+  return &ring->cqes[head & *ring->cq_mask];
+}
+
+/* Gives the completion uring_cqe returned back to the kernel. */
+void uring_seen(struct Uring *ring){
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
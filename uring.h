@@ -0,0 +1,40 @@
+#ifndef URING_H
+#define URING_H
+
+#ifdef HAVE_IO_URING
+
+#include <stdbool.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/*
+ * A bare io_uring: the submission and completion rings mapped from the
+ * kernel and driven through the raw system calls, so the server does not
+ * depend on liburing. One thread owns a ring. Entries taken with uring_sqe
+ * only reach the kernel on the next uring_submit, which is also where the
+ * caller waits for completions, so a whole batch costs one system call.
+ */
+struct Uring{
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned sq_entries;
+  unsigned tail;
+  void *sq_map, *cq_map;
+  size_t sq_map_len, cq_map_len, sqes_len;
+};
+
+int uring_init(struct Uring *ring, unsigned entries);
+void uring_close(struct Uring *ring);
+bool uring_supports(struct Uring *ring, const int *ops, int count);
+int uring_register_buffers(struct Uring *ring, const struct iovec *iovecs, unsigned count);
+struct io_uring_sqe *uring_sqe(struct Uring *ring);
+int uring_submit(struct Uring *ring, unsigned wait);
+struct io_uring_cqe *uring_cqe(struct Uring *ring);
+void uring_seen(struct Uring *ring);
+
+#endif
+
+#endif